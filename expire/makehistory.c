@@ -6,9 +6,14 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
+#ifdef HAVE_PTHREAD
+#    include <pthread.h>
+#endif
 
 #include "inn/buffer.h"
 #include "inn/history.h"
@@ -45,8 +50,8 @@ getloadavg(double loadavg[], int nelem)
 #endif
 
 static const char usage[] = "\
-Usage: makehistory [-abFIOSx] [-f file] [-l count] [-L load] [-s size]\n\
-                   [-T tmpdir]\n\
+Usage: makehistory [-abFIORSx] [-f file] [-j threads] [-l count] [-L load]\n\
+                   [-p interval] [-s size] [-T tmpdir]\n\
 \n\
     -a          open output history database in append mode\n\
     -b          delete bad articles from spool\n\
@@ -54,9 +59,12 @@ Usage: makehistory [-abFIOSx] [-f file] [-l count] [-L load] [-s size]\n\
     -f file     write history entries to file\n\
                 (default $pathhistory/history{.sqlite})\n\
     -I          do not create overview for articles numbered below lowmark\n\
+    -j threads  parse articles in that many threads (default 1)\n\
     -l count    size of overview updates (default 10000)\n\
     -L load     pause when load average exceeds threshold\n\
     -O          create overview entries for articles\n\
+    -p interval report progress every interval seconds\n\
+    -R          resume an interrupted run, writing checkpoints as it goes\n\
     -S          write overview data to standard output\n\
     -s size     size new history database for approximately size entries\n\
     -T tmpdir   use directory tmpdir for temporary files\n\
@@ -77,6 +85,10 @@ typedef struct _ARTOVERFIELD {
 
 #define DEFAULT_SEGSIZE 10000
 
+/* Articles queued per worker thread, and seconds between checkpoints. */
+#define JOBS_PER_THREAD     16
+#define CHECKPOINT_INTERVAL 300
+
 static bool NukeBadArts;
 static char *ActivePath = NULL;
 static char *HistoryPath = NULL;
@@ -92,6 +104,7 @@ static char *OverTmpPath = NULL;
 static bool NoHistory;
 static OVSORTTYPE sorttype;
 static bool WriteStdout = false;
+static char *ResumePath = NULL;
 
 /* Misc variables needed for the overview creation code. */
 static char BYTES[] = "Bytes";
@@ -118,21 +131,20 @@ static size_t Missfieldsize = 0;
 static void OverAddAllNewsgroups(void);
 
 /*
-**  Check and parse a Message-ID header field body.  Return private space.
+**  Check and parse a Message-ID header field body.  Return it in the given
+**  buffer.
 */
 static const char *
-GetMessageID(char *p)
+GetMessageID(char *p, struct buffer *buffer)
 {
-    static struct buffer buffer = {0, 0, 0, NULL};
-
     while (ISWHITE(*p))
         p++;
     if (p[0] != '<' || p[strlen(p) - 1] != '>')
         return "";
 
     /* Copy into reused memory space, including NUL. */
-    buffer_set(&buffer, p, strlen(p) + 1);
-    return buffer.data;
+    buffer_set(buffer, p, strlen(p) + 1);
+    return buffer->data;
 }
 
 /*
@@ -169,6 +181,7 @@ FlushOverTmpFile(void)
     if (fflush(OverTmpFile) == EOF || ferror(OverTmpFile)
         || fclose(OverTmpFile) == EOF)
         sysdie("cannot close temporary overview file");
+    OverTmpFile = NULL;
     if (Fork) {
         if (!first) { /* if previous one is running, wait for it */
             int status;
@@ -597,33 +610,120 @@ ARTreadschema(bool Overview)
 }
 
 /*
-**  Handle a single article.  This routine's fairly complicated.
+**  The outcome of parsing an article.
+*/
+enum parse_status {
+    PARSE_OK,    /* Ready to be written to history and overview. */
+    PARSE_SKIP,  /* Nothing to write. */
+    PARSE_BAD,   /* No usable Message-ID. */
+    PARSE_PROBE  /* Needs the storage manager to find its Xref. */
+};
+
+/*
+**  The state of the parse of one article and its result, which is written
+**  out separately by StoreArt.  The serial path has a single one using the
+**  global ARTfields and Missfields.  With worker threads, each job has its
+**  own copy of those arrays, since parsing points them into the article.
+*/
+struct parse {
+    ARTOVERFIELD *fields;
+    ARTOVERFIELD *miss;
+    ARTOVERFIELD *bytesp, *datep, *expp, *injectiondatep, *linesp, *msgidp;
+    ARTOVERFIELD *xrefp;
+    struct buffer buffer;    /* Header field bodies, then overview data. */
+    struct buffer msgid;     /* The Message-ID returned by GetMessageID. */
+    char *xrefdata;          /* Xref built from SMprobe, if any. */
+    char bytes[BIG_BUFFER];
+    char lines[BIG_BUFFER];
+    enum parse_status status;
+    const char *messageid;
+    time_t arrived;
+    time_t posted;
+    time_t expires;
+    bool overview;           /* Whether buffer holds overview data. */
+};
+
+static struct parse Serial;
+
+
+/*
+**  Return the field of a parse corresponding to one of the global fields.
+*/
+static ARTOVERFIELD *
+ParseField(struct parse *ps, ARTOVERFIELD *fp)
+{
+    if (fp == NULL)
+        return NULL;
+    if (ARTfieldsize > 0 && fp >= ARTfields && fp < ARTfields + ARTfieldsize)
+        return ps->fields + (fp - ARTfields);
+    return ps->miss + (fp - Missfields);
+}
+
+
+/*
+**  Set up a parse, either on the global overview fields or, if copy is true,
+**  on a private copy of them.  Must be called after ARTreadschema.
 */
 static void
-DoArt(ARTHANDLE *art)
+ParseInit(struct parse *ps, bool copy)
+{
+    memset(ps, 0, sizeof(*ps));
+    if (copy) {
+        if (ARTfieldsize > 0) {
+            ps->fields = xmalloc(ARTfieldsize * sizeof(ARTOVERFIELD));
+            memcpy(ps->fields, ARTfields,
+                   ARTfieldsize * sizeof(ARTOVERFIELD));
+        }
+        if (Missfieldsize > 0) {
+            ps->miss = xmalloc(Missfieldsize * sizeof(ARTOVERFIELD));
+            memcpy(ps->miss, Missfields,
+                   Missfieldsize * sizeof(ARTOVERFIELD));
+        }
+    } else {
+        ps->fields = ARTfields;
+        ps->miss = Missfields;
+    }
+    ps->bytesp = ParseField(ps, Bytesp);
+    ps->datep = ParseField(ps, Datep);
+    ps->expp = ParseField(ps, Expp);
+    ps->injectiondatep = ParseField(ps, InjectionDatep);
+    ps->linesp = ParseField(ps, Linesp);
+    ps->msgidp = ParseField(ps, Msgidp);
+    ps->xrefp = ParseField(ps, Xrefp);
+}
+
+
+/*
+**  Parse a single article.  This routine's fairly complicated.  It only
+**  calls the storage manager (to find the newsgroups of an article without
+**  an Xref header field) if probe is true, and otherwise leaves the article
+**  as PARSE_PROBE; worker threads parse with probe set to false.  It neither
+**  warns nor writes anything, which is left to StoreArt.
+*/
+static void
+ParseArt(struct parse *ps, ARTHANDLE *art, bool probe)
 {
     ARTOVERFIELD *fp;
     const char *p, *end;
     char *q;
-    static struct buffer buffer = {0, 0, 0, NULL};
     static char SEP[] = "\t";
     static char NUL[] = "\0";
     static char COLONSPACE[] = ": ";
     size_t i, j;
-    const char *MessageID;
-    time_t Arrived;
-    time_t Expires;
-    time_t Posted;
-    char *overdata = NULL;
-    char Bytes[BIG_BUFFER];
-    char Lines[BIG_BUFFER];
     struct artngnum ann;
     int DotStuffedLines = 0;
     int lines = 0;
     bool hasCounts = false;
 
+    ps->status = PARSE_SKIP;
+    ps->overview = false;
+    if (ps->xrefdata != NULL) {
+        free(ps->xrefdata);
+        ps->xrefdata = NULL;
+    }
+
     /* Set up place to store headers. */
-    for (fp = ARTfields, i = 0; i < ARTfieldsize; i++, fp++) {
+    for (fp = ps->fields, i = 0; i < ARTfieldsize; i++, fp++) {
         if (fp->HeaderLength) {
             fp->Header = 0;
         }
@@ -631,7 +731,7 @@ DoArt(ARTHANDLE *art)
         fp->HasHeader = false;
     }
     if (Missfieldsize > 0) {
-        for (fp = Missfields, i = 0; i < Missfieldsize; i++, fp++) {
+        for (fp = ps->miss, i = 0; i < Missfieldsize; i++, fp++) {
             if (fp->HeaderLength) {
                 fp->Header = 0;
             }
@@ -639,7 +739,7 @@ DoArt(ARTHANDLE *art)
             fp->HasHeader = false;
         }
     }
-    for (fp = ARTfields, i = 0; i < ARTfieldsize; i++, fp++) {
+    for (fp = ps->fields, i = 0; i < ARTfieldsize; i++, fp++) {
         fp->Header =
             wire_findheader(art->data, art->len, fp->Headername, false);
 
@@ -647,7 +747,7 @@ DoArt(ARTHANDLE *art)
            multiple Xref header fields, and INN had a bug where it wouldn't
            notice this and reject the article.  Just in case, see if there are
            multiple Xref header fields and use the last one. */
-        if (fp == Xrefp) {
+        if (fp == ps->xrefp) {
             const char *next = fp->Header;
             size_t left;
 
@@ -664,7 +764,7 @@ DoArt(ARTHANDLE *art)
         }
 
         /* Work out the real values for :bytes and :lines. */
-        if (fp == Bytesp || fp == Linesp) {
+        if (fp == ps->bytesp || fp == ps->linesp) {
             /* Parse the article only once. */
             if (!hasCounts
                 && (p = wire_findbody(art->data, art->len)) != NULL) {
@@ -684,16 +784,17 @@ DoArt(ARTHANDLE *art)
                 }
             }
 
-            if (fp == Bytesp) {
+            if (fp == ps->bytesp) {
                 /* :bytes does not count the final ".\r\n", so remove 3. */
-                snprintf(Bytes, sizeof(Bytes), "%lu",
+                snprintf(ps->bytes, sizeof(ps->bytes), "%lu",
                          (unsigned long) art->len - DotStuffedLines - 3);
-                fp->Header = Bytes;
-                fp->HeaderLength = strlen(Bytes);
+                fp->Header = ps->bytes;
+                fp->HeaderLength = strlen(ps->bytes);
             } else {
-                snprintf(Lines, sizeof(Lines), "%lu", (unsigned long) lines);
-                fp->Header = Lines;
-                fp->HeaderLength = strlen(Lines);
+                snprintf(ps->lines, sizeof(ps->lines), "%lu",
+                         (unsigned long) lines);
+                fp->Header = ps->lines;
+                fp->HeaderLength = strlen(ps->lines);
             }
             fp->HasHeader = true;
             hasCounts = true;
@@ -715,7 +816,7 @@ DoArt(ARTHANDLE *art)
         }
     }
     if (Missfieldsize > 0) {
-        for (fp = Missfields, i = 0; i < Missfieldsize; i++, fp++) {
+        for (fp = ps->miss, i = 0; i < Missfieldsize; i++, fp++) {
             fp->Header =
                 wire_findheader(art->data, art->len, fp->Headername, false);
             if (fp->Header != NULL) {
@@ -727,44 +828,46 @@ DoArt(ARTHANDLE *art)
             }
         }
     }
-    if (DoOverview && Xrefp->HeaderLength == 0) {
+    if (DoOverview && ps->xrefp->HeaderLength == 0) {
+        if (!probe) {
+            ps->status = PARSE_PROBE;
+            return;
+        }
         if (!SMprobe(SMARTNGNUM, art->token, (void *) &ann)) {
-            Xrefp->Header = NULL;
-            Xrefp->HeaderLength = 0;
+            ps->xrefp->Header = NULL;
+            ps->xrefp->HeaderLength = 0;
         } else {
-            if (ann.artnum == 0 || ann.groupname == NULL)
+            if (ann.artnum == 0 || ann.groupname == NULL) {
+                free(ann.groupname);
                 return;
+            }
 
-            xasprintf(&overdata, "%s %s:%lu", innconf->pathhost, ann.groupname,
-                      ann.artnum);
-            Xrefp->Header = overdata;
-            Xrefp->HeaderLength = strlen(overdata);
+            xasprintf(&ps->xrefdata, "%s %s:%lu", innconf->pathhost,
+                      ann.groupname, ann.artnum);
+            ps->xrefp->Header = ps->xrefdata;
+            ps->xrefp->HeaderLength = strlen(ps->xrefdata);
 
             if (ann.groupname != NULL)
                 free(ann.groupname);
         }
     }
 
-    Arrived = art->arrived;
-    Expires = 0;
+    ps->arrived = art->arrived;
+    ps->expires = 0;
 
-    if (!Msgidp->HasHeader) {
-        warn("no Message-ID header field in %s", TokenToText(*art->token));
-        if (NukeBadArts)
-            SMcancel(*art->token);
+    if (!ps->msgidp->HasHeader) {
+        ps->status = PARSE_BAD;
         return;
     }
 
-    buffer_set(&buffer, Msgidp->Header, Msgidp->HeaderLength);
-    buffer_append(&buffer, NUL, 1);
-    for (i = 0, q = buffer.data; i < buffer.left; q++, i++)
+    buffer_set(&ps->buffer, ps->msgidp->Header, ps->msgidp->HeaderLength);
+    buffer_append(&ps->buffer, NUL, 1);
+    for (i = 0, q = ps->buffer.data; i < ps->buffer.left; q++, i++)
         if (*q == '\t' || *q == '\n' || *q == '\r')
             *q = ' ';
-    MessageID = GetMessageID(buffer.data);
-    if (*MessageID == '\0') {
-        warn("no Message-ID header field in %s", TokenToText(*art->token));
-        if (NukeBadArts)
-            SMcancel(*art->token);
+    ps->messageid = GetMessageID(ps->buffer.data, &ps->msgid);
+    if (*ps->messageid == '\0') {
+        ps->status = PARSE_BAD;
         return;
     }
 
@@ -773,52 +876,55 @@ DoArt(ARTHANDLE *art)
      * newer than start time of makehistory.
      */
 
-    if (!InjectionDatep->HasHeader && !Datep->HasHeader) {
-        Posted = Arrived;
+    if (!ps->injectiondatep->HasHeader && !ps->datep->HasHeader) {
+        ps->posted = ps->arrived;
     } else {
-        if (InjectionDatep->HasHeader) {
-            buffer_set(&buffer, InjectionDatep->Header,
-                       InjectionDatep->HeaderLength);
-            buffer_append(&buffer, NUL, 1);
-            Posted = parsedate_rfc5322_lax(buffer.data);
+        if (ps->injectiondatep->HasHeader) {
+            buffer_set(&ps->buffer, ps->injectiondatep->Header,
+                       ps->injectiondatep->HeaderLength);
+            buffer_append(&ps->buffer, NUL, 1);
+            ps->posted = parsedate_rfc5322_lax(ps->buffer.data);
             /* If parsing failed for the Injection-Date header field, take
              * the arrival time.
              * Do not look at the Date header field (though we could). */
-            if (Posted == (time_t) -1)
-                Posted = Arrived;
+            if (ps->posted == (time_t) -1)
+                ps->posted = ps->arrived;
         } else {
-            buffer_set(&buffer, Datep->Header, Datep->HeaderLength);
-            buffer_append(&buffer, NUL, 1);
-            Posted = parsedate_rfc5322_lax(buffer.data);
-            if (Posted == (time_t) -1)
-                Posted = Arrived;
+            buffer_set(&ps->buffer, ps->datep->Header,
+                       ps->datep->HeaderLength);
+            buffer_append(&ps->buffer, NUL, 1);
+            ps->posted = parsedate_rfc5322_lax(ps->buffer.data);
+            if (ps->posted == (time_t) -1)
+                ps->posted = ps->arrived;
         }
     }
 
-    if (Expp->HasHeader) {
-        buffer_set(&buffer, Expp->Header, Expp->HeaderLength);
-        buffer_append(&buffer, NUL, 1);
-        Expires = parsedate_rfc5322_lax(buffer.data);
-        if (Expires == (time_t) -1)
-            Expires = 0;
+    if (ps->expp->HasHeader) {
+        buffer_set(&ps->buffer, ps->expp->Header, ps->expp->HeaderLength);
+        buffer_append(&ps->buffer, NUL, 1);
+        ps->expires = parsedate_rfc5322_lax(ps->buffer.data);
+        if (ps->expires == (time_t) -1)
+            ps->expires = 0;
     }
 
-    if (DoOverview && Xrefp->HeaderLength > 0) {
-        for (fp = ARTfields, j = 0; j < ARTfieldsize; j++, fp++) {
-            if (fp == ARTfields)
-                buffer_set(&buffer, "", 0);
+    ps->status = PARSE_OK;
+    if (DoOverview && ps->xrefp->HeaderLength > 0) {
+        for (fp = ps->fields, j = 0; j < ARTfieldsize; j++, fp++) {
+            if (fp == ps->fields)
+                buffer_set(&ps->buffer, "", 0);
             else
-                buffer_append(&buffer, SEP, strlen(SEP));
+                buffer_append(&ps->buffer, SEP, strlen(SEP));
             if (fp->HeaderLength == 0)
                 continue;
             if (fp->NeedHeadername) {
-                buffer_append(&buffer, fp->Headername, fp->HeadernameLength);
-                buffer_append(&buffer, COLONSPACE, strlen(COLONSPACE));
+                buffer_append(&ps->buffer, fp->Headername,
+                              fp->HeadernameLength);
+                buffer_append(&ps->buffer, COLONSPACE, strlen(COLONSPACE));
             }
-            i = buffer.left;
-            buffer_resize(&buffer, buffer.left + fp->HeaderLength);
+            i = ps->buffer.left;
+            buffer_resize(&ps->buffer, ps->buffer.left + fp->HeaderLength);
             end = fp->Header + fp->HeaderLength - 1;
-            for (p = fp->Header, q = &buffer.data[i]; p <= end; p++) {
+            for (p = fp->Header, q = &ps->buffer.data[i]; p <= end; p++) {
                 if (*p == '\r' && p < end && p[1] == '\n') {
                     p++;
                     continue;
@@ -827,22 +933,340 @@ DoArt(ARTHANDLE *art)
                     *q++ = ' ';
                 else
                     *q++ = *p;
-                buffer.left++;
+                ps->buffer.left++;
             }
         }
-        WriteOverLine(art->token, Xrefp->Header, Xrefp->HeaderLength,
-                      buffer.data, buffer.left, Arrived, Expires);
-        if (overdata != NULL)
-            free(overdata);
+        ps->overview = true;
+    }
+}
+
+
+/*
+**  Write out the result of parsing an article, in the main thread.
+*/
+static void
+StoreArt(struct parse *ps, ARTHANDLE *art)
+{
+    switch (ps->status) {
+    case PARSE_BAD:
+        warn("no Message-ID header field in %s", TokenToText(*art->token));
+        if (NukeBadArts)
+            SMcancel(*art->token);
+        break;
+    case PARSE_OK:
+        if (ps->overview)
+            WriteOverLine(art->token, ps->xrefp->Header,
+                          ps->xrefp->HeaderLength, ps->buffer.data,
+                          ps->buffer.left, ps->arrived, ps->expires);
+        if (!NoHistory) {
+            bool r;
+
+            r = HISwrite(History, ps->messageid, ps->arrived, ps->posted,
+                         ps->expires, art->token);
+            if (r == false)
+                sysdie("cannot write history line");
+        }
+        break;
+    case PARSE_SKIP:
+    case PARSE_PROBE:
+        break;
+    }
+    if (ps->xrefdata != NULL) {
+        free(ps->xrefdata);
+        ps->xrefdata = NULL;
+    }
+}
+
+
+/*
+**  Handle a single article in the main thread.
+*/
+static void
+DoArt(ARTHANDLE *art)
+{
+    ParseArt(&Serial, art, true);
+    StoreArt(&Serial, art);
+}
+
+
+#ifdef HAVE_PTHREAD
+
+/*
+**  An article queued for the worker threads.  SMnext reuses its handle, so
+**  the job holds a copy of the article, and the parse of it.
+*/
+struct job {
+    ARTHANDLE art;
+    TOKEN token;
+    struct buffer data;
+    struct parse parse;
+    bool parsed;
+};
+
+static struct {
+    pthread_mutex_t lock;  /* Protects everything below. */
+    pthread_cond_t ready;  /* Signalled when a job is queued. */
+    pthread_cond_t done;   /* Signalled when a job is parsed. */
+    struct job *jobs;      /* Ring of jobs, indexed by count % size. */
+    size_t size;
+    unsigned long queued;  /* Jobs queued so far. */
+    unsigned long taken;   /* Jobs picked up by a thread. */
+    unsigned long stored;  /* Jobs written out by the main thread. */
+    bool stopping;
+    pthread_t *threads;
+    int nthreads;
+} work;
+
+
+/*
+**  A worker thread.  Parse queued articles in turn until told to stop.
+*/
+static void *
+ParseThread(void *arg UNUSED)
+{
+    struct job *job;
+
+    pthread_mutex_lock(&work.lock);
+    for (;;) {
+        while (work.taken == work.queued && !work.stopping)
+            pthread_cond_wait(&work.ready, &work.lock);
+        if (work.taken == work.queued)
+            break;
+        job = &work.jobs[work.taken++ % work.size];
+        pthread_mutex_unlock(&work.lock);
+
+        ParseArt(&job->parse, &job->art, false);
+
+        pthread_mutex_lock(&work.lock);
+        job->parsed = true;
+        pthread_cond_signal(&work.done);
+    }
+    pthread_mutex_unlock(&work.lock);
+    return NULL;
+}
+
+
+/*
+**  Start nthreads worker threads.
+*/
+static void
+StartThreads(int nthreads)
+{
+    sigset_t all, old;
+    size_t i;
+    int n, status;
+
+    pthread_mutex_init(&work.lock, NULL);
+    pthread_cond_init(&work.ready, NULL);
+    pthread_cond_init(&work.done, NULL);
+    work.size = (size_t) nthreads * JOBS_PER_THREAD;
+    work.jobs = xcalloc(work.size, sizeof(struct job));
+    for (i = 0; i < work.size; i++)
+        ParseInit(&work.jobs[i].parse, true);
+    work.queued = 0;
+    work.taken = 0;
+    work.stored = 0;
+    work.stopping = false;
+    work.threads = xmalloc(nthreads * sizeof(pthread_t));
+
+    /* Signals are handled by the main thread only. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (n = 0; n < nthreads; n++) {
+        status = pthread_create(&work.threads[n], NULL, ParseThread, NULL);
+        if (status != 0) {
+            errno = status;
+            sysdie("cannot create thread");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    work.nthreads = nthreads;
+}
+
+
+/*
+**  Write out parsed jobs in the order they were queued, waiting for the
+**  threads until at least upto jobs have been written.  Articles without an
+**  Xref header field are parsed again here, since the storage manager can
+**  only be used from the main thread.
+*/
+static void
+StoreJobs(unsigned long upto)
+{
+    struct job *job;
+
+    pthread_mutex_lock(&work.lock);
+    while (work.stored < work.queued) {
+        job = &work.jobs[work.stored % work.size];
+        if (!job->parsed) {
+            if (work.stored >= upto)
+                break;
+            pthread_cond_wait(&work.done, &work.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&work.lock);
+        if (job->parse.status == PARSE_PROBE)
+            ParseArt(&job->parse, &job->art, true);
+        StoreArt(&job->parse, &job->art);
+        pthread_mutex_lock(&work.lock);
+        job->parsed = false;
+        work.stored++;
     }
+    pthread_mutex_unlock(&work.lock);
+}
+
+
+/*
+**  Queue a copy of an article for the worker threads, first writing out
+**  whatever they have finished and making room for it if needed.
+*/
+static void
+QueueArt(ARTHANDLE *art)
+{
+    struct job *job;
+
+    if (work.queued - work.stored == work.size)
+        StoreJobs(work.stored + 1);
+    else
+        StoreJobs(0);
+    job = &work.jobs[work.queued % work.size];
+    job->art = *art;
+    job->token = *art->token;
+    buffer_set(&job->data, art->data, art->len);
+    buffer_append(&job->data, "", 1);
+    job->art.data = job->data.data;
+    job->art.token = &job->token;
+    job->art.private = NULL;
+
+    pthread_mutex_lock(&work.lock);
+    work.queued++;
+    pthread_cond_signal(&work.ready);
+    pthread_mutex_unlock(&work.lock);
+}
+
+
+/*
+**  Write out everything queued and stop the worker threads.
+*/
+static void
+StopThreads(void)
+{
+    int n;
+
+    StoreJobs(work.queued);
+    pthread_mutex_lock(&work.lock);
+    work.stopping = true;
+    pthread_cond_broadcast(&work.ready);
+    pthread_mutex_unlock(&work.lock);
+    for (n = 0; n < work.nthreads; n++)
+        pthread_join(work.threads[n], NULL);
+}
+
+#else /* !HAVE_PTHREAD */
+
+static void
+StartThreads(int nthreads UNUSED)
+{
+}
+
+static void
+StoreJobs(unsigned long upto UNUSED)
+{
+}
+
+static void
+QueueArt(ARTHANDLE *art)
+{
+    DoArt(art);
+}
+
+static void
+StopThreads(void)
+{
+}
+
+#endif /* !HAVE_PTHREAD */
+
+
+/*
+**  Report how far the scan of the spool has got.  count is the number of
+**  articles read since start, out of total read so far.
+*/
+static void
+Report(unsigned long total, unsigned long count, time_t start, time_t now)
+{
+    unsigned long rate = 0;
+
+    if (now > start)
+        rate = count / (unsigned long) (now - start);
+    notice("%lu articles read, %lu per second", total, rate);
+}
+
+
+/*
+**  Record that everything up to and including the count-th article returned
+**  by SMnext, which has the given token, has been written out.  History is
+**  synced and overview is flushed first.  For hisv6, the size of the history
+**  file is recorded too, so that whatever is written to it after the
+**  checkpoint can be cut off when resuming.
+*/
+static void
+Checkpoint(unsigned long count, const TOKEN *token)
+{
+    struct stat st;
+    long long size = 0;
+    char *tmp;
+    FILE *F;
 
     if (!NoHistory) {
-        bool r;
+        if (!HISsync(History))
+            sysdie("cannot sync history");
+        if (strcmp(innconf->hismethod, "hisv6") == 0) {
+            if (stat(HistoryPath, &st) < 0)
+                sysdie("cannot stat %s", HistoryPath);
+            size = (long long) st.st_size;
+        }
+    }
+    if (DoOverview && sorttype != OVNOSORT)
+        FlushOverTmpFile();
+
+    tmp = concat(ResumePath, ".new", (char *) 0);
+    if ((F = fopen(tmp, "w")) == NULL)
+        sysdie("cannot open %s", tmp);
+    fprintf(F, "%lu %s %lld\n", count, TokenToText(*token), size);
+    if (fflush(F) == EOF || ferror(F) || fclose(F) == EOF)
+        sysdie("cannot write %s", tmp);
+    if (rename(tmp, ResumePath) < 0)
+        sysdie("cannot rename %s to %s", tmp, ResumePath);
+    free(tmp);
+}
+
+
+/*
+**  Read the checkpoint left by an interrupted run, if any.  Returns the
+**  number of articles already done, or 0 if there is no checkpoint, and sets
+**  token and size to what Checkpoint recorded.
+*/
+static unsigned long
+ReadCheckpoint(TOKEN *token, off_t *size)
+{
+    char text[64];
+    unsigned long count;
+    long long recorded;
+    FILE *F;
 
-        r = HISwrite(History, MessageID, Arrived, Posted, Expires, art->token);
-        if (r == false)
-            sysdie("cannot write history line");
+    if ((F = fopen(ResumePath, "r")) == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        sysdie("cannot open %s", ResumePath);
     }
+    if (fscanf(F, "%lu %63s %lld", &count, text, &recorded) != 3
+        || count == 0 || !IsToken(text) || recorded < 0)
+        die("malformed checkpoint in %s", ResumePath);
+    fclose(F);
+    *token = TextToToken(text);
+    *size = (off_t) recorded;
+    return count;
 }
 
 
@@ -905,6 +1329,14 @@ main(int argc, char **argv)
     char *buff;
     size_t npairs = 0;
     FILE *F;
+    int Threads = 1;
+    long Progress = 0;
+    bool Resume = false;
+    unsigned long count = 0;
+    unsigned long done = 0;
+    TOKEN token;
+    off_t size = 0;
+    time_t now, start, NextReport, NextCheckpoint;
 
     /* First thing, set up logging and our identity. */
     openlog("makehistory", L_OPENLOG_FLAGS | LOG_PID, LOG_INN_PROG);
@@ -927,7 +1359,7 @@ main(int argc, char **argv)
     LoadAverage = 0;
     NoHistory = false;
 
-    while ((i = getopt(argc, argv, "abFf:Il:L:OSs:T:x")) != EOF) {
+    while ((i = getopt(argc, argv, "abFf:Ij:l:L:Op:RSs:T:x")) != EOF) {
         switch (i) {
         case 'a':
             AppendMode = true;
@@ -944,6 +1376,11 @@ main(int argc, char **argv)
         case 'I':
             Cutofflow = true;
             break;
+        case 'j':
+            Threads = atoi(optarg);
+            if (Threads < 1)
+                die("-j needs a positive number of threads");
+            break;
         case 'l':
             OverTmpSegSize = atoi(optarg);
             break;
@@ -953,6 +1390,12 @@ main(int argc, char **argv)
         case 'O':
             DoOverview = true;
             break;
+        case 'p':
+            Progress = atol(optarg);
+            break;
+        case 'R':
+            Resume = true;
+            break;
         case 'S':
             WriteStdout = true;
             OverTmpSegSize = 0;
@@ -977,6 +1420,27 @@ main(int argc, char **argv)
         fprintf(stderr, "%s", usage);
         exit(1);
     }
+#ifndef HAVE_PTHREAD
+    if (Threads > 1) {
+        warn("-j set but threads are not supported");
+        Threads = 1;
+    }
+#endif
+    if (Progress > 0)
+        message_handlers_notice(1, message_log_stderr);
+
+    /* A checkpoint cannot account for overview data written to standard
+       output or by a forked process. */
+    if (Resume) {
+        if (Fork || WriteStdout)
+            die("-R cannot be used with -F or -S");
+        ResumePath = concatpath(TmpDir, "makehistory.resume");
+        done = ReadCheckpoint(&token, &size);
+        if (done > 0) {
+            AppendMode = true;
+            notice("resuming after article %lu", done);
+        }
+    }
 
     if (!NoHistory) {
         if ((p = strrchr(HistoryPath, '/')) == NULL) {
@@ -989,6 +1453,11 @@ main(int argc, char **argv)
         }
         if (chdir(HistoryDir) < 0)
             sysdie("cannot chdir to %s", HistoryDir);
+
+        /* Drop whatever an interrupted run wrote after its checkpoint. */
+        if (size > 0 && strcmp(innconf->hismethod, "hisv6") == 0
+            && truncate(HistoryPath, size) < 0)
+            sysdie("cannot truncate %s", HistoryPath);
     }
 
     /* Change to the runasuser user and runasgroup group if necessary. */
@@ -999,6 +1468,7 @@ main(int argc, char **argv)
 
     /* Read in the overview schema. */
     ARTreadschema(DoOverview);
+    ParseInit(&Serial, false);
 
     if (DoOverview && !WriteStdout) {
         /* Init the overview setup. */
@@ -1006,6 +1476,12 @@ main(int argc, char **argv)
             sysdie("cannot open overview");
         if (!OVctl(OVSORT, (void *) &sorttype))
             die("cannot obtain overview sort information");
+
+        /* Such methods get the entries at once, not at checkpoints, so
+           those added after the last one would be added again. */
+        if (ResumePath != NULL && sorttype == OVNOSORT)
+            die("-R cannot be used with an overview method that does not"
+                " sort, such as buffindexed");
         if (!Fork) {
             if (!OVctl(OVCUTOFFLOW, (void *) &Cutofflow))
                 die("cannot obtain overview cutoff information");
@@ -1044,26 +1520,66 @@ main(int argc, char **argv)
             sysdie("cannot open %s", HistoryPath);
     }
 
+    /* When resuming, skip what was done before the checkpoint, checking
+       that the spool still returns the same article there.  Only headers
+       are retrieved; not every storage method can step with RETR_STAT. */
+    while (count < done) {
+        if ((art = SMnext(art, RETR_HEAD)) == NULL)
+            die("spool has fewer articles than the checkpoint in %s",
+                ResumePath);
+        count++;
+    }
+    if (done > 0
+        && (art->token == NULL
+            || memcmp(art->token, &token, sizeof(token)) != 0))
+        die("spool changed since the checkpoint in %s", ResumePath);
+
+    if (Threads > 1)
+        StartThreads(Threads);
+    start = time(NULL);
+    NextReport = start + Progress;
+    NextCheckpoint = start + CHECKPOINT_INTERVAL;
+
     /*
      * Scan the entire spool, nuke any bad arts if needed, and process each
      * article.  We take a break when the load is too high.
      */
 
     while ((art = SMnext(art, RETR_ALL)) != NULL) {
+        count++;
         if (art->len == 0) {
             if (NukeBadArts && art->data == NULL && art->token != NULL)
                 SMcancel(*art->token);
-            continue;
-        }
-
-        DoArt(art);
+        } else if (Threads > 1)
+            QueueArt(art);
+        else
+            DoArt(art);
 
         if (LoadAverage > 0) {
             while (getloadavg(load, 1) > 0 && (int) (load[0]) >= LoadAverage) {
                 sleep(1);
             }
         }
+
+        if (Progress > 0 || ResumePath != NULL) {
+            now = time(NULL);
+            if (Progress > 0 && now >= NextReport) {
+                Report(count, count - done, start, now);
+                NextReport = now + Progress;
+            }
+            if (ResumePath != NULL && now >= NextCheckpoint
+                && art->token != NULL) {
+                if (Threads > 1)
+                    StoreJobs(ULONG_MAX);
+                Checkpoint(count, art->token);
+                NextCheckpoint = now + CHECKPOINT_INTERVAL;
+            }
+        }
     }
+    if (Threads > 1)
+        StopThreads();
+    if (Progress > 0)
+        Report(count, count - done, start, time(NULL));
 
     if (!NoHistory) {
         /* Close history database. */
@@ -1093,5 +1609,7 @@ main(int argc, char **argv)
     }
     if (!Fork && !WriteStdout)
         OVclose();
+    if (ResumePath != NULL && unlink(ResumePath) < 0 && errno != ENOENT)
+        syswarn("cannot remove %s", ResumePath);
     exit(0);
 }
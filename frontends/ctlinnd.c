@@ -89,6 +89,8 @@ static COMMAND Commands[] = {
       1,  SC_LOWMARK,        false },
     { "reserve",      "reason...\t\tReserve the next pause or throttle",
       1,  SC_RESERVE,        true },
+    { "resizehist",   "size\t\t\tRebuild history index for size entries",
+      1,  SC_RESIZEHIST,     false },
     { "rmgroup",      "group\t\t\tRemove named group",
       1,  SC_RMGROUP,        false },
     { "send",         "feed text...\t\tSend text to exploder feed",
@@ -58,27 +58,93 @@
 #include "hisinterface.h"
 #include "hismethods.h"
 
+/*
+**  The history cache is set-associative: the last four bytes of the hash of
+**  a Message-ID pick a set of HISCACHE_WAYS entries, and the other bytes are
+**  kept as the tag of its entry in that set.  A set fits in a cache line.
+**  When a set is full, its hand sweeps over the entries as a CLOCK, sparing
+**  once those looked up since it last passed, and the new entry replaces the
+**  first one it does not spare.
+*/
+#define HISCACHE_WAYS 4
+#define HISCACHE_TAG  (sizeof(HASH) - sizeof(uint32_t))
+#define HISCACHE_LINE 64
+
+/* Flags of an entry. */
+#define HISCACHE_USED       0x01 /* The entry holds a Message-ID. */
+#define HISCACHE_FOUND      0x02 /* It is in the history. */
+#define HISCACHE_REFERENCED 0x04 /* It was looked up since the hand passed. */
+
 struct hiscache {
-    HASH Hash;  /* Hash value of the message-id using Hash() */
-    bool Found; /* Whether this entry is in the dbz file yet */
+    char tag[HISCACHE_WAYS][HISCACHE_TAG];
+    unsigned char flags[HISCACHE_WAYS];
+    unsigned char hand; /* Next entry to consider for replacement. */
+    char pad[HISCACHE_LINE - HISCACHE_WAYS * (HISCACHE_TAG + 1) - 1];
+};
+
+/* A write held back by HISCTLS_BATCHSIZE */
+struct hispending {
+    HASH hash;
+    char *key;
+    time_t arrived;
+    time_t posted;
+    time_t expires;
+    TOKEN token;
+    bool remember; /* HISremember rather than HISwrite */
 };
 
 struct history {
     struct hismethod *methods;
     void *sub;
     struct hiscache *cache;
-    size_t cachesize;
+    void *cachebase;            /* what was allocated, for alignment */
+    size_t cachemask;           /* number of sets minus one */
     const char *error;
     struct histstats stats;
+    struct hispending *batch;
+    size_t batchsize;           /* 0 if writes are not held back */
+    size_t batchcount;          /* writes currently held */
+    unsigned long batchdelay;   /* milliseconds a write may be held */
+    struct timeval batchstart;  /* when the oldest held write was made */
 };
 
+/* Keys of HIScheck_batch and HISlookup_batch passed to the method at once */
+#define HIS_BATCHMAX 64
+
 enum HISRESULT {
     HIScachehit,
     HIScachemiss,
     HIScachedne
 };
 
-static const struct histstats nullhist = {0, 0, 0, 0};
+static const struct histstats nullhist = {0, 0, 0, 0, 0};
+
+/*
+** Return the set of the history cache for a hash
+*/
+static struct hiscache *
+his_cacheset(struct history *h, const HASH *MessageID)
+{
+    uint32_t loc;
+
+    memcpy(&loc, ((const char *) MessageID) + HISCACHE_TAG, sizeof(loc));
+    return &h->cache[loc & h->cachemask];
+}
+
+/*
+** Return the way of a set holding a hash, or HISCACHE_WAYS if none does
+*/
+static unsigned int
+his_cacheway(const struct hiscache *set, const HASH *MessageID)
+{
+    unsigned int i;
+
+    for (i = 0; i < HISCACHE_WAYS; i++)
+        if ((set->flags[i] & HISCACHE_USED)
+            && memcmp(set->tag[i], MessageID, HISCACHE_TAG) == 0)
+            break;
+    return i;
+}
 
 /*
 ** Put an entry into the history cache
@@ -86,15 +152,30 @@ static const struct histstats nullhist = {0, 0, 0, 0};
 static void
 his_cacheadd(struct history *h, HASH MessageID, bool Found)
 {
-    unsigned int i, loc;
+    struct hiscache *set;
+    unsigned int i;
 
     his_logger("HIScacheadd begin", S_HIScacheadd);
     if (h->cache != NULL) {
-        memcpy(&loc, ((char *) &MessageID) + (sizeof(HASH) - sizeof(loc)),
-               sizeof(loc));
-        i = loc % h->cachesize;
-        memcpy((char *) &h->cache[i].Hash, (char *) &MessageID, sizeof(HASH));
-        h->cache[i].Found = Found;
+        set = his_cacheset(h, &MessageID);
+        i = his_cacheway(set, &MessageID);
+        if (i == HISCACHE_WAYS) {
+            for (i = 0; i < HISCACHE_WAYS; i++)
+                if (!(set->flags[i] & HISCACHE_USED))
+                    break;
+        }
+        if (i == HISCACHE_WAYS) {
+            /* The set is full; sweep for an entry not looked up lately. */
+            while (set->flags[set->hand] & HISCACHE_REFERENCED) {
+                set->flags[set->hand] &= ~HISCACHE_REFERENCED;
+                set->hand = (set->hand + 1) % HISCACHE_WAYS;
+            }
+            i = set->hand;
+            set->hand = (set->hand + 1) % HISCACHE_WAYS;
+            h->stats.evictions++;
+        }
+        memcpy(set->tag[i], &MessageID, HISCACHE_TAG);
+        set->flags[i] = HISCACHE_USED | (Found ? HISCACHE_FOUND : 0);
     }
     his_logger("HIScacheadd end", S_HIScacheadd);
 }
@@ -105,26 +186,115 @@ his_cacheadd(struct history *h, HASH MessageID, bool Found)
 static enum HISRESULT
 his_cachelookup(struct history *h, HASH MessageID)
 {
-    unsigned int i, loc;
+    struct hiscache *set;
+    unsigned int i;
 
     if (h->cache == NULL)
         return HIScachedne;
     his_logger("HIScachelookup begin", S_HIScachelookup);
-    memcpy(&loc, ((char *) &MessageID) + (sizeof(HASH) - sizeof(loc)),
-           sizeof(loc));
-    i = loc % h->cachesize;
-    if (memcmp((char *) &h->cache[i].Hash, (char *) &MessageID, sizeof(HASH))
-        == 0) {
-        his_logger("HIScachelookup end", S_HIScachelookup);
-        if (h->cache[i].Found) {
-            return HIScachehit;
+    set = his_cacheset(h, &MessageID);
+    i = his_cacheway(set, &MessageID);
+    his_logger("HIScachelookup end", S_HIScachelookup);
+    if (i == HISCACHE_WAYS)
+        return HIScachedne;
+    set->flags[i] |= HISCACHE_REFERENCED;
+    if (set->flags[i] & HISCACHE_FOUND)
+        return HIScachehit;
+    else
+        return HIScachemiss;
+}
+
+/*
+**  Pass the held writes on to the method as one group.  Returns false if any
+**  of them failed; the method will have set the error.
+*/
+static bool
+his_batchflush(struct history *h)
+{
+    struct hispending *p;
+    bool r = true, grouped;
+    size_t i;
+
+    if (h->batchcount == 0)
+        return true;
+    grouped = true;
+    (*h->methods->ctl)(h->sub, HISCTLS_WRITEBATCH, &grouped);
+    for (i = 0; i < h->batchcount; i++) {
+        p = &h->batch[i];
+        if (p->remember) {
+            if (!(*h->methods->remember)(h->sub, p->key, p->arrived,
+                                         p->posted))
+                r = false;
         } else {
-            return HIScachemiss;
+            if (!(*h->methods->write)(h->sub, p->key, p->arrived, p->posted,
+                                      p->expires, &p->token))
+                r = false;
         }
-    } else {
-        his_logger("HIScachelookup end", S_HIScachelookup);
-        return HIScachedne;
+        free(p->key);
     }
+    h->batchcount = 0;
+    grouped = false;
+    if (!(*h->methods->ctl)(h->sub, HISCTLS_WRITEBATCH, &grouped))
+        r = false;
+    return r;
+}
+
+/*
+**  Whether the oldest held write has waited for HISCTLS_BATCHDELAY.
+*/
+static bool
+his_batchexpired(struct history *h)
+{
+    struct timeval now;
+    unsigned long waited;
+
+    if (h->batchcount == 0)
+        return false;
+    gettimeofday(&now, NULL);
+    waited = (now.tv_sec - h->batchstart.tv_sec) * 1000
+             + (now.tv_usec - h->batchstart.tv_usec) / 1000;
+    return waited >= h->batchdelay;
+}
+
+/*
+**  Hold back a write, passing on the whole batch if it is now full or old
+**  enough.  The entry goes into the cache as found straight away.
+*/
+static bool
+his_batchadd(struct history *h, const char *key, time_t arrived,
+             time_t posted, time_t expires, const TOKEN *token)
+{
+    struct hispending *p;
+
+    if (h->batchcount == 0)
+        gettimeofday(&h->batchstart, NULL);
+    p = &h->batch[h->batchcount++];
+    p->hash = HashMessageID(key);
+    p->key = xstrdup(key);
+    p->arrived = arrived;
+    p->posted = posted;
+    p->expires = expires;
+    p->remember = (token == NULL);
+    if (token != NULL)
+        p->token = *token;
+    his_cacheadd(h, p->hash, true);
+    if (h->batchcount >= h->batchsize || his_batchexpired(h))
+        return his_batchflush(h);
+    return true;
+}
+
+/*
+**  Find a held write by hash, the most recent one if there are several.
+*/
+static struct hispending *
+his_batchlookup(struct history *h, HASH MessageID)
+{
+    size_t i;
+
+    for (i = h->batchcount; i > 0; i--)
+        if (memcmp(&h->batch[i - 1].hash, &MessageID, sizeof(HASH)) == 0)
+            return &h->batch[i - 1];
+    return NULL;
 }
 
 /*
@@ -163,9 +333,14 @@ HISopen(const char *path, const char *method, int flags)
     h = xmalloc(sizeof *h);
     h->methods = &his_methods[i];
     h->cache = NULL;
+    h->cachebase = NULL;
+    h->cachemask = 0;
     h->error = NULL;
-    h->cachesize = 0;
     h->stats = nullhist;
+    h->batch = NULL;
+    h->batchsize = 0;
+    h->batchcount = 0;
+    h->batchdelay = 0;
     h->sub = (*h->methods->open)(path, flags, h);
     if (h->sub == NULL) {
         free(h);
@@ -190,11 +365,11 @@ HISclose(struct history *h)
 
     if (his_checknull(h))
         return false;
-    r = (*h->methods->close)(h->sub);
-    if (h->cache) {
-        free(h->cache);
-        h->cache = NULL;
-    }
+    r = his_batchflush(h);
+    if (!(*h->methods->close)(h->sub))
+        r = false;
+    free(h->batch);
+    free(h->cachebase);
     if (h->error) {
         free((void *) h->error);
         h->error = NULL;
@@ -211,7 +386,9 @@ HISsync(struct history *h)
     if (his_checknull(h))
         return false;
     TMRstart(TMR_HISSYNC);
-    r = (*h->methods->sync)(h->sub);
+    r = his_batchflush(h);
+    if (!(*h->methods->sync)(h->sub))
+        r = false;
     TMRstop(TMR_HISSYNC);
     return r;
 }
@@ -220,12 +397,32 @@ bool
 HISlookup(struct history *h, const char *key, time_t *arrived, time_t *posted,
           time_t *expires, TOKEN *token)
 {
+    struct hispending *p;
     bool r;
 
     if (his_checknull(h))
         return false;
     TMRstart(TMR_HISGREP);
-    r = (*h->methods->lookup)(h->sub, key, arrived, posted, expires, token);
+    if (his_batchexpired(h))
+        his_batchflush(h);
+    p = h->batchcount != 0 ? his_batchlookup(h, HashMessageID(key)) : NULL;
+    if (p == NULL)
+        r = (*h->methods->lookup)(h->sub, key, arrived, posted, expires,
+                                  token);
+    else if (p->remember)
+        /* as with the methods, only an entry with a token is found */
+        r = false;
+    else {
+        if (arrived != NULL)
+            *arrived = p->arrived;
+        if (posted != NULL)
+            *posted = p->posted;
+        if (expires != NULL)
+            *expires = p->expires;
+        if (token != NULL)
+            *token = p->token;
+        r = true;
+    }
     TMRstop(TMR_HISGREP);
     return r;
 }
@@ -239,6 +436,8 @@ HIScheck(struct history *h, const char *key)
     if (his_checknull(h))
         return false;
     TMRstart(TMR_HISHAVE);
+    if (his_batchexpired(h))
+        his_batchflush(h);
     hash = HashMessageID(key);
     switch (his_cachelookup(h, hash)) {
     case HIScachehit:
@@ -252,6 +451,12 @@ HIScheck(struct history *h, const char *key)
         break;
 
     case HIScachedne:
+        if (h->batchcount != 0 && his_batchlookup(h, hash) != NULL) {
+            his_cacheadd(h, hash, true);
+            h->stats.hitpos++;
+            r = true;
+            break;
+        }
         r = (*h->methods->check)(h->sub, key);
         his_cacheadd(h, hash, r);
         if (r)
@@ -264,6 +469,143 @@ HIScheck(struct history *h, const char *key)
     return r;
 }
 
+/*
+**  Look up n keys at once, as HISlookup would one after the other.  Those
+**  not among the held writes are passed to the method together, which can
+**  then overlap their lookups.  The arrays other than keys and found may be
+**  NULL.  Returns false if the method failed for some of them.
+*/
+bool
+HISlookup_batch(struct history *h, const char *const *keys, size_t n,
+                bool *found, time_t *arrived, time_t *posted, time_t *expires,
+                TOKEN *tokens)
+{
+    const char *todo[HIS_BATCHMAX];
+    size_t where[HIS_BATCHMAX];
+    bool rs[HIS_BATCHMAX];
+    time_t as[HIS_BATCHMAX], ps[HIS_BATCHMAX], es[HIS_BATCHMAX];
+    TOKEN ts[HIS_BATCHMAX];
+    struct hispending *p;
+    size_t i, j, count;
+    bool r = true;
+
+    if (his_checknull(h))
+        return false;
+    TMRstart(TMR_HISGREP);
+    if (his_batchexpired(h))
+        his_batchflush(h);
+    for (i = 0; i < n;) {
+        for (count = 0; i < n && count < HIS_BATCHMAX; i++) {
+            p = h->batchcount != 0 ? his_batchlookup(h, HashMessageID(keys[i]))
+                                   : NULL;
+            if (p == NULL) {
+                where[count] = i;
+                todo[count++] = keys[i];
+                continue;
+            }
+            /* as with the methods, only an entry with a token is found */
+            found[i] = !p->remember;
+            if (p->remember)
+                continue;
+            if (arrived != NULL)
+                arrived[i] = p->arrived;
+            if (posted != NULL)
+                posted[i] = p->posted;
+            if (expires != NULL)
+                expires[i] = p->expires;
+            if (tokens != NULL)
+                tokens[i] = p->token;
+        }
+        if (count == 0)
+            continue;
+        if (!(*h->methods->lookup_batch)(h->sub, todo, count, rs, as, ps, es,
+                                         ts))
+            r = false;
+        for (j = 0; j < count; j++) {
+            found[where[j]] = rs[j];
+            if (!rs[j])
+                continue;
+            if (arrived != NULL)
+                arrived[where[j]] = as[j];
+            if (posted != NULL)
+                posted[where[j]] = ps[j];
+            if (expires != NULL)
+                expires[where[j]] = es[j];
+            if (tokens != NULL)
+                tokens[where[j]] = ts[j];
+        }
+    }
+    TMRstop(TMR_HISGREP);
+    return r;
+}
+
+/*
+**  Check n keys at once, setting found to what HIScheck would return for
+**  each of them.  Those answered neither by the cache nor by the held
+**  writes are passed to the method together, which can then overlap their
+**  lookups.  Returns false if the method failed for some of them.
+*/
+bool
+HIScheck_batch(struct history *h, const char *const *keys, size_t n,
+               bool *found)
+{
+    const char *todo[HIS_BATCHMAX];
+    size_t where[HIS_BATCHMAX];
+    HASH hashes[HIS_BATCHMAX];
+    bool rs[HIS_BATCHMAX];
+    size_t i, j, count;
+    HASH hash;
+    bool r = true;
+
+    if (his_checknull(h))
+        return false;
+    TMRstart(TMR_HISHAVE);
+    if (his_batchexpired(h))
+        his_batchflush(h);
+    for (i = 0; i < n;) {
+        for (count = 0; i < n && count < HIS_BATCHMAX; i++) {
+            hash = HashMessageID(keys[i]);
+            switch (his_cachelookup(h, hash)) {
+            case HIScachehit:
+                h->stats.hitpos++;
+                found[i] = true;
+                break;
+
+            case HIScachemiss:
+                h->stats.hitneg++;
+                found[i] = false;
+                break;
+
+            case HIScachedne:
+                if (h->batchcount != 0 && his_batchlookup(h, hash) != NULL) {
+                    his_cacheadd(h, hash, true);
+                    h->stats.hitpos++;
+                    found[i] = true;
+                    break;
+                }
+                hashes[count] = hash;
+                where[count] = i;
+                todo[count++] = keys[i];
+                break;
+            }
+        }
+        if (count == 0)
+            continue;
+        if (!(*h->methods->check_batch)(h->sub, todo, count, rs))
+            r = false;
+        for (j = 0; j < count; j++) {
+            found[where[j]] = rs[j];
+            his_cacheadd(h, hashes[j], rs[j]);
+            if (rs[j])
+                h->stats.misses++;
+            else
+                h->stats.dne++;
+        }
+    }
+    TMRstop(TMR_HISHAVE);
+    return r;
+}
+
 bool
 HISwrite(struct history *h, const char *key, time_t arrived, time_t posted,
          time_t expires, const TOKEN *token)
@@ -273,6 +615,11 @@ HISwrite(struct history *h, const char *key, time_t arrived, time_t posted,
     if (his_checknull(h))
         return false;
     TMRstart(TMR_HISWRITE);
+    if (h->batchsize != 0) {
+        r = his_batchadd(h, key, arrived, posted, expires, token);
+        TMRstop(TMR_HISWRITE);
+        return r;
+    }
     r = (*h->methods->write)(h->sub, key, arrived, posted, expires, token);
     if (r == true) {
         HASH hash;
@@ -294,6 +641,11 @@ HISremember(struct history *h, const char *key, time_t arrived, time_t posted)
     if (his_checknull(h))
         return false;
     TMRstart(TMR_HISWRITE);
+    if (h->batchsize != 0) {
+        r = his_batchadd(h, key, arrived, posted, 0, NULL);
+        TMRstop(TMR_HISWRITE);
+        return r;
+    }
     r = (*h->methods->remember)(h->sub, key, arrived, posted);
     if (r == true) {
         HASH hash;
@@ -315,6 +667,7 @@ HISreplace(struct history *h, const char *key, time_t arrived, time_t posted,
 
     if (his_checknull(h))
         return false;
+    his_batchflush(h);
     r = (*h->methods->replace)(h->sub, key, arrived, posted, expires, token);
     if (r == true) {
         HASH hash;
@@ -335,6 +688,7 @@ HISwalk(struct history *h, const char *reason, void *cookie,
 
     if (his_checknull(h))
         return false;
+    his_batchflush(h);
     r = (*h->methods->walk)(h->sub, reason, cookie, callback);
     return r;
 }
@@ -348,6 +702,7 @@ HISexpire(struct history *h, const char *path, const char *reason,
 
     if (his_checknull(h))
         return false;
+    his_batchflush(h);
     r = (*h->methods->expire)(h->sub, path, reason, writing, cookie, threshold,
                               exists);
     return r;
@@ -356,16 +711,30 @@ HISexpire(struct history *h, const char *path, const char *reason,
 void
 HISsetcache(struct history *h, size_t size)
 {
+    size_t sets;
+    uintptr_t base;
+
     if (h == NULL)
         return;
-    if (h->cache) {
-        free(h->cache);
-        h->cache = NULL;
-    }
-    h->cachesize = size / sizeof(struct hiscache);
-    if (h->cachesize != 0)
-        h->cache = xcalloc(h->cachesize, sizeof(struct hiscache));
+    free(h->cachebase);
+    h->cache = NULL;
+    h->cachebase = NULL;
+    h->cachemask = 0;
     h->stats = nullhist;
+
+    /* Round down to a power of two so that the set is a mask away. */
+    sets = size / sizeof(struct hiscache);
+    if (sets == 0)
+        return;
+    while ((sets & (sets - 1)) != 0)
+        sets &= sets - 1;
+    h->cachemask = sets - 1;
+
+    /* Start the sets on a cache line. */
+    h->cachebase = xcalloc(1, sets * sizeof(struct hiscache) + HISCACHE_LINE);
+    base = (uintptr_t) h->cachebase;
+    base = (base + HISCACHE_LINE - 1) & ~((uintptr_t) HISCACHE_LINE - 1);
+    h->cache = (struct hiscache *) base;
 }
 
 
@@ -398,7 +767,7 @@ HISerror(struct history *h)
 
 
 /*
-**  control interface to underlying method
+**  control interface to underlying method; write batching is handled here
 */
 bool
 HISctl(struct history *h, int selector, void *val)
@@ -407,7 +776,24 @@ HISctl(struct history *h, int selector, void *val)
 
     if (his_checknull(h))
         return false;
-    r = (*h->methods->ctl)(h->sub, selector, val);
+    r = his_batchflush(h);
+    switch (selector) {
+    case HISCTLS_BATCHSIZE:
+        h->batchsize = *(size_t *) val;
+        free(h->batch);
+        h->batch = NULL;
+        if (h->batchsize != 0)
+            h->batch = xcalloc(h->batchsize, sizeof(struct hispending));
+        break;
+
+    case HISCTLS_BATCHDELAY:
+        h->batchdelay = *(unsigned long *) val;
+        break;
+
+    default:
+        r = (*h->methods->ctl)(h->sub, selector, val);
+        break;
+    }
     return r;
 }
 
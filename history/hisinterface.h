@@ -26,6 +26,9 @@ typedef struct hismethod {
     bool (*lookup)(void *, const char *, time_t *, time_t *, time_t *,
                    struct token *);
     bool (*check)(void *, const char *);
+    bool (*lookup_batch)(void *, const char *const *, size_t, bool *,
+                         time_t *, time_t *, time_t *, struct token *);
+    bool (*check_batch)(void *, const char *const *, size_t, bool *);
     bool (*write)(void *, const char *, time_t, time_t, time_t,
                   const struct token *);
     bool (*replace)(void *, const char *, time_t, time_t, time_t,
@@ -43,6 +43,24 @@ select arrived, posted, expires, token
 -- .check
 select 1 from hist where hash = ?1;
 
+-- HISlookup_batch and HIScheck_batch: up to HISSQLITE_LOOKUP_BATCH hashes in
+-- one statement, so that a batch of CHECKs costs one B-tree descent per key
+-- but a single statement execution.  Unused parameters are bound to NULL,
+-- which matches no row.  Rows come back in any order and are matched to the
+-- keys by hash in hissqlite.c; remembered rows are skipped by the lookup as
+-- in .lookup.
+-- .lookup_batch
+select hash, arrived, posted, expires, token
+    from hist
+    where hash in (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8,
+                   ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);
+
+-- .check_batch
+select hash
+    from hist
+    where hash in (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8,
+                   ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);
+
 -- HISwrite: a real, stored article.  The accept path runs HIScheck first, so
 -- this is normally a fresh insert.  DO NOTHING on a hash conflict keeps the
 -- existing row rather than failing: a duplicate Message-ID during a
@@ -47,6 +47,10 @@
    higher.  32 keeps the division a strict overestimate. */
 #define HISSQLITE_MIN_ROW_BYTES   32
 
+/* Number of parameters of the .lookup_batch and .check_batch statements:
+   HISlookup_batch and HIScheck_batch look up this many keys per execution. */
+#define HISSQLITE_LOOKUP_BATCH    16
+
 /* HIS_INCORE (a bulk rebuild, makehistory) commits writes in transactions of
    this many rows instead of one each; matches hissqlite-convert's
    COMMIT_EVERY.  See the batch_* helpers in hissqlite.c. */
@@ -71,12 +75,14 @@ struct hissqlite {
 
     /* Writer side (NULL for a pure read-only direct reader).  Writes
        autocommit unless the handle was opened HIS_INCORE, the bulk-rebuild
-       hint, which enables transaction batching (see hissqlite.c). */
+       hint, which enables transaction batching, or the history API is
+       passing on a group of held writes (see hissqlite.c). */
     hissqlite_main_t main;
     int wal_pages;        /* WAL frame count, updated by the wal_hook. */
     size_t batch_size;    /* writes per transaction; 0 = autocommit. */
     size_t batch_pending; /* writes in the currently open batch. */
     bool batch_open;      /* an explicit batch transaction is open. */
+    bool batch_grouped;   /* inside HISCTLS_WRITEBATCH true ... false. */
 
     /* Reader side (used when opened HIS_RDONLY in WAL mode). */
     hissqlite_read_t read;
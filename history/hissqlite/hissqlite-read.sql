@@ -22,5 +22,18 @@ select arrived, posted, expires, token
 -- .check
 select 1 from hist where hash = ?1;
 
+-- Batched lookups, as in hissqlite-main.sql.
+-- .lookup_batch
+select hash, arrived, posted, expires, token
+    from hist
+    where hash in (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8,
+                   ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);
+
+-- .check_batch
+select hash
+    from hist
+    where hash in (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8,
+                   ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);
+
 -- .walk
 select hash, arrived, posted, expires, token from hist;
@@ -11,8 +11,9 @@
 **  read/write instead of rebuilding and swapping a file, so innd is not
 **  paused).  SQLite's WAL write lock and busy_timeout serialize the two
 **  without a broker server process (unlike ovsqlite): this works because
-**  writes autocommit, so the lock is held only per statement and the periodic,
-**  light expire does not contend with innd for long.  See hissqlite(5).
+**  writes autocommit (or, when the history API batches writes, commit as one
+**  short burst), so the lock is held only briefly and the periodic, light
+**  expire does not contend with innd for long.  See hissqlite(5).
 **
 **  Written by Kevin Bowling in 2026.
 */
@@ -51,6 +52,24 @@ bind_key(sqlite3_stmt *stmt, const char *key)
     sqlite3_bind_blob(stmt, 1, &hash, sizeof(HASH), SQLITE_TRANSIENT);
 }
 
+/*
+**  Bind the MD5s of up to HISSQLITE_LOOKUP_BATCH Message-IDs as the
+**  parameters of a batched statement, and NULL to those left over.
+*/
+static void
+bind_keys(sqlite3_stmt *stmt, const HASH *hashes, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < HISSQLITE_LOOKUP_BATCH; i++) {
+        if (i < count)
+            sqlite3_bind_blob(stmt, (int) i + 1, &hashes[i], sizeof(HASH),
+                              SQLITE_TRANSIENT);
+        else
+            sqlite3_bind_null(stmt, (int) i + 1);
+    }
+}
+
 /*
 **  Copy a column blob into a fixed-size destination, verifying its length
 **  first.  A wrong-length blob means a corrupt row; report it (so corruption
@@ -96,6 +115,13 @@ copy_blob(struct hissqlite *h, sqlite3_stmt *stmt, int col, void *dst,
 **  transactions of HISSQLITE_BULK_BATCH rows.  The batch commits when full,
 **  on HISsync and on HISclose, so every write that returned true is
 **  committed by close.
+**
+**  The history API's own write batching (HISCTLS_BATCHSIZE in his.c) does
+**  not contradict the above: his.c holds the writes in core while articles
+**  arrive, and only when it passes them on does it bracket them with
+**  HISCTLS_WRITEBATCH true and false.  The transaction opened here spans
+**  just that burst of INSERTs, not the wall-clock time it took to collect
+**  them, so expire still gets the lock between bursts.
 */
 static bool
 batch_commit(struct hissqlite *h)
@@ -133,7 +159,32 @@ batch_advance(struct hissqlite *h)
 {
     if (!h->batch_open)
         return true;
-    if (++h->batch_pending < h->batch_size)
+    if (++h->batch_pending < h->batch_size || h->batch_grouped)
+        return true;
+    return batch_commit(h);
+}
+
+/*
+**  Start or end a group of writes passed on together by the history API.
+**  The whole group is one transaction; a bulk-rebuild batch already open is
+**  simply extended, and left open at the end of the group unless full.
+*/
+static bool
+batch_group(struct hissqlite *h, bool start)
+{
+    if (h->direct_reader || h->db == NULL)
+        return false;
+    if (start) {
+        if (!h->batch_open
+            && sqlite3_exec(h->db, "begin", NULL, NULL, NULL) == SQLITE_OK) {
+            h->batch_open = true;
+            h->batch_pending = 0;
+        }
+        h->batch_grouped = true;
+        return true;
+    }
+    h->batch_grouped = false;
+    if (h->batch_size != 0 && h->batch_pending < h->batch_size)
         return true;
     return batch_commit(h);
 }
@@ -586,6 +637,106 @@ hissqlite_check(void *history, const char *key)
     return found;
 }
 
+/*
+**  Look up n keys, HISSQLITE_LOOKUP_BATCH of them per execution of the
+**  .lookup_batch statement.  Its rows come in any order, so each is matched
+**  to the keys by hash; as in hissqlite_lookup, remembered rows are not
+**  found.  The arrays other than keys and found may be NULL.
+*/
+bool
+hissqlite_lookup_batch(void *history, const char *const *keys, size_t n,
+                       bool *found, time_t *arrived, time_t *posted,
+                       time_t *expires, struct token *tokens)
+{
+    struct hissqlite *h = history;
+    sqlite3_stmt *stmt =
+        h->direct_reader ? h->read.lookup_batch : h->main.lookup_batch;
+    HASH hashes[HISSQLITE_LOOKUP_BATCH];
+    size_t i, j, count;
+    bool ok = true;
+    int status;
+
+    for (i = 0; i < n; i += count) {
+        count = n - i < HISSQLITE_LOOKUP_BATCH ? n - i
+                                               : HISSQLITE_LOOKUP_BATCH;
+        for (j = 0; j < count; j++) {
+            hashes[j] = HashMessageID(keys[i + j]);
+            found[i + j] = false;
+        }
+        bind_keys(stmt, hashes, count);
+        while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != (int) sizeof(HASH)
+                || sqlite3_column_type(stmt, 4) == SQLITE_NULL)
+                continue;
+            for (j = 0; j < count; j++) {
+                if (memcmp(sqlite3_column_blob(stmt, 0), &hashes[j],
+                           sizeof(HASH))
+                    != 0)
+                    continue;
+                if (tokens != NULL
+                    && !copy_blob(h, stmt, 4, &tokens[i + j], sizeof(TOKEN),
+                                  "corrupt token blob in lookup"))
+                    continue;
+                found[i + j] = true;
+                if (arrived != NULL)
+                    arrived[i + j] = (time_t) sqlite3_column_int64(stmt, 1);
+                if (posted != NULL)
+                    posted[i + j] = (time_t) sqlite3_column_int64(stmt, 2);
+                if (expires != NULL)
+                    expires[i + j] = (time_t) sqlite3_column_int64(stmt, 3);
+            }
+        }
+        if (status != SQLITE_DONE) {
+            hissqlite_seterror(h, "lookup");
+            ok = false;
+        }
+        sqlite3_reset(stmt);
+    }
+    return ok;
+}
+
+/*
+**  Check n keys, HISSQLITE_LOOKUP_BATCH of them per execution of the
+**  .check_batch statement.  Remembered rows count, as in hissqlite_check.
+*/
+bool
+hissqlite_check_batch(void *history, const char *const *keys, size_t n,
+                      bool *found)
+{
+    struct hissqlite *h = history;
+    sqlite3_stmt *stmt =
+        h->direct_reader ? h->read.check_batch : h->main.check_batch;
+    HASH hashes[HISSQLITE_LOOKUP_BATCH];
+    size_t i, j, count;
+    bool ok = true;
+    int status;
+
+    for (i = 0; i < n; i += count) {
+        count = n - i < HISSQLITE_LOOKUP_BATCH ? n - i
+                                               : HISSQLITE_LOOKUP_BATCH;
+        for (j = 0; j < count; j++) {
+            hashes[j] = HashMessageID(keys[i + j]);
+            found[i + j] = false;
+        }
+        bind_keys(stmt, hashes, count);
+        while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) != (int) sizeof(HASH))
+                continue;
+            for (j = 0; j < count; j++)
+                if (memcmp(sqlite3_column_blob(stmt, 0), &hashes[j],
+                           sizeof(HASH))
+                    == 0)
+                    found[i + j] = true;
+        }
+        if (status != SQLITE_DONE) {
+            hissqlite_seterror(h, "check");
+            ok = false;
+        }
+        sqlite3_reset(stmt);
+    }
+    return ok;
+}
+
 bool
 hissqlite_write(void *history, const char *key, time_t arrived, time_t posted,
                 time_t expires, const struct token *token)
@@ -881,6 +1032,8 @@ hissqlite_ctl(void *history, int selector, void *val)
     case HISCTLS_SYNCCOUNT:
         /* No-op: writes autocommit, so there is no batch size to set. */
         return true;
+    case HISCTLS_WRITEBATCH:
+        return batch_group(h, *(bool *) val);
     case HISCTLS_STATINTERVAL:
         /* No-op: WAL readers always see a consistent snapshot; there is no
            swapped-inode poll as in hisv6. */
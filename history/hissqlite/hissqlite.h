@@ -27,6 +27,13 @@ bool hissqlite_lookup(void *, const char *key, time_t *arrived, time_t *posted,
 
 bool hissqlite_check(void *, const char *key);
 
+bool hissqlite_lookup_batch(void *, const char *const *keys, size_t n,
+                            bool *found, time_t *arrived, time_t *posted,
+                            time_t *expires, struct token *tokens);
+
+bool hissqlite_check_batch(void *, const char *const *keys, size_t n,
+                           bool *found);
+
 bool hissqlite_write(void *, const char *key, time_t arrived, time_t posted,
                      time_t expires, const struct token *token);
 
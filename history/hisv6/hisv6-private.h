@@ -44,6 +44,12 @@
     1 - \n */
 #define HISV6_MINLINE     37
 
+/* number of lookups of a key whose history line is not the right one */
+#define HISV6_FETCHTRIES  3
+
+/* number of keys of a batch whose index lookups are started together */
+#define HISV6_PREFETCH    32
+
 struct hisv6 {
     char *histpath;
     FILE *writefp;
@@ -53,10 +59,17 @@ struct hisv6 {
     time_t statinterval;
     size_t synccount;
     size_t dirty;
+    bool batch; /* Between HISCTLS_WRITEBATCH true and false. */
     ssize_t npairs;
     int readfd;
     int flags;
     struct stat st;
+    ino_t dirino;             /* Inode of the .dir file, to detect a new one */
+    unsigned long resizefill; /* Percent full that starts a rebuild, or 0 */
+    pid_t resizepid;          /* Process rebuilding the index, or 0 */
+    pid_t resizeowner;        /* Process which started the rebuild */
+    int resizefd;             /* Where the rebuild tells whether it worked */
+    off_t resizefrom;         /* Length of the text when it started */
 };
 
 /* values in the bitmap returned from hisv6_splitline */
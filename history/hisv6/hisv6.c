@@ -48,6 +48,7 @@
 #include "inn/fdflag.h"
 #include "inn/innconf.h"
 #include "inn/inndcomm.h"
+#include "inn/messages.h"
 #include "inn/qio.h"
 #include "inn/sequence.h"
 #include "inn/timer.h"
@@ -55,6 +56,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 /*
 **  because we can only have one open dbz per process, we keep a
@@ -62,6 +65,17 @@
 */
 static struct hisv6 *hisv6_dbzowner;
 
+/* the files of a dbz index besides the text, the .dir last so that it can
+   be renamed last */
+#ifdef DO_TAGGED_HASH
+static const char *const hisv6_dbzfiles[] = {".pag", ".dir"};
+#else
+static const char *const hisv6_dbzfiles[] = {".index", ".hash", ".dir"};
+#endif
+
+static bool hisv6_syncfiles(struct hisv6 *h);
+static void hisv6_resizeabort(struct hisv6 *h);
+
 
 /*
 **  set error status to that indicated by s; doesn't copy the string,
@@ -224,7 +238,7 @@ hisv6_dbzclose(struct hisv6 *h)
     bool r = true;
 
     if (h == hisv6_dbzowner) {
-        if (!hisv6_sync(h))
+        if (!hisv6_syncfiles(h))
             r = false;
         if (!dbzclose()) {
             hisv6_seterror(h, concat("can't dbzclose ", h->histpath, " ",
@@ -246,6 +260,7 @@ hisv6_closefiles(struct hisv6 *h)
 {
     bool r = true;
 
+    hisv6_resizeabort(h);
     if (!hisv6_dbzclose(h))
         r = false;
 
@@ -275,6 +290,7 @@ hisv6_closefiles(struct hisv6 *h)
 
     h->nextcheck = 0;
     h->st.st_ino = (ino_t) -1;
+    h->dirino = (ino_t) -1;
     /* FIXME - mips defines dev_t to be 64-bits whereas st_dev is 32-bits,
      * so we have an overflow when casting to dev_t.
      * As we always compare against st_ino as well, it shouldn't
@@ -435,10 +451,18 @@ hisv6_checkfiles(struct hisv6 *h)
         }
     }
     if (seq_lcompare(t, h->nextcheck) == 1) {
-        struct stat st;
-
+        struct stat st, dirst;
+        char *dirpath;
+
+        /* the index alone is replaced when it is rebuilt while the server
+           is running */
+        dirpath = concat(h->histpath, ".dir", NULL);
+        if (stat(dirpath, &dirst) != 0)
+            dirst.st_ino = h->dirino;
+        free(dirpath);
         if (stat(h->histpath, &st) == 0
-            && (st.st_ino != h->st.st_ino || st.st_dev != h->st.st_dev)) {
+            && (st.st_ino != h->st.st_ino || st.st_dev != h->st.st_dev
+                || dirst.st_ino != h->dirino)) {
             /* there's a possible race on the history file here... */
             hisv6_closefiles(h);
             if (!hisv6_reopen(h)) {
@@ -446,6 +470,7 @@ hisv6_checkfiles(struct hisv6 *h)
                 return false;
             }
             h->st = st;
+            h->dirino = dirst.st_ino;
         }
         h->nextcheck = hisv6_nextcheck(h, t);
     }
@@ -492,7 +517,14 @@ hisv6_new(const char *path, int flags, struct history *history)
     h->npairs = 0;
     h->dirty = 0;
     h->synccount = 0;
+    h->batch = false;
     h->st.st_ino = (ino_t) -1;
+    h->dirino = (ino_t) -1;
+    h->resizefill = 0;
+    h->resizepid = 0;
+    h->resizeowner = 0;
+    h->resizefd = -1;
+    h->resizefrom = 0;
 /* FIXME - mips defines dev_t to be 64-bits whereas st_dev is 32-bits,
  * so we have an overflow when casting to dev_t.
  * As we always compare against st_ino as well, it shouldn't
@@ -551,10 +583,9 @@ hisv6_close(void *history)
 /*
 **  synchronise any outstanding history changes to disk
 */
-bool
-hisv6_sync(void *history)
+static bool
+hisv6_syncfiles(struct hisv6 *h)
 {
-    struct hisv6 *h = history;
     bool r = true;
 
     if (h->writefp != NULL) {
@@ -579,6 +610,315 @@ hisv6_sync(void *history)
 }
 
 
+/*
+**  name of a file of the index being rebuilt, next to a link to the text
+**  named by an empty ext
+*/
+static char *
+hisv6_resizepath(struct hisv6 *h, const char *ext)
+{
+    return concat(h->histpath, ".r", ext, NULL);
+}
+
+
+/*
+**  remove the files of the index being rebuilt
+*/
+static void
+hisv6_resizeunlink(struct hisv6 *h)
+{
+    char *p;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(hisv6_dbzfiles); i++) {
+        p = hisv6_resizepath(h, hisv6_dbzfiles[i]);
+        unlink(p);
+        free(p);
+    }
+    p = hisv6_resizepath(h, "");
+    unlink(p);
+    free(p);
+}
+
+
+/*
+**  start rebuilding the index in the background for npairs entries, or
+**  twice as many as it holds if 0.  makedbz builds it from a link to the
+**  text, and a child of ours waits for it and tells through a pipe
+**  whether it worked; the caller's SIGCHLD handler may reap the child
+**  itself before we could get its status.
+*/
+static bool
+hisv6_resizestart(struct hisv6 *h, size_t npairs)
+{
+    char *text, *makedbz;
+    char size[32], c;
+    long used, tsize;
+    int fd[2], i, status;
+    pid_t pid, child;
+
+    if (h->resizepid != 0) {
+        hisv6_seterror(h, concat("index of ", h->histpath,
+                                 " already being rebuilt", NULL));
+        return false;
+    }
+    if (!(h->flags & HIS_RDWR) || h != hisv6_dbzowner || innconf == NULL) {
+        hisv6_seterror(
+            h, concat("history not open for writing ", h->histpath, NULL));
+        return false;
+    }
+    if (npairs == 0) {
+        if (!dbzusage(&used, &tsize)) {
+            hisv6_seterror(h, concat("can't get size of index of ",
+                                     h->histpath, NULL));
+            return false;
+        }
+        npairs = used * 2;
+    }
+
+    /* makedbz must see everything written so far */
+    if (!hisv6_syncfiles(h))
+        return false;
+    hisv6_resizeunlink(h);
+    text = hisv6_resizepath(h, "");
+    if (link(h->histpath, text) < 0) {
+        hisv6_seterror(h, concat("can't link ", h->histpath, " to ", text,
+                                 " ", strerror(errno), NULL));
+        free(text);
+        return false;
+    }
+    if (pipe(fd) < 0) {
+        hisv6_seterror(h, concat("can't pipe for rebuild of ", h->histpath,
+                                 " ", strerror(errno), NULL));
+        unlink(text);
+        free(text);
+        return false;
+    }
+    snprintf(size, sizeof(size), "%lu", (unsigned long) npairs);
+    makedbz = concatpath(innconf->pathbin, "makedbz");
+    pid = fork();
+    if (pid == 0) {
+        xsignal_forked();
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        setpgid(0, 0);
+
+        /* Only wait for makedbz, without holding the sockets and files of
+           our caller open meanwhile. */
+        for (i = getfdlimit() - 1; i > 2; i--)
+            if (i != fd[1])
+                close(i);
+        child = fork();
+        if (child == 0) {
+            close(fd[1]);
+            execl(makedbz, makedbz, "-f", text, "-s", size, (char *) 0);
+            syswarn("can't exec %s", makedbz);
+            _exit(1);
+        }
+        c = 'n';
+        if (child > 0 && waitpid(child, &status, 0) == child
+            && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            c = 'y';
+        _exit(write(fd[1], &c, 1) == 1 ? 0 : 1);
+    }
+    free(makedbz);
+    close(fd[1]);
+    if (pid < 0) {
+        hisv6_seterror(h, concat("can't fork for rebuild of ", h->histpath,
+                                 " ", strerror(errno), NULL));
+        close(fd[0]);
+        unlink(text);
+        free(text);
+        return false;
+    }
+    free(text);
+
+    /* so that hisv6_resizeabort can stop makedbz as well */
+    setpgid(pid, pid);
+    fdflag_nonblocking(fd[0], true);
+    fdflag_close_exec(fd[0], true);
+    h->resizepid = pid;
+    h->resizeowner = getpid();
+    h->resizefd = fd[0];
+    h->resizefrom = h->offset;
+    notice("rebuilding index of %s for %s entries", h->histpath, size);
+    return true;
+}
+
+
+/*
+**  stop the rebuild of the index, throwing away what it built; a process
+**  forked from the one which started it just forgets about it
+*/
+static void
+hisv6_resizeabort(struct hisv6 *h)
+{
+    if (h->resizepid == 0)
+        return;
+    if (h->resizeowner == getpid()) {
+        kill(-h->resizepid, SIGTERM);
+        waitpid(h->resizepid, NULL, 0);
+        hisv6_resizeunlink(h);
+        notice("stopped rebuilding index of %s", h->histpath);
+    }
+    close(h->resizefd);
+    h->resizefd = -1;
+    h->resizepid = 0;
+}
+
+
+/*
+**  replace the index by the rebuilt one, after storing in it the lines
+**  written to the text since the rebuild started
+*/
+static bool
+hisv6_resizefinish(struct hisv6 *h)
+{
+    char *text, *from, *to, *p;
+    const char *error;
+    QIOSTATE *qp;
+    off_t where, end;
+    HASH hash;
+    size_t i;
+    int fd;
+    bool r = false;
+
+    text = hisv6_resizepath(h, "");
+    if (!hisv6_dbzclose(h))
+        goto done;
+    end = h->offset;
+    if (!dbzinit(text)) {
+        hisv6_seterror(h, concat("can't dbzinit ", text, " ", strerror(errno),
+                                 NULL));
+        goto done;
+    }
+    fd = open(text, O_RDONLY);
+    if (fd < 0 || lseek(fd, h->resizefrom, SEEK_SET) == -1) {
+        hisv6_seterror(h, concat("can't read ", text, " ", strerror(errno),
+                                 NULL));
+        if (fd >= 0)
+            close(fd);
+        dbzclose();
+        goto done;
+    }
+    qp = QIOfdopen(fd);
+    r = true;
+    where = h->resizefrom;
+    while (where < end) {
+        p = QIOread(qp);
+        if (p == NULL && !QIOtoolong(qp))
+            break;
+        if (p != NULL
+            && hisv6_splitline(p, &error, &hash, NULL, NULL, NULL, NULL) > 0
+            && dbzstore(hash, where) == DBZSTORE_ERROR) {
+            hisv6_seterror(h, concat("can't dbzstore ", text, " ",
+                                     strerror(errno), NULL));
+            r = false;
+            break;
+        }
+        where = h->resizefrom + QIOtell(qp);
+    }
+    if (QIOerror(qp) && !QIOtoolong(qp)) {
+        hisv6_seterror(h, concat("can't read ", text, " ", strerror(errno),
+                                 NULL));
+        r = false;
+    }
+    QIOclose(qp);
+    if (!dbzclose()) {
+        hisv6_seterror(h, concat("can't dbzclose ", text, " ", strerror(errno),
+                                 NULL));
+        r = false;
+    }
+
+    /* readers notice the new .dir file, renamed last, and reopen */
+    for (i = 0; r && i < ARRAY_SIZE(hisv6_dbzfiles); i++) {
+        from = hisv6_resizepath(h, hisv6_dbzfiles[i]);
+        to = concat(h->histpath, hisv6_dbzfiles[i], NULL);
+        if (rename(from, to) < 0) {
+            hisv6_seterror(h, concat("can't rename ", from, " to ", to, " ",
+                                     strerror(errno), NULL));
+            r = false;
+        }
+        free(from);
+        free(to);
+    }
+
+done:
+    if (r) {
+        unlink(text);
+        notice("rebuilt index of %s", h->histpath);
+    } else
+        hisv6_resizeunlink(h);
+    free(text);
+    hisv6_closefiles(h);
+    if (!hisv6_reopen(h)) {
+        hisv6_closefiles(h);
+        r = false;
+    }
+    return r;
+}
+
+
+/*
+**  see whether the rebuild of the index is over, and if so swap it in
+*/
+static bool
+hisv6_resizepoll(struct hisv6 *h)
+{
+    ssize_t n;
+    pid_t pid;
+    char c;
+
+    if (h->resizeowner != getpid())
+        return true;
+    n = read(h->resizefd, &c, 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    pid = h->resizepid;
+    close(h->resizefd);
+    h->resizefd = -1;
+    h->resizepid = 0;
+
+    /* it exits right after telling */
+    waitpid(pid, NULL, 0);
+    if (n == 1 && c == 'y')
+        return hisv6_resizefinish(h);
+    hisv6_resizeunlink(h);
+    hisv6_seterror(h, concat("can't rebuild index of ", h->histpath, NULL));
+
+    /* don't start again and again if it can't work */
+    h->resizefill = 0;
+    return false;
+}
+
+
+/*
+**  synchronise any outstanding history changes to disk, and swap in a
+**  rebuilt index or start rebuilding it if it's time to
+*/
+bool
+hisv6_sync(void *history)
+{
+    struct hisv6 *h = history;
+    bool r;
+    long used, size;
+
+    r = hisv6_syncfiles(h);
+    if (h->resizepid != 0) {
+        if (!hisv6_resizepoll(h))
+            r = false;
+    } else if (h->resizefill != 0 && h == hisv6_dbzowner
+               && dbzusage(&used, &size) && size != 0
+               && (double) used * 100 >= (double) size * h->resizefill) {
+        if (!hisv6_resizestart(h, 0)) {
+            h->resizefill = 0;
+            r = false;
+        }
+    }
+    return r;
+}
+
+
 /*
 **  fetch the line associated with `hash' in the history database into
 **  buf; buf must be at least HISV6_MAXLINE+1 bytes. `poff' is filled
@@ -588,6 +928,8 @@ static bool
 hisv6_fetchline(struct hisv6 *h, const HASH *hash, char *buf, off_t *poff)
 {
     off_t offset;
+    HASH found;
+    int tries = 0;
     bool r;
 
     if (h != hisv6_dbzowner) {
@@ -607,6 +949,7 @@ hisv6_fetchline(struct hisv6 *h, const HASH *hash, char *buf, off_t *poff)
     }
 
     /* Get the seek value into the history file. */
+again:
     errno = 0;
     r = dbzfetch(*hash, &offset);
 #ifdef ESTALE
@@ -654,6 +997,18 @@ hisv6_fetchline(struct hisv6 *h, const HASH *hash, char *buf, off_t *poff)
                 *p = '\0';
                 *poff = offset;
                 r = true;
+
+                /* dbz only keeps part of the hash, and may give the line
+                   of an entry being moved by another process; look again
+                   in the latter case. */
+                if (buf[0] == '[') {
+                    found = TextToHash(buf + 1);
+                    if (memcmp(&found, hash, sizeof(HASH)) != 0) {
+                        if (++tries < HISV6_FETCHTRIES)
+                            goto again;
+                        r = false;
+                    }
+                }
             }
         } else {
             char location[HISV6_MAX_LOCATION];
@@ -673,28 +1028,17 @@ fail:
 
 
 /*
-**  lookup up the entry `key' in the history database, returning
-**  arrived, posted and expires (for those which aren't NULL
-**  pointers), and any storage token associated with the entry.
-**
-**  If any of arrived, posted or expires aren't available, return zero
-**  for that component.
+**  look up the history line of a hash, as hisv6_lookup does for a key
 */
-bool
-hisv6_lookup(void *history, const char *key, time_t *arrived, time_t *posted,
-             time_t *expires, TOKEN *token)
+static bool
+hisv6_lookuphash(struct hisv6 *h, const HASH *messageid, time_t *arrived,
+                 time_t *posted, time_t *expires, TOKEN *token)
 {
-    struct hisv6 *h = history;
-    HASH messageid;
     bool r;
     off_t offset;
     char buf[HISV6_MAXLINE + 1];
 
-    his_logger("HISfilesfor begin", S_HISfilesfor);
-    hisv6_checkfiles(h);
-
-    messageid = HashMessageID(key);
-    r = hisv6_fetchline(h, &messageid, buf, &offset);
+    r = hisv6_fetchline(h, messageid, buf, &offset);
     if (r == true) {
         int status;
         const char *error;
@@ -712,11 +1056,71 @@ hisv6_lookup(void *history, const char *key, time_t *arrived, time_t *posted,
             r = !!(status & HISV6_HAVE_TOKEN);
         }
     }
+    return r;
+}
+
+
+/*
+**  lookup up the entry `key' in the history database, returning
+**  arrived, posted and expires (for those which aren't NULL
+**  pointers), and any storage token associated with the entry.
+**
+**  If any of arrived, posted or expires aren't available, return zero
+**  for that component.
+*/
+bool
+hisv6_lookup(void *history, const char *key, time_t *arrived, time_t *posted,
+             time_t *expires, TOKEN *token)
+{
+    struct hisv6 *h = history;
+    HASH messageid;
+    bool r;
+
+    his_logger("HISfilesfor begin", S_HISfilesfor);
+    hisv6_checkfiles(h);
+
+    messageid = HashMessageID(key);
+    r = hisv6_lookuphash(h, &messageid, arrived, posted, expires, token);
     his_logger("HISfilesfor end", S_HISfilesfor);
     return r;
 }
 
 
+/*
+**  lookup n keys at once; the index lookups of up to HISV6_PREFETCH of
+**  them are started before the first one is waited for.  The arrays
+**  other than keys and found may be NULL.
+*/
+bool
+hisv6_lookup_batch(void *history, const char *const *keys, size_t n,
+                   bool *found, time_t *arrived, time_t *posted,
+                   time_t *expires, TOKEN *tokens)
+{
+    struct hisv6 *h = history;
+    HASH hashes[HISV6_PREFETCH];
+    size_t i, j, count;
+
+    his_logger("HISfilesfor begin", S_HISfilesfor);
+    hisv6_checkfiles(h);
+    for (i = 0; i < n; i += count) {
+        count = n - i < HISV6_PREFETCH ? n - i : HISV6_PREFETCH;
+        for (j = 0; j < count; j++) {
+            hashes[j] = HashMessageID(keys[i + j]);
+            if (h == hisv6_dbzowner)
+                dbzprefetch(hashes[j], true);
+        }
+        for (j = 0; j < count; j++)
+            found[i + j] = hisv6_lookuphash(
+                h, &hashes[j], arrived == NULL ? NULL : &arrived[i + j],
+                posted == NULL ? NULL : &posted[i + j],
+                expires == NULL ? NULL : &expires[i + j],
+                tokens == NULL ? NULL : &tokens[i + j]);
+    }
+    his_logger("HISfilesfor end", S_HISfilesfor);
+    return true;
+}
+
+
 /*
 **  check `key' has been seen in this history database
 */
@@ -742,6 +1146,42 @@ hisv6_check(void *history, const char *key)
 }
 
 
+/*
+**  check n keys at once, starting the index lookups of up to
+**  HISV6_PREFETCH of them before waiting for the first one
+*/
+bool
+hisv6_check_batch(void *history, const char *const *keys, size_t n,
+                  bool *found)
+{
+    struct hisv6 *h = history;
+    HASH hashes[HISV6_PREFETCH];
+    size_t i, j, count;
+
+    if (h != hisv6_dbzowner) {
+        hisv6_seterror(h, concat("dbz not open for this history file ",
+                                 h->histpath, NULL));
+        for (i = 0; i < n; i++)
+            found[i] = false;
+        return false;
+    }
+
+    his_logger("HIShavearticle begin", S_HIShavearticle);
+    hisv6_checkfiles(h);
+    for (i = 0; i < n; i += count) {
+        count = n - i < HISV6_PREFETCH ? n - i : HISV6_PREFETCH;
+        for (j = 0; j < count; j++) {
+            hashes[j] = HashMessageID(keys[i + j]);
+            dbzprefetch(hashes[j], false);
+        }
+        for (j = 0; j < count; j++)
+            found[i + j] = dbzexists(hashes[j]);
+    }
+    his_logger("HIShavearticle end", S_HIShavearticle);
+    return true;
+}
+
+
 /*
 **  Format a history line.  s should hold at least HISV6_MAXLINE + 1
 **  characters (to allow for the nul).  Returns the length of the data
@@ -824,8 +1264,10 @@ hisv6_writedbz(struct hisv6 *h, const HASH *hash, off_t offset)
         hisv6_seterror(h, concat(error, h->histpath, ":[", HashToText(*hash),
                                  "]", location, " ", strerror(errno), NULL));
     }
-    if (r && h->synccount != 0 && ++h->dirty >= h->synccount)
-        r = hisv6_sync(h);
+    /* Count the write even without a synccount, so that HISsync still
+       writes out the index. */
+    if (r && ++h->dirty >= h->synccount && h->synccount != 0 && !h->batch)
+        r = hisv6_syncfiles(h);
 
     return r;
 }
@@ -1438,6 +1880,14 @@ hisv6_ctl(void *history, int selector, void *val)
         h->synccount = *(size_t *) val;
         break;
 
+    case HISCTLS_WRITEBATCH:
+        /* hold off the synccount sync until the end of the group, so the
+         * whole group goes out in one flush */
+        h->batch = *(bool *) val;
+        if (!h->batch && h->synccount != 0 && h->dirty >= h->synccount)
+            r = hisv6_syncfiles(h);
+        break;
+
     case HISCTLS_NPAIRS:
         h->npairs = (ssize_t) * (size_t *) val;
         break;
@@ -1450,6 +1900,18 @@ hisv6_ctl(void *history, int selector, void *val)
         }
         break;
 
+    case HISCTLS_RESIZE:
+        r = hisv6_resizestart(h, *(size_t *) val);
+        break;
+
+    case HISCTLS_RESIZEFILL:
+        h->resizefill = *(unsigned long *) val;
+        break;
+
+    case HISCTLG_RESIZING:
+        *(bool *) val = (h->resizepid != 0);
+        break;
+
     case HISCTLG_ENTRYESTIMATE: {
         /* Minimum history line: 34 (hash) + 1 (tab) + 1 (arrived)
          * + 1 (newline).  Dividing the text file size by this gives a
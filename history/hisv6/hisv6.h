@@ -27,6 +27,13 @@ bool hisv6_lookup(void *, const char *key, time_t *arrived, time_t *posted,
 
 bool hisv6_check(void *, const char *key);
 
+bool hisv6_lookup_batch(void *, const char *const *keys, size_t n,
+                        bool *found, time_t *arrived, time_t *posted,
+                        time_t *expires, struct token *tokens);
+
+bool hisv6_check_batch(void *, const char *const *keys, size_t n,
+                       bool *found);
+
 bool hisv6_write(void *, const char *key, time_t arrived, time_t posted,
                  time_t expires, const struct token *token);
 
@@ -71,9 +71,11 @@ extern bool dbzfresh(const char *name, off_t size);
 extern bool dbzagain(const char *name, const char *oldname);
 extern bool dbzexists(const HASH key);
 extern bool dbzfetch(const HASH key, off_t *value);
+extern void dbzprefetch(const HASH key, bool value);
 extern DBZSTORE_RESULT dbzstore(const HASH key, off_t data);
 extern bool dbzsync(void);
 extern long dbzsize(off_t contents);
+extern bool dbzusage(long *used, long *size);
 extern void dbzsetoptions(const dbzoptions options);
 extern void dbzgetoptions(dbzoptions *options);
 
@@ -36,6 +36,8 @@ struct histstats {
     int misses;
     /* number of does not exists (negative hit, but not in cache) */
     int dne;
+    /* number of entries pushed out of the cache by new ones */
+    int evictions;
 };
 
 
@@ -100,7 +102,35 @@ enum {
      * value untouched) if no estimate can be made; callers should fall back
      * to their own default sizing.  expireover(8) uses this to size its
      * Bloom filter before walking the history database. */
-    HISCTLG_ENTRYESTIMATE
+    HISCTLG_ENTRYESTIMATE,
+
+    /* (size_t) number of HISwrite and HISremember calls the history API
+     * may hold in core and then pass to the backend together, 0 (the
+     * default) to pass each one on at once.  Held entries are seen by
+     * HIScheck and HISlookup on the same handle. */
+    HISCTLS_BATCHSIZE,
+
+    /* (unsigned long) longest time, in milliseconds, a held entry may wait
+     * before being passed on; checked on each call to the history API. */
+    HISCTLS_BATCHDELAY,
+
+    /* (bool) sent by the history API to the backend around a group of held
+     * entries: true before the first one, false after the last one.  A
+     * backend that can commits the whole group at once. */
+    HISCTLS_WRITEBATCH,
+
+    /* (size_t) start rebuilding the index in the background for that many
+     * entries, 0 for twice as many as it holds; the new index replaces the
+     * current one at a later HISsync once it is built.  {hisv6} */
+    HISCTLS_RESIZE,
+
+    /* (unsigned long) how full, in percent, the index may get before
+     * HISsync starts rebuilding it as with HISCTLS_RESIZE, or 0 (the
+     * default) never to do so.  {hisv6} */
+    HISCTLS_RESIZEFILL,
+
+    /* (bool) get whether a rebuild of the index is running.  {hisv6} */
+    HISCTLG_RESIZING
 };
 
 struct history *HISopen(const char *, const char *, int);
@@ -110,6 +140,9 @@ void HISsetcache(struct history *, size_t);
 bool HISlookup(struct history *, const char *, time_t *, time_t *, time_t *,
                struct token *);
 bool HIScheck(struct history *, const char *);
+bool HISlookup_batch(struct history *, const char *const *, size_t, bool *,
+                     time_t *, time_t *, time_t *, struct token *);
+bool HIScheck_batch(struct history *, const char *const *, size_t, bool *);
 bool HISwrite(struct history *, const char *, time_t, time_t, time_t,
               const struct token *);
 bool HISremember(struct history *, const char *, time_t, time_t);
@@ -50,9 +50,15 @@ struct innconf {
     unsigned long artcutoff;    /* Max accepted article age */
     char *bindaddress;          /* Which interface IP to bind to */
     char *bindaddress6;         /* Which interface IPv6 to bind to */
+    unsigned long cancelrate;   /* Queued cancels executed per second */
     char *docancels;            /* Which cancels to process */
     bool dontrejectfiltered;    /* Don't reject filtered article? */
+    unsigned long filtercachesize; /* Size of the filter verdict cache in kB */
+    unsigned long filtercachetime; /* Seconds filter verdicts are kept */
+    unsigned long filterworkers; /* Processes running article filters */
     unsigned long hiscachesize; /* Size of the history cache in kB */
+    unsigned long
+        hisoverlaysize; /* Size of the recently seen Message-IDs in kB */
     bool ignorenewsgroups;      /* Propagate cmsgs by affected group? */
     bool immediatecancel;       /* Immediately cancel timecaf messages? */
     unsigned long
@@ -72,6 +78,8 @@ struct innconf {
     unsigned long wipexpire; /* How long to keep pending article record */
 
     /* History settings */
+    unsigned long hisbatchdelay;      /* Max ms a history write is held */
+    unsigned long hisbatchsize;       /* History writes passed on together */
     char *hismethod;                  /* Which history method to use */
     unsigned long hissqlitecachesize; /* hissqlite writer page cache, in kB */
     unsigned long
@@ -80,6 +88,8 @@ struct innconf {
         hissqlitepagesize; /* hissqlite database page size, in bytes */
     unsigned long
         hissqlitereadercachesize; /* hissqlite per-nnrpd reader cache, in kB */
+    unsigned long hisv6dbzversion; /* Format of new hisv6 dbz indexes */
+    unsigned long hisv6resizefill; /* Percent full to rebuild dbz, or 0 */
 
     /* Article Storage */
     unsigned long cnfscheckfudgesize; /* Additional CNFS integrity checking */
@@ -194,6 +204,7 @@ struct innconf {
     bool logsitename;         /* Log outgoing site names? */
     bool logstatus;           /* Send a status report to syslog? */
     bool logtrash;            /* Log unwanted newsgroups? */
+    bool metrics;             /* Serve metrics on a local socket? */
     bool nnrpdoverstats;      /* Log overview statistics? */
     bool nntplinklog;         /* Put storage token into the log? */
     char *stathist;           /* Filename for history profiler outputs */
@@ -219,6 +230,7 @@ struct innconf {
     unsigned long pauseretrytime; /* Seconds before seeing if pause is ended */
     unsigned long peertimeout;    /* How long peers can be inactive */
     long rlimitnofile;            /* File descriptor limit to set */
+    bool storethread;             /* Store articles from a separate thread? */
 
     /* Paths */
     char *patharchive;  /* Archived news */
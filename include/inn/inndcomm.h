@@ -53,6 +53,7 @@ typedef char ICC_PROTOCOLTYPE;
 #define SC_RELOAD      'o'
 #define SC_RENUMBER    'n'
 #define SC_RESERVE     'z'
+#define SC_RESIZEHIST  'G'
 #define SC_RMGROUP     'p'
 #define SC_SEND        'A'
 #define SC_SHUTDOWN    'q'
@@ -66,7 +67,7 @@ typedef char ICC_PROTOCOLTYPE;
 #define SC_XEXEC       'y'
 
 /* Yes, we don't want anyone to use this. */
-#define SC_FIRSTFREE   G
+#define SC_FIRSTFREE   I
 
 #define MAX_REASON_LEN 80
 
@@ -57,6 +57,16 @@ extern bool uwildmat(const char *text, const char *pat);
 extern bool uwildmat_simple(const char *text, const char *pat);
 extern enum uwildmat uwildmat_poison(const char *text, const char *pat);
 
+/* A list of wildmat patterns compiled for matching many texts.  Patterns are
+   added in order, each optionally starting with ! or @; matching gives the
+   same result as uwildmat_poison on the patterns joined with commas. */
+struct uwildmat_list;
+extern struct uwildmat_list *uwildmat_list_new(void);
+extern void uwildmat_list_add(struct uwildmat_list *, const char *pat);
+extern enum uwildmat uwildmat_list_match(const struct uwildmat_list *,
+                                         const char *text);
+extern void uwildmat_list_free(struct uwildmat_list *);
+
 
 /*
 **  File locking.
@@ -92,10 +92,11 @@ typedef unsigned long ARTNUM;
    less than LOW_WATER bytes left free in the buffer, use the current
    buffersize as input to GROW_AMOUNT to determine how much to realloc.
    Growth must be at least NNTP_MAXLEN_COMMAND bytes!  The default settings
-   provide aggressive, exponential buffer growth. */
+   provide aggressive, exponential buffer growth: doubling up to 128 KB, then
+   growing by half, so that a large article costs few reallocations. */
 #define START_BUFF_SIZE          (4 * 1024)
 #define LOW_WATER                (1 * 1024)
-#define GROW_AMOUNT(x)           ((x) < 128 * 1024 ? (x) : 128 * 1024)
+#define GROW_AMOUNT(x)           ((x) < 128 * 1024 ? (x) : (x) / 2)
 
 /* The maximum length of a single header or body line, including CRLF. */
 #define MAXARTLINELENGTH         1000
@@ -119,6 +120,14 @@ typedef unsigned long ARTNUM;
 /* Default buffer size for outgoing feeds from innd. */
 #define SITE_BUFFER_SIZE         (16 * 1024)
 
+/* Default size of the shared-memory ring for channel feeds with the R flag. */
+#define SITE_RING_SIZE           (1024 * 1024)
+
+/* Size of the shared-memory ring through which innd hands articles to each
+   filter worker.  Articles larger than half of it are filtered by innd
+   itself. */
+#define FILTER_RING_SIZE         (4 * 1024 * 1024)
+
 /* Maximum size of a pathname in the spool directory. */
 #define SPOOLNAMEBUFF            512
 
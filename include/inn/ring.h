@@ -0,0 +1,72 @@
+/*
+**  Single-producer, single-consumer ring buffer in a shared file.
+**
+**  One process creates the ring and appends records to it; another process
+**  opens the same file and reads the records back in order.  Neither side
+**  makes a system call to pass a record.  When the consumer has emptied the
+**  ring, it asks to be woken up and the producer is told, on its next append,
+**  to do so by some other means (innd writes a blank line down the pipe it
+**  already has to the consumer).
+**
+**  Rings need the compiler's __atomic built-ins; without them, ring_create
+**  and ring_open fail with ENOSYS and callers are expected to fall back on
+**  whatever they did before.
+*/
+
+#ifndef INN_RING_H
+#define INN_RING_H
+
+#include "inn/portable-macros.h"
+#include "inn/portable-stdbool.h"
+
+#include <stddef.h>
+
+BEGIN_DECLS
+
+/* The layout of this struct is entirely internal to the implementation. */
+struct ring;
+
+/*
+**  Create a ring of at least size bytes of records in a new file at path,
+**  replacing any file already there (a consumer still using the old file
+**  keeps it).  Returns NULL and sets errno on failure.
+*/
+struct ring *ring_create(const char *path, size_t size);
+
+/*
+**  Open a ring created by ring_create.  Returns NULL and sets errno on
+**  failure.  The file may be unlinked once opened.
+*/
+struct ring *ring_open(const char *path);
+
+/*
+**  Producer side.  ring_put appends a record and returns false, without
+**  appending anything, if there is not enough room for it.  ring_wakeup
+**  returns true once for each time the consumer went to sleep; call it after
+**  appending records and wake up the consumer if it does.
+*/
+bool ring_put(struct ring *ring, const void *data, size_t length);
+bool ring_wakeup(struct ring *ring);
+
+/*
+**  Consumer side.  ring_peek returns the oldest record and stores its length
+**  in length, or returns NULL if the ring is empty.  The record stays valid
+**  until ring_advance drops it.  Once ring_peek has returned NULL, ring_sleep
+**  asks the producer for a wakeup; it returns false if a record came in
+**  meanwhile, in which case the consumer should not wait.
+**
+**  The producer may also read back what the consumer left in the ring if it
+**  knows the consumer is gone.
+*/
+const void *ring_peek(struct ring *ring, size_t *length);
+void ring_advance(struct ring *ring);
+bool ring_sleep(struct ring *ring);
+
+/*
+**  Unmap a ring.  Safe to call with NULL.
+*/
+void ring_free(struct ring *ring);
+
+END_DECLS
+
+#endif /* INN_RING_H */
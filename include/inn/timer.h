@@ -4,13 +4,15 @@
 **  An interface to a simple profiling library.  An application can declare
 **  its intent to use n timers by calling TMRinit(n), and then start and
 **  stop numbered timers with TMRstart and TMRstop.  TMRsummary logs the
-**  results to syslog given labels for each numbered timer.
+**  results to syslog given labels for each numbered timer, along with
+**  percentiles of their times kept in log-linear histograms.
 */
 
 #ifndef INN_TIMER_H
 #define INN_TIMER_H
 
 #include "inn/macros.h"
+#include "inn/portable-stdbool.h"
 
 BEGIN_DECLS
 
@@ -22,6 +24,33 @@ enum {
     TMR_APPLICATION /* Application numbering starts here. */
 };
 
+/*
+**  A log-linear histogram of times in microseconds.  Times are grouped by
+**  power of two, and each group is split into 2^TMR_HIST_BITS buckets, so
+**  that the error on a percentile is at most 1/2^TMR_HIST_BITS.  Times of
+**  2^TMR_HIST_RANGE microseconds (a bit more than an hour) or more all go in
+**  the last bucket.  A zeroed struct is an empty histogram.
+*/
+#define TMR_HIST_BITS  4
+#define TMR_HIST_RANGE 32
+#define TMR_HIST_BUCKETS \
+    ((TMR_HIST_RANGE - TMR_HIST_BITS + 1) << TMR_HIST_BITS)
+
+struct timer_hist {
+    unsigned long count;
+    unsigned long max;
+    unsigned long bucket[TMR_HIST_BUCKETS];
+};
+
+/*
+**  Running totals of a timer since TMRinit, whatever timers it was nested
+**  in.  total is in milliseconds, like the times of TMRsummary.
+*/
+struct timer_stats {
+    unsigned long total;
+    struct timer_hist hist;
+};
+
 void TMRinit(unsigned int);
 void TMRstart(unsigned int);
 void TMRstop(unsigned int);
@@ -29,6 +58,18 @@ void TMRsummary(const char *prefix, const char *const *labels);
 unsigned long TMRnow(void);
 void TMRfree(void);
 
+/* Return the totals of a timer, and the label for a timer given the labels
+   of the application timers, as passed to TMRsummary. */
+bool TMRstats(unsigned int, struct timer_stats *);
+const char *TMRlabel(const char *const *labels, unsigned int);
+
+/* Add a time in microseconds to a histogram, return the time under which a
+   fraction of its times fall, and return how many of its times are shorter
+   than a given time (exact for powers of two). */
+void TMRhistadd(struct timer_hist *, unsigned long usec);
+unsigned long TMRhistpercentile(const struct timer_hist *, double fraction);
+unsigned long TMRhistcount(const struct timer_hist *, unsigned long usec);
+
 /* Return the current time as a double of seconds and fractional sections. */
 double TMRnow_double(void);
 
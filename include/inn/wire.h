@@ -24,6 +24,11 @@ BEGIN_DECLS
    your article is bodyless). */
 char *wire_findbody(const char *, size_t);
 
+/* Given a pointer into an article and a pointer one past the end of the data
+   to search, return a pointer to the first \r, \n or nul, or the end pointer
+   if there is none. */
+char *wire_findctl(const char *, const char *end);
+
 /* Given a pointer into an article and a pointer to its final octet, find the
    start of the next line or return NULL if there are no more lines remaining
    in the article. */
@@ -15,6 +15,7 @@
 #include "inn/vector.h"
 #include "inn/wire.h"
 #include "innd.h"
+#include "innperl.h"
 
 typedef struct iovec IOVEC;
 
@@ -38,18 +39,19 @@ typedef struct _HEADERP {
 #define HPCOUNT 4
 
 /*
-**  For speed we build a binary tree of the headers, sorted by their
-**  name.  We also store the header field names in the tree to avoid
-**  doing an extra indirection.
+**  For speed we look the system header fields up in a table indexed by a
+**  hash of their name.  ARTsetup picks a seed for which no two of them land
+**  in the same slot, so a lookup is one hash and at most one comparison.
+**  Slots hold an index into ARTheaders plus one, so that zero is empty.
 */
-typedef struct _TREE {
-    const char *Name;
-    const ARTHEADER *Header;
-    struct _TREE *Before;
-    struct _TREE *After;
-} TREE;
+#define ARTHASHSIZE 512
+
+#if MAX_ARTHEADER >= 255
+#    error "ARThashtable slots are too small for MAX_ARTHEADER"
+#endif
 
-static TREE *ARTheadertree;
+static unsigned char ARThashtable[ARTHASHSIZE];
+static unsigned int ARThashseed;
 
 /*
 **  For doing the overview database, we keep a list of the header fields and
@@ -62,6 +64,37 @@ typedef struct _ARTOVERFIELD {
 
 static ARTOVERFIELD *ARTfields;
 
+/*
+**  What ARTpostfinish needs to know about an article from ARTpost, and the
+**  per-site state ARTpost computes for it.  Both are saved in an ARTPENDING
+**  while the article is handed to the storage thread.
+*/
+typedef struct _ARTPOST {
+    int hopcount;
+    bool ihave;
+    bool Accepted;
+    bool IsControl;
+    bool ControlStore;
+    bool Filtered;
+} ARTPOST;
+
+typedef struct _ARTSITE {
+    NEWSGROUP *ng;
+    bool Poison;
+    bool Sendit;
+    bool Seenit;
+} ARTSITE;
+
+typedef struct _ARTPENDING {
+    STOREJOB job; /* Must be first. */
+    CHANNEL *cp;
+    ARTPOST post;
+    HASH hash;
+    struct iovec iov[ARTIOVCNT];
+    int iovcnt;
+    ARTSITE *sites;
+} ARTPENDING;
+
 /*
 **  General newsgroup we care about, and what we put in the Path line.
 */
@@ -183,42 +216,66 @@ ARTreadschema(void)
 
 
 /*
-**  Build a balanced tree for the headers in subscript range [lo..hi).
-**  This only gets called once, and the tree only has about 37 entries,
-**  so we don't bother to unroll the recursion.
+**  Hash a header field name of the given length, ignoring case.  This is
+**  FNV-1a with the seed mixed into the offset basis; folding in 0x20 is
+**  enough to lowercase the characters allowed in field names.
 */
-static TREE *
-ARTbuildtree(const ARTHEADER **Table, int lo, int hi)
+static unsigned int
+ARThash(const char *name, size_t length, unsigned int seed)
 {
-    int mid;
-    TREE *tp;
-
-    mid = lo + (hi - lo) / 2;
-    tp = xmalloc(sizeof(TREE));
-    tp->Header = Table[mid];
-    tp->Name = tp->Header->Name;
-    if (mid == lo)
-        tp->Before = NULL;
-    else
-        tp->Before = ARTbuildtree(Table, lo, mid);
-    if (mid == hi - 1)
-        tp->After = NULL;
-    else
-        tp->After = ARTbuildtree(Table, mid + 1, hi);
-    return tp;
+    const unsigned char *p = (const unsigned char *) name;
+    unsigned long h = 2166136261UL ^ seed;
+
+    for (; length > 0; length--, p++)
+        h = ((h ^ (*p | 0x20)) * 16777619UL) & 0xffffffffUL;
+    h ^= h >> 16;
+    return h & (ARTHASHSIZE - 1);
 }
 
 
 /*
-**  Sorting predicate for qsort call in ARTsetup.
+**  Return the system header field whose name is the given length octets at
+**  name, or NULL if it is not one.
 */
-static int
-ARTcompare(const void *p1, const void *p2)
+static const ARTHEADER *
+ARTfindheader(const char *name, size_t length)
 {
-    const char *n1 = ((const ARTHEADER *const *) p1)[0]->Name;
-    const char *n2 = ((const ARTHEADER *const *) p2)[0]->Name;
+    const ARTHEADER *hp;
+    unsigned int slot;
+
+    slot = ARThashtable[ARThash(name, length, ARThashseed)];
+    if (slot == 0)
+        return NULL;
+    hp = &ARTheaders[slot - 1];
+    if ((size_t) hp->Size != length || strncasecmp(name, hp->Name, length) != 0)
+        return NULL;
+    return hp;
+}
+
 
-    return strcasecmp(n1, n2);
+/*
+**  Fill in the header field hash table, trying seeds until one has no
+**  collisions.  With this many header fields and this many slots, a few
+**  dozen tries are usually enough.
+*/
+static void
+ARTbuildhash(void)
+{
+    unsigned int i, slot;
+
+    for (ARThashseed = 0; ARThashseed < 0x100000; ARThashseed++) {
+        memset(ARThashtable, 0, sizeof(ARThashtable));
+        for (i = 0; i < ARRAY_SIZE(ARTheaders); i++) {
+            slot = ARThash(ARTheaders[i].Name, ARTheaders[i].Size,
+                           ARThashseed);
+            if (ARThashtable[slot] != 0)
+                break;
+            ARThashtable[slot] = i + 1;
+        }
+        if (i == ARRAY_SIZE(ARTheaders))
+            return;
+    }
+    die("SERVER cant build header field hash table");
 }
 
 
@@ -228,7 +285,6 @@ ARTcompare(const void *p1, const void *p2)
 void
 ARTsetup(void)
 {
-    const ARTHEADER **table;
     const unsigned char *p;
     unsigned int i;
 
@@ -248,33 +304,14 @@ ARTsetup(void)
     hostcclass['-'] = 1;
     hostcclass['_'] = 1;
 
-    /* Build the header tree. */
-    table = xmalloc(ARRAY_SIZE(ARTheaders) * sizeof(ARTHEADER *));
-    for (i = 0; i < ARRAY_SIZE(ARTheaders); i++)
-        table[i] = &ARTheaders[i];
-    qsort(table, ARRAY_SIZE(ARTheaders), sizeof *table, ARTcompare);
-    ARTheadertree = ARTbuildtree(table, 0, ARRAY_SIZE(ARTheaders));
-    free(table);
+    /* Build the header field hash table. */
+    ARTbuildhash();
 
     /* Set up database; ignore errors. */
     ARTreadschema();
 }
 
 
-static void
-ARTfreetree(TREE *tp)
-{
-    TREE *next;
-
-    for (; tp != NULL; tp = next) {
-        if (tp->Before)
-            ARTfreetree(tp->Before);
-        next = tp->After;
-        free(tp);
-    }
-}
-
-
 void
 ARTclose(void)
 {
@@ -282,16 +319,16 @@ ARTclose(void)
         free(ARTfields);
         ARTfields = NULL;
     }
-    ARTfreetree(ARTheadertree);
 }
 
 /*
-**  Start a log message about an article.
+**  Start a log message about an article, given the site it came from and its
+**  Message-ID.
 */
 static void
-ARTlog(const ARTDATA *data, char code, const char *text)
+ARTlogsite(const char *Feedsite, const char *MessageID, char code,
+           const char *text)
 {
-    const HDRCONTENT *hc = data->HdrContent;
     int i;
     bool Done;
     time_t t;
@@ -304,16 +341,14 @@ ARTlog(const ARTDATA *data, char code, const char *text)
     if (text)
         i = fprintf(Log, "%.15s.%03d %c %s %s %s%s", ctime(&t) + 4,
                     (int) (Now.tv_usec / 1000), code,
-                    data->Feedsite != NULL ? data->Feedsite : "(null)",
-                    HDR_FOUND(HDR__MESSAGE_ID) ? HDR(HDR__MESSAGE_ID)
-                                               : "(null)",
-                    text, Done ? "" : "\n");
+                    Feedsite != NULL ? Feedsite : "(null)",
+                    MessageID != NULL ? MessageID : "(null)", text,
+                    Done ? "" : "\n");
     else
         i = fprintf(Log, "%.15s.%03d %c %s %s%s", ctime(&t) + 4,
                     (int) (Now.tv_usec / 1000), code,
-                    data->Feedsite != NULL ? data->Feedsite : "(null)",
-                    HDR_FOUND(HDR__MESSAGE_ID) ? HDR(HDR__MESSAGE_ID)
-                                               : "(null)",
+                    Feedsite != NULL ? Feedsite : "(null)",
+                    MessageID != NULL ? MessageID : "(null)",
                     Done ? "" : "\n");
     if (i == EOF || (Done && !BufferedLogs && fflush(Log)) || ferror(Log)) {
         i = errno;
@@ -324,6 +359,19 @@ ARTlog(const ARTDATA *data, char code, const char *text)
     TMRstop(TMR_ARTLOG);
 }
 
+/*
+**  Start a log message about an article.
+*/
+static void
+ARTlog(const ARTDATA *data, char code, const char *text)
+{
+    const HDRCONTENT *hc = data->HdrContent;
+
+    ARTlogsite(data->Feedsite,
+               HDR_FOUND(HDR__MESSAGE_ID) ? HDR(HDR__MESSAGE_ID) : NULL, code,
+               text);
+}
+
 /*
 **  Parse a Path line, splitting it up into NULL-terminated array of strings.
 */
@@ -432,25 +480,22 @@ ARTheaderpcmp(const void *p1, const void *p2)
     return (((const HEADERP *) p1)->p - ((const HEADERP *) p2)->p);
 }
 
-/* Write an article using the storage api.  Put it together in memory and
-   call out to the api. */
-static TOKEN
-ARTstore(CHANNEL *cp, bool filtered)
+/* Put an article together in memory for the storage api.  Fills in iov
+   and arth, and returns the number of iovecs used or -1 if the article
+   cannot be stored. */
+static int
+ARTstoreprepare(CHANNEL *cp, bool filtered, struct iovec *iov,
+                ARTHANDLE *arth)
 {
     struct buffer *Article = &cp->In;
     ARTDATA *data = &cp->Data;
     HDRCONTENT *hc = data->HdrContent;
     const char *p;
-    ARTHANDLE arth = ARTHANDLE_INITIALIZER;
     int i, j, iovcnt = 0;
-    long headersize = 0;
-    TOKEN result;
-    struct buffer *headers = &data->Headers;
-    struct iovec iov[ARTIOVCNT];
     HEADERP hp[HPCOUNT];
 
     /* find Path, Bytes and Xref to be prepended/dropped/replaced */
-    arth.len = i = 0;
+    arth->len = i = 0;
     /* assumes Path header field is required header field */
     hp[i].p = HDR(HDR__PATH);
     hp[i++].index = HDR__PATH;
@@ -472,21 +517,21 @@ ARTstore(CHANNEL *cp, bool filtered)
                 /* write heading data */
                 iov[iovcnt].iov_base = (char *) p;
                 iov[iovcnt++].iov_len = HDR(HDR__PATH) - p;
-                arth.len += HDR(HDR__PATH) - p;
+                arth->len += HDR(HDR__PATH) - p;
                 /* append clusterpath */
                 if (Pathcluster.used) {
                     iov[iovcnt].iov_base = Pathcluster.data;
                     iov[iovcnt++].iov_len = Pathcluster.used;
-                    arth.len += Pathcluster.used;
+                    arth->len += Pathcluster.used;
                 }
                 /* now append new one */
                 iov[iovcnt].iov_base = Path.data;
                 iov[iovcnt++].iov_len = Path.used;
-                arth.len += Path.used;
+                arth->len += Path.used;
                 if (data->AddAlias) {
                     iov[iovcnt].iov_base = Pathalias.data;
                     iov[iovcnt++].iov_len = Pathalias.used;
-                    arth.len += Pathalias.used;
+                    arth->len += Pathalias.used;
                 }
                 /* next to write */
                 p = HDR(HDR__PATH);
@@ -499,11 +544,11 @@ ARTstore(CHANNEL *cp, bool filtered)
                 /* write heading data */
                 iov[iovcnt].iov_base = (char *) p;
                 iov[iovcnt++].iov_len = HDR(HDR__XREF) - p;
-                arth.len += HDR(HDR__XREF) - p;
+                arth->len += HDR(HDR__XREF) - p;
                 /* replace with new one */
                 iov[iovcnt].iov_base = data->Xref;
                 iov[iovcnt++].iov_len = data->XrefLength - 2;
-                arth.len += data->XrefLength - 2;
+                arth->len += data->XrefLength - 2;
                 /* next to write */
                 /* this points where trailing "\r\n" of original Xref header
                  * field exists */
@@ -515,15 +560,13 @@ ARTstore(CHANNEL *cp, bool filtered)
             /* write heading data */
             iov[iovcnt].iov_base = (char *) p;
             iov[iovcnt++].iov_len = data->BytesHeader - p;
-            arth.len += data->BytesHeader - p;
+            arth->len += data->BytesHeader - p;
             /* next to write */
             /* need to skip trailing "\r\n" of Bytes header field */
             p = HDR(HDR__BYTES) + HDR_LEN(HDR__BYTES) + 2;
             break;
         default:
-            memset(&result, 0, sizeof(result));
-            result.type = TOKEN_EMPTY;
-            return result;
+            return -1;
         }
     }
     /* In case no Xref header field is included in original article. */
@@ -531,20 +574,20 @@ ARTstore(CHANNEL *cp, bool filtered)
         /* Write heading data. */
         iov[iovcnt].iov_base = (char *) p;
         iov[iovcnt++].iov_len = Article->data + (data->Body - 2) - p;
-        arth.len += Article->data + (data->Body - 2) - p;
+        arth->len += Article->data + (data->Body - 2) - p;
         /* An Xref header field needs to be inserted. */
         iov[iovcnt].iov_base = (char *) "Xref: ";
         iov[iovcnt++].iov_len = sizeof("Xref: ") - 1;
-        arth.len += sizeof("Xref: ") - 1;
+        arth->len += sizeof("Xref: ") - 1;
         iov[iovcnt].iov_base = data->Xref;
         iov[iovcnt++].iov_len = data->XrefLength;
-        arth.len += data->XrefLength;
+        arth->len += data->XrefLength;
         p = Article->data + (data->Body - 2);
     }
     /* write rest of data */
     iov[iovcnt].iov_base = (char *) p;
     iov[iovcnt++].iov_len = Article->data + cp->Next - p;
-    arth.len += Article->data + cp->Next - p;
+    arth->len += Article->data + cp->Next - p;
 
     /* revert trailing '\0\n' to '\r\n' of all system header fields */
     for (i = 0; i < MAX_ARTHEADER; i++) {
@@ -552,31 +595,45 @@ ARTstore(CHANNEL *cp, bool filtered)
             HDR_PARSE_END(i);
     }
 
-    arth.iov = iov;
-    arth.iovcnt = iovcnt;
-    arth.arrived = (time_t) 0;
-    arth.token = (TOKEN *) NULL;
-    arth.expires = data->Expires;
-    arth.filtered = filtered;
+    arth->iov = iov;
+    arth->iovcnt = iovcnt;
+    arth->arrived = (time_t) 0;
+    arth->token = (TOKEN *) NULL;
+    arth->expires = data->Expires;
+    arth->filtered = filtered;
     if (innconf->storeonxref) {
-        arth.groups = data->Replic;
-        arth.groupslen = data->ReplicLength;
+        arth->groups = data->Replic;
+        arth->groupslen = data->ReplicLength;
     } else {
-        arth.groups = HDR(HDR__NEWSGROUPS);
-        arth.groupslen = HDR_LEN(HDR__NEWSGROUPS);
+        arth->groups = HDR(HDR__NEWSGROUPS);
+        arth->groupslen = HDR_LEN(HDR__NEWSGROUPS);
     }
-    arth.path = HDR(HDR__PATH);
-    arth.pathlen = HDR_LEN(HDR__PATH);
+    arth->path = HDR(HDR__PATH);
+    arth->pathlen = HDR_LEN(HDR__PATH);
 
-    SMerrno = SMERR_NOERROR;
-    result = SMstore(arth);
-    if (result.type == TOKEN_EMPTY) {
-        if (SMerrno == SMERR_NOMATCH)
-            ThrottleNoMatchError();
-        else if (SMerrno != SMERR_NOERROR)
-            IOError("SMstore", SMerrno);
-        return result;
-    }
+    return iovcnt;
+}
+
+/* Report an article that the storage api failed to store. */
+static void
+ARTstorefailed(int error)
+{
+    if (error == SMERR_NOMATCH)
+        ThrottleNoMatchError();
+    else if (error != SMERR_NOERROR)
+        IOError("SMstore", error);
+}
+
+/* Once an article has been stored, compute its Bytes header field and save
+   its headers if needed. */
+static void
+ARTstoresize(CHANNEL *cp, const struct iovec *iov, int iovcnt)
+{
+    struct buffer *Article = &cp->In;
+    ARTDATA *data = &cp->Data;
+    struct buffer *headers = &data->Headers;
+    long headersize = 0;
+    int i;
 
     /* calculate stored size */
     for (data->BytesValue = i = 0; i < iovcnt; i++) {
@@ -600,7 +657,7 @@ ARTstore(CHANNEL *cp, bool filtered)
     data->BytesLength = strlen(data->Bytes) - 9;
 
     if (!NeedHeaders)
-        return result;
+        return;
 
     /* Add the data. */
     buffer_resize(headers, headersize);
@@ -614,7 +671,31 @@ ARTstore(CHANNEL *cp, bool filtered)
             buffer_append(headers, iov[i].iov_base, iov[i].iov_len);
     }
     buffer_trimcr(headers);
+}
+
+/* Write an article using the storage api.  Put it together in memory and
+   call out to the api. */
+static TOKEN
+ARTstore(CHANNEL *cp, bool filtered)
+{
+    ARTHANDLE arth = ARTHANDLE_INITIALIZER;
+    struct iovec iov[ARTIOVCNT];
+    TOKEN result;
+    int iovcnt;
 
+    iovcnt = ARTstoreprepare(cp, filtered, iov, &arth);
+    if (iovcnt < 0) {
+        memset(&result, 0, sizeof(result));
+        result.type = TOKEN_EMPTY;
+        return result;
+    }
+    SMerrno = SMERR_NOERROR;
+    result = SMstore(arth);
+    if (result.type == TOKEN_EMPTY) {
+        ARTstorefailed(SMerrno);
+        return result;
+    }
+    ARTstoresize(cp, iov, iovcnt);
     return result;
 }
 
@@ -631,7 +712,6 @@ ARTcheckheader(CHANNEL *cp, int size)
     ARTDATA *data = &cp->Data;
     char *header = cp->In.data + data->CurHeader;
     HDRCONTENT *hc = cp->Data.HdrContent;
-    TREE *tp;
     const ARTHEADER *hp;
     char c, *p, *colon;
     int i;
@@ -653,22 +733,10 @@ ARTcheckheader(CHANNEL *cp, int size)
         return;
     }
 
-    /* See if this is a system header field.
-       A fairly tightly-coded binary search. */
-    c = islower((unsigned char) *header) ? toupper((unsigned char) *header)
-                                         : *header;
-    for (*colon = '\0', tp = ARTheadertree; tp;) {
-        if ((i = c - tp->Name[0]) == 0
-            && (i = strcasecmp(header, tp->Name)) == 0)
-            break;
-        if (i < 0)
-            tp = tp->Before;
-        else
-            tp = tp->After;
-    }
-    *colon = ':';
+    /* See if this is a system header field. */
+    hp = ARTfindheader(header, colon - header);
 
-    if (tp == NULL) {
+    if (hp == NULL) {
         /* Not a system header field, make sure we have <word><colon><space>.
          */
         for (p = colon; --p > header;) {
@@ -686,7 +754,6 @@ ARTcheckheader(CHANNEL *cp, int size)
         }
         return;
     }
-    hp = tp->Header;
     i = hp - ARTheaders;
     /* remember to ditch if it's the Bytes header field */
     if (i == HDR__BYTES)
@@ -806,7 +873,7 @@ ARTchecksize(CHANNEL *cp)
             msgid = HDR(HDR__MESSAGE_ID);
             /* The article posting time has not been parsed.  We cannot
              * give it to InndHisRemember. */
-            if (!HIScheck(History, msgid) && !InndHisRemember(msgid, 0))
+            if (!InndHisHave(msgid) && !InndHisRemember(msgid, 0))
                 warn("SERVER cant write %s", msgid);
             HDR_PARSE_END(HDR__MESSAGE_ID);
         }
@@ -826,6 +893,10 @@ ARTparseheader(CHANNEL *cp)
     size_t i;
 
     for (i = cp->Next; i < bp->used; i++) {
+        /* Skip ahead to the next octet that needs a look. */
+        i = wire_findctl(bp->data + i, bp->data + bp->used) - bp->data;
+        if (i == bp->used)
+            break;
         if (bp->data[i] == '\0')
             ARTerror(cp, "Nul character in header");
         if (bp->data[i] == '\n') {
@@ -910,6 +981,9 @@ ARTparsebody(CHANNEL *cp)
     size_t i;
 
     for (i = cp->Next; i < bp->used; i++) {
+        i = wire_findctl(bp->data + i, bp->data + bp->used) - bp->data;
+        if (i == bp->used)
+            break;
         if (bp->data[i] == '\0')
             ARTerror(cp, "Nul character in body");
         if (bp->data[i] == '\n')
@@ -1164,10 +1238,15 @@ ARTreject(Reject_type code, CHANNEL *cp)
 }
 
 /*
-**  Process a cancel message.
+**  Withdraw an article we have, once ARTcancel has accepted the cancel for
+**  it, either right away or from the queue of cancels.  Feedsite and
+**  CancelID, the Message-ID of the cancel, are only used for logging.
+**  CancelKey is the body of the Cancel-Key header field of the cancel, or
+**  NULL.
 */
 void
-ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
+ARTcancelnow(const char *Feedsite, const char *CancelID,
+             const char *MessageID, const char *CancelKey, bool Trusted)
 {
     char buff[SMBUF + 16];
     const char *start, *end;
@@ -1175,37 +1254,23 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
     TOKEN token;
 #if defined(HAVE_CANLOCK)
     char *canlockhdr;
-    const HDRCONTENT *hc = data->HdrContent;
 #endif
     bool r;
 
     TMRstart(TMR_ARTCNCL);
-    if (strcasecmp(innconf->docancels, "none") == 0 && !Trusted) {
-        TMRstop(TMR_ARTCNCL);
-        return;
-    }
-
-    if (!IsValidMessageID(MessageID, true, laxmid)) {
-        syslog(L_NOTICE, "%s bad cancel Message-ID %s", data->Feedsite,
-               MaxLength(MessageID, MessageID));
-        TMRstop(TMR_ARTCNCL);
-        return;
-    }
 
     /* No additional checks if cancels should all be executed. */
     if (strcasecmp(innconf->docancels, "all") != 0 && !Trusted) {
         /* Retrieve the Cancel-Lock header field of the article to be
          * cancelled.  If the original article is not found or has no
-         * Cancel-Lock header field, we cannot authenticate the cancel.
-         *
-         * It also means that we do not honour cancel requests for articles not
-         * yet received, even if they do not have a Cancel-Lock header field
-         * (but we don't know yet). */
+         * Cancel-Lock header field, we cannot authenticate the cancel. */
         if (!HISlookup(History, MessageID, NULL, NULL, NULL, &token)) {
             TMRstop(TMR_ARTCNCL);
             return;
         }
+        STORElock();
         if ((art = SMretrieve(token, RETR_HEAD)) == NULL) {
+            STOREunlock();
             TMRstop(TMR_ARTCNCL);
             return;
         }
@@ -1214,6 +1279,7 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
         if (start == NULL
             && strcasecmp(innconf->docancels, "require-auth") == 0) {
             SMfreearticle(art);
+            STOREunlock();
             TMRstop(TMR_ARTCNCL);
             return;
         } else if (start != NULL) {
@@ -1225,21 +1291,23 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
             if (end == NULL
                 && strcasecmp(innconf->docancels, "require-auth") == 0) {
                 SMfreearticle(art);
+                STOREunlock();
                 TMRstop(TMR_ARTCNCL);
                 return;
             } else if (end != NULL) {
                 r = false;
+                if (CancelKey != NULL) {
 #if defined(HAVE_CANLOCK)
-                if (HDR(HDR__CANCEL_KEY) != NULL) {
                     canlockhdr = xstrndup(start, end - start);
 
                     /* Is the Cancel-Key header field legitimate? */
-                    r = verify_cancel_key(HDR(HDR__CANCEL_KEY), canlockhdr);
+                    r = verify_cancel_key(CancelKey, canlockhdr);
 
                     free(canlockhdr);
-                }
 #endif
+                }
                 SMfreearticle(art);
+                STOREunlock();
 
                 if (r == false) {
                     TMRstop(TMR_ARTCNCL);
@@ -1248,29 +1316,15 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
             } else {
                 /* docancels is "auth", and there is no Cancel-Lock. */
                 SMfreearticle(art);
+                STOREunlock();
             }
         } else {
             /* docancels is "auth", and there is no Cancel-Lock. */
             SMfreearticle(art);
+            STOREunlock();
         }
     }
 
-    if (!HIScheck(History, MessageID)) {
-        /* Article hasn't arrived here, so write a fake entry using
-         * most of the information from the cancel message. */
-        if ((strcasecmp(innconf->docancels, "require-auth") == 0
-             || strcasecmp(innconf->docancels, "auth") == 0)
-            && !Trusted) {
-            TMRstop(TMR_ARTCNCL);
-            return;
-        }
-        InndHisRemember(MessageID, data->Posted);
-        snprintf(buff, sizeof(buff), "Cancelling %s",
-                 MaxLength(MessageID, MessageID));
-        ARTlog(data, ART_CANC, buff);
-        TMRstop(TMR_ARTCNCL);
-        return;
-    }
     r = HISlookup(History, MessageID, NULL, NULL, NULL, &token);
     if (r == false) {
         TMRstop(TMR_ARTCNCL);
@@ -1280,6 +1334,7 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
     /* Get stored message and zap them. */
     if (innconf->enableoverview)
         OVcancel(token);
+    STORElock();
     if (SMcancel(token) || SMerrno == SMERR_NOENT) {
         /* Record the out-of-band cancel so a later expire run can drop
          * the history entry without an SMretrieve(RETR_STAT).  Best-
@@ -1292,10 +1347,70 @@ ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
     if (innconf->immediatecancel && !SMflushcacheddata(SM_CANCELLEDART))
         syslog(L_ERROR, "%s cant cancel cached %s", LogName,
                TokenToText(token));
+    STOREunlock();
     snprintf(buff, sizeof(buff), "Cancelling %s",
              MaxLength(MessageID, MessageID));
-    ARTlog(data, ART_CANC, buff);
+    ARTlogsite(Feedsite, CancelID, ART_CANC, buff);
+    TMRstop(TMR_ARTCNCL);
+}
+
+/*
+**  Process a cancel message.  The cancel of an article that has not arrived
+**  yet is remembered in history at once, so that the article is refused when
+**  it comes.  Other cancels are queued if cancelrate is set, unless they are
+**  trusted.
+*/
+void
+ARTcancel(const ARTDATA *data, const char *MessageID, const bool Trusted)
+{
+    char buff[SMBUF + 16];
+    const HDRCONTENT *hc = data->HdrContent;
+    const char *CancelID, *CancelKey;
+
+    TMRstart(TMR_ARTCNCL);
+    if (strcasecmp(innconf->docancels, "none") == 0 && !Trusted) {
+        TMRstop(TMR_ARTCNCL);
+        return;
+    }
+
+    if (!IsValidMessageID(MessageID, true, laxmid)) {
+        syslog(L_NOTICE, "%s bad cancel Message-ID %s", data->Feedsite,
+               MaxLength(MessageID, MessageID));
+        TMRstop(TMR_ARTCNCL);
+        return;
+    }
+
+    if (!InndHisHave(MessageID)) {
+        /* Article hasn't arrived here, so write a fake entry using
+         * most of the information from the cancel message.
+         *
+         * We do not honour cancel requests for articles not yet received
+         * if they have to be authenticated, even if they do not have a
+         * Cancel-Lock header field (but we don't know yet). */
+        if ((strcasecmp(innconf->docancels, "require-auth") == 0
+             || strcasecmp(innconf->docancels, "auth") == 0)
+            && !Trusted) {
+            TMRstop(TMR_ARTCNCL);
+            return;
+        }
+        InndHisRemember(MessageID, data->Posted);
+        snprintf(buff, sizeof(buff), "Cancelling %s",
+                 MaxLength(MessageID, MessageID));
+        ARTlog(data, ART_CANC, buff);
+        TMRstop(TMR_ARTCNCL);
+        return;
+    }
     TMRstop(TMR_ARTCNCL);
+
+    CancelID = HDR_FOUND(HDR__MESSAGE_ID) ? HDR(HDR__MESSAGE_ID) : NULL;
+    CancelKey = NULL;
+    if (!Trusted) {
+        if (HDR_FOUND(HDR__CANCEL_KEY))
+            CancelKey = HDR(HDR__CANCEL_KEY);
+        if (CANCELadd(data->Feedsite, CancelID, MessageID, CancelKey))
+            return;
+    }
+    ARTcancelnow(data->Feedsite, CancelID, MessageID, CancelKey, Trusted);
 }
 
 /*
@@ -1478,6 +1593,7 @@ ARTassignnumbers(ARTDATA *data)
             syslog(L_ERROR, "%s cant update_active %s", LogName, ngp->Name);
             continue;
         }
+        ICDmarkdirty(ngp->LastString, ngp->Lastwidth);
         ngp->Filenum = ngp->Last;
         /*  len  ' ' "news_groupname"  ':' "#" "\r\n"
             plus an extra 2 bytes for "\r\n" in case of a continuation line. */
@@ -1592,6 +1708,7 @@ ARTxrefslave(ARTDATA *data)
                        ngp->Name);
                 continue;
             }
+            ICDmarkdirty(ngp->LastString, ngp->Lastwidth);
         }
         /* Mark that this group gets the article. */
         ngp->PostCount++;
@@ -1701,147 +1818,187 @@ HashFeedMatch(HASHFEEDLIST *hf, char *MessageID)
 }
 
 /*
-**  Propagate an article to the sites have "expressed an interest."
+**  Check the conditions of a site in SITEmasks.Checked that depend on the
+**  article, and return whether it wants the article.
 */
-static void
-ARTpropagate(ARTDATA *data, const char **hops, int hopcount, char **list,
-             bool ControlStore, bool OverviewCreated, bool filtered)
+static bool
+ARTsitewants(SITE *sp, ARTDATA *data, int hopcount, char **list,
+             int Groupcount, int Followcount, int Crosscount)
 {
     HDRCONTENT *hc = data->HdrContent;
-    SITE *sp, *funnel;
-    int i, j, Groupcount, Followcount, Crosscount;
+    int j;
     char *p, *q, *begin, savec;
     bool sendit;
 
-    /* Work out which sites should really get it. */
-    Groupcount = data->Groupcount;
-    Followcount = data->Followcount;
-    Crosscount = Groupcount + Followcount * Followcount;
-    for (sp = Sites, i = nSites; --i >= 0; sp++) {
-        if ((sp->IgnoreControl && ControlStore)
-            || (sp->NeedOverviewCreation && !OverviewCreated))
-            sp->Sendit = false;
-        if (sp->Seenit || !sp->Sendit)
-            continue;
-        sp->Sendit = false;
+    if (sp->Originator) {
+        if (!HDR_FOUND(HDR__XTRACE) && !HDR_FOUND(HDR__INJECTION_INFO)) {
+            if (!sp->FeedwithoutOriginator)
+                return false;
+        } else if (HDR_FOUND(HDR__INJECTION_INFO)) {
+            begin = (char *) skip_cfws(HDR(HDR__INJECTION_INFO));
 
-        if (sp->Originator) {
-            if (!HDR_FOUND(HDR__XTRACE) && !HDR_FOUND(HDR__INJECTION_INFO)) {
-                if (!sp->FeedwithoutOriginator)
-                    continue;
-            } else if (HDR_FOUND(HDR__INJECTION_INFO)) {
-                begin = (char *) skip_cfws(HDR(HDR__INJECTION_INFO));
+            if (*begin == '\0')
+                return false;
 
-                if (*begin == '\0')
-                    continue;
+            /* The path identity ends with ';' or CFWS. */
+            for (p = begin; *p != ';' && *p != ' ' && *p != '\t'
+                            && *p != '\r' && *p != '\0';
+                 p++)
+                ;
+            savec = *p;
+            *p = '\0';
 
-                /* The path identity ends with ';' or CFWS. */
-                for (p = begin; *p != ';' && *p != ' ' && *p != '\t'
-                                && *p != '\r' && *p != '\0';
-                     p++)
-                    ;
-                savec = *p;
+            for (j = 0, sendit = false; (q = sp->Originator[j]) != NULL;
+                 j++) {
+                if (*q == '@') {
+                    if (uwildmat(begin, &q[1])) {
+                        *p = savec;
+                        sendit = false;
+                        break;
+                    }
+                } else {
+                    if (uwildmat(begin, q))
+                        sendit = true;
+                }
+            }
+            *p = savec;
+            if (!sendit)
+                return false;
+        } else if (HDR_FOUND(HDR__XTRACE)) {
+            if ((p = strchr(HDR(HDR__XTRACE), ' ')) != NULL) {
                 *p = '\0';
-
                 for (j = 0, sendit = false; (q = sp->Originator[j]) != NULL;
                      j++) {
                     if (*q == '@') {
-                        if (uwildmat(begin, &q[1])) {
-                            *p = savec;
+                        if (uwildmat(HDR(HDR__XTRACE), &q[1])) {
+                            *p = ' ';
                             sendit = false;
                             break;
                         }
                     } else {
-                        if (uwildmat(begin, q))
+                        if (uwildmat(HDR(HDR__XTRACE), q))
                             sendit = true;
                     }
                 }
-                *p = savec;
+                *p = ' ';
                 if (!sendit)
-                    continue;
-            } else if (HDR_FOUND(HDR__XTRACE)) {
-                if ((p = strchr(HDR(HDR__XTRACE), ' ')) != NULL) {
-                    *p = '\0';
-                    for (j = 0, sendit = false;
-                         (q = sp->Originator[j]) != NULL; j++) {
-                        if (*q == '@') {
-                            if (uwildmat(HDR(HDR__XTRACE), &q[1])) {
-                                *p = ' ';
-                                sendit = false;
-                                break;
-                            }
-                        } else {
-                            if (uwildmat(HDR(HDR__XTRACE), q))
-                                sendit = true;
-                        }
-                    }
-                    *p = ' ';
-                    if (!sendit)
-                        continue;
-                } else
-                    continue;
-            }
+                    return false;
+            } else
+                return false;
         }
+    }
 
-        if (sp->Master != NOSITE && Sites[sp->Master].Seenit)
-            continue;
+    if (sp->Master != NOSITE && Sites[sp->Master].Seenit)
+        return false;
 
-        if (sp->MaxSize && data->BytesValue > sp->MaxSize)
-            /* Too big for the site. */
-            continue;
+    if (sp->MaxSize && data->BytesValue > sp->MaxSize)
+        /* Too big for the site. */
+        return false;
 
-        if (sp->MinSize && data->BytesValue < sp->MinSize)
-            /* Too small for the site. */
-            continue;
+    if (sp->MinSize && data->BytesValue < sp->MinSize)
+        /* Too small for the site. */
+        return false;
 
-        if ((sp->Hops && hopcount > sp->Hops)
-            || (!sp->IgnorePath && ListHas(hops, sp->Name))
-            || (sp->Groupcount && Groupcount > sp->Groupcount)
-            || (sp->Followcount && Followcount > sp->Followcount)
-            || (sp->Crosscount && Crosscount > sp->Crosscount))
-            /* Site already saw the article; path too long; or too much
-             * cross-posting. */
-            continue;
+    if ((sp->Hops && hopcount > sp->Hops)
+        || (sp->Groupcount && Groupcount > sp->Groupcount)
+        || (sp->Followcount && Followcount > sp->Followcount)
+        || (sp->Crosscount && Crosscount > sp->Crosscount))
+        /* Path too long; or too much cross-posting. */
+        return false;
 
-        if (sp->HashFeedList
-            && !HashFeedMatch(sp->HashFeedList, HDR(HDR__MESSAGE_ID)))
-            /* Hashfeed doesn't match. */
-            continue;
+    if (sp->HashFeedList
+        && !HashFeedMatch(sp->HashFeedList, HDR(HDR__MESSAGE_ID)))
+        /* Hashfeed doesn't match. */
+        return false;
 
-        if (list && *list != NULL && sp->Distributions
-            && !DISTwantany(sp->Distributions, list))
-            /* Not in the site's desired list of distributions. */
-            continue;
-        if (sp->DistRequired && (list == NULL || *list == NULL))
-            /* Site requires Distribution header field and there isn't one. */
-            continue;
+    if (list && *list != NULL && sp->Distributions
+        && !DISTwantany(sp->Distributions, list))
+        /* Not in the site's desired list of distributions. */
+        return false;
 
-        if (sp->Exclusions) {
-            for (j = 0; (p = sp->Exclusions[j]) != NULL; j++)
-                if (ListHas(hops, p))
-                    break;
-            if (p != NULL)
-                /* A host in the site's exclusion list was in the Path. */
-                continue;
+    return true;
+}
+
+/*
+**  Propagate an article to the sites have "expressed an interest."
+**
+**  The sites marked by ARTpost are first narrowed down with the site masks,
+**  a word at a time: sites that already have the article or exclude a host
+**  in its Path, and sites whose A flags rule it out.  Only the remaining
+**  sites with other conditions are then checked one by one.
+*/
+static void
+ARTpropagate(ARTDATA *data, const char **hops, int hopcount, char **list,
+             bool ControlStore, bool OverviewCreated, bool filtered)
+{
+    static SITEBITS *want = NULL;
+    static SITEBITS *skip = NULL;
+    static size_t words = 0;
+    const SITEMASKS *masks;
+    SITE *sp, *funnel;
+    SITEBITS bits;
+    size_t w;
+    int i, j, oerrno, Groupcount, Followcount, Crosscount;
+
+    /* Work out which sites should really get it. */
+    Groupcount = data->Groupcount;
+    Followcount = data->Followcount;
+    Crosscount = Groupcount + Followcount * Followcount;
+    masks = SITEgetmasks();
+    if (words < masks->Words) {
+        words = masks->Words;
+        want = xrealloc(want, words * sizeof(SITEBITS));
+        skip = xrealloc(skip, words * sizeof(SITEBITS));
+    }
+    memset(want, 0, masks->Words * sizeof(SITEBITS));
+    for (sp = Sites, i = 0; i < nSites; sp++, i++)
+        if (sp->Sendit) {
+            SITEBITS_SET(want, i);
+            sp->Sendit = false;
         }
+    SITEpathmask(hops, skip);
+    for (w = 0; w < masks->Words; w++) {
+        bits = want[w] & ~skip[w];
+        if (ControlStore)
+            bits &= ~masks->IgnoreControl[w];
+        if (!OverviewCreated)
+            bits &= ~masks->NeedOverview[w];
+        if (filtered)
+            /* Handle dontrejectfiltered. */
+            bits &= ~masks->DropFiltered[w];
+        if (list == NULL || *list == NULL)
+            /* Site requires Distribution header field and there isn't one. */
+            bits &= ~masks->DistRequired[w];
+        want[w] = bits;
+    }
 
-        /* Handle dontrejectfiltered. */
-        if (filtered && sp->DropFiltered)
-            continue;
+    for (w = 0; w < masks->Words; w++) {
+        for (bits = want[w]; bits != 0; bits &= bits - 1) {
+            for (j = 0; !((bits >> j) & 1); j++)
+                continue;
+            i = w * SITEBITS_WORD + j;
+            sp = &Sites[i];
+            if (sp->Seenit)
+                continue;
+            if (((masks->Checked[w] >> j) & 1)
+                && !ARTsitewants(sp, data, hopcount, list, Groupcount,
+                                 Followcount, Crosscount))
+                continue;
 
-        /* Write that the site is getting it, and flag to send it. */
-        if (innconf->logsitename) {
-            if (fprintf(Log, " %s", sp->Name) == EOF || ferror(Log)) {
-                j = errno;
-                syslog(L_ERROR, "%s cant write log_site %m", LogName);
-                IOError("logging site", j);
-                clearerr(Log);
+            /* Write that the site is getting it, and flag to send it. */
+            if (innconf->logsitename) {
+                if (fprintf(Log, " %s", sp->Name) == EOF || ferror(Log)) {
+                    oerrno = errno;
+                    syslog(L_ERROR, "%s cant write log_site %m", LogName);
+                    IOError("logging site", oerrno);
+                    clearerr(Log);
+                }
             }
+            sp->Sendit = true;
+            sp->Seenit = true;
+            if (sp->Master != NOSITE)
+                Sites[sp->Master].Seenit = true;
         }
-        sp->Sendit = true;
-        sp->Seenit = true;
-        if (sp->Master != NOSITE)
-            Sites[sp->Master].Seenit = true;
     }
     if (putc('\n', Log) == EOF || (!BufferedLogs && fflush(Log))
         || ferror(Log)) {
@@ -1977,46 +2134,400 @@ ARTmakeoverview(CHANNEL *cp)
 }
 
 /*
-**  This routine is the heart of it all.  Take a full article, parse it,
-**  file or reject it, feed it to the other sites.  Return the NNTP
-**  message to send back.
+**  Finish posting an article once the storage api has been called: record
+**  it in overview and history, log it, and feed it to the other sites.
+**  error is the storage api error message if the article was not stored.
 */
-bool
-ARTpost(CHANNEL *cp)
+static bool
+ARTpostfinish(CHANNEL *cp, TOKEN token, const ARTPOST *post,
+              const char *error)
 {
-    char *p, **groups, ControlWord[SMBUF], **hops, *controlgroup;
-    int i, j, *isp, hopcount, oerrno, canpost;
+    ARTDATA *data = &cp->Data;
+    HDRCONTENT *hc = data->HdrContent;
+    SITE *sp;
+    int i, oerrno;
     float f;
-    size_t n;
-    NEWSGROUP *ngp, **ngptr;
-    NEWSGROUP *ngpjunk;
+    bool OverviewCreated = false;
+    OVADDRESULT result;
+
+    /* Change trailing '\r\n' to '\0\n' of all system header fields. */
+    for (i = 0; i < MAX_ARTHEADER; i++) {
+        if (HDR_FOUND(i)) {
+            HDR_LASTCHAR_SAVE(i);
+            HDR_PARSE_START(i);
+        }
+    }
+    if (token.type == TOKEN_EMPTY) {
+        syslog(L_ERROR, "%s cant store article: %s", LogName, error);
+        snprintf(cp->Error, sizeof(cp->Error), "%d Can't store article",
+                 post->ihave ? NNTP_FAIL_IHAVE_DEFER : NNTP_FAIL_ACTION);
+        /* Do not remember the message-ID of the article because we want
+         * it to be received again later. */
+        ARTlog(data, ART_REJECT, cp->Error);
+        ARTreject(REJECT_OTHER, cp);
+        TMRstop(TMR_ARTWRITE);
+        return false;
+    }
+    TMRstop(TMR_ARTWRITE);
+    if ((innconf->enableoverview && !innconf->useoverchan) || NeedOverview) {
+        TMRstart(TMR_OVERV);
+        ARTmakeoverview(cp);
+        if (innconf->enableoverview && !innconf->useoverchan) {
+            if ((result =
+                     OVadd(token, data->Overview.data, data->Overview.left,
+                           data->Arrived, data->Expires))
+                == OVADDFAILED) {
+                if (OVctl(OVSPACE, (void *) &f)
+                    && (int) (f + 0.01f) == OV_NOSPACE)
+                    IOError("creating overview", ENOSPC);
+                else
+                    IOError("creating overview", 0);
+                syslog(L_ERROR, "%s cant store overview for %s", LogName,
+                       TokenToText(token));
+                OverviewCreated = false;
+            } else {
+                if (result == OVADDCOMPLETED)
+                    OverviewCreated = true;
+                else
+                    OverviewCreated = false;
+            }
+        }
+        TMRstop(TMR_OVERV);
+    }
+    strlcpy(data->TokenText, TokenToText(token), sizeof(data->TokenText));
+
+    /* Update history if we didn't get too many I/O errors above. */
+    if ((Mode != OMrunning)
+        || !InndHisWrite(HDR(HDR__MESSAGE_ID), data->Arrived, data->Posted,
+                         data->Expires, &token)) {
+        i = errno;
+        syslog(L_ERROR, "%s cant write history %s %m", LogName,
+               HDR(HDR__MESSAGE_ID));
+        snprintf(cp->Error, sizeof(cp->Error), "%d Can't write history, %s",
+                 post->ihave ? NNTP_FAIL_IHAVE_DEFER : NNTP_FAIL_ACTION,
+                 strerror(errno));
+        ARTlog(data, ART_REJECT, cp->Error);
+        ARTreject(REJECT_OTHER, cp);
+        return false;
+    }
+
+    if (NeedStoredGroup)
+        data->StoredGroupLength = strlen(data->Newsgroups.List[0]);
+
+    /* Start logging, then propagate the article. */
+    if (data->CRwithoutLF > 0 || data->LFwithoutCR > 0) {
+        if (data->CRwithoutLF > 0 && data->LFwithoutCR == 0)
+            snprintf(cp->Error, sizeof(cp->Error),
+                     "Article accepted but includes CR without LF(%d)",
+                     data->CRwithoutLF);
+        else if (data->CRwithoutLF == 0 && data->LFwithoutCR > 0)
+            snprintf(cp->Error, sizeof(cp->Error),
+                     "Article accepted but includes LF without CR(%d)",
+                     data->LFwithoutCR);
+        else
+            snprintf(cp->Error, sizeof(cp->Error),
+                     "Article accepted but includes CR without LF(%d) and LF "
+                     "without CR(%d)",
+                     data->CRwithoutLF, data->LFwithoutCR);
+        /* We have another ARTlog() for the same article just after. */
+        ARTlog(data, ART_STRSTR, cp->Error);
+    }
+    ARTlog(data, post->Accepted ? ART_ACCEPT : ART_JUNK, (char *) NULL);
+    if ((innconf->nntplinklog)
+        && (fprintf(Log, " (%s)", data->TokenText) == EOF || ferror(Log))) {
+        oerrno = errno;
+        syslog(L_ERROR, "%s cant write log_nntplink %m", LogName);
+        IOError("logging nntplink", oerrno);
+        clearerr(Log);
+    }
+    /* Calculate Max Article Time */
+    i = Now.tv_sec - cp->ArtBeg;
+    if (i > cp->ArtMax)
+        cp->ArtMax = i;
+    cp->ArtBeg = 0;
+
+    cp->Size += (float) data->BytesValue;
+    if (innconf->logartsize) {
+        if (fprintf(Log, " %ld", data->BytesValue) == EOF || ferror(Log)) {
+            oerrno = errno;
+            syslog(L_ERROR, "%s cant write artsize %m", LogName);
+            IOError("logging artsize", oerrno);
+            clearerr(Log);
+        }
+    }
+
+    ARTpropagate(data, (const char **) data->Path.List, post->hopcount,
+                 data->Distribution.List, post->ControlStore, OverviewCreated,
+                 post->Filtered);
+
+    /* Now that it's been written, process the control message.  This has
+     * a small window, if we get a new article before the newgroup message
+     * has been processed.  We could pause ourselves here, but it doesn't
+     * seem to be worth it. */
+    if (post->Accepted) {
+        if (post->IsControl) {
+            ARTcontrol(data, HDR(HDR__CONTROL), cp);
+        }
+        if (HDR_FOUND(HDR__SUPERSEDES)) {
+            if (IsValidMessageID(HDR(HDR__SUPERSEDES), true, laxmid))
+                ARTcancel(data, HDR(HDR__SUPERSEDES), false);
+        }
+    }
+
+    /* And finally, send to everyone who should get it.
+     * sp->Sendit is false for funnel sites: ARTpropagate()
+     * transferred it to the corresponding funnel. */
+    for (sp = Sites, i = nSites; --i >= 0; sp++) {
+        if (sp->Sendit) {
+            TMRstart(TMR_SITESEND);
+            SITEsend(sp, data);
+            TMRstop(TMR_SITESEND);
+        }
+    }
+
+    return true;
+}
+
+
+/*
+**  Called from the main loop when the storage thread is done with an
+**  article.  Restore the per-site state ARTpost computed for it and finish
+**  posting it.
+*/
+static void
+ARTstored(STOREJOB *job)
+{
+    ARTPENDING *pending = (ARTPENDING *) job;
+    CHANNEL *cp = pending->cp;
     SITE *sp;
+    bool accepted;
+    int i;
+
+    for (i = 0, sp = Sites; i < nSites; i++, sp++) {
+        sp->Poison = pending->sites[i].Poison;
+        sp->Sendit = pending->sites[i].Sendit;
+        sp->Seenit = pending->sites[i].Seenit;
+        sp->ng = pending->sites[i].ng;
+        buffer_set(&sp->FNLnames, NULL, 0);
+    }
+    cp->Data.Hash = &pending->hash;
+
+    TMRstart(TMR_ARTWRITE);
+    if (job->Token.type == TOKEN_EMPTY)
+        ARTstorefailed(job->Errno);
+    else
+        ARTstoresize(cp, pending->iov, pending->iovcnt);
+    accepted = ARTpostfinish(cp, job->Token, &pending->post, job->Error);
+
+    free(job->Error);
+    free(pending->sites);
+    free(pending);
+    NCstored(cp, accepted);
+}
+
+
+/*
+**  Hand an article to the storage thread.  The per-site state computed by
+**  ARTpost is saved, since other articles will be posted before this one is
+**  stored.  The channel is not read until ARTstored is done.
+*/
+static bool
+ARTqueue(CHANNEL *cp, const ARTPOST *post, HASH hash)
+{
+    ARTPENDING *pending;
+    TOKEN token;
+    SITE *sp;
+    int i;
+
+    pending = xcalloc(1, sizeof(ARTPENDING));
+    pending->iovcnt = ARTstoreprepare(cp, post->Filtered, pending->iov,
+                                      &pending->job.Article);
+    if (pending->iovcnt < 0) {
+        free(pending);
+        memset(&token, 0, sizeof(token));
+        token.type = TOKEN_EMPTY;
+        return ARTpostfinish(cp, token, post, SMerrorstr);
+    }
+    pending->job.Done = ARTstored;
+    pending->cp = cp;
+    pending->post = *post;
+    pending->hash = hash;
+    pending->sites = xmalloc(nSites * sizeof(ARTSITE));
+    for (i = 0, sp = Sites; i < nSites; i++, sp++) {
+        pending->sites[i].Poison = sp->Poison;
+        pending->sites[i].Sendit = sp->Sendit;
+        pending->sites[i].Seenit = sp->Seenit;
+        pending->sites[i].ng = sp->ng;
+    }
+
+    cp->State = CSstoring;
+    RCHANremove(cp);
+    STOREqueue(&pending->job);
+    TMRstop(TMR_ARTWRITE);
+    return true;
+}
+
+
+#if defined(DO_PERL) || defined(DO_PYTHON)
+/*
+**  Act on what the article filter of the given language said about the
+**  article on cp.  Returns false if the article was rejected, in which case
+**  the rejection has been logged and counted.
+*/
+static bool
+ARTfilterverdict(CHANNEL *cp, const char *language, const char *filterrc,
+                 bool *Filtered)
+{
     ARTDATA *data = &cp->Data;
     HDRCONTENT *hc = data->HdrContent;
-    bool Approved, Accepted, LikeNewgroup, ToGroup, GroupMissing;
-    bool NoHistoryUpdate, artclean;
-    bool ControlStore = false;
-    bool NonExist = false;
-    bool OverviewCreated = false;
-    bool IsControl = false;
+    bool ihave;
+
+    if (filterrc == NULL || *filterrc == '\0')
+        return true;
+    ihave = (cp->Sendid.size > 3) ? false : true;
+    if (innconf->dontrejectfiltered) {
+        *Filtered = true;
+        syslog(L_NOTICE,
+               "rejecting[%s] %s %d %.200s (with dontrejectfiltered)",
+               language, HDR(HDR__MESSAGE_ID),
+               ihave ? NNTP_OK_IHAVE : NNTP_OK_TAKETHIS, filterrc);
+        return true;
+    }
+    snprintf(cp->Error, sizeof(cp->Error), "%d %.200s",
+             ihave ? NNTP_FAIL_IHAVE_REJECT : NNTP_FAIL_TAKETHIS_REJECT,
+             filterrc);
+    syslog(L_NOTICE, "rejecting[%s] %s %s", language, HDR(HDR__MESSAGE_ID),
+           cp->Error);
+    ARTlog(data, ART_REJECT, cp->Error);
+    if (innconf->remembertrash && (Mode == OMrunning)
+        && !InndHisRemember(HDR(HDR__MESSAGE_ID), data->Posted))
+        syslog(L_ERROR, "%s cant write history %s %m", LogName,
+               HDR(HDR__MESSAGE_ID));
+    ARTreject(REJECT_FILTER, cp);
+    return false;
+}
+
+
+/*
+**  Compute the key under which the verdicts of the article filters on the
+**  article on cp are remembered: the hash of its Message-ID mixed with that
+**  of its body.  Returns NULL if verdicts are not remembered.
+*/
+static const HASH *
+ARTfilterkey(CHANNEL *cp, HASH hash, HASH *key)
+{
+    ARTDATA *data = &cp->Data;
+    HASH body;
+    size_t i;
+
+    if (!VERDICTenabled())
+        return NULL;
+    body = Hash(cp->In.data + data->Body, cp->Next - data->Body);
+    for (i = 0; i < sizeof(key->hash); i++)
+        key->hash[i] = hash.hash[i] ^ body.hash[i];
+    return key;
+}
+
+
+/*
+**  Act on the remembered verdicts of the article filters, if they are all
+**  known.  Returns false if they have to be run; otherwise, Accepted is set
+**  to false if the article was rejected.
+*/
+static bool
+ARTfiltercached(CHANNEL *cp, const HASH *key, bool *Filtered, bool *Accepted)
+{
+    char *python = NULL;
+    char *perl = NULL;
+
+    if (key == NULL)
+        return false;
+#    if defined(DO_PYTHON)
+    if (PythonFilterActive && !VERDICTfind(VERDICT_PYTHONART, key, &python))
+        return false;
+#    endif
+#    if defined(DO_PERL)
+    /* The Perl filter does not run on articles Python rejected. */
+    if (PerlFilterActive && (python == NULL || innconf->dontrejectfiltered)
+        && !VERDICTfind(VERDICT_PERLART, key, &perl))
+        return false;
+#    endif
+    *Accepted = ARTfilterverdict(cp, "python", python, Filtered)
+                && ARTfilterverdict(cp, "perl", perl, Filtered);
+    return true;
+}
+
+
+/*
+**  Run the article on cp through the Python and Perl article filters, and
+**  remember their verdicts under key unless it is NULL.  Returns false if
+**  one of them rejected it.
+*/
+static bool
+ARTfilter(CHANNEL *cp, const HASH *key, bool *Filtered)
+{
+    ARTDATA *data = &cp->Data;
+    struct buffer *article = &cp->In;
+    char *filterrc;
+
+#    if defined(DO_PYTHON)
+    TMRstart(TMR_PYTHON);
+    filterrc = PYartfilter(data, article->data + data->Body,
+                           cp->Next - data->Body, data->Lines);
+    TMRstop(TMR_PYTHON);
+    if (key != NULL && PythonFilterActive)
+        VERDICTadd(VERDICT_PYTHONART, key, filterrc);
+    if (!ARTfilterverdict(cp, "python", filterrc, Filtered))
+        return false;
+#    endif /* DO_PYTHON */
+
+    /* I suppose some masochist will run with Python and Perl in together */
+
+#    if defined(DO_PERL)
+    TMRstart(TMR_PERL);
+    filterrc = PLartfilter(data, article->data + data->Body,
+                           cp->Next - data->Body, data->Lines);
+    TMRstop(TMR_PERL);
+    if (key != NULL && PerlFilterActive)
+        VERDICTadd(VERDICT_PERLART, key, filterrc);
+    if (!ARTfilterverdict(cp, "perl", filterrc, Filtered))
+        return false;
+#    endif /* DO_PERL */
+
+    return true;
+}
+#endif /* DO_PERL || DO_PYTHON */
+
+
+static bool ARTpostfiltered(CHANNEL *cp, HASH hash, int hopcount,
+                            bool Filtered);
+
+/*
+**  This routine is the heart of it all.  Take a full article, parse it,
+**  file or reject it, feed it to the other sites.  Return the NNTP
+**  message to send back.
+*/
+bool
+ARTpost(CHANNEL *cp)
+{
+    char **hops;
+    int j, hopcount;
+    size_t n;
+    ARTDATA *data = &cp->Data;
+    HDRCONTENT *hc = data->HdrContent;
+    bool artclean;
     bool Filtered = false;
     bool ihave;
     HASH hash;
-    TOKEN token;
-    char *groupbuff[2];
 #if defined(DO_PERL) || defined(DO_PYTHON)
-    struct buffer *article;
-    char *filterrc;
+    const HASH *key;
+    HASH keydata;
+    bool accepted;
 #endif
-    OVADDRESULT result;
 
     /* Check whether we are receiving the article via IHAVE or TAKETHIS. */
     ihave = (cp->Sendid.size > 3) ? false : true;
 
-#if defined(DO_PERL) || defined(DO_PYTHON)
-    article = &cp->In;
-#endif
-
     /* Preliminary clean-ups. */
     artclean = ARTclean(data, cp->Error, ihave);
 
@@ -2068,7 +2579,7 @@ ARTpost(CHANNEL *cp)
 
     hash = HashMessageID(HDR(HDR__MESSAGE_ID));
     data->Hash = &hash;
-    if (HIScheck(History, HDR(HDR__MESSAGE_ID))) {
+    if (InndHisHave(HDR(HDR__MESSAGE_ID))) {
         snprintf(cp->Error, sizeof(cp->Error), "%d Duplicate",
                  ihave ? NNTP_FAIL_IHAVE_REJECT : NNTP_FAIL_TAKETHIS_REJECT);
         ARTlog(data, ART_REJECT, cp->Error);
@@ -2121,67 +2632,49 @@ ARTpost(CHANNEL *cp)
         }
     }
 
-#if defined(DO_PYTHON)
-    TMRstart(TMR_PYTHON);
-    filterrc = PYartfilter(data, article->data + data->Body,
-                           cp->Next - data->Body, data->Lines);
-    TMRstop(TMR_PYTHON);
-    if (filterrc != NULL) {
-        if (innconf->dontrejectfiltered) {
-            Filtered = true;
-            syslog(L_NOTICE,
-                   "rejecting[python] %s %d %.200s (with dontrejectfiltered)",
-                   HDR(HDR__MESSAGE_ID),
-                   ihave ? NNTP_OK_IHAVE : NNTP_OK_TAKETHIS, filterrc);
-        } else {
-            snprintf(cp->Error, sizeof(cp->Error), "%d %.200s",
-                     ihave ? NNTP_FAIL_IHAVE_REJECT
-                           : NNTP_FAIL_TAKETHIS_REJECT,
-                     filterrc);
-            syslog(L_NOTICE, "rejecting[python] %s %s", HDR(HDR__MESSAGE_ID),
-                   cp->Error);
-            ARTlog(data, ART_REJECT, cp->Error);
-            if (innconf->remembertrash && (Mode == OMrunning)
-                && !InndHisRemember(HDR(HDR__MESSAGE_ID), data->Posted))
-                syslog(L_ERROR, "%s cant write history %s %m", LogName,
-                       HDR(HDR__MESSAGE_ID));
-            ARTreject(REJECT_FILTER, cp);
+#if defined(DO_PERL) || defined(DO_PYTHON)
+    key = ARTfilterkey(cp, hash, &keydata);
+    if (ARTfiltercached(cp, key, &Filtered, &accepted)) {
+        if (!accepted)
+            return false;
+    } else {
+        if (FILTERqueue(cp, hash, hopcount))
+            return true;
+        if (!ARTfilter(cp, key, &Filtered))
             return false;
-        }
     }
-#endif /* DO_PYTHON */
+#endif
 
-    /* I suppose some masochist will run with Python and Perl in together */
+    return ARTpostfiltered(cp, hash, hopcount, Filtered);
+}
 
-#if defined(DO_PERL)
-    TMRstart(TMR_PERL);
-    filterrc = PLartfilter(data, article->data + data->Body,
-                           cp->Next - data->Body, data->Lines);
-    TMRstop(TMR_PERL);
-    if (filterrc) {
-        if (innconf->dontrejectfiltered) {
-            Filtered = true;
-            syslog(L_NOTICE,
-                   "rejecting[perl] %s %d %.200s (with dontrejectfiltered)",
-                   HDR(HDR__MESSAGE_ID),
-                   ihave ? NNTP_OK_IHAVE : NNTP_OK_TAKETHIS, filterrc);
-        } else {
-            snprintf(cp->Error, sizeof(cp->Error), "%d %.200s",
-                     ihave ? NNTP_FAIL_IHAVE_REJECT
-                           : NNTP_FAIL_TAKETHIS_REJECT,
-                     filterrc);
-            syslog(L_NOTICE, "rejecting[perl] %s %s", HDR(HDR__MESSAGE_ID),
-                   cp->Error);
-            ARTlog(data, ART_REJECT, cp->Error);
-            if (innconf->remembertrash && (Mode == OMrunning)
-                && !InndHisRemember(HDR(HDR__MESSAGE_ID), data->Posted))
-                syslog(L_ERROR, "%s cant write history %s %m", LogName,
-                       HDR(HDR__MESSAGE_ID));
-            ARTreject(REJECT_FILTER, cp);
-            return false;
-        }
-    }
-#endif /* DO_PERL */
+
+/*
+**  The part of ARTpost that comes after the article filters.  Filtered is
+**  true if a filter rejected the article but dontrejectfiltered is set.
+*/
+static bool
+ARTpostfiltered(CHANNEL *cp, HASH hash, int hopcount, bool Filtered)
+{
+    char *p, **groups, ControlWord[SMBUF], *controlgroup;
+    int i, j, *isp, canpost;
+    NEWSGROUP *ngp, **ngptr, **found;
+    NEWSGROUP *ngpjunk;
+    SITE *sp;
+    ARTDATA *data = &cp->Data;
+    HDRCONTENT *hc = data->HdrContent;
+    bool Approved, Accepted, LikeNewgroup, ToGroup, GroupMissing;
+    bool NoHistoryUpdate;
+    bool ControlStore = false;
+    bool NonExist = false;
+    bool IsControl = false;
+    bool ihave;
+    TOKEN token;
+    ARTPOST post;
+    char *groupbuff[2];
+
+    ihave = (cp->Sendid.size > 3) ? false : true;
+    data->Hash = &hash;
 
     /* If we limit what distributions we get, see if we want this one. */
     if (HDR_FOUND(HDR__DISTRIBUTION)) {
@@ -2315,8 +2808,10 @@ ARTpost(CHANNEL *cp)
     ToGroup = NoHistoryUpdate = false;
     Approved = HDR_FOUND(HDR__APPROVED);
     ngptr = GroupPointers;
-    for (GroupMissing = Accepted = false; (p = *groups) != NULL; groups++) {
-        if ((ngp = NGfind(p)) == NULL) {
+    found = NGfindlist(groups);
+    for (GroupMissing = Accepted = false; (p = *groups) != NULL;
+         groups++, found++) {
+        if ((ngp = *found) == NULL) {
             GroupMissing = true;
             if (LikeNewgroup && Approved) {
                 /* Checkgroups/newgroup/rmgroup being sent to a group that
@@ -2587,140 +3082,53 @@ ARTpost(CHANNEL *cp)
     for (i = 0; (ngp = GroupPointers[i]) != NULL; i++)
         ngp->PostCount = 0;
 
+    post.hopcount = hopcount;
+    post.ihave = ihave;
+    post.Accepted = Accepted;
+    post.IsControl = IsControl;
+    post.ControlStore = ControlStore;
+    post.Filtered = Filtered;
+    if (STOREenabled())
+        return ARTqueue(cp, &post, hash);
     token = ARTstore(cp, Filtered);
-    /* Change trailing '\r\n' to '\0\n' of all system header fields. */
-    for (i = 0; i < MAX_ARTHEADER; i++) {
-        if (HDR_FOUND(i)) {
-            HDR_LASTCHAR_SAVE(i);
-            HDR_PARSE_START(i);
-        }
-    }
-    if (token.type == TOKEN_EMPTY) {
-        syslog(L_ERROR, "%s cant store article: %s", LogName, SMerrorstr);
-        snprintf(cp->Error, sizeof(cp->Error), "%d Can't store article",
-                 ihave ? NNTP_FAIL_IHAVE_DEFER : NNTP_FAIL_ACTION);
-        /* Do not remember the message-ID of the article because we want
-         * it to be received again later. */
-        ARTlog(data, ART_REJECT, cp->Error);
-        ARTreject(REJECT_OTHER, cp);
-        TMRstop(TMR_ARTWRITE);
-        return false;
-    }
-    TMRstop(TMR_ARTWRITE);
-    if ((innconf->enableoverview && !innconf->useoverchan) || NeedOverview) {
-        TMRstart(TMR_OVERV);
-        ARTmakeoverview(cp);
-        if (innconf->enableoverview && !innconf->useoverchan) {
-            if ((result =
-                     OVadd(token, data->Overview.data, data->Overview.left,
-                           data->Arrived, data->Expires))
-                == OVADDFAILED) {
-                if (OVctl(OVSPACE, (void *) &f)
-                    && (int) (f + 0.01f) == OV_NOSPACE)
-                    IOError("creating overview", ENOSPC);
-                else
-                    IOError("creating overview", 0);
-                syslog(L_ERROR, "%s cant store overview for %s", LogName,
-                       TokenToText(token));
-                OverviewCreated = false;
-            } else {
-                if (result == OVADDCOMPLETED)
-                    OverviewCreated = true;
-                else
-                    OverviewCreated = false;
-            }
-        }
-        TMRstop(TMR_OVERV);
-    }
-    strlcpy(data->TokenText, TokenToText(token), sizeof(data->TokenText));
-
-    /* Update history if we didn't get too many I/O errors above. */
-    if ((Mode != OMrunning)
-        || !InndHisWrite(HDR(HDR__MESSAGE_ID), data->Arrived, data->Posted,
-                         data->Expires, &token)) {
-        i = errno;
-        syslog(L_ERROR, "%s cant write history %s %m", LogName,
-               HDR(HDR__MESSAGE_ID));
-        snprintf(cp->Error, sizeof(cp->Error), "%d Can't write history, %s",
-                 ihave ? NNTP_FAIL_IHAVE_DEFER : NNTP_FAIL_ACTION,
-                 strerror(errno));
-        ARTlog(data, ART_REJECT, cp->Error);
-        ARTreject(REJECT_OTHER, cp);
-        return false;
-    }
-
-    if (NeedStoredGroup)
-        data->StoredGroupLength = strlen(data->Newsgroups.List[0]);
-
-    /* Start logging, then propagate the article. */
-    if (data->CRwithoutLF > 0 || data->LFwithoutCR > 0) {
-        if (data->CRwithoutLF > 0 && data->LFwithoutCR == 0)
-            snprintf(cp->Error, sizeof(cp->Error),
-                     "Article accepted but includes CR without LF(%d)",
-                     data->CRwithoutLF);
-        else if (data->CRwithoutLF == 0 && data->LFwithoutCR > 0)
-            snprintf(cp->Error, sizeof(cp->Error),
-                     "Article accepted but includes LF without CR(%d)",
-                     data->LFwithoutCR);
-        else
-            snprintf(cp->Error, sizeof(cp->Error),
-                     "Article accepted but includes CR without LF(%d) and LF "
-                     "without CR(%d)",
-                     data->CRwithoutLF, data->LFwithoutCR);
-        /* We have another ARTlog() for the same article just after. */
-        ARTlog(data, ART_STRSTR, cp->Error);
-    }
-    ARTlog(data, Accepted ? ART_ACCEPT : ART_JUNK, (char *) NULL);
-    if ((innconf->nntplinklog)
-        && (fprintf(Log, " (%s)", data->TokenText) == EOF || ferror(Log))) {
-        oerrno = errno;
-        syslog(L_ERROR, "%s cant write log_nntplink %m", LogName);
-        IOError("logging nntplink", oerrno);
-        clearerr(Log);
-    }
-    /* Calculate Max Article Time */
-    i = Now.tv_sec - cp->ArtBeg;
-    if (i > cp->ArtMax)
-        cp->ArtMax = i;
-    cp->ArtBeg = 0;
-
-    cp->Size += (float) data->BytesValue;
-    if (innconf->logartsize) {
-        if (fprintf(Log, " %ld", data->BytesValue) == EOF || ferror(Log)) {
-            oerrno = errno;
-            syslog(L_ERROR, "%s cant write artsize %m", LogName);
-            IOError("logging artsize", oerrno);
-            clearerr(Log);
-        }
-    }
+    return ARTpostfinish(cp, token, &post, SMerrorstr);
+}
 
-    ARTpropagate(data, (const char **) hops, hopcount, data->Distribution.List,
-                 ControlStore, OverviewCreated, Filtered);
 
-    /* Now that it's been written, process the control message.  This has
-     * a small window, if we get a new article before the newgroup message
-     * has been processed.  We could pause ourselves here, but it doesn't
-     * seem to be worth it. */
-    if (Accepted) {
-        if (IsControl) {
-            ARTcontrol(data, HDR(HDR__CONTROL), cp);
-        }
-        if (HDR_FOUND(HDR__SUPERSEDES)) {
-            if (IsValidMessageID(HDR(HDR__SUPERSEDES), true, laxmid))
-                ARTcancel(data, HDR(HDR__SUPERSEDES), false);
-        }
-    }
+/*
+**  Go on with an article handed to the filter workers by ARTpost, once they
+**  are done with it.  Returns what ARTpost would have returned.
+*/
+bool
+ARTfiltered(CHANNEL *cp, FILTERJOB *job)
+{
+    bool Filtered = false;
+#if defined(DO_PERL) || defined(DO_PYTHON)
+    const HASH *key;
+    HASH keydata;
 
-    /* And finally, send to everyone who should get it.
-     * sp->Sendit is false for funnel sites: ARTpropagate()
-     * transferred it to the corresponding funnel. */
-    for (sp = Sites, i = nSites; --i >= 0; sp++) {
-        if (sp->Sendit) {
-            TMRstart(TMR_SITESEND);
-            SITEsend(sp, data);
-            TMRstop(TMR_SITESEND);
-        }
+    cp->Data.Hash = &job->Hash;
+    key = ARTfilterkey(cp, job->Hash, &keydata);
+    if (!job->Ran) {
+        if (!ARTfilter(cp, key, &Filtered))
+            return false;
+    } else {
+        /* Filters reloaded or turned on or off since the article was
+           queued emptied the cache, and may have changed the verdicts. */
+        if (key != NULL && job->Generation == VERDICTgeneration()) {
+#    if defined(DO_PYTHON)
+            if (job->PythonRan && PythonFilterActive)
+                VERDICTadd(VERDICT_PYTHONART, key, job->Python);
+#    endif
+#    if defined(DO_PERL)
+            if (job->PerlRan && PerlFilterActive)
+                VERDICTadd(VERDICT_PERLART, key, job->Perl);
+#    endif
+        }
+        if (!ARTfilterverdict(cp, "python", job->Python, &Filtered)
+            || !ARTfilterverdict(cp, "perl", job->Perl, &Filtered))
+            return false;
     }
-
-    return true;
+#endif
+    return ARTpostfiltered(cp, job->Hash, job->Hopcount, Filtered);
 }
@@ -0,0 +1,341 @@
+/*
+**  The queue of cancels waiting to be executed.
+**
+**  A flood of cancels of articles we have would otherwise hold up the main
+**  loop with a history lookup, an overview cancel and a storage cancel for
+**  each of them, plus the retrieval of the original article when cancels
+**  are authenticated.  When cancelrate is set, ARTcancel hands those cancels
+**  to CANCELadd, and the main loop calls CANCELrun to execute at most
+**  cancelrate of them a second with ARTcancelnow.  Cancels of articles we do
+**  not have yet are never queued: ARTcancel remembers their Message-IDs in
+**  history at once, so that the articles are refused when they come.
+**
+**  Each queued cancel is also appended to INN_PATH_CANCELQUEUE in pathdb,
+**  which is read back by the next innd so that a crash does not lose them.
+**  The file is rewritten with only the waiting cancels when innd exits or
+**  re-executes itself, and when it grows too far beyond the queue; it is
+**  emptied whenever the queue is.  After a crash, the cancels run since the
+**  file was last rewritten are run again, which does no harm.  Each line
+**  holds the Message-ID of the article to cancel, the site the cancel came
+**  from and the Message-ID of the cancel ("-" when unknown), followed by the
+**  body of its Cancel-Key header field if any.
+*/
+
+#include "portable/system.h"
+
+#include "inn/fdflag.h"
+#include "inn/innconf.h"
+#include "inn/xwrite.h"
+#include "innd.h"
+
+/* Beyond this many waiting cancels, new ones are executed at once. */
+#define CANCEL_MAXQUEUE 100000
+
+/* How many lines of cancels already run the file may hold beyond twice the
+   queue before it is rewritten. */
+#define CANCEL_SLACK 10000
+
+struct cancel {
+    char *MessageID;
+    char *Feedsite;  /* NULL if unknown. */
+    char *CancelID;  /* NULL if unknown. */
+    char *CancelKey; /* NULL if none. */
+};
+
+/* A ring of count entries starting at first. */
+static struct {
+    struct cancel *entries;
+    size_t size;
+    size_t first;
+    size_t count;
+    time_t second;        /* When the budget below was last refilled. */
+    unsigned long budget; /* Cancels that may still run in that second. */
+} cancels;
+
+static char *CANCELpath;
+
+/* The file the queue is appended to, -1 if not open, and its line count. */
+static int CANCELfd = -1;
+static size_t CANCELlines;
+
+
+/*
+**  Append a cancel to the queue, copying the strings.
+*/
+static void
+CANCELpush(const char *MessageID, const char *Feedsite, const char *CancelID,
+           const char *CancelKey)
+{
+    struct cancel *c;
+    size_t i, size;
+    char *p;
+
+    if (cancels.count == cancels.size) {
+        size = cancels.size == 0 ? 64 : cancels.size * 2;
+        cancels.entries =
+            xrealloc(cancels.entries, size * sizeof(struct cancel));
+        /* Unwrap the entries that were at the start of the old ring. */
+        for (i = 0; i < cancels.first; i++)
+            cancels.entries[cancels.size + i] = cancels.entries[i];
+        cancels.size = size;
+    }
+    c = &cancels.entries[(cancels.first + cancels.count) % cancels.size];
+    c->MessageID = xstrdup(MessageID);
+    c->Feedsite = Feedsite == NULL ? NULL : xstrdup(Feedsite);
+    c->CancelID = CancelID == NULL ? NULL : xstrdup(CancelID);
+    c->CancelKey = NULL;
+    if (CancelKey != NULL) {
+        /* Keep the saved queue one line per cancel. */
+        c->CancelKey = xstrdup(CancelKey);
+        for (p = c->CancelKey; *p != '\0'; p++)
+            if (*p == '\r' || *p == '\n' || *p == '\t')
+                *p = ' ';
+    }
+    cancels.count++;
+}
+
+
+/*
+**  Remove the first cancel of the queue, returning it.  The caller frees
+**  the strings.
+*/
+static struct cancel
+CANCELshift(void)
+{
+    struct cancel c;
+
+    c = cancels.entries[cancels.first];
+    cancels.first = (cancels.first + 1) % cancels.size;
+    cancels.count--;
+    return c;
+}
+
+
+/*
+**  Free the strings of a cancel taken from the queue.
+*/
+static void
+CANCELfree(struct cancel *c)
+{
+    free(c->MessageID);
+    free(c->Feedsite);
+    free(c->CancelID);
+    free(c->CancelKey);
+}
+
+
+/*
+**  Append the line for a cancel to a buffer.
+*/
+static void
+CANCELformat(struct buffer *b, const struct cancel *c)
+{
+    buffer_append_sprintf(b, "%s %s %s%s%s\n", c->MessageID,
+                          c->Feedsite != NULL ? c->Feedsite : "-",
+                          c->CancelID != NULL ? c->CancelID : "-",
+                          c->CancelKey != NULL ? " " : "",
+                          c->CancelKey != NULL ? c->CancelKey : "");
+}
+
+
+/*
+**  Open the file the queue is appended to, if not open yet.
+*/
+static bool
+CANCELopen(void)
+{
+    if (CANCELfd >= 0)
+        return true;
+    CANCELfd = open(CANCELpath, O_WRONLY | O_APPEND | O_CREAT, 0664);
+    if (CANCELfd < 0) {
+        syslog(L_ERROR, "%s cant open %s %m", LogName, CANCELpath);
+        return false;
+    }
+    fdflag_close_exec(CANCELfd, true);
+    return true;
+}
+
+
+/*
+**  Rewrite the file with the waiting cancels only, or remove it if there are
+**  none.  It is left closed.
+*/
+static void
+CANCELsave(void)
+{
+    struct buffer *b;
+    char *tmp;
+    size_t i;
+    int fd;
+
+    if (CANCELfd >= 0) {
+        close(CANCELfd);
+        CANCELfd = -1;
+    }
+    CANCELlines = 0;
+    if (cancels.count == 0) {
+        if (unlink(CANCELpath) < 0 && errno != ENOENT)
+            syslog(L_ERROR, "%s cant unlink %s %m", LogName, CANCELpath);
+        return;
+    }
+    b = buffer_new();
+    for (i = 0; i < cancels.count; i++)
+        CANCELformat(b, &cancels.entries[(cancels.first + i) % cancels.size]);
+    tmp = concat(CANCELpath, ".tmp", (char *) 0);
+    fd = open(tmp, O_WRONLY | O_TRUNC | O_CREAT, 0664);
+    if (fd < 0)
+        syslog(L_ERROR, "%s cant open %s %m", LogName, tmp);
+    else if (xwrite(fd, b->data, b->left) < 0) {
+        syslog(L_ERROR, "%s cant write %s %m", LogName, tmp);
+        close(fd);
+    } else if (close(fd) < 0)
+        syslog(L_ERROR, "%s cant close %s %m", LogName, tmp);
+    else if (rename(tmp, CANCELpath) < 0)
+        syslog(L_ERROR, "%s cant rename %s %m", LogName, tmp);
+    else
+        CANCELlines = cancels.count;
+    free(tmp);
+    buffer_free(b);
+}
+
+
+/*
+**  Read back the cancels left by the previous innd.
+*/
+void
+CANCELsetup(void)
+{
+    char *data, *line, *next, *fields[3];
+    int i;
+
+    if (CANCELpath == NULL)
+        CANCELpath = concatpath(innconf->pathdb, INN_PATH_CANCELQUEUE);
+    if ((data = ReadInFile(CANCELpath, NULL)) == NULL) {
+        if (errno != ENOENT)
+            syslog(L_ERROR, "%s cant read %s %m", LogName, CANCELpath);
+        return;
+    }
+    for (line = data; *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        if (*line == '\0')
+            continue;
+        for (i = 0; i < 3; i++) {
+            fields[i] = line;
+            if ((line = strchr(line, ' ')) == NULL)
+                break;
+            *line++ = '\0';
+        }
+        if (i < 2 || !IsValidMessageID(fields[0], true, laxmid)) {
+            syslog(L_ERROR, "%s bad_cancel_queue %s", LogName,
+                   MaxLength(fields[0], fields[0]));
+            continue;
+        }
+        CANCELpush(fields[0], strcmp(fields[1], "-") == 0 ? NULL : fields[1],
+                   strcmp(fields[2], "-") == 0 ? NULL : fields[2], line);
+    }
+    free(data);
+
+    /* Drop the lines that could not be parsed. */
+    CANCELsave();
+    if (cancels.count > 0)
+        syslog(L_NOTICE, "%s cancel_queue %lu pending", LogName,
+               (unsigned long) cancels.count);
+}
+
+
+/*
+**  Queue a cancel of an article we have.  Returns false if it should be
+**  executed right away instead.
+*/
+bool
+CANCELadd(const char *Feedsite, const char *CancelID, const char *MessageID,
+          const char *CancelKey)
+{
+    struct buffer *b;
+
+    if (innconf->cancelrate == 0 || cancels.count >= CANCEL_MAXQUEUE)
+        return false;
+    if (CANCELpath == NULL)
+        CANCELpath = concatpath(innconf->pathdb, INN_PATH_CANCELQUEUE);
+    CANCELpush(MessageID, Feedsite, CancelID, CancelKey);
+    if (CANCELopen()) {
+        b = buffer_new();
+        CANCELformat(b, &cancels.entries[(cancels.first + cancels.count - 1)
+                                         % cancels.size]);
+        if (xwrite(CANCELfd, b->data, b->left) < 0)
+            syslog(L_ERROR, "%s cant write %s %m", LogName, CANCELpath);
+        else
+            CANCELlines++;
+        buffer_free(b);
+    }
+    return true;
+}
+
+
+/*
+**  The number of cancels waiting in the queue.
+*/
+unsigned long
+CANCELpending(void)
+{
+    return cancels.count;
+}
+
+
+/*
+**  Execute as many queued cancels as the rate allows.  Called from the main
+**  loop; history must be open.  The whole queue is run if cancelrate has been
+**  unset since the cancels were queued.
+*/
+void
+CANCELrun(void)
+{
+    struct cancel c;
+
+    if (cancels.count == 0)
+        return;
+    if (cancels.second != Now.tv_sec) {
+        cancels.second = Now.tv_sec;
+        cancels.budget = innconf->cancelrate;
+    }
+    while (cancels.count > 0
+           && (innconf->cancelrate == 0 || cancels.budget > 0)) {
+        c = CANCELshift();
+        ARTcancelnow(c.Feedsite, c.CancelID, c.MessageID, c.CancelKey, false);
+        CANCELfree(&c);
+        if (cancels.budget > 0)
+            cancels.budget--;
+    }
+
+    /* Keep the file from growing without bound. */
+    if (cancels.count == 0 && CANCELfd >= 0) {
+        if (ftruncate(CANCELfd, 0) < 0)
+            syslog(L_ERROR, "%s cant truncate %s %m", LogName, CANCELpath);
+        else
+            CANCELlines = 0;
+    } else if ((cancels.count == 0 && CANCELlines > 0)
+               || CANCELlines > 2 * cancels.count + CANCEL_SLACK)
+        CANCELsave();
+}
+
+
+/*
+**  Save the queue for the next innd and free it.
+*/
+void
+CANCELclose(void)
+{
+    struct cancel c;
+
+    if (CANCELpath != NULL)
+        CANCELsave();
+    while (cancels.count > 0) {
+        c = CANCELshift();
+        CANCELfree(&c);
+    }
+    free(cancels.entries);
+    memset(&cancels, 0, sizeof(cancels));
+}
@@ -45,6 +45,7 @@ static const char *CCflushlogs(char *unused[]);
 static const char *CCgo(char *av[]);
 static const char *CChangup(char *av[]);
 static const char *CCreserve(char *av[]);
+static const char *CCresizehist(char *av[]);
 static const char *CClogmode(char *unused[]);
 static const char *CCmode(char *unused[]);
 static const char *CCname(char *av[]);
@@ -111,6 +112,7 @@ static CCDISPATCH CCcommands[] = {
     {SC_RENUMBER,    1, CCrenumber },
     {SC_RELOAD,      2, CCreload   },
     {SC_RESERVE,     1, CCreserve  },
+    {SC_RESIZEHIST,  1, CCresizehist},
     {SC_RMGROUP,     1, CCrmgroup  },
     {SC_SEND,        2, CCsend     },
     {SC_SHUTDOWN,    1, CCshutdown },
@@ -281,6 +283,10 @@ CCaddhist(char *av[])
     if ((p = CCgetid(av[0], &msgid)) != NULL)
         return p;
 
+    /* A filter worker only has a copy of the history database. */
+    if (FilterWorker)
+        return "1 Not available in filter workers";
+
     /* If paused, don't try to use the history database since expire may be
        running */
     if (Mode == OMpaused)
@@ -293,7 +299,7 @@ CCaddhist(char *av[])
         InndHisOpen();
     }
 
-    if (HIScheck(History, msgid)) {
+    if (InndHisHave(msgid)) {
         if (Mode != OMrunning)
             InndHisClose();
         return "1 Duplicate";
@@ -486,6 +492,8 @@ CCcancel(char *av[])
     Data.Feedsite = "?";
     if ((p = CCgetid(av[0], &msgid)) != NULL)
         return p;
+    if (FilterWorker)
+        return "1 Not available in filter workers";
 
     Data.HdrContent[HDR__MESSAGE_ID].Value = (char *) msgid;
     Data.HdrContent[HDR__MESSAGE_ID].Length = strlen(msgid);
@@ -637,6 +645,7 @@ CCperl(char *av[] UNUSED)
         PerlFilter(false);
         break;
     }
+    VERDICTclear();
     return NULL;
 #else
     return "1 Perl filtering support not compiled in";
@@ -648,7 +657,12 @@ static const char *
 CCpython(char *av[] UNUSED)
 {
 #ifdef DO_PYTHON
-    return PYcontrol(av);
+    const char *p;
+
+    p = PYcontrol(av);
+    if (p == NULL)
+        VERDICTclear();
+    return p;
 #else
     return "1 Python filtering support not compiled in";
 #endif
@@ -757,8 +771,6 @@ CCgo(char *av[])
     InndHisOpen();
     syslog(L_NOTICE, "%s running", LogName);
     CCsdnotify();
-    if (ICDneedsetup)
-        ICDsetup(true);
     SCHANwakeup(&Mode);
     return NULL;
 }
@@ -819,8 +831,6 @@ CClowmark(char *av[])
 
     if (Mode != OMrunning)
         return CCnotrunning;
-    if (ICDneedsetup)
-        return "1 Must first reload newsfeeds";
     if ((qp = QIOopen(av[0])) == NULL) {
         syslog(L_ERROR, "%s cant open %s %m", LogName, av[0]);
         return "1 Cannot read input file";
@@ -877,6 +887,9 @@ static const char *
 CCmode(char *unused[] UNUSED)
 {
     int count, i;
+    struct inndhisstats his;
+    unsigned long lookups;
+    bool resizing;
 
 #ifdef DO_PERL
     char *stats;
@@ -934,6 +947,28 @@ CCmode(char *unused[] UNUSED)
     else
         buffer_append_sprintf(&CCreply, "disabled %s", NNRPReason);
 
+    /* Cancels waiting to be executed. */
+    if (innconf->cancelrate != 0 || CANCELpending() != 0)
+        buffer_append_sprintf(&CCreply, "\nCancels queued %lu, %lu a second",
+                              CANCELpending(), innconf->cancelrate);
+
+    /* How well the history cache did since the server started. */
+    if (innconf->hiscachesize != 0) {
+        InndHisTotals(&his);
+        lookups = his.hitpos + his.hitneg + his.misses + his.dne;
+        buffer_append_sprintf(&CCreply,
+                              "\nHistory cache %lu hits in %lu lookups"
+                              " (%.1f%%), %lu evicted",
+                              his.hitpos + his.hitneg, lookups,
+                              lookups == 0 ? 0.0
+                                           : 100.0 * (his.hitpos + his.hitneg)
+                                                 / lookups,
+                              his.evictions);
+    }
+    if (History != NULL && HISctl(History, HISCTLG_RESIZING, &resizing)
+        && resizing)
+        buffer_append_sprintf(&CCreply, "\nHistory index being rebuilt");
+
 #ifdef DO_PERL
     buffer_append_sprintf(&CCreply, "\nPerl filtering ");
     if (PerlFilterActive)
@@ -1040,6 +1075,15 @@ CCnameWriteInfo(struct buffer *buffer, CHANNEL *cp)
     case CTcontrol:
         buffer_append_sprintf(buffer, ":control::");
         break;
+    case CTstore:
+        buffer_append_sprintf(buffer, ":store::");
+        break;
+    case CTfilter:
+        buffer_append_sprintf(buffer, ":filter::");
+        break;
+    case CTmetrics:
+        buffer_append_sprintf(buffer, ":metrics::");
+        break;
     case CTfile:
         buffer_append_sprintf(buffer, "::");
         break;
@@ -1484,6 +1528,8 @@ CCreload(char *av[])
         if (PYreadfilter())
             syslog(L_NOTICE, "reloaded pyfilter OK");
 #endif
+        VERDICTclear();
+        FILTERrestart();
         p = "all";
     } else if (strcmp(p, "active") == 0 || strcmp(p, "newsfeeds") == 0) {
         /* Check the syntax of the newsfeeds file before reloading. */
@@ -1551,12 +1597,16 @@ CCreload(char *av[])
             return BADPERLRELOAD;
         }
         free(path);
+        VERDICTclear();
+        FILTERrestart();
     }
 #endif
 #ifdef DO_PYTHON
     else if (strcmp(p, "filter.python") == 0) {
         if (!PYreadfilter())
             return BADPYRELOAD;
+        VERDICTclear();
+        FILTERrestart();
     }
 #endif
     else
@@ -1579,8 +1629,6 @@ CCrenumber(char *av[])
 
     if (Mode != OMrunning)
         return CCnotrunning;
-    if (ICDneedsetup)
-        return "1 Must first reload newsfeeds";
     p = av[0];
     if (*p) {
         if ((ngp = NGfind(p)) == NULL)
@@ -1625,6 +1673,35 @@ CCreserve(char *av[])
 }
 
 
+/*
+**  Rebuild the history index in the background, for that many entries or
+**  twice as many as it holds if 0.
+*/
+static const char *
+CCresizehist(char *av[])
+{
+    size_t npairs;
+    const char *error;
+    char *p;
+
+    for (p = av[0]; *p; p++) {
+        if (!isdigit((unsigned char) *p))
+            return "1 parameter should be a number";
+    }
+    if (Mode != OMrunning)
+        return CCnotrunning;
+    npairs = strtoul(av[0], NULL, 10);
+    if (!HISctl(History, HISCTLS_RESIZE, &npairs)) {
+        error = HISerror(History);
+        buffer_sprintf(&CCreply, "1 %s",
+                       error != NULL ? error
+                                     : "Not supported by the history method");
+        return CCreply.data;
+    }
+    return NULL;
+}
+
+
 /*
 **  Remove a newsgroup.
 */
@@ -2035,6 +2112,10 @@ CCreader(CHANNEL *cp)
     p = argv[1];
     i = *p;
 
+    /* Commands may change the newsgroups or the sites, which articles being
+     * stored still refer to. */
+    STOREsync();
+
     /* Dispatch to the command function. */
     for (argc -= 2, dp = CCcommands; dp < ARRAY_END(CCcommands); dp++)
         if (i == dp->Name) {
@@ -2162,7 +2243,7 @@ CCsetup(void)
     }
 #endif /* defined(HAVE_UNIX_DOMAIN_SOCKETS) */
 
-    if (!isvalidfd(i)) {
+    if (!CHANvalidfd(i)) {
         syslog(L_FATAL,
                "%s cant CHANcreate %s: file descriptor %d too high (see "
                "rlimitnofile in inn.conf)",
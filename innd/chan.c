@@ -7,10 +7,10 @@
 **  are all channel operations.
 **
 **  Channels can be in one of three states: reading, writing, or sleeping.
-**  The first two are represented in the select file descriptor sets.  The
-**  last sits there until something else wakes the channel up.  CHANreadloop
-**  is the main I/O loop for innd, calling select and then dispatching control
-**  to whatever channels have work to do.
+**  The first two are handed to a readiness backend (epoll where available,
+**  select otherwise).  The last sits there until something else wakes the
+**  channel up.  CHANreadloop is the main I/O loop for innd, waiting on the
+**  backend and then dispatching control to whatever channels have work to do.
 */
 
 #include "portable/system.h"
@@ -19,6 +19,11 @@
 #ifdef HAVE_SYS_SELECT_H
 #    include <sys/select.h>
 #endif
+#if HAVE_SYS_EPOLL_H && HAVE_EPOLL_CREATE1
+#    include <sys/epoll.h>
+#    define HAVE_EPOLL 1
+#endif
+#include <limits.h>
 
 #include "inn/fdflag.h"
 #include "inn/innconf.h"
@@ -36,25 +41,68 @@
 #    define ENOTTY 0
 #endif
 
-static const char *const timer_name[] = {
+const char *const TimerNames[] = {
     "idle", "artclean", "artwrite", "artcncl",  "sitesend", "overv",
-    "perl", "python",   "nntpread", "artparse", "artlog",   "datamove"};
+    "perl", "python",   "nntpread", "artparse", "artlog",   "datamove",
+    "hisseen"};
+
+/* Bits kept for each descriptor in channels.mask.  The first three say what
+   the channel is waiting for; CHAN_NOPOLL is set by a backend that cannot
+   watch the descriptor (epoll refuses regular files) so that it is always
+   reported ready, as select would do.  CHAN_READABLE and CHAN_WRITABLE
+   record what the last wait returned, until the channel is dispatched. */
+#define CHAN_READ     0x01
+#define CHAN_WRITE    0x02
+#define CHAN_SLEEP    0x04
+#define CHAN_NOPOLL   0x08
+#define CHAN_READABLE 0x10
+#define CHAN_WRITABLE 0x20
+#define CHAN_WATCHED  (CHAN_READ | CHAN_WRITE)
+
+/* A readiness backend.  update is called whenever the CHAN_READ or
+   CHAN_WRITE bits of a descriptor change and returns the mask to store;
+   wait blocks for at most tv, marks the ready descriptors in channels.mask,
+   lists them in channels.ready, and returns how many there are (or -1 on
+   error with errno set). */
+struct chan_backend {
+    const char *name;
+    bool (*setup)(void);
+    void (*shutdown)(void);
+    unsigned int (*update)(int fd, unsigned int oldmask, unsigned int mask);
+    int (*wait)(struct timeval *tv);
+};
 
 /* Global data about the channels. */
 struct channels {
-    fd_set read_set;
-    fd_set sleep_set;
-    fd_set write_set;
-    int sleep_count;  /* Number of sleeping channels. */
-    int max_fd;       /* Max fd in read_set or write_set. */
-    int max_sleep_fd; /* Max fd in sleep_set. */
-    int table_size;   /* Total number of channels. */
-    CHANNEL *table;   /* Table of channel structs. */
+    unsigned char *mask; /* CHAN_* bits, indexed by descriptor. */
+    int *ready;          /* Descriptors returned by the last wait. */
+    time_t *deadline;    /* When to look at a channel, by descriptor. */
+    int *heap_index;     /* Position in heap, or -1, by descriptor. */
+    int *heap;           /* Min-heap of descriptors ordered by deadline. */
+    int heap_count;      /* Number of descriptors in heap. */
+    int sleep_count;     /* Number of sleeping channels. */
+    int max_fd;          /* Max fd being read or written. */
+    int max_sleep_fd;    /* Max fd sleeping. */
+    int table_size;      /* Total number of channels. */
+    CHANNEL *table;      /* Table of channel structs. */
+    const struct chan_backend *backend;
 
     /* Special prioritized channels, for the control and remconn channels.  We
        check these first each time. */
     CHANNEL **prioritized;
     int prioritized_size;
+
+    /* State private to the select backend. */
+    fd_set read_set;
+    fd_set write_set;
+
+#ifdef HAVE_EPOLL
+    /* State private to the epoll backend. */
+    int epoll_fd;
+    struct epoll_event *epoll_events;
+    int *nopoll; /* Descriptors epoll refused to watch. */
+    int nopoll_count;
+#endif
 };
 
 /* Eventually this will move into some sort of global INN state structure. */
@@ -92,6 +140,364 @@ CHANsystemdsa(CHANNEL *cp)
 }
 
 
+/*
+**  The select backend.  It keeps its own read and write descriptor sets and
+**  scans them up to channels.max_fd after every call to select, so it is
+**  limited to FD_SETSIZE descriptors.
+*/
+static bool
+CHANselect_setup(void)
+{
+    FD_ZERO(&channels.read_set);
+    FD_ZERO(&channels.write_set);
+    return true;
+}
+
+static void
+CHANselect_shutdown(void)
+{
+    FD_ZERO(&channels.read_set);
+    FD_ZERO(&channels.write_set);
+}
+
+static unsigned int
+CHANselect_update(int fd, unsigned int oldmask UNUSED, unsigned int mask)
+{
+    if (mask & CHAN_READ)
+        FD_SET(fd, &channels.read_set);
+    else
+        FD_CLR(fd, &channels.read_set);
+    if (mask & CHAN_WRITE)
+        FD_SET(fd, &channels.write_set);
+    else
+        FD_CLR(fd, &channels.write_set);
+    return mask;
+}
+
+static int
+CHANselect_wait(struct timeval *tv)
+{
+    fd_set rdfds, wrfds;
+    int count, fd, found;
+
+    rdfds = channels.read_set;
+    wrfds = channels.write_set;
+    count = select(channels.max_fd + 1, &rdfds, &wrfds, NULL, tv);
+    if (count <= 0)
+        return count;
+    for (found = 0, fd = 0; fd <= channels.max_fd; fd++) {
+        if (FD_ISSET(fd, &rdfds))
+            channels.mask[fd] |= CHAN_READABLE;
+        if (FD_ISSET(fd, &wrfds))
+            channels.mask[fd] |= CHAN_WRITABLE;
+        if (channels.mask[fd] & (CHAN_READABLE | CHAN_WRITABLE))
+            channels.ready[found++] = fd;
+    }
+    return found;
+}
+
+static const struct chan_backend CHANselect = {
+    "select", CHANselect_setup, CHANselect_shutdown, CHANselect_update,
+    CHANselect_wait};
+
+
+#ifdef HAVE_EPOLL
+/*
+**  The epoll backend.  Only descriptors with pending events are returned, so
+**  the cost of a wakeup does not depend on the number of channels, and there
+**  is no limit on descriptor numbers besides the channel table size.  epoll
+**  refuses regular files, which are always ready anyway; those are kept
+**  aside in channels.nopoll and reported ready on every wait.
+*/
+static bool
+CHANepoll_setup(void)
+{
+    channels.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (channels.epoll_fd < 0) {
+        syswarn("%s cant epoll_create1, falling back to select", LogName);
+        return false;
+    }
+    channels.epoll_events =
+        xmalloc(channels.table_size * sizeof(struct epoll_event));
+    channels.nopoll = xmalloc(channels.table_size * sizeof(int));
+    channels.nopoll_count = 0;
+    return true;
+}
+
+static void
+CHANepoll_shutdown(void)
+{
+    if (channels.epoll_fd >= 0)
+        close(channels.epoll_fd);
+    channels.epoll_fd = -1;
+    free(channels.epoll_events);
+    channels.epoll_events = NULL;
+    free(channels.nopoll);
+    channels.nopoll = NULL;
+    channels.nopoll_count = 0;
+}
+
+static unsigned int
+CHANepoll_update(int fd, unsigned int oldmask, unsigned int mask)
+{
+    struct epoll_event ev;
+    int i, op;
+
+    /* Descriptors that epoll refused only need to leave the nopoll list once
+       nobody waits on them any more. */
+    if (oldmask & CHAN_NOPOLL) {
+        if (mask & CHAN_WATCHED)
+            return mask | CHAN_NOPOLL;
+        for (i = 0; i < channels.nopoll_count; i++)
+            if (channels.nopoll[i] == fd) {
+                channels.nopoll[i] = channels.nopoll[--channels.nopoll_count];
+                break;
+            }
+        return mask & ~CHAN_NOPOLL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (mask & CHAN_READ)
+        ev.events |= EPOLLIN;
+    if (mask & CHAN_WRITE)
+        ev.events |= EPOLLOUT;
+    if ((mask & CHAN_WATCHED) == 0)
+        op = EPOLL_CTL_DEL;
+    else if ((oldmask & CHAN_WATCHED) == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+    if (epoll_ctl(channels.epoll_fd, op, fd, &ev) == 0)
+        return mask;
+
+    /* The descriptor may have been closed and reused behind our back, in
+       which case the kernel already forgot about it (or still knows it). */
+    if (op == EPOLL_CTL_DEL)
+        return mask;
+    if (op == EPOLL_CTL_MOD && errno == ENOENT)
+        op = EPOLL_CTL_ADD;
+    else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+        op = EPOLL_CTL_MOD;
+    else
+        op = -1;
+    if (op != -1 && epoll_ctl(channels.epoll_fd, op, fd, &ev) == 0)
+        return mask;
+    if (errno == EPERM) {
+        channels.nopoll[channels.nopoll_count++] = fd;
+        return mask | CHAN_NOPOLL;
+    }
+    syswarn("%s cant epoll_ctl %d", LogName, fd);
+    return mask;
+}
+
+static int
+CHANepoll_wait(struct timeval *tv)
+{
+    int count, found, fd, i, timeout;
+    unsigned int events;
+
+    if (channels.nopoll_count > 0)
+        timeout = 0;
+    else
+        timeout = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+    count = epoll_wait(channels.epoll_fd, channels.epoll_events,
+                       channels.table_size, timeout);
+    if (count < 0)
+        return count;
+    for (found = 0, i = 0; i < count; i++) {
+        fd = channels.epoll_events[i].data.fd;
+        events = channels.epoll_events[i].events;
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            channels.mask[fd] |= CHAN_READABLE;
+        if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            channels.mask[fd] |= CHAN_WRITABLE;
+        channels.ready[found++] = fd;
+    }
+    for (i = 0; i < channels.nopoll_count; i++) {
+        fd = channels.nopoll[i];
+        if (channels.mask[fd] & CHAN_READ)
+            channels.mask[fd] |= CHAN_READABLE;
+        if (channels.mask[fd] & CHAN_WRITE)
+            channels.mask[fd] |= CHAN_WRITABLE;
+        channels.ready[found++] = fd;
+    }
+    return found;
+}
+
+static const struct chan_backend CHANepoll = {
+    "epoll", CHANepoll_setup, CHANepoll_shutdown, CHANepoll_update,
+    CHANepoll_wait};
+#endif /* HAVE_EPOLL */
+
+
+/*
+**  Change the CHAN_* bits of a descriptor, telling the backend if what the
+**  channel waits for changed.
+*/
+static void
+CHANsetmask(int fd, unsigned int mask)
+{
+    unsigned int oldmask;
+
+    if (fd < 0 || fd >= channels.table_size)
+        return;
+    oldmask = channels.mask[fd];
+    if (((oldmask ^ mask) & CHAN_WATCHED) != 0)
+        mask = channels.backend->update(fd, oldmask, mask);
+    channels.mask[fd] = mask;
+}
+
+
+/*
+**  The deadline heap.  Every channel that will need attention at some point
+**  in time regardless of I/O (a sleeping channel, or an NNTP or reject
+**  channel that may time out) is kept in a binary min-heap ordered by that
+**  time, so that the main loop only looks at channels whose deadline has
+**  passed and can compute how long it may wait from the first one.
+**
+**  Deadlines that move later (LastActive and NextLog only ever increase) are
+**  not tracked eagerly; the channel is simply looked at when its old
+**  deadline comes and rescheduled.  Deadlines that move earlier (SCHANadd
+**  and SCHANwakeup) reschedule the channel right away.
+*/
+static void
+CHANheap_swap(int i, int j)
+{
+    int fd;
+
+    fd = channels.heap[i];
+    channels.heap[i] = channels.heap[j];
+    channels.heap[j] = fd;
+    channels.heap_index[channels.heap[i]] = i;
+    channels.heap_index[channels.heap[j]] = j;
+}
+
+static void
+CHANheap_fix(int i)
+{
+    int child, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (channels.deadline[channels.heap[parent]]
+            <= channels.deadline[channels.heap[i]])
+            break;
+        CHANheap_swap(i, parent);
+        i = parent;
+    }
+    while ((child = 2 * i + 1) < channels.heap_count) {
+        if (child + 1 < channels.heap_count
+            && channels.deadline[channels.heap[child + 1]]
+                   < channels.deadline[channels.heap[child]])
+            child++;
+        if (channels.deadline[channels.heap[i]]
+            <= channels.deadline[channels.heap[child]])
+            break;
+        CHANheap_swap(i, child);
+        i = child;
+    }
+}
+
+static void
+CHANunschedule(int fd)
+{
+    int i;
+
+    if (fd < 0 || fd >= channels.table_size)
+        return;
+    i = channels.heap_index[fd];
+    if (i < 0)
+        return;
+    channels.heap_index[fd] = -1;
+    if (--channels.heap_count == i)
+        return;
+    channels.heap[i] = channels.heap[channels.heap_count];
+    channels.heap_index[channels.heap[i]] = i;
+    CHANheap_fix(i);
+}
+
+
+/*
+**  Compute when a channel next needs to be looked at and put it at the
+**  right place in the deadline heap (or take it out if it has no deadline).
+**  The timeouts fire once LastActive plus the delay is strictly in the past,
+**  hence the extra second.
+*/
+static void
+CHANschedule(CHANNEL *cp)
+{
+    time_t when = 0;
+    bool scheduled = false;
+    int fd = cp->fd;
+
+    if (!CHANvalidfd(fd))
+        return;
+    if (channels.mask[fd] & CHAN_SLEEP) {
+        when = cp->Waketime;
+        scheduled = true;
+    }
+    if (cp->Type == CTreject
+        && (!scheduled || cp->LastActive + REJECT_TIMEOUT + 1 < when)) {
+        when = cp->LastActive + REJECT_TIMEOUT + 1;
+        scheduled = true;
+    }
+    if (cp->Type == CTmetrics && cp->State != CSwaiting
+        && (!scheduled || cp->LastActive + METRICS_TIMEOUT + 1 < when)) {
+        when = cp->LastActive + METRICS_TIMEOUT + 1;
+        scheduled = true;
+    }
+    if (cp->Type == CTnntp
+        && (!scheduled || cp->LastActive + cp->NextLog + 1 < when)) {
+        when = cp->LastActive + cp->NextLog + 1;
+        scheduled = true;
+    }
+    if (cp->Type == CTnntp && cp->Held
+        && (!scheduled || cp->Started + cp->HoldTime + 1 < when)) {
+        when = cp->Started + cp->HoldTime + 1;
+        scheduled = true;
+    }
+    if (!scheduled) {
+        CHANunschedule(fd);
+        return;
+    }
+    channels.deadline[fd] = when;
+    if (channels.heap_index[fd] < 0) {
+        channels.heap_index[fd] = channels.heap_count;
+        channels.heap[channels.heap_count++] = fd;
+    }
+    CHANheap_fix(channels.heap_index[fd]);
+}
+
+
+/*
+**  Return the largest number of channels the readiness backend can handle,
+**  used by innd to size the channel table.
+*/
+int
+CHANlimit(void)
+{
+#ifdef HAVE_EPOLL
+    return INT_MAX;
+#elif defined(FD_SETSIZE)
+    return FD_SETSIZE;
+#else
+    return sizeof(fd_set) * CHAR_BIT;
+#endif
+}
+
+
+/*
+**  Return true if a channel can be created for the given file descriptor,
+**  which must fit in the channel table.
+*/
+bool
+CHANvalidfd(int fd)
+{
+    return fd >= 0 && fd < channels.table_size;
+}
+
+
 /*
 **  Tear down our world.  Free all of the allocated channels and clear all
 **  global state data.  This function can also be used to initialize the
@@ -103,13 +509,6 @@ CHANshutdown(void)
     CHANNEL *cp;
     int i;
 
-    FD_ZERO(&channels.read_set);
-    FD_ZERO(&channels.sleep_set);
-    FD_ZERO(&channels.write_set);
-    channels.sleep_count = 0;
-    channels.max_fd = -1;
-    channels.max_sleep_fd = -1;
-
     if (channels.table != NULL) {
         cp = channels.table;
         for (i = channels.table_size; --i >= 0; cp++) {
@@ -130,6 +529,23 @@ CHANshutdown(void)
         free(channels.prioritized);
         channels.prioritized_size = 0;
     }
+    if (channels.backend != NULL)
+        channels.backend->shutdown();
+    channels.backend = NULL;
+    free(channels.mask);
+    channels.mask = NULL;
+    free(channels.ready);
+    channels.ready = NULL;
+    free(channels.deadline);
+    channels.deadline = NULL;
+    free(channels.heap_index);
+    channels.heap_index = NULL;
+    free(channels.heap);
+    channels.heap = NULL;
+    channels.heap_count = 0;
+    channels.sleep_count = 0;
+    channels.max_fd = -1;
+    channels.max_sleep_fd = -1;
 }
 
 
@@ -137,7 +553,8 @@ CHANshutdown(void)
 **  Initialize the global I/O channel state and prepare for creation of new
 **  channels.  Takes the number of channels to pre-create, which currently
 **  must be as large as the largest file descriptor that will be used for a
-**  channel.
+**  channel.  If epoll is not usable, this is capped to what select can
+**  handle.
 */
 void
 CHANsetup(int count)
@@ -147,6 +564,26 @@ CHANsetup(int count)
 
     CHANshutdown();
     channels.table_size = count;
+    channels.backend = &CHANselect;
+#ifdef HAVE_EPOLL
+    if (CHANepoll.setup())
+        channels.backend = &CHANepoll;
+#endif
+    if (channels.backend == &CHANselect) {
+#if defined(FD_SETSIZE)
+        if (count > FD_SETSIZE)
+            count = FD_SETSIZE;
+#endif
+        channels.table_size = count;
+        CHANselect.setup();
+    }
+    channels.mask = xcalloc(count, sizeof(unsigned char));
+    channels.ready = xmalloc(count * sizeof(int));
+    channels.deadline = xcalloc(count, sizeof(time_t));
+    channels.heap = xmalloc(count * sizeof(int));
+    channels.heap_index = xmalloc(count * sizeof(int));
+    for (i = 0; i < count; i++)
+        channels.heap_index[i] = -1;
     channels.table = xmalloc(count * sizeof(CHANNEL));
 
     /* Finish initializing CHANnull, since we can't do this entirely with a
@@ -189,7 +626,7 @@ CHANcreate(int fd, enum channel_type type, enum channel_state state,
        normally already handled that case before and not called CHANcreate().
        Note that the channel table, created in CHANsetup(), is known to have
        enough room. */
-    if (!isvalidfd(fd)) {
+    if (!CHANvalidfd(fd)) {
         /* Go on without returning NULL, in case a caller is not prepared to
            receive such a response. */
         syswarn("%s file descriptor %d too high in CHANcreate (see "
@@ -206,6 +643,9 @@ CHANcreate(int fd, enum channel_type type, enum channel_state state,
        FIXME: Design a better data structure that can be resized easily. */
     cp = &channels.table[fd];
 
+    /* Forget any readiness reported for a previous user of the descriptor. */
+    channels.mask[fd] &= ~(CHAN_READABLE | CHAN_WRITABLE);
+
     /* Don't lose the existing buffers when overwriting with CHANnull. */
     in = cp->In;
     buffer_resize(&in, START_BUFF_SIZE);
@@ -232,6 +672,7 @@ CHANcreate(int fd, enum channel_type type, enum channel_state state,
     cp->Tracing = Tracing;
     HashClear(&cp->CurrentMessageIDHash);
     ARTprepare(cp);
+    CHANschedule(cp);
 
     fdflag_close_exec(fd, true);
 
@@ -285,14 +726,14 @@ CHANtracing(CHANNEL *cp, bool flag)
                                 (struct sockaddr *) &cp->Address);
         notice("%s trace address %s lastactive %lu nextlog %lu", name, addr,
                (unsigned long) cp->LastActive, (unsigned long) cp->NextLog);
-        if (FD_ISSET(cp->fd, &channels.sleep_set))
+        if (CHANsleeping(cp))
             notice("%s trace sleeping %lu %p", name,
                    (unsigned long) cp->Waketime, (void *) cp->Waker);
-        if (FD_ISSET(cp->fd, &channels.read_set))
+        if (channels.mask[cp->fd] & CHAN_READ)
             notice("%s trace reading %lu %s", name,
                    (unsigned long) cp->In.used,
                    MaxLength(cp->In.data, cp->In.data));
-        if (FD_ISSET(cp->fd, &channels.write_set))
+        if (channels.mask[cp->fd] & CHAN_WRITE)
             notice("%s trace writing %lu %s", name,
                    (unsigned long) cp->Out.left,
                    MaxLength(cp->Out.data, cp->Out.data));
@@ -311,6 +752,12 @@ CHANtracing(CHANNEL *cp, bool flag)
 static void
 CHANclose_nntp(CHANNEL *cp, const char *name)
 {
+    /* The storage thread may still be reading our input buffer, and the
+       filter workers may still have a verdict for it. */
+    if (cp->State == CSstoring) {
+        STOREsync();
+        FILTERforget(cp);
+    }
     WIPprecomfree(cp);
     NCclearwip(cp);
     if (cp->State == CScancel)
@@ -335,6 +782,7 @@ CHANclose_nntp(CHANNEL *cp, const char *name)
                name, (unsigned long) (Now.tv_sec - cp->Started), cp->Received,
                cp->Refused, cp->Rejected, cp->Duplicate, (double) cp->Size,
                (double) cp->DuplicateSize, (double) cp->RejectSize);
+        STATUSclosed(cp);
     }
     if (cp->Data.Newsgroups.Data != NULL) {
         free(cp->Data.Newsgroups.Data);
@@ -424,11 +872,12 @@ CHANclose(CHANNEL *cp, const char *name)
             notice("%s %lu", name, cp->Rejected);
         } else if (cp->Out.left)
             warn("%s closed lost %lu", name, (unsigned long) cp->Out.left);
-        else
+        else if (cp->Type != CTmetrics)
             notice("%s closed", name);
         WCHANremove(cp);
         RCHANremove(cp);
         SCHANremove(cp);
+        CHANunschedule(cp->fd);
         if (cp->fd >= 0 && close(cp->fd) < 0)
             syswarn("%s cant close %s", LogName, name);
         for (i = 0; i < channels.prioritized_size; i++)
@@ -523,6 +972,15 @@ CHANname(CHANNEL *cp)
     case CTcontrol:
         snprintf(cp->Name, sizeof(cp->Name), "control:%d", cp->fd);
         break;
+    case CTstore:
+        snprintf(cp->Name, sizeof(cp->Name), "store:%d", cp->fd);
+        break;
+    case CTfilter:
+        snprintf(cp->Name, sizeof(cp->Name), "filter:%d", cp->fd);
+        break;
+    case CTmetrics:
+        snprintf(cp->Name, sizeof(cp->Name), "metrics:%d", cp->fd);
+        break;
     case CTexploder:
     case CTfile:
     case CTprocess:
@@ -596,8 +1054,7 @@ static void
 CHANresetlast(int fd)
 {
     if (fd == channels.max_fd)
-        while (!FD_ISSET(channels.max_fd, &channels.read_set)
-               && !FD_ISSET(channels.max_fd, &channels.write_set)
+        while (!(channels.mask[channels.max_fd] & CHAN_WATCHED)
                && channels.max_fd > 1)
             channels.max_fd--;
 }
@@ -611,7 +1068,7 @@ static void
 CHANresetlastsleeping(int fd)
 {
     if (fd == channels.max_sleep_fd) {
-        while (!FD_ISSET(channels.max_sleep_fd, &channels.sleep_set)
+        while (!(channels.mask[channels.max_sleep_fd] & CHAN_SLEEP)
                && channels.max_sleep_fd > 1)
             channels.max_sleep_fd--;
     }
@@ -624,7 +1081,9 @@ CHANresetlastsleeping(int fd)
 void
 RCHANadd(CHANNEL *cp)
 {
-    FD_SET(cp->fd, &channels.read_set);
+    if (!CHANvalidfd(cp->fd))
+        return;
+    CHANsetmask(cp->fd, channels.mask[cp->fd] | CHAN_READ);
     if (cp->fd > channels.max_fd)
         channels.max_fd = cp->fd;
 
@@ -640,8 +1099,8 @@ RCHANadd(CHANNEL *cp)
 void
 RCHANremove(CHANNEL *cp)
 {
-    if (FD_ISSET(cp->fd, &channels.read_set)) {
-        FD_CLR(cp->fd, &channels.read_set);
+    if (CHANvalidfd(cp->fd) && (channels.mask[cp->fd] & CHAN_READ)) {
+        CHANsetmask(cp->fd, channels.mask[cp->fd] & ~CHAN_READ);
         CHANresetlast(cp->fd);
     }
 }
@@ -655,9 +1114,11 @@ void
 SCHANadd(CHANNEL *cp, time_t wake, void *event, innd_callback_func waker,
          void *arg)
 {
+    if (!CHANvalidfd(cp->fd))
+        return;
     if (!CHANsleeping(cp)) {
         channels.sleep_count++;
-        FD_SET(cp->fd, &channels.sleep_set);
+        channels.mask[cp->fd] |= CHAN_SLEEP;
     }
     if (cp->fd > channels.max_sleep_fd)
         channels.max_sleep_fd = cp->fd;
@@ -668,6 +1129,7 @@ SCHANadd(CHANNEL *cp, time_t wake, void *event, innd_callback_func waker,
         cp->Argument = arg;
     }
     cp->Event = event;
+    CHANschedule(cp);
 }
 
 
@@ -679,9 +1141,10 @@ SCHANremove(CHANNEL *cp)
 {
     if (!CHANsleeping(cp))
         return;
-    FD_CLR(cp->fd, &channels.sleep_set);
+    channels.mask[cp->fd] &= ~CHAN_SLEEP;
     channels.sleep_count--;
     cp->Waketime = 0;
+    CHANschedule(cp);
 
     /* If this was the highest descriptor, get a new highest. */
     CHANresetlastsleeping(cp->fd);
@@ -694,7 +1157,7 @@ SCHANremove(CHANNEL *cp)
 bool
 CHANsleeping(CHANNEL *cp)
 {
-    return FD_ISSET(cp->fd, &channels.sleep_set);
+    return CHANvalidfd(cp->fd) && (channels.mask[cp->fd] & CHAN_SLEEP);
 }
 
 
@@ -710,8 +1173,10 @@ SCHANwakeup(void *event)
     int i;
 
     for (cp = channels.table, i = channels.table_size; --i >= 0; cp++)
-        if (cp->Type != CTfree && cp->Event == event && CHANsleeping(cp))
+        if (cp->Type != CTfree && cp->Event == event && CHANsleeping(cp)) {
             cp->Waketime = 0;
+            CHANschedule(cp);
+        }
 }
 
 
@@ -722,8 +1187,8 @@ SCHANwakeup(void *event)
 void
 WCHANadd(CHANNEL *cp)
 {
-    if (cp->Out.left > 0) {
-        FD_SET(cp->fd, &channels.write_set);
+    if (cp->Out.left > 0 && CHANvalidfd(cp->fd)) {
+        CHANsetmask(cp->fd, channels.mask[cp->fd] | CHAN_WRITE);
         if (cp->fd > channels.max_fd)
             channels.max_fd = cp->fd;
     }
@@ -736,8 +1201,8 @@ WCHANadd(CHANNEL *cp)
 void
 WCHANremove(CHANNEL *cp)
 {
-    if (FD_ISSET(cp->fd, &channels.write_set)) {
-        FD_CLR(cp->fd, &channels.write_set);
+    if (CHANvalidfd(cp->fd) && (channels.mask[cp->fd] & CHAN_WRITE)) {
+        CHANsetmask(cp->fd, channels.mask[cp->fd] & ~CHAN_WRITE);
         CHANresetlast(cp->fd);
 
         /* No data left -- reset used so we don't grow the buffer. */
@@ -880,6 +1345,8 @@ CHANreadtext(CHANNEL *cp)
     }
     bp->used += count;
     bp->left -= count;
+    if (bp->used > cp->InPeak)
+        cp->InPeak = bp->used;
     return count;
 }
 
@@ -976,6 +1443,7 @@ CHANwritesleep(CHANNEL *cp, const char *name)
             break;
         case CTreject:
         case CTnntp:
+        case CTmetrics:
         case CTfile:
         case CTexploder:
         case CTprocess:
@@ -1003,25 +1471,25 @@ CHANdiagnose(void)
 
     FD_ZERO(&test);
     for (fd = channels.max_fd; fd >= 0; fd--) {
-        if (FD_ISSET(fd, &channels.read_set)) {
+        if (channels.mask[fd] & CHAN_READ) {
             FD_SET(fd, &test);
             tv.tv_sec = 0;
             tv.tv_usec = 0;
             if (select(fd + 1, &test, NULL, NULL, &tv) < 0 && errno != EINTR) {
                 warn("%s bad read file %d", LogName, fd);
-                FD_CLR(fd, &channels.read_set);
+                CHANsetmask(fd, channels.mask[fd] & ~CHAN_READ);
                 /* Probably do something about the file descriptor here; call
                    CHANclose on it? */
             }
             FD_CLR(fd, &test);
         }
-        if (FD_ISSET(fd, &channels.write_set)) {
+        if (channels.mask[fd] & CHAN_WRITE) {
             FD_SET(fd, &test);
             tv.tv_sec = 0;
             tv.tv_usec = 0;
             if (select(fd + 1, NULL, &test, NULL, &tv) < 0 && errno != EINTR) {
                 warn("%s bad write file %d", LogName, fd);
-                FD_CLR(fd, &channels.write_set);
+                CHANsetmask(fd, channels.mask[fd] & ~CHAN_WRITE);
                 /* Probably do something about the file descriptor here; call
                    CHANclose on it? */
             }
@@ -1082,18 +1550,24 @@ CHANhandle_read(CHANNEL *cp)
     cp->LastActive = Now.tv_sec;
     (*cp->Reader)(cp);
 
-    /* Check and see if the buffer is grossly overallocated and shrink if
-       needed. */
-    if (cp->In.size <= BIG_BUFFER)
+    /* Check and see if the buffer is much larger than what the channel has
+       needed lately and shrink it if so.  InPeak is halved whenever the
+       buffer is drained, so that one large article does not keep a large
+       buffer around for good, while a feed of large articles keeps its
+       buffer instead of growing it again (and copying it each time) for
+       every article.  Never move the buffer while the storage thread is
+       writing the article from it. */
+    if (cp->In.size <= BIG_BUFFER || cp->State == CSstoring)
         return;
-    if (cp->In.used == 0)
-        CHANresize(cp, START_BUFF_SIZE);
-    else if ((cp->In.size / cp->In.used) > 10) {
-        size = cp->In.used * 2;
+    size = cp->InPeak > cp->In.used ? cp->InPeak : cp->In.used;
+    if (cp->In.size / 4 > size) {
+        size *= 2;
         if (size < START_BUFF_SIZE)
             size = START_BUFF_SIZE;
         CHANresize(cp, size);
     }
+    if (cp->In.used == 0)
+        cp->InPeak /= 2;
 }
 
 
@@ -1124,6 +1598,7 @@ CHANhandle_write(CHANNEL *cp)
     }
     cp->LastActive = Now.tv_sec;
     count = CHANwrite(cp->fd, &bp->data[bp->used], bp->left);
+    cp->Writes++;
     if (count <= 0) {
         oerrno = errno;
         name = CHANname(cp);
@@ -1162,6 +1637,174 @@ CHANhandle_write(CHANNEL *cp)
 }
 
 
+/*
+**  Check whether this peer has too many open connections, and if so, either
+**  close or make inactive this connection.  An inactive connection is closed
+**  once HoldTime has passed; its deadline makes CHANexpire check it then.
+**  Returns true if the channel should not be serviced any further this time
+**  through the loop.
+*/
+static bool
+CHANcheck_maxcnx(CHANNEL *cp)
+{
+    if (cp->Type != CTnntp || cp->MaxCnx <= 0 || cp->HoldTime <= 0)
+        return false;
+    if (!cp->Held) {
+        CHANcount_active(cp);
+        if (cp->ActiveCnx <= cp->MaxCnx || cp->fd <= 0)
+            return false;
+    }
+    if (cp->Started + cp->HoldTime < Now.tv_sec)
+        CHANclose(cp, CHANname(cp));
+    else if (!cp->Held) {
+        cp->ActiveCnx = 0;
+        cp->Held = true;
+        RCHANremove(cp);
+        CHANschedule(cp);
+    } else
+        return false;
+    return true;
+}
+
+
+/*
+**  Service a descriptor returned by the readiness backend.  Somebody could
+**  have closed the channel since, so we double-check that it still wants to
+**  read or write before looking at what the backend returned.  The code is
+**  written so that a channel could be reading and writing at the same time,
+**  even though that's not possible.
+*/
+static void
+CHANdispatch(int fd)
+{
+    CHANNEL *cp;
+    unsigned int mask;
+
+    cp = &channels.table[fd];
+    if (CHANcheck_maxcnx(cp)) {
+        channels.mask[fd] &= ~(CHAN_READABLE | CHAN_WRITABLE);
+        return;
+    }
+
+    /* Anything to read? */
+    mask = channels.mask[fd];
+    if ((mask & CHAN_READ) && (mask & CHAN_READABLE)) {
+        channels.mask[fd] &= ~CHAN_READABLE;
+        CHANhandle_read(cp);
+    }
+
+    /* Possibly recheck for dead children so we don't get SIGPIPE on
+       readerless channels. */
+    if (PROCneedscan)
+        PROCscan();
+
+    /* Ready to write? */
+    mask = channels.mask[fd];
+    if ((mask & CHAN_WRITE) && (mask & CHAN_WRITABLE)) {
+        channels.mask[fd] &= ~CHAN_WRITABLE;
+        CHANhandle_write(cp);
+    }
+    channels.mask[fd] &= ~(CHAN_READABLE | CHAN_WRITABLE);
+}
+
+
+/*
+**  Handle a channel whose deadline has passed: wake it up if it was
+**  sleeping, and time it out if it has been idle for too long.
+*/
+static void
+CHANexpire(CHANNEL *cp, int fd)
+{
+    unsigned long silence;
+    const char *name;
+
+    /* Coming off a sleep? */
+    if ((channels.mask[fd] & CHAN_SLEEP) && cp->Waketime <= Now.tv_sec) {
+        if (cp->Type == CTfree) {
+            warn("%s %d free but was in SMASK", CHANname(cp), fd);
+            channels.mask[fd] &= ~CHAN_SLEEP;
+            channels.sleep_count--;
+            CHANresetlastsleeping(fd);
+            close(fd);
+            cp->fd = -1;
+            return;
+        }
+        cp->LastActive = Now.tv_sec;
+        SCHANremove(cp);
+        if (cp->Waker != NULL) {
+            (*cp->Waker)(cp);
+        } else {
+            name = CHANname(cp);
+            warn("%s %d sleeping without Waker", name, fd);
+            SITEchanclose(cp);
+            CHANclose(cp, name);
+        }
+    }
+
+    /* Close a connection held over its peer's limit once HoldTime is up. */
+    if (cp->Type == CTnntp && cp->Held && CHANcheck_maxcnx(cp))
+        return;
+
+    /* Toss CTreject channel early if it's inactive. */
+    if (cp->Type == CTreject && cp->LastActive + REJECT_TIMEOUT < Now.tv_sec) {
+        name = CHANname(cp);
+        notice("%s timeout reject", name);
+        CHANclose(cp, name);
+    }
+
+    /* Same for a metrics client that does not finish its request or does not
+       read the reply. */
+    if (cp->Type == CTmetrics && cp->State != CSwaiting
+        && cp->LastActive + METRICS_TIMEOUT < Now.tv_sec) {
+        name = CHANname(cp);
+        notice("%s timeout", name);
+        CHANclose(cp, name);
+    }
+
+    /* Has this channel been inactive very long? */
+    if (cp->Type == CTnntp && cp->LastActive + cp->NextLog < Now.tv_sec) {
+        name = CHANname(cp);
+        silence = Now.tv_sec - cp->LastActive;
+        cp->NextLog += innconf->chaninacttime;
+        notice("%s inactive %lu", name, silence / 60L);
+        if (silence > innconf->peertimeout) {
+            notice("%s timeout", name);
+            CHANclose(cp, name);
+        }
+    }
+}
+
+
+/*
+**  Handle all the channels whose deadline has passed.  They are taken off
+**  the heap first and rescheduled afterwards, so that a channel still late
+**  after being handled waits for the next pass through the main loop.
+*/
+static void
+CHANrun_deadlines(void)
+{
+    int count, fd, i;
+    CHANNEL *cp;
+
+    /* The list of ready descriptors is free again once they have all been
+       dispatched, so use it to hold the expired ones. */
+    count = 0;
+    while (channels.heap_count > 0
+           && channels.deadline[channels.heap[0]] <= Now.tv_sec) {
+        fd = channels.heap[0];
+        CHANunschedule(fd);
+        channels.ready[count++] = fd;
+    }
+    for (i = 0; i < count; i++) {
+        fd = channels.ready[i];
+        cp = &channels.table[fd];
+        CHANexpire(cp, fd);
+        if (cp->fd == fd && cp->Type != CTfree)
+            CHANschedule(cp);
+    }
+}
+
+
 /*
 **  Main I/O loop.  Wait for data, call the channel's handler when there is
 **  something to read or when the queued write is finished.  In order to be
@@ -1173,14 +1816,11 @@ CHANhandle_write(CHANNEL *cp)
 void
 CHANreadloop(void)
 {
-    int i, startpoint, count, lastfd;
+    int i, count, pass;
     CHANNEL *cp;
-    fd_set rdfds, wrfds;
     struct timeval tv;
-    unsigned long silence;
-    const char *name;
-    time_t last_sync;
-    int fd = 0;
+    time_t last_sync, delay;
+    int fd, rotor, next = 0;
 
     STATUSinit();
     gettimeofday(&Now, NULL);
@@ -1191,8 +1831,6 @@ CHANreadloop(void)
         PROCscan();
 
         /* Wait for data, note the time. */
-        rdfds = channels.read_set;
-        wrfds = channels.write_set;
         tv = TimeOut;
         if (innconf->timer != 0) {
             unsigned long now = TMRnow();
@@ -1200,25 +1838,49 @@ CHANreadloop(void)
             if (now < 1000 * innconf->timer)
                 tv.tv_sec = innconf->timer - now / 1000;
             else {
-                TMRsummary("ME", timer_name);
+                TMRsummary("ME", TimerNames);
                 InndHisLogStats();
+                VERDICTlogstats();
                 tv.tv_sec = innconf->timer;
             }
         }
 
+        /* Don't sleep past the first channel deadline. */
+        if (channels.heap_count > 0) {
+            delay = channels.deadline[channels.heap[0]] - Now.tv_sec;
+            if (delay <= 0) {
+                tv.tv_sec = 0;
+                tv.tv_usec = 0;
+            } else if (delay <= tv.tv_sec) {
+                tv.tv_sec = delay;
+                tv.tv_usec = 0;
+                if (Now.tv_usec > 0) {
+                    tv.tv_sec--;
+                    tv.tv_usec = 1000000 - Now.tv_usec;
+                }
+            }
+        }
+
+        /* Wake up every second while cancels are queued. */
+        if (CANCELpending() > 0 && tv.tv_sec >= 1) {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        }
+
         /* Mask signals when not in select to prevent a signal handler
            from accessing data that the main code is mutating. */
         TMRstart(TMR_IDLE);
         xsignal_unmask();
-        count = select(channels.max_fd + 1, &rdfds, &wrfds, NULL, &tv);
+        count = channels.backend->wait(&tv);
         xsignal_mask();
         TMRstop(TMR_IDLE);
 
         if (count < 0) {
             if (errno != EINTR) {
-                syswarn("%s cant select", LogName);
+                syswarn("%s cant %s", LogName, channels.backend->name);
 #ifdef INND_FIND_BAD_FDS
-                CHANdiagnose();
+                if (channels.backend == &CHANselect)
+                    CHANdiagnose();
 #endif
             }
             continue;
@@ -1247,139 +1909,41 @@ CHANreadloop(void)
             last_sync = Now.tv_sec;
         }
 
-        /* If no channels are active, flush and skip if nobody's sleeping. */
-        if (count == 0) {
-            if (Mode == OMrunning)
-                ICDwrite();
-            if (channels.sleep_count == 0)
-                continue;
-        }
+        /* Execute the cancels whose turn has come. */
+        if (Mode == OMrunning)
+            CANCELrun();
+
+        /* If no channels are active, flush. */
+        if (count == 0 && Mode == OMrunning)
+            ICDwrite();
 
         /* Try the prioritized channels first. */
         for (i = 0; i < channels.prioritized_size; i++) {
-            int pfd;
-
-            if (channels.prioritized[i] == NULL)
+            cp = channels.prioritized[i];
+            if (cp == NULL || !CHANvalidfd(cp->fd))
                 continue;
-            pfd = channels.prioritized[i]->fd;
-            if (FD_ISSET(pfd, &channels.read_set) && FD_ISSET(pfd, &rdfds)) {
-                count--;
-                if (count > 4)
-                    count = 4; /* might be more requests */
-                (*channels.prioritized[i]->Reader)(channels.prioritized[i]);
-                FD_CLR(pfd, &rdfds);
+            fd = cp->fd;
+            if ((channels.mask[fd] & CHAN_READ)
+                && (channels.mask[fd] & CHAN_READABLE)) {
+                channels.mask[fd] &= ~CHAN_READABLE;
+                (*cp->Reader)(cp);
             }
         }
 
-        /* Loop through all active channels.  Somebody could have closed a
-           channel so we double-check the global mask before looking at what
-           select returned.  The code here is written so that a channel could
-           be reading and writing and sleeping at the same time, even though
-           that's not possible.  (Just as well, since in SysVr4 the count
-           would be wrong.) */
-        lastfd = channels.max_fd;
-        if (lastfd < channels.max_sleep_fd)
-            lastfd = channels.max_sleep_fd;
-        if (fd > lastfd)
-            fd = 0;
-        startpoint = fd;
-        do {
-            cp = &channels.table[fd];
-
-            /* Check to see if this peer has too many open connections, and if
-               so, either close or make inactive this connection. */
-            if (cp->Type == CTnntp && cp->MaxCnx > 0 && cp->HoldTime > 0) {
-                CHANcount_active(cp);
-                if (cp->ActiveCnx > cp->MaxCnx && cp->fd > 0) {
-                    if (cp->Started + cp->HoldTime < Now.tv_sec)
-                        CHANclose(cp, CHANname(cp));
-                    else {
-                        if (fd >= lastfd)
-                            fd = 0;
-                        else
-                            fd++;
-                        cp->ActiveCnx = 0;
-                        RCHANremove(cp);
-                    }
+        /* Dispatch the ready descriptors, starting with the first one at or
+           above where we stopped last time and then wrapping around. */
+        rotor = next;
+        for (pass = 0; pass < 2; pass++) {
+            for (i = 0; i < count; i++) {
+                fd = channels.ready[i];
+                if ((fd >= rotor) != (pass == 0))
                     continue;
-                }
+                CHANdispatch(fd);
+                next = fd + 1;
             }
+        }
 
-            /* Anything to read? */
-            if (FD_ISSET(fd, &channels.read_set) && FD_ISSET(fd, &rdfds)) {
-                count--;
-                CHANhandle_read(cp);
-            }
-
-            /* Possibly recheck for dead children so we don't get SIGPIPE on
-               readerless channels. */
-            if (PROCneedscan)
-                PROCscan();
-
-            /* Ready to write? */
-            if (FD_ISSET(fd, &channels.write_set) && FD_ISSET(fd, &wrfds)) {
-                count--;
-                CHANhandle_write(cp);
-            }
-
-            /* Coming off a sleep? */
-            if (FD_ISSET(fd, &channels.sleep_set)
-                && cp->Waketime <= Now.tv_sec) {
-                if (cp->Type == CTfree) {
-                    warn("%s %d free but was in SMASK", CHANname(cp), fd);
-                    FD_CLR(fd, &channels.sleep_set);
-                    channels.sleep_count--;
-                    CHANresetlastsleeping(fd);
-                    close(fd);
-                    cp->fd = -1;
-                } else {
-                    cp->LastActive = Now.tv_sec;
-                    SCHANremove(cp);
-                    if (cp->Waker != NULL) {
-                        (*cp->Waker)(cp);
-                    } else {
-                        name = CHANname(cp);
-                        warn("%s %d sleeping without Waker", name, fd);
-                        SITEchanclose(cp);
-                        CHANclose(cp, name);
-                    }
-                }
-            }
-
-            /* Toss CTreject channel early if it's inactive. */
-            if (cp->Type == CTreject
-                && cp->LastActive + REJECT_TIMEOUT < Now.tv_sec) {
-                name = CHANname(cp);
-                notice("%s timeout reject", name);
-                CHANclose(cp, name);
-            }
-
-            /* Has this channel been inactive very long? */
-            if (cp->Type == CTnntp
-                && cp->LastActive + cp->NextLog < Now.tv_sec) {
-                name = CHANname(cp);
-                silence = Now.tv_sec - cp->LastActive;
-                cp->NextLog += innconf->chaninacttime;
-                notice("%s inactive %lu", name, silence / 60L);
-                if (silence > innconf->peertimeout) {
-                    notice("%s timeout", name);
-                    CHANclose(cp, name);
-                }
-            }
-
-            /* Bump pointer, modulo the table size. */
-            if (fd >= lastfd)
-                fd = 0;
-            else
-                fd++;
-
-            /* If there is nothing to do, break out.
-
-               FIXME: Do we really want to keep going until sleep_count is
-               zero?  That means that when there are sleeping channels, we do
-               a full traversal every time through the select loop. */
-            if (count == 0 && channels.sleep_count == 0)
-                break;
-        } while (fd != startpoint);
+        /* Wake up sleeping channels and time out idle ones. */
+        CHANrun_deadlines();
     }
 }
@@ -0,0 +1,582 @@
+/*
+**  Routines for running the embedded article filters in worker processes.
+**
+**  When filterworkers is set in inn.conf, innd forks that many processes
+**  once the Perl and Python filters are loaded.  Each of them inherits the
+**  embedded interpreters and waits for articles on a ring buffer shared with
+**  innd (see lib/ring.c), holding the header field bodies and the body of
+**  each article.  ARTpost puts the article in the ring of the least busy
+**  worker and leaves the channel in the CSstoring state, so the main loop
+**  keeps serving the other channels while the filters run.  The worker sends
+**  the verdicts back down a pipe, whose read end is a channel in the main
+**  loop; NCfiltered then goes on with the article where ARTpost left it.
+**
+**  A worker answers the articles it gets in order.  If it dies, innd runs
+**  the filters itself on the articles it had not answered yet and starts a
+**  new worker.  Articles too large for the ring, or arriving while the ring
+**  is full, are also filtered by innd itself.  Reloading the filters starts
+**  new workers; the old ones exit once they have answered what they have.
+**
+**  Only filter_art runs in the workers.  The Message-ID filters are cheap
+**  enough and their verdict is needed right away, so they still run in
+**  innd, as do the mode and statistics hooks.  The workers have a copy of
+**  innd's state as it was when they were started, so the filter callbacks
+**  that change that state (INN::addhist and INN::cancel and their Python
+**  counterparts) fail in a worker.
+*/
+
+#include "portable/system.h"
+
+#include <errno.h>
+
+#include "inn/fdflag.h"
+#include "inn/innconf.h"
+#include "inn/ring.h"
+#include "innd.h"
+#include "innperl.h"
+
+#if defined(DO_PERL) || defined(DO_PYTHON)
+
+/* What innd puts in the ring for an article, followed by the header field
+   bodies found in the article, each followed by a nul, and the body. */
+struct filter_request {
+    unsigned long id;
+    long body; /* Length of the body. */
+    int lines;
+    bool python; /* Which filters to run. */
+    bool perl;
+    int length[MAX_ARTHEADER]; /* Of each header field body, as in hc. */
+};
+
+/* What a worker sends back down its pipe.  An empty verdict accepts the
+   article. */
+struct filter_reply {
+    unsigned long id;
+    bool perldied; /* Whether filter_art died, disabling the Perl filter. */
+    char python[256];
+    char perl[256];
+};
+
+struct worker {
+    pid_t pid;
+    time_t started;
+    struct ring *ring;
+    int wake;         /* Write end of the wakeup pipe, -1 when retiring. */
+    CHANNEL *channel; /* Read end of the reply pipe. */
+    struct buffer replies;
+    FILTERJOB *jobs; /* Articles given to the worker, oldest first. */
+    FILTERJOB **tail;
+    unsigned long pending;
+    struct worker *next;
+};
+
+static struct worker *workers;
+static unsigned long lastid;
+static struct buffer request;
+
+static void FILTERspawn(void);
+static void FILTERworker(struct ring *ring, int wake, int fd)
+    __attribute__((__noreturn__));
+
+
+/*
+**  Run the filters on an article from the ring, in a worker.
+*/
+static void
+FILTERrun(const char *record, size_t length, struct filter_reply *reply)
+{
+    static ARTDATA data;
+    HDRCONTENT *hc = data.HdrContent;
+    struct filter_request header;
+    char *p, *body;
+    char *verdict;
+    int i;
+
+    memset(reply, 0, sizeof(*reply));
+    if (length < sizeof(header))
+        return;
+    memcpy(&header, record, sizeof(header));
+    reply->id = header.id;
+    p = (char *) record + sizeof(header);
+    for (i = 0; i < MAX_ARTHEADER; i++) {
+        hc[i].Length = header.length[i];
+        if (HDR_FOUND(i)) {
+            hc[i].Value = p;
+            p += hc[i].Length + 1;
+        } else
+            hc[i].Value = NULL;
+    }
+    body = p;
+    if ((size_t) (body - record) + header.body > length)
+        return;
+
+#    if defined(DO_PYTHON)
+    PythonFilterActive = header.python;
+    if (header.python) {
+        verdict = PYartfilter(&data, body, header.body, header.lines);
+        if (verdict != NULL)
+            strlcpy(reply->python, verdict, sizeof(reply->python));
+    }
+#    endif
+#    if defined(DO_PERL)
+    PerlFilterActive = header.perl;
+    if (header.perl) {
+        verdict = PLartfilter(&data, body, header.body, header.lines);
+        if (verdict != NULL)
+            strlcpy(reply->perl, verdict, sizeof(reply->perl));
+        reply->perldied = !PerlFilterActive;
+    }
+#    endif
+}
+
+
+/*
+**  Main loop of a worker.  Filter articles as they come until innd closes
+**  the wakeup pipe, and then exit.
+*/
+static void
+FILTERworker(struct ring *ring, int wake, int fd)
+{
+    struct filter_reply reply;
+    const char *record;
+    size_t length;
+    ssize_t status;
+    char c;
+
+    while (true) {
+        record = ring_peek(ring, &length);
+        if (record == NULL) {
+            if (!ring_sleep(ring))
+                continue;
+            status = read(wake, &c, 1);
+            if (status == 0)
+                _exit(0);
+            if (status < 0 && errno != EINTR) {
+                syswarn("SERVER filter worker cant read wakeup pipe");
+                _exit(1);
+            }
+            continue;
+        }
+        FILTERrun(record, length, &reply);
+        ring_advance(ring);
+        if (xwrite(fd, &reply, sizeof(reply)) < 0) {
+            syswarn("SERVER filter worker cant write reply");
+            _exit(1);
+        }
+    }
+}
+
+
+/*
+**  Go on with an article once its worker is done with it, or is gone.
+*/
+static void
+FILTERfinish(FILTERJOB *job)
+{
+    if (job->cp != NULL)
+        NCfiltered(job->cp, job);
+    free(job);
+}
+
+
+/*
+**  Forget about a worker that exited and filter whatever it left.  A worker
+**  that was not told to exit is replaced, unless it did not last long.
+*/
+static void
+FILTERdied(struct worker *w)
+{
+    struct worker **wp;
+    FILTERJOB *job;
+    bool replace;
+
+    replace = (w->wake >= 0);
+    if (replace) {
+        warn("SERVER filter worker %ld exited with %lu articles pending",
+             (long) w->pid, w->pending);
+        close(w->wake);
+        w->wake = -1;
+    }
+    CHANclose(w->channel, CHANname(w->channel));
+    w->channel = NULL;
+
+    /* The worker stays on the list meanwhile, so that FILTERforget still
+       sees the articles not finished yet. */
+    while ((job = w->jobs) != NULL) {
+        w->jobs = job->Next;
+        job->Ran = false;
+        FILTERfinish(job);
+    }
+    for (wp = &workers; *wp != w; wp = &(*wp)->next)
+        ;
+    *wp = w->next;
+    ring_free(w->ring);
+    free(w->replies.data);
+
+    if (replace) {
+        if (Now.tv_sec - w->started < 60)
+            warn("SERVER filter worker %ld did not last, not restarting it",
+                 (long) w->pid);
+        else {
+            /* As in FILTERstart, only fork with the storage thread idle. */
+            STOREsync();
+            FILTERspawn();
+        }
+    }
+    free(w);
+}
+
+
+/*
+**  Read function for the reply pipe of a worker.  Finish the articles it
+**  answered.
+*/
+static void
+FILTERreader(CHANNEL *cp)
+{
+    struct worker *w;
+    struct filter_reply reply;
+    FILTERJOB *job;
+    ssize_t count;
+
+    for (w = workers; w != NULL && w->channel != cp; w = w->next)
+        ;
+    if (w == NULL) {
+        warn("SERVER internal no filter worker for %s", CHANname(cp));
+        CHANclose(cp, CHANname(cp));
+        return;
+    }
+    buffer_compact(&w->replies);
+    if (w->replies.size - w->replies.left < 16 * sizeof(reply))
+        buffer_resize(&w->replies, w->replies.left + 16 * sizeof(reply));
+    count = buffer_read(&w->replies, cp->fd);
+    if (count < 0)
+        syswarn("SERVER cant read from filter worker %ld", (long) w->pid);
+
+    while (w->replies.left >= sizeof(reply)) {
+        memcpy(&reply, w->replies.data + w->replies.used, sizeof(reply));
+        w->replies.used += sizeof(reply);
+        w->replies.left -= sizeof(reply);
+        job = w->jobs;
+        if (job == NULL || job->Id != reply.id) {
+            warn("SERVER internal unexpected reply %lu from filter worker %ld",
+                 reply.id, (long) w->pid);
+            continue;
+        }
+        w->jobs = job->Next;
+        if (w->jobs == NULL)
+            w->tail = &w->jobs;
+        w->pending--;
+#    if defined(DO_PERL)
+        if (reply.perldied && PerlFilterActive)
+            PerlFilter(false);
+#    endif
+        job->Ran = true;
+        strlcpy(job->Python, reply.python, sizeof(job->Python));
+        strlcpy(job->Perl, reply.perl, sizeof(job->Perl));
+        FILTERfinish(job);
+    }
+    if (count <= 0)
+        FILTERdied(w);
+}
+
+
+/*
+**  Start a worker.
+*/
+static void
+FILTERspawn(void)
+{
+    struct worker *w, *other;
+    struct ring *ring;
+    char *path;
+    int wake[2], reply[2];
+    int i;
+    pid_t pid;
+    CHANNEL *cp;
+
+    path = concatpath(innconf->pathrun, "innd.filter");
+    ring = ring_create(path, FILTER_RING_SIZE);
+    if (ring == NULL) {
+        syswarn("SERVER cant create filter ring %s", path);
+        free(path);
+        return;
+    }
+    unlink(path);
+    free(path);
+    if (pipe(wake) < 0) {
+        syswarn("SERVER cant pipe for filter worker");
+        ring_free(ring);
+        return;
+    }
+    if (pipe(reply) < 0) {
+        syswarn("SERVER cant pipe for filter worker");
+        close(wake[PIPE_READ]);
+        close(wake[PIPE_WRITE]);
+        ring_free(ring);
+        return;
+    }
+    if (!CHANvalidfd(reply[PIPE_READ])) {
+        warn("SERVER cant start filter worker: file descriptor %d too high",
+             reply[PIPE_READ]);
+        pid = -1;
+    } else {
+        pid = fork();
+        if (pid < 0)
+            syswarn("SERVER cant fork filter worker");
+    }
+    if (pid < 0) {
+        close(wake[PIPE_READ]);
+        close(wake[PIPE_WRITE]);
+        close(reply[PIPE_READ]);
+        close(reply[PIPE_WRITE]);
+        ring_free(ring);
+        return;
+    }
+
+    if (pid == 0) {
+        /* Let peers, feeds and the other workers see the descriptors innd
+           closes as closed. */
+        FilterWorker = true;
+        xsignal_forked();
+        for (i = 0; (cp = CHANiter(&i, CTany)) != NULL;)
+            if (cp->fd >= 0)
+                close(cp->fd);
+        for (other = workers; other != NULL; other = other->next)
+            if (other->wake >= 0)
+                close(other->wake);
+        close(wake[PIPE_WRITE]);
+        close(reply[PIPE_READ]);
+#    if defined(DO_PYTHON)
+        PYforked();
+#    endif
+        FILTERworker(ring, wake[PIPE_READ], reply[PIPE_WRITE]);
+    }
+
+    close(wake[PIPE_READ]);
+    close(reply[PIPE_WRITE]);
+    fdflag_nonblocking(wake[PIPE_WRITE], true);
+    fdflag_close_exec(wake[PIPE_WRITE], true);
+    fdflag_close_exec(reply[PIPE_READ], true);
+
+    w = xcalloc(1, sizeof(struct worker));
+    w->pid = pid;
+    w->started = Now.tv_sec;
+    w->ring = ring;
+    w->wake = wake[PIPE_WRITE];
+    w->channel = CHANcreate(reply[PIPE_READ], CTfilter, CSwaiting,
+                            FILTERreader, NULL);
+    w->tail = &w->jobs;
+    w->next = workers;
+    workers = w;
+    RCHANadd(w->channel);
+}
+
+
+/*
+**  Start the workers inn.conf asks for.  The storage thread must not be in
+**  the middle of anything, since the workers only get the calling thread.
+*/
+static void
+FILTERstart(void)
+{
+    unsigned long i;
+
+    STOREsync();
+    for (i = 0; i < innconf->filterworkers; i++)
+        FILTERspawn();
+    if (workers != NULL)
+        notice("SERVER running article filters in %lu worker processes",
+               innconf->filterworkers);
+}
+
+
+/*
+**  Start the workers, once the filters have been loaded.
+*/
+void
+FILTERsetup(void)
+{
+    if (innconf->filterworkers > 0 && workers == NULL)
+        FILTERstart();
+}
+
+
+/*
+**  Replace the workers after the filters have been reloaded.  The old ones
+**  answer what they already have before they exit.
+*/
+void
+FILTERrestart(void)
+{
+    struct worker *w;
+    bool running = false;
+
+    for (w = workers; w != NULL; w = w->next)
+        if (w->wake >= 0) {
+            close(w->wake);
+            w->wake = -1;
+            running = true;
+        }
+    if (running)
+        FILTERstart();
+}
+
+
+/*
+**  Hand the article on cp to a worker.  Returns false if it should be
+**  filtered right away instead.
+*/
+bool
+FILTERqueue(CHANNEL *cp, HASH hash, int hopcount)
+{
+    struct filter_request header;
+    struct worker *w, *best;
+    ARTDATA *data = &cp->Data;
+    HDRCONTENT *hc = data->HdrContent;
+    FILTERJOB *job;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+#    if defined(DO_PYTHON)
+    header.python = PythonFilterActive;
+#    endif
+#    if defined(DO_PERL)
+    header.perl = PerlFilterActive;
+#    endif
+    if (!header.python && !header.perl)
+        return false;
+    for (best = NULL, w = workers; w != NULL; w = w->next)
+        if (w->wake >= 0 && (best == NULL || w->pending < best->pending))
+            best = w;
+    if (best == NULL)
+        return false;
+
+    header.id = ++lastid;
+    header.body = (long) (cp->Next - data->Body);
+    header.lines = data->Lines;
+    for (i = 0; i < MAX_ARTHEADER; i++)
+        header.length[i] = hc[i].Length;
+    buffer_set(&request, (const char *) &header, sizeof(header));
+    for (i = 0; i < MAX_ARTHEADER; i++)
+        if (HDR_FOUND(i)) {
+            buffer_append(&request, HDR(i), HDR_LEN(i));
+            buffer_append(&request, "", 1);
+        }
+    buffer_append(&request, cp->In.data + data->Body, (size_t) header.body);
+    if (!ring_put(best->ring, request.data, request.left))
+        return false;
+    if (ring_wakeup(best->ring) && write(best->wake, "", 1) < 0
+        && errno != EAGAIN)
+        syswarn("SERVER cant wake up filter worker %ld", (long) best->pid);
+
+    job = xcalloc(1, sizeof(FILTERJOB));
+    job->cp = cp;
+    job->Hash = hash;
+    job->Hopcount = hopcount;
+    job->PythonRan = header.python;
+    job->PerlRan = header.perl;
+    job->Generation = VERDICTgeneration();
+    job->Id = header.id;
+    *best->tail = job;
+    best->tail = &job->Next;
+    best->pending++;
+
+    cp->State = CSstoring;
+    RCHANremove(cp);
+    return true;
+}
+
+
+/*
+**  Drop the verdict for the article on a channel being closed.
+*/
+void
+FILTERforget(CHANNEL *cp)
+{
+    struct worker *w;
+    FILTERJOB *job;
+
+    for (w = workers; w != NULL; w = w->next)
+        for (job = w->jobs; job != NULL; job = job->Next)
+            if (job->cp == cp)
+                job->cp = NULL;
+}
+
+
+/*
+**  The number of articles waiting for a worker.
+*/
+unsigned long
+FILTERpending(void)
+{
+    struct worker *w;
+    unsigned long pending = 0;
+
+    for (w = workers; w != NULL; w = w->next)
+        pending += w->pending;
+    return pending;
+}
+
+
+/*
+**  Let the workers exit.  The channels waiting for them are being closed.
+*/
+void
+FILTERclose(void)
+{
+    struct worker *w;
+    FILTERJOB *job;
+
+    while ((w = workers) != NULL) {
+        workers = w->next;
+        if (w->wake >= 0)
+            close(w->wake);
+        CHANclose(w->channel, CHANname(w->channel));
+        ring_free(w->ring);
+        free(w->replies.data);
+        while ((job = w->jobs) != NULL) {
+            w->jobs = job->Next;
+            free(job);
+        }
+        free(w);
+    }
+}
+
+#else /* !(DO_PERL || DO_PYTHON) */
+
+void
+FILTERsetup(void)
+{
+    if (innconf->filterworkers > 0)
+        warn("SERVER filterworkers set but there is no embedded filter");
+}
+
+void
+FILTERrestart(void)
+{
+}
+
+bool
+FILTERqueue(CHANNEL *cp UNUSED, HASH hash UNUSED, int hopcount UNUSED)
+{
+    return false;
+}
+
+void
+FILTERforget(CHANNEL *cp UNUSED)
+{
+}
+
+unsigned long
+FILTERpending(void)
+{
+    return 0;
+}
+
+void
+FILTERclose(void)
+{
+}
+
+#endif /* !(DO_PERL || DO_PYTHON) */
@@ -24,6 +24,13 @@ static char *ICDactpointer;
 static int ICDactfd;
 static int ICDactsize;
 
+/* One bit per page of the active file, set when a page is changed in place
+   and cleared when it is written back, so that a sync with 100,000 groups
+   does not touch megabytes of unchanged high water marks. */
+static unsigned char *ICDdirtypages;
+static size_t ICDpagesize;
+static size_t ICDpagecount;
+
 
 /*
 **  Set and unset (or copy) IOVEC elements.  We make copies to
@@ -51,7 +58,7 @@ ICDiovset(struct iovec *iovp, char *base, int len)
 /*
 **  Close the active file, releasing its resources.
 */
-static void
+void
 ICDcloseactive(void)
 {
     if (ICDactpointer) {
@@ -62,6 +69,8 @@ ICDcloseactive(void)
         free(ICDactpointer);
 #endif
         ICDactpointer = NULL;
+        free(ICDdirtypages);
+        ICDdirtypages = NULL;
         if (close(ICDactfd) < 0) {
             syslog(L_FATAL, "%s cant close %s %m", LogName, ICDactpath);
             exit(1);
@@ -71,17 +80,11 @@ ICDcloseactive(void)
 
 
 /*
-**  Set up the hash and in-core tables.
+**  Make sure the groups innd files articles into on its own are there.
 */
-void
-ICDsetup(bool StartSites)
+static void
+ICDcheckgroups(void)
 {
-    if (ICDneedsetup == true) {
-        ICDneedsetup = false;
-    } else {
-        ICDcloseactive();
-        NGparsefile();
-    }
     if (NGfind("control") == NULL || NGfind("junk") == NULL) {
         syslog(L_FATAL, "%s internal no control and/or junk group", LogName);
         exit(1);
@@ -94,6 +97,18 @@ ICDsetup(bool StartSites)
         syslog(L_FATAL, "%s internal no to group", LogName);
         exit(1);
     }
+}
+
+
+/*
+**  Set up the hash and in-core tables.
+*/
+void
+ICDsetup(bool StartSites)
+{
+    ICDcloseactive();
+    NGparsefile();
+    ICDcheckgroups();
     SITEparsefile(StartSites);
 }
 
@@ -105,7 +120,9 @@ void
 ICDwrite(void)
 {
     HISsync(History);
+    STORElock();
     SMflushcacheddata(SM_ALL);
+    STOREunlock();
 
     if (ICDactivedirty != 0) {
         ICDwriteactive();
@@ -273,16 +290,10 @@ bailout:
 
 #endif /* __CYGWIN__ */
 
-    /* Invalidate in-core pointers. */
-    ICDcloseactive();
-
-    /* Restore in-core pointers. */
-    if (Mode != OMrunning) {
-        ICDneedsetup = true;
-        /* Force the active file into memory. */
-        NGparsefile();
-    } else
-        ICDsetup(true);
+    /* Restore in-core pointers.  Sites keep their lists of groups, so no
+       feed has to be flushed. */
+    NGreparsefile();
+    ICDcheckgroups();
     return true;
 }
 
@@ -434,6 +445,7 @@ char *
 ICDreadactive(char **endp)
 {
     struct stat Sb;
+    int pagesize;
 
     if (ICDactpointer) {
         *endp = ICDactpointer + ICDactsize;
@@ -496,31 +508,80 @@ ICDreadactive(char **endp)
 
 #endif /* HAVE_MMAP */
 
+    pagesize = getpagesize();
+    ICDpagesize = pagesize > 0 ? (size_t) pagesize : 8192;
+    ICDpagecount = (ICDactsize + ICDpagesize - 1) / ICDpagesize;
+    ICDdirtypages = xcalloc((ICDpagecount + 7) / 8, 1);
+
     *endp = ICDactpointer + ICDactsize;
     return ICDactpointer;
 }
 
 
 /*
-**  Write the active file out.
+**  Note that length bytes at p in the active file have been changed in
+**  place, so that the next ICDwriteactive writes them back.
 */
 void
-ICDwriteactive(void)
+ICDmarkdirty(const char *p, size_t length)
+{
+    size_t first, last;
+
+    if (ICDdirtypages == NULL || length == 0 || p < ICDactpointer
+        || p + length > ICDactpointer + ICDactsize)
+        return;
+    first = (p - ICDactpointer) / ICDpagesize;
+    last = (p + length - 1 - ICDactpointer) / ICDpagesize;
+    for (; first <= last; first++)
+        ICDdirtypages[first / 8] |= 1 << (first % 8);
+}
+
+
+/*
+**  Write back size bytes of the active file starting at offset.
+*/
+static void
+ICDwriterange(size_t offset, size_t size)
 {
 #ifdef HAVE_MMAP
-    if (inn_msync_page(ICDactpointer, ICDactsize, MS_ASYNC) < 0) {
-        syslog(L_FATAL, "%s msync failed %s %p %d %m", LogName, ICDactpath,
-               (void *) ICDactpointer, ICDactsize);
+    if (inn_msync_page(ICDactpointer + offset, size, MS_ASYNC) < 0) {
+        syslog(L_FATAL, "%s msync failed %s %p %lu %m", LogName, ICDactpath,
+               (void *) (ICDactpointer + offset), (unsigned long) size);
         exit(1);
     }
 #else  /* !HAVE_MMAP */
-    if (lseek(ICDactfd, 0, SEEK_SET) == -1) {
-        syslog(L_FATAL, "%s cant rewind %s %m", LogName, ICDactpath);
-        exit(1);
-    }
-    if (xwrite(ICDactfd, ICDactpointer, ICDactsize) < 0) {
+    if (xpwrite(ICDactfd, ICDactpointer + offset, size, offset) < 0) {
         syslog(L_FATAL, "%s cant write %s %m", LogName, ICDactpath);
         exit(1);
     }
 #endif /* HAVE_MMAP */
 }
+
+
+/*
+**  Write the active file out.  Only the runs of pages changed since the
+**  last call are synced or written.
+*/
+void
+ICDwriteactive(void)
+{
+    size_t page, start, end;
+
+    if (ICDdirtypages == NULL)
+        return;
+    for (page = 0; page < ICDpagecount;) {
+        if ((ICDdirtypages[page / 8] & (1 << (page % 8))) == 0) {
+            page++;
+            continue;
+        }
+        start = page;
+        while (page < ICDpagecount
+               && (ICDdirtypages[page / 8] & (1 << (page % 8))) != 0)
+            page++;
+        end = page * ICDpagesize;
+        if (end > (size_t) ICDactsize)
+            end = ICDactsize;
+        ICDwriterange(start * ICDpagesize, end - start * ICDpagesize);
+    }
+    memset(ICDdirtypages, 0, (ICDpagecount + 7) / 8);
+}
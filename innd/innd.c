@@ -4,11 +4,6 @@
 
 #include "portable/system.h"
 
-/* Needed on AIX 4.1 to get fd_set and friends. */
-#ifdef HAVE_SYS_SELECT_H
-#    include <sys/select.h>
-#endif
-
 #include "inn/innconf.h"
 #include "inn/messages.h"
 #include "inn/newsuser.h"
@@ -292,10 +287,14 @@ CleanupAndExit(int status, const char *why)
 void
 JustCleanup(void)
 {
+    FILTERclose();
+    STOREclose();
     SITEflushall(false);
     CCclose();
     LCclose();
+    METRICSclose();
     NCclose();
+    CANCELclose();
     RCclose();
     ICDclose();
     InndHisClose();
@@ -673,7 +672,7 @@ main(int ac, char *av[])
     if (i < 0)
         sysdie("SERVER cant get file descriptor limit");
 
-    if (!isvalidfd(i)) {
+    if (i >= CHANlimit()) {
         /* Only log a warning if rlimitnofile has been set
          * to a value different than the default setting of letting
          * the system set the number of file descriptors. */
@@ -683,11 +682,7 @@ main(int ac, char *av[])
                    "supports (rlimitnofile too high in inn.conf)",
                    LogName, i);
         }
-#if defined(FD_SETSIZE)
-        i = FD_SETSIZE - 1;
-#else
-        i = sizeof(fd_set) * CHAR_BIT - 1;
-#endif
+        i = CHANlimit() - 1;
     }
 
     /* There is no file descriptor limit on some hosts; for those, cap at
@@ -741,6 +736,7 @@ main(int ac, char *av[])
         InndHisOpen();
     CCsetup();
     LCsetup();
+    METRICSsetup();
     RCsetup();
     PROCsetup(10);
     WIPsetup();
@@ -756,6 +752,7 @@ main(int ac, char *av[])
         die("SERVER cant set up storage manager");
     if (!SMinit())
         die("SERVER cant initialize storage manager: %s", SMerrorstr);
+    STOREsetup();
 
 #if defined(_DEBUG_MALLOC_INC)
     m.i = 1;
@@ -805,6 +802,11 @@ main(int ac, char *av[])
         PYfilter(false);
 #endif /* DO_PYTHON */
 
+    /* Now that the filters are loaded, start the processes that run them. */
+    VERDICTsetup();
+    FILTERsetup();
+    CANCELsetup();
+
     /* And away we go... */
     if (ShouldRenumber) {
         syslog(LOG_NOTICE, "SERVER renumbering");
@@ -62,7 +62,6 @@ typedef short SITEIDX;
 */
 
 /* Used for storing group subscriptions for feeds. */
-#define SUB_DEFAULT     false
 #define SUB_NEGATE      '!'
 #define SUB_POISON      '@'
 
@@ -291,7 +290,10 @@ enum channel_type {
     CTcontrol,
     CTfile,
     CTexploder,
-    CTprocess
+    CTprocess,
+    CTstore,
+    CTfilter,
+    CTmetrics
 };
 
 /* The state a channel is in.  Interpretation of this depends on the channel's
@@ -312,10 +314,26 @@ enum channel_state {
     CSeatarticle,
     CSeatcommand,
     CSgetxbatch,
-    CScancel
+    CScancel,
+    CSstoring
 };
 
 
+/*
+**  An article handed to the storage thread.  The thread sets Token, Errno
+**  and Error (a copy of SMerrorstr, only if storing failed) and Done is then
+**  called from the main loop.
+*/
+typedef struct _STOREJOB {
+    ARTHANDLE Article;
+    TOKEN Token;
+    int Errno;
+    char *Error;
+    void (*Done)(struct _STOREJOB *);
+    struct _STOREJOB *Next;
+} STOREJOB;
+
+
 #define SAVE_AMT           10 /* used for eating article/command */
 #define PRECOMMITCACHESIZE 128
 
@@ -370,6 +388,8 @@ typedef struct _CHANNEL {
     unsigned long Ihave_Duplicate;
     unsigned long Ihave_Deferred;
     unsigned long Ihave_SendIt;
+    unsigned long Replies; /* Reply lines sent. */
+    unsigned long Writes;  /* System calls they took. */
     unsigned long Reported;
     unsigned long Received;
     unsigned long Received_checkpoint;
@@ -393,6 +413,7 @@ typedef struct _CHANNEL {
     void *Argument;
     void *Event;
     struct buffer In;
+    size_t InPeak; /* Most of In used lately, to decide when to shrink it */
     struct buffer Out;
     bool Tracing;
     struct buffer Sendid;
@@ -405,6 +426,7 @@ typedef struct _CHANNEL {
     int ActiveCnx;
     int MaxCnx;
     int HoldTime;
+    bool Held; /* No longer read from, its peer being over MaxCnx */
     time_t ArtBeg;
     int ArtMax;
     size_t Start;      /* where current cmd/article starts
@@ -416,6 +438,29 @@ typedef struct _CHANNEL {
     char Name[SMBUF];  /* storage for CHANname */
 } CHANNEL;
 
+
+/*
+**  An article waiting for the verdicts of the filter workers, with what
+**  ARTpost needs to go on with it.  cp is cleared if the channel is closed
+**  meanwhile.  Ran is false if no worker gave a verdict, in which case the
+**  filters are run by innd itself.  Generation, PythonRan and PerlRan say
+**  which filters the worker was asked to run, so that its verdicts are only
+**  cached if the filters did not change since.
+*/
+typedef struct _FILTERJOB {
+    CHANNEL *cp;
+    HASH Hash;
+    int Hopcount;
+    bool Ran;
+    bool PythonRan;
+    bool PerlRan;
+    unsigned long Generation;
+    char Python[256];
+    char Perl[256];
+    unsigned long Id;
+    struct _FILTERJOB *Next;
+} FILTERJOB;
+
 #define DEFAULTNGBOXSIZE 64
 
 /*
@@ -493,6 +538,7 @@ typedef struct _SITE {
     char **Exclusions;
     char **Distributions;
     char **Patterns;
+    struct uwildmat_list *Wildmat; /* ME's and Patterns, compiled */
     bool Poison;
     bool PoisonEntry;
     bool Sendit;
@@ -506,6 +552,8 @@ typedef struct _SITE {
     bool FeedwithoutOriginator;
     bool DropFiltered;
     bool FeedTrash;
+    bool JustModerated;   /* Only moderated groups (Nm flag) */
+    bool JustUnmoderated; /* Only unmoderated groups (Nu flag) */
     int Hops;
     int Groupcount;
     int Followcount;
@@ -534,12 +582,35 @@ typedef struct _SITE {
     size_t Flushpoint;
     struct buffer Buffer;
     bool Buffered;
+    size_t RingSize;   /* From the R flag; 0 to use the pipe only */
+    struct ring *Ring; /* Shared with the channel process, if any */
     char **Originator;
     HASHFEEDLIST *HashFeedList;
     int Next;
     int Prev;
 } SITE;
 
+/*
+**  A set of sites, one bit per entry in Sites.  The masks are compiled from
+**  the sites by SITEgetmasks so that ARTpropagate can rule out most sites for
+**  an article a word at a time; only the sites in Checked have conditions
+**  left that must be looked at one site at a time.
+*/
+typedef unsigned long SITEBITS;
+#define SITEBITS_WORD     (sizeof(SITEBITS) * CHAR_BIT)
+#define SITEBITS_WORDS(n) (((n) + SITEBITS_WORD - 1) / SITEBITS_WORD)
+#define SITEBITS_SET(b, i) \
+    ((b)[(i) / SITEBITS_WORD] |= 1UL << ((i) % SITEBITS_WORD))
+
+typedef struct _SITEMASKS {
+    size_t Words;
+    SITEBITS *IgnoreControl; /* Ac */
+    SITEBITS *NeedOverview;  /* Ao */
+    SITEBITS *DropFiltered;  /* Af */
+    SITEBITS *DistRequired;  /* Ad */
+    SITEBITS *Checked;       /* Anything else that depends on the article */
+} SITEMASKS;
+
 
 /*
 **  A process is something we start up to send articles.
@@ -575,7 +646,7 @@ typedef struct _WIP {
     time_t Timestamp;  /* Time we last looked at this MessageID */
     CHANNEL *Chan;     /* Channel that this message is associated
                           with */
-    struct _WIP *Next; /* Next item in this bucket */
+    struct _WIP *Next; /* Next unused entry */
 } WIP;
 
 /*
@@ -595,9 +666,33 @@ enum timer {
     TMR_ARTPARSE,               /* Parsing an article. */
     TMR_ARTLOG,                 /* Logging article disposition. */
     TMR_DATAMOVE,               /* Moving data. */
+    TMR_HISSEEN,                /* Checking recently seen Message-IDs. */
     TMR_MAX
 };
 
+/*
+**  The filter verdicts remembered by verdict.c, Message-ID filters first.
+*/
+enum verdict_kind {
+    VERDICT_PERLMID,   /* Perl filter_messageid. */
+    VERDICT_PYTHONMID, /* Python filter_messageid. */
+    VERDICT_PERLART,   /* Perl filter_art. */
+    VERDICT_PYTHONART, /* Python filter_art. */
+    VERDICT_MAX
+};
+
+/*
+**  History cache counters, as in struct histstats but wide enough to keep
+**  running totals.
+*/
+struct inndhisstats {
+    unsigned long hitpos; /* Positive hits. */
+    unsigned long hitneg; /* Negative hits. */
+    unsigned long misses; /* Positive hits, but not in cache. */
+    unsigned long dne;    /* Negative hits, but not in cache. */
+    unsigned long evictions; /* Entries pushed out by new ones. */
+};
+
 
 /*
 **  In-line macros for efficiency.
@@ -634,7 +729,6 @@ extern bool BufferedLogs;
 EXTERN bool AnyIncoming;
 extern bool Debug;
 extern bool laxmid;
-EXTERN bool ICDneedsetup;
 EXTERN bool NeedHeaders;
 EXTERN bool NeedOverview;
 EXTERN bool NeedPath;
@@ -654,6 +748,7 @@ EXTERN FILE *Errlog;
 EXTERN FILE *Log;
 extern char LogName[];
 extern int ErrorCount;
+extern const char *const TimerNames[]; /* Labels of the innd timers */
 EXTERN unsigned long ICDactivedirty;
 EXTERN int MaxOutgoing;
 EXTERN int nGroups;
@@ -668,6 +763,7 @@ EXTERN SITE ME;
 EXTERN struct timeval TimeOut;
 EXTERN struct timeval Now; /* Reasonably accurate time */
 EXTERN bool ThrottledbyIOError;
+EXTERN bool FilterWorker; /* Whether this process is a filter worker */
 EXTERN char *NCgreeting;
 EXTERN struct history *History;
 
@@ -685,6 +781,7 @@ EXTERN struct history *History;
 #define REMOTETIMER     0
 #define REMOTETOTAL     60
 #define REJECT_TIMEOUT  10
+#define METRICS_TIMEOUT 10
 extern int RemoteLimit;    /* Per host limit. */
 extern time_t RemoteTimer; /* How long to remember connects. */
 extern int RemoteTotal;    /* Total limit. */
@@ -695,10 +792,16 @@ extern int RemoteTotal;    /* Total limit. */
 */
 extern void InndHisOpen(void);
 extern void InndHisClose(void);
+extern void InndHisPrefetch(const CHANNEL *cp, const char *const *keys,
+                            size_t n);
+extern bool InndHisPrefetched(const CHANNEL *cp);
+extern bool InndHisHave(const char *key);
+extern bool InndHisHaveFor(const CHANNEL *cp, const char *key);
 extern bool InndHisWrite(const char *key, time_t arrived, time_t posted,
                          time_t expires, TOKEN *token);
 extern bool InndHisRemember(const char *key, time_t posted);
 extern void InndHisLogStats(void);
+extern void InndHisTotals(struct inndhisstats *stats);
 extern bool FormatLong(char *p, unsigned long value, int width);
 extern bool NeedShell(char *p, const char **av, const char **end);
 extern char **CommaSplit(char *text);
@@ -717,8 +820,12 @@ extern bool ARTreadschema(void);
 extern const char *ARTreadarticle(char *files);
 extern char *ARTreadheader(char *files);
 extern bool ARTpost(CHANNEL *cp);
+extern bool ARTfiltered(CHANNEL *cp, FILTERJOB *job);
 extern void ARTcancel(const ARTDATA *data, const char *MessageID,
                       bool Trusted);
+extern void ARTcancelnow(const char *Feedsite, const char *CancelID,
+                         const char *MessageID, const char *CancelKey,
+                         bool Trusted);
 extern void ARTclose(void);
 extern void ARTsetup(void);
 extern void ARTprepare(CHANNEL *cp);
@@ -726,6 +833,13 @@ extern void ARTparse(CHANNEL *cp);
 extern void ARTlogreject(CHANNEL *cp, const char *text);
 extern void ARTreject(Reject_type, CHANNEL *);
 
+extern bool CANCELadd(const char *Feedsite, const char *CancelID,
+                      const char *MessageID, const char *CancelKey);
+extern void CANCELclose(void);
+extern unsigned long CANCELpending(void);
+extern void CANCELrun(void);
+extern void CANCELsetup(void);
+
 extern bool CHANsleeping(CHANNEL *cp);
 extern bool CHANsystemdsa(CHANNEL *cp);
 extern CHANNEL *CHANcreate(int fd, enum channel_type type,
@@ -733,6 +847,8 @@ extern CHANNEL *CHANcreate(int fd, enum channel_type type,
                            innd_callback_func write_done);
 extern CHANNEL *CHANiter(int *ip, enum channel_type type);
 extern CHANNEL *CHANfromdescriptor(int fd);
+extern int CHANlimit(void);
+extern bool CHANvalidfd(int fd);
 extern char *CHANname(CHANNEL *cp);
 extern int CHANreadtext(CHANNEL *cp);
 extern void CHANclose(CHANNEL *cp, const char *name);
@@ -765,6 +881,8 @@ extern bool ICDnewgroup(char *Name, char *Rest);
 extern char *ICDreadactive(char **endp);
 extern bool ICDchangegroup(NEWSGROUP *ngp, char *Rest);
 extern void ICDclose(void);
+extern void ICDcloseactive(void);
+extern void ICDmarkdirty(const char *p, size_t length);
 extern bool ICDrenumberactive(void);
 extern bool ICDrmgroup(NEWSGROUP *ngp);
 extern void ICDsetup(bool StartSites);
@@ -779,17 +897,27 @@ extern void KEYgenerate(HDRCONTENT *, const char *, size_t);
 extern void LCclose(void);
 extern void LCsetup(void);
 
+extern void METRICSclose(void);
+extern void METRICSsetup(void);
+extern void METRICSfamily(struct buffer *out, const char *name,
+                          const char *type, const char *help);
+extern const char *METRICSquote(const char *value);
+
 extern int NGsplit(char *p, int size, LISTBUFFER *list);
 extern NEWSGROUP *NGfind(const char *Name);
+extern NEWSGROUP **NGfindlist(char **names);
 extern void NGclose(void);
 extern CHANNEL *NCcreate(int fd, bool MustAuthorize, bool IsLocal);
 extern void NGparsefile(void);
+extern void NGreparsefile(void);
 extern bool NGrenumber(NEWSGROUP *ngp);
 extern bool NGlowmark(NEWSGROUP *ngp, long lomark);
 
 extern void NCclearwip(CHANNEL *cp);
 extern void NCclose(void);
 extern void NCsetup(void);
+extern void NCfiltered(CHANNEL *cp, FILTERJOB *job);
+extern void NCstored(CHANNEL *cp, bool accepted);
 extern void NCwritereply(CHANNEL *cp, const char *text);
 extern void NCwriteshutdown(CHANNEL *cp, const char *text);
 
@@ -819,6 +947,8 @@ extern void RCreadlist(void);
 extern void RCsetup(void);
 
 extern bool SITEfunnelpatch(void);
+extern const SITEMASKS *SITEgetmasks(void);
+extern void SITEpathmask(const char **hops, SITEBITS *skip);
 extern bool SITEsetup(SITE *sp);
 extern bool SITEwantsgroup(SITE *sp, char *name);
 extern bool SITEpoisongroup(SITE *sp, char *name);
@@ -835,12 +965,45 @@ extern void SITEforward(SITE *sp, const char *text);
 extern void SITEfree(SITE *sp);
 extern void SITEinfo(struct buffer *bp, SITE *sp, bool Verbose);
 extern void SITEparsefile(bool StartSite);
+extern void SITEresetmasks(void);
+extern void SITEsubscribe(NEWSGROUP *ngp);
 extern void SITEprocdied(SITE *sp, int process, PROCESS *pp);
 extern void SITEsend(SITE *sp, ARTDATA *Data);
 extern void SITEwrite(SITE *sp, const char *text);
 
 extern void STATUSinit(void);
 extern void STATUSmainloophook(void);
+extern void STATUSclosed(CHANNEL *cp);
+extern void STATUSmetrics(struct buffer *out);
+
+extern void SEENsetup(void);
+extern bool SEENenabled(void);
+extern bool SEENcheck(const HASH *hash);
+extern void SEENadd(const HASH *hash);
+
+extern void VERDICTsetup(void);
+extern bool VERDICTenabled(void);
+extern void VERDICTclear(void);
+extern unsigned long VERDICTgeneration(void);
+extern bool VERDICTfind(enum verdict_kind kind, const HASH *key, char **text);
+extern void VERDICTadd(enum verdict_kind kind, const HASH *key,
+                       const char *text);
+extern void VERDICTlogstats(void);
+
+extern void FILTERsetup(void);
+extern void FILTERclose(void);
+extern void FILTERrestart(void);
+extern bool FILTERqueue(CHANNEL *cp, HASH hash, int hopcount);
+extern void FILTERforget(CHANNEL *cp);
+extern unsigned long FILTERpending(void);
+
+extern void STOREsetup(void);
+extern void STOREclose(void);
+extern bool STOREenabled(void);
+extern void STOREqueue(STOREJOB *job);
+extern void STOREsync(void);
+extern void STORElock(void);
+extern void STOREunlock(void);
 
 extern void WIPsetup(void);
 extern WIP *WIPnew(const char *messageid, CHANNEL *cp);
@@ -849,6 +1012,7 @@ extern void WIPfree(WIP *wp);
 extern bool WIPinprogress(const char *msgid, CHANNEL *cp, bool Precommit);
 extern WIP *WIPbyid(const char *messageid);
 extern WIP *WIPbyhash(const HASH hash);
+extern void WIPusage(unsigned long *count, unsigned long *slots);
 
 /*
 **  Python globals and functions
@@ -865,6 +1029,7 @@ extern char *PYmidfilter(char *messageID, int msglen);
 extern void PYmode(OPERATINGMODE mode, OPERATINGMODE newmode, char *reason);
 extern void PYsetup(void);
 extern void PYclose(void);
+extern void PYforked(void);
 #    if PY_MAJOR_VERSION >= 3
 extern PyMODINIT_FUNC PyInit_INN(void);
 #    else
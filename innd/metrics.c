@@ -0,0 +1,418 @@
+/*
+**  Routines for the metrics channel.  Create a Unix-domain stream socket
+**  that a monitoring system, or a local proxy for it, connects to.  Each
+**  client sends an HTTP request, gets back the current counters of the
+**  server in the Prometheus text format, and is disconnected.  This only
+**  reads state innd already keeps, so answering costs about as much as a
+**  ctlinnd command.
+*/
+
+#include "portable/system.h"
+
+#include "inn/innconf.h"
+#include "inn/timer.h"
+#include "innd.h"
+
+
+#ifdef HAVE_UNIX_DOMAIN_SOCKETS
+#    include "portable/socket-unix.h"
+
+/* Longest request we are willing to read. */
+#    define METRICS_MAXREQUEST 8192
+
+static char *METRICSpath = NULL;
+static CHANNEL *METRICSchan;
+static time_t METRICSstarted;
+
+/* Names of the channel types, in the order of enum channel_type. */
+static const char *const METRICSchantypes[] = {
+    "any",  "free",     "remconn", "reject", "nntp",   "localconn", "control",
+    "file", "exploder", "process", "store",  "filter", "metrics"};
+
+#endif /* HAVE_UNIX_DOMAIN_SOCKETS */
+
+
+/*
+**  Start a metric family: its help text and its type.
+*/
+void
+METRICSfamily(struct buffer *out, const char *name, const char *type,
+              const char *help)
+{
+    buffer_append_sprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+                          name, type);
+}
+
+
+/*
+**  Escape a label value.  Returns a static buffer, valid until the next
+**  call.
+*/
+const char *
+METRICSquote(const char *value)
+{
+    static struct buffer quoted;
+    const char *p;
+
+    buffer_set(&quoted, NULL, 0);
+    for (p = value; *p != '\0'; p++)
+        switch (*p) {
+        case '\\':
+            buffer_append(&quoted, "\\\\", 2);
+            break;
+        case '"':
+            buffer_append(&quoted, "\\\"", 2);
+            break;
+        case '\n':
+            buffer_append(&quoted, "\\n", 2);
+            break;
+        default:
+            buffer_append(&quoted, p, 1);
+            break;
+        }
+    buffer_append(&quoted, "", 1);
+    return quoted.data;
+}
+
+
+#ifdef HAVE_UNIX_DOMAIN_SOCKETS
+
+/*
+**  Append the distribution of each timer as a histogram.  The histograms of
+**  timer.c are finer than anyone wants to scrape, so only report them at
+**  every other power of two from 16 microseconds on, where their buckets
+**  start.
+*/
+static void
+METRICStimers(struct buffer *out)
+{
+    struct timer_stats stats;
+    const char *label;
+    unsigned int id, bits;
+
+    if (innconf->timer == 0)
+        return;
+    METRICSfamily(out, "innd_timer_seconds", "histogram",
+                  "Time spent in each innd timer");
+    for (id = 0; id < TMR_MAX; id++) {
+        if (!TMRstats(id, &stats))
+            continue;
+        label = METRICSquote(TMRlabel(TimerNames, id));
+        for (bits = TMR_HIST_BITS; bits < TMR_HIST_RANGE; bits += 2)
+            buffer_append_sprintf(out,
+                                  "innd_timer_seconds_bucket{timer=\"%s\","
+                                  "le=\"%.6f\"} %lu\n",
+                                  label, (double) (1UL << bits) / 1.0e6,
+                                  TMRhistcount(&stats.hist, 1UL << bits));
+        buffer_append_sprintf(out,
+                              "innd_timer_seconds_bucket{timer=\"%s\","
+                              "le=\"+Inf\"} %lu\n",
+                              label, stats.hist.count);
+        buffer_append_sprintf(out,
+                              "innd_timer_seconds_sum{timer=\"%s\"} %.3f\n",
+                              label, (double) stats.total / 1000.0);
+        buffer_append_sprintf(out,
+                              "innd_timer_seconds_count{timer=\"%s\"} %lu\n",
+                              label, stats.hist.count);
+    }
+}
+
+
+/*
+**  Build the whole reply body.
+*/
+static void
+METRICSbody(struct buffer *out)
+{
+    unsigned long types[ARRAY_SIZE(METRICSchantypes)];
+    struct inndhisstats his;
+    unsigned long count, slots;
+    CHANNEL *cp;
+    size_t t;
+    int i;
+
+    METRICSfamily(out, "innd_start_time_seconds", "gauge",
+                  "Time innd started, in seconds since the epoch");
+    buffer_append_sprintf(out, "innd_start_time_seconds %lu\n",
+                          (unsigned long) METRICSstarted);
+
+    METRICSfamily(out, "innd_mode", "gauge",
+                  "Whether innd is running, paused or throttled");
+    buffer_append_sprintf(out, "innd_mode{mode=\"running\"} %d\n",
+                          Mode == OMrunning);
+    buffer_append_sprintf(out, "innd_mode{mode=\"paused\"} %d\n",
+                          Mode == OMpaused);
+    buffer_append_sprintf(out, "innd_mode{mode=\"throttled\"} %d\n",
+                          Mode == OMthrottled);
+
+    memset(types, 0, sizeof(types));
+    for (i = 0; (cp = CHANiter(&i, CTany)) != NULL;)
+        if ((size_t) cp->Type < ARRAY_SIZE(types))
+            types[cp->Type]++;
+    METRICSfamily(out, "innd_channels", "gauge", "Open channels, by type");
+    for (t = 0; t < ARRAY_SIZE(types); t++)
+        if (t != CTany && t != CTfree)
+            buffer_append_sprintf(out, "innd_channels{type=\"%s\"} %lu\n",
+                                  METRICSchantypes[t], types[t]);
+
+    WIPusage(&count, &slots);
+    METRICSfamily(out, "innd_wip_entries", "gauge",
+                  "Articles offered but not yet received");
+    buffer_append_sprintf(out, "innd_wip_entries %lu\n", count);
+    METRICSfamily(out, "innd_wip_slots", "gauge",
+                  "Slots in the table of articles in progress");
+    buffer_append_sprintf(out, "innd_wip_slots %lu\n", slots);
+
+    InndHisTotals(&his);
+    METRICSfamily(out, "innd_history_cache_lookups_total", "counter",
+                  "History lookups, by how the cache answered");
+    buffer_append_sprintf(out,
+                          "innd_history_cache_lookups_total{result=\"hitpos\"}"
+                          " %lu\n",
+                          his.hitpos);
+    buffer_append_sprintf(out,
+                          "innd_history_cache_lookups_total{result=\"hitneg\"}"
+                          " %lu\n",
+                          his.hitneg);
+    buffer_append_sprintf(out,
+                          "innd_history_cache_lookups_total{result=\"miss\"}"
+                          " %lu\n",
+                          his.misses);
+    buffer_append_sprintf(out,
+                          "innd_history_cache_lookups_total{result=\"dne\"}"
+                          " %lu\n",
+                          his.dne);
+    METRICSfamily(out, "innd_history_cache_evictions_total", "counter",
+                  "History cache entries pushed out by new ones");
+    buffer_append_sprintf(out, "innd_history_cache_evictions_total %lu\n",
+                          his.evictions);
+
+    METRICSfamily(out, "innd_cancels_queued", "gauge",
+                  "Cancels waiting to be executed");
+    buffer_append_sprintf(out, "innd_cancels_queued %lu\n", CANCELpending());
+
+    METRICSfamily(out, "innd_filter_pending", "gauge",
+                  "Articles waiting for a filter worker");
+    buffer_append_sprintf(out, "innd_filter_pending %lu\n", FILTERpending());
+
+    METRICStimers(out);
+    STATUSmetrics(out);
+}
+
+
+/*
+**  Whether the request in data is complete, which is when an empty line
+**  ends its headers.
+*/
+static bool
+METRICScomplete(const char *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < length; i++)
+        if (data[i] == '\n') {
+            if (data[i + 1] == '\n')
+                return true;
+            if (data[i + 1] == '\r' && i + 2 < length && data[i + 2] == '\n')
+                return true;
+        }
+    return false;
+}
+
+
+/*
+**  Queue the reply to a request and stop reading from the client.
+*/
+static void
+METRICSreply(CHANNEL *cp, const char *status, struct buffer *body)
+{
+    buffer_sprintf(&cp->Out,
+                   "HTTP/1.0 %s\r\n"
+                   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                   "Content-Length: %lu\r\n"
+                   "Connection: close\r\n\r\n",
+                   status, (unsigned long) body->left);
+    buffer_append(&cp->Out, body->data, body->left);
+    cp->State = CSwritegoodbye;
+    RCHANremove(cp);
+    WCHANadd(cp);
+}
+
+
+/*
+**  Read function for a client.  Wait for the end of the headers of the
+**  request, then answer.  Only GET is supported, whatever the path.
+*/
+static void
+METRICSreader(CHANNEL *cp)
+{
+    struct buffer body = {0, 0, 0, NULL};
+    const char *name;
+    const char *data;
+    size_t length;
+
+    if (CHANreadtext(cp) <= 0) {
+        name = CHANname(cp);
+        CHANclose(cp, name);
+        return;
+    }
+    cp->LastActive = Now.tv_sec;
+
+    /* The In buffer uses .used as the amount of data in it. */
+    data = cp->In.data;
+    length = cp->In.used;
+    if (!METRICScomplete(data, length)) {
+        if (length < METRICS_MAXREQUEST)
+            return;
+        METRICSreply(cp, "431 Request Header Fields Too Large", &body);
+        return;
+    }
+
+    if (length < 4 || memcmp(data, "GET ", 4) != 0) {
+        buffer_set(&body, "Only GET is supported.\n", 23);
+        METRICSreply(cp, "405 Method Not Allowed", &body);
+    } else {
+        METRICSbody(&body);
+        METRICSreply(cp, "200 OK", &body);
+    }
+    free(body.data);
+}
+
+
+/*
+**  Write-done function for a client.  The reply is complete, so hang up.
+*/
+static void
+METRICSwritedone(CHANNEL *cp)
+{
+    CHANclose(cp, CHANname(cp));
+}
+
+
+/*
+**  Read function for the listening socket.  Accept the connection and
+**  create a channel for the client.
+*/
+static void
+METRICSaccept(CHANNEL *cp)
+{
+    int fd;
+    CHANNEL *new;
+
+    if (cp != METRICSchan) {
+        syslog(L_ERROR, "%s internal METRICSaccept wrong channel %p not %p",
+               LogName, (void *) cp, (void *) METRICSchan);
+        return;
+    }
+
+    if ((fd = accept(cp->fd, NULL, NULL)) < 0) {
+        syslog(L_ERROR, "%s cant accept METRICSaccept %m", LogName);
+        return;
+    }
+
+    if (!CHANvalidfd(fd)) {
+        syslog(L_ERROR,
+               "%s cant accept METRICSaccept: file descriptor %d too high "
+               "(see rlimitnofile in inn.conf)",
+               LogName, fd);
+        close(fd);
+        return;
+    }
+
+    new = CHANcreate(fd, CTmetrics, CSgetcmd, METRICSreader,
+                     METRICSwritedone);
+    RCHANadd(new);
+}
+
+
+/*
+**  Write-done function for the listening socket.  Shouldn't happen.
+*/
+static void
+METRICSlistenwritedone(CHANNEL *unused UNUSED)
+{
+    syslog(L_ERROR, "%s internal METRICSlistenwritedone", LogName);
+}
+
+#endif /* HAVE_UNIX_DOMAIN_SOCKETS */
+
+
+/*
+**  Create the listening channel, if metrics are wanted.  Unlike the local
+**  connect channel, failures are not fatal: the metrics are not worth
+**  refusing articles over.
+*/
+void
+METRICSsetup(void)
+{
+#if defined(HAVE_UNIX_DOMAIN_SOCKETS)
+    int i;
+    struct sockaddr_un server;
+
+    METRICSstarted = time(NULL);
+    if (!innconf->metrics)
+        return;
+    if (METRICSpath == NULL)
+        METRICSpath = concatpath(innconf->pathrun, INN_PATH_METRICS);
+    /* Remove old detritus. */
+    if (unlink(METRICSpath) < 0 && errno != ENOENT) {
+        syslog(L_ERROR, "%s cant unlink %s %m", LogName, METRICSpath);
+        return;
+    }
+
+    /* Create a socket and name it. */
+    if ((i = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        syslog(L_ERROR, "%s cant socket %s %m", LogName, METRICSpath);
+        return;
+    }
+    memset(&server, 0, sizeof server);
+    server.sun_family = AF_UNIX;
+    strlcpy(server.sun_path, METRICSpath, sizeof(server.sun_path));
+    if (bind(i, (struct sockaddr *) &server, SUN_LEN(&server)) < 0) {
+        syslog(L_ERROR, "%s cant bind %s %m", LogName, METRICSpath);
+        close(i);
+        return;
+    }
+
+    /* Set it up to wait for connections. */
+    if (listen(i, innconf->maxlisten) < 0) {
+        syslog(L_ERROR, "%s cant listen %s %m", LogName, METRICSpath);
+        close(i);
+        return;
+    }
+
+    if (!CHANvalidfd(i)) {
+        syslog(L_ERROR,
+               "%s cant listen %s: file descriptor %d too high (see "
+               "rlimitnofile in inn.conf)",
+               LogName, METRICSpath, i);
+        close(i);
+        return;
+    }
+
+    METRICSchan = CHANcreate(i, CTmetrics, CSwaiting, METRICSaccept,
+                             METRICSlistenwritedone);
+    syslog(L_NOTICE, "%s metricssetup %s", LogName, CHANname(METRICSchan));
+    RCHANadd(METRICSchan);
+#endif /* defined(HAVE_UNIX_DOMAIN_SOCKETS) */
+}
+
+
+/*
+**  Cleanly shut down the listening channel.  Clients still being answered
+**  are closed along with the other channels.
+*/
+void
+METRICSclose(void)
+{
+#if defined(HAVE_UNIX_DOMAIN_SOCKETS)
+    if (METRICSchan == NULL)
+        return;
+    CHANclose(METRICSchan, CHANname(METRICSchan));
+    METRICSchan = NULL;
+    if (unlink(METRICSpath) < 0)
+        syslog(L_ERROR, "%s cant unlink %s %m", LogName, METRICSpath);
+    free(METRICSpath);
+    METRICSpath = NULL;
+#endif /* defined(HAVE_UNIX_DOMAIN_SOCKETS) */
+}
@@ -9,6 +9,7 @@
 #include "inn/qio.h"
 #include "inn/version.h"
 #include "innd.h"
+#include "innperl.h"
 
 #define BAD_COMMAND_COUNT 10
 
@@ -113,6 +114,25 @@ static char *NCquietlist[] = {INND_QUIET_BADLIST};
 static const char NCterm[] = "\r\n";
 static const char NCdot[] = ".";
 
+/* While NCproc works through the commands received in one read, the replies
+   to them are gathered in the output buffer of the channel and written
+   together when it is done, or once NC_GATHER_REPLIES replies have been
+   gathered or the first of them has waited NC_GATHER_USEC microseconds. */
+#define NC_GATHER_REPLIES 64
+#define NC_GATHER_USEC    10000
+
+/* When NCcheck finds that further CHECK commands have already been received,
+   the history lookups of up to NC_PREFETCH_CHECKS of them are done together
+   (see NCprefetch). */
+#define NC_PREFETCH_CHECKS 32
+
+static struct {
+    CHANNEL *cp;          /* The channel being gathered, or NULL. */
+    bool own;             /* Whether its output buffer was empty. */
+    unsigned int replies; /* Replies gathered since the last write. */
+    struct timeval first; /* When the first of them was gathered. */
+} NCgather;
+
 /*
 ** Clear the WIP entry for the given channel.
 */
@@ -124,14 +144,45 @@ NCclearwip(CHANNEL *cp)
     cp->ArtBeg = 0;
 }
 
+/*
+**  Try to write the output buffer of the channel right away.  Then, if the
+**  write is successful, calls NCwritedone (which does whatever is necessary
+**  to accommodate state changes).  Else, NCwritedone will be called from the
+**  main select loop later.
+*/
+static void
+NCflush(CHANNEL *cp)
+{
+    struct buffer *bp;
+    ssize_t i;
+
+    bp = &cp->Out;
+    i = write(cp->fd, &bp->data[bp->used], bp->left);
+    cp->Writes++;
+    if (Tracing || cp->Tracing)
+        syslog(L_TRACE, "%s NCflush %ld=write(%d, \"%.15s\", %lu)",
+               CHANname(cp), (long) i, cp->fd, &bp->data[bp->used],
+               (unsigned long) bp->left);
+    if (i > 0)
+        bp->used += i;
+    if (bp->used == bp->left) {
+        /* All the data was written. */
+        bp->used = bp->left = 0;
+        NCwritedone(cp);
+    } else {
+        if (i > 0)
+            bp->left -= i;
+        /* Write failed, queue it for later. */
+        WCHANadd(cp);
+    }
+}
+
 /*
 **  Write an NNTP reply message.
 **
 **  Tries to do the actual write immediately if it will not block and if there
-**  is not already other buffered output.  Then, if the write is successful,
-**  calls NCwritedone (which does whatever is necessary to accommodate state
-**  changes).  Else, NCwritedone will be called from the main select loop
-**  later.
+**  is not already other buffered output, with NCflush.  Replies to commands
+**  processed by NCproc are gathered and flushed together instead.
 **
 **  If the reply that we are writing now is associated with a state change,
 **  then cp->State must be set to its new value *before* NCwritereply is
@@ -141,7 +192,8 @@ void
 NCwritereply(CHANNEL *cp, const char *text)
 {
     struct buffer *bp;
-    int i;
+    struct timeval now;
+    size_t left;
 
     /* XXX could do RCHANremove(cp) here, as the old NCwritetext() used to
      * do, but that would be wrong if the channel is streaming (because it
@@ -149,36 +201,33 @@ NCwritereply(CHANNEL *cp, const char *text)
      * never calling RCHANremove here. */
 
     bp = &cp->Out;
-    i = bp->left;
+    left = bp->left;
     WCHANappend(cp, text, strlen(text));     /* Text in buffer. */
     WCHANappend(cp, NCterm, strlen(NCterm)); /* Add CR LF to text. */
+    cp->Replies++;
+    if (Tracing || cp->Tracing)
+        syslog(L_TRACE, "%s > %s", CHANname(cp), text);
 
-    if (i == 0) { /* If only new data, then try to write directly. */
-        i = write(cp->fd, &bp->data[bp->used], bp->left);
-        if (Tracing || cp->Tracing)
-            syslog(L_TRACE, "%s NCwritereply %d=write(%d, \"%.15s\", %lu)",
-                   CHANname(cp), i, cp->fd, &bp->data[bp->used],
-                   (unsigned long) bp->left);
-        if (i > 0)
-            bp->used += i;
-        if (bp->used == bp->left) {
-            /* All the data was written. */
-            bp->used = bp->left = 0;
-            NCwritedone(cp);
-        } else {
-            if (i > 0) {
-                bp->left -= i;
-            }
-            i = 0;
+    if (cp == NCgather.cp && NCgather.own) {
+        if (NCgather.replies++ == 0) {
+            gettimeofday(&NCgather.first, NULL);
+            return;
         }
-    } else {
-        i = 0;
-    }
-    if (i <= 0) { /* Write failed, queue it for later. */
+        if (NCgather.replies < NC_GATHER_REPLIES) {
+            gettimeofday(&now, NULL);
+            if ((now.tv_sec - NCgather.first.tv_sec) * 1000000
+                    + (now.tv_usec - NCgather.first.tv_usec)
+                < NC_GATHER_USEC)
+                return;
+        }
+        /* Waited long enough; go on gathering if all is written. */
+        NCgather.replies = 0;
+        NCflush(cp);
+        NCgather.own = (bp->left == 0);
+    } else if (left == 0)
+        NCflush(cp);
+    else
         WCHANadd(cp);
-    }
-    if (Tracing || cp->Tracing)
-        syslog(L_TRACE, "%s > %s", CHANname(cp), text);
 }
 
 /*
@@ -200,49 +249,16 @@ NCwriteshutdown(CHANNEL *cp, const char *text)
 
 
 /*
-**  We have an entire article collected; try to post it.  If we're
-**  not running, drop the article or just pause and reschedule.
+**  Send the reply for an article that we tried to post, and update the
+**  channel's statistics.
 */
 static void
-NCpostit(CHANNEL *cp)
+NCposted(CHANNEL *cp, bool accepted)
 {
     const char *response;
     char buff[SMBUF];
 
-    if (Mode == OMthrottled) {
-        cp->Reported++;
-        NCwriteshutdown(cp, ModeReason);
-        return;
-    } else if (Mode == OMpaused) {
-        cp->Reported++;
-        if (cp->Sendid.size > 3) {
-            /* In streaming mode, there is no NNTP_FAIL_TAKETHIS_DEFER and RFC
-             * 4644 mentions that we MUST send 400 here and close the
-             * connection so as not to reject the article. Yet, we could have
-             * sent NNTP_FAIL_ACTION without closing the connection... */
-            cp->State = CSwritegoodbye;
-            snprintf(buff, sizeof(buff), "%d %s", NNTP_FAIL_TERMINATING,
-                     ModeReason);
-        } else {
-            cp->State = CSgetcmd;
-            snprintf(buff, sizeof(buff), "%d %s", NNTP_FAIL_IHAVE_DEFER,
-                     ModeReason);
-        }
-        NCwritereply(cp, buff);
-        return;
-    }
-
-    /* Return an error without trying to post the article if the TAKETHIS
-     * command was not correct in the first place (code which does not start
-     * with a '2'). */
-    if ((cp->Sendid.size > 3) && (cp->Sendid.data[0] != NNTP_CLASS_OK)) {
-        cp->State = CSgetcmd;
-        NCwritereply(cp, cp->Sendid.data);
-        return;
-    }
-
-    /* Note that some use break, some use return here. */
-    if (ARTpost(cp)) {
+    if (accepted) {
         cp->Received++;
         if (cp->Sendid.size > 3) { /* We are streaming. */
             cp->Takethis_Ok++;
@@ -300,6 +316,70 @@ NCpostit(CHANNEL *cp)
 }
 
 
+/*
+**  If we're not running, drop the article or just pause and reschedule, and
+**  return true.  Otherwise, return false.
+*/
+static bool
+NCdefer(CHANNEL *cp)
+{
+    char buff[SMBUF];
+
+    if (Mode == OMthrottled) {
+        cp->Reported++;
+        NCwriteshutdown(cp, ModeReason);
+        return true;
+    } else if (Mode == OMpaused) {
+        cp->Reported++;
+        if (cp->Sendid.size > 3) {
+            /* In streaming mode, there is no NNTP_FAIL_TAKETHIS_DEFER and RFC
+             * 4644 mentions that we MUST send 400 here and close the
+             * connection so as not to reject the article. Yet, we could have
+             * sent NNTP_FAIL_ACTION without closing the connection... */
+            cp->State = CSwritegoodbye;
+            snprintf(buff, sizeof(buff), "%d %s", NNTP_FAIL_TERMINATING,
+                     ModeReason);
+        } else {
+            cp->State = CSgetcmd;
+            snprintf(buff, sizeof(buff), "%d %s", NNTP_FAIL_IHAVE_DEFER,
+                     ModeReason);
+        }
+        NCwritereply(cp, buff);
+        return true;
+    }
+    return false;
+}
+
+
+/*
+**  We have an entire article collected; try to post it.  If the article was
+**  handed to the filter workers or to the storage thread, the reply is sent
+**  by NCstored once it is done with.
+*/
+static void
+NCpostit(CHANNEL *cp)
+{
+    bool accepted;
+
+    if (NCdefer(cp))
+        return;
+
+    /* Return an error without trying to post the article if the TAKETHIS
+     * command was not correct in the first place (code which does not start
+     * with a '2'). */
+    if ((cp->Sendid.size > 3) && (cp->Sendid.data[0] != NNTP_CLASS_OK)) {
+        cp->State = CSgetcmd;
+        NCwritereply(cp, cp->Sendid.data);
+        return;
+    }
+
+    accepted = ARTpost(cp);
+    if (cp->State == CSstoring)
+        return;
+    NCposted(cp, accepted);
+}
+
+
 /*
 **  Write-done function.  Close down or set state for what we expect to
 **  read next.
@@ -327,6 +407,10 @@ NCwritedone(CHANNEL *cp)
     case CScancel:
         RCHANadd(cp);
         break;
+
+    case CSstoring:
+        /* NCstored will resume reading once the article is stored. */
+        break;
     }
 }
 
@@ -378,7 +462,9 @@ NChead(CHANNEL *cp)
         free(buff);
         return;
     }
+    STORElock();
     if ((art = SMretrieve(token, RETR_HEAD)) == NULL) {
+        STOREunlock();
         xasprintf(&buff, "%d No such article", NNTP_FAIL_MSGID_NOTFOUND);
         NCwritereply(cp, buff);
         free(buff);
@@ -389,11 +475,12 @@ NChead(CHANNEL *cp)
     xasprintf(&buff, "%d 0 %s head%s", NNTP_OK_HEAD, cp->av[1], NCterm);
     WCHANappend(cp, buff, strlen(buff));
     WCHANappend(cp, art->data, art->len);
+    SMfreearticle(art);
+    STOREunlock();
 
     /* Write the terminator. */
     NCwritereply(cp, NCdot);
     free(buff);
-    SMfreearticle(art);
 }
 
 
@@ -444,13 +531,16 @@ NCstat(CHANNEL *cp)
         free(buff);
         return;
     }
+    STORElock();
     if ((art = SMretrieve(token, RETR_STAT)) == NULL) {
+        STOREunlock();
         xasprintf(&buff, "%d No such article", NNTP_FAIL_MSGID_NOTFOUND);
         NCwritereply(cp, buff);
         free(buff);
         return;
     }
     SMfreearticle(art);
+    STOREunlock();
 
     /* Write the message. */
     xasprintf(&buff, "%d 0 %s status", NNTP_OK_STAT, cp->av[1]);
@@ -624,6 +714,52 @@ NCcapabilities(CHANNEL *cp)
 }
 
 
+#if defined(DO_PERL)
+/*
+**  Run a message-ID through the Perl filter, unless its verdict is known.
+*/
+static char *
+NCperlmid(char *mid)
+{
+    HASH hash;
+    char *filterrc;
+
+    if (!VERDICTenabled() || !PerlFilterActive)
+        return PLmidfilter(mid);
+    hash = HashMessageID(mid);
+    if (VERDICTfind(VERDICT_PERLMID, &hash, &filterrc))
+        return filterrc;
+    filterrc = PLmidfilter(mid);
+    if (PerlFilterActive)
+        VERDICTadd(VERDICT_PERLMID, &hash, filterrc);
+    return filterrc;
+}
+#endif /* defined(DO_PERL) */
+
+
+#if defined(DO_PYTHON)
+/*
+**  Run a message-ID through the Python filter, unless its verdict is known.
+*/
+static char *
+NCpythonmid(char *mid, size_t idlen)
+{
+    HASH hash;
+    char *filterrc;
+
+    if (!VERDICTenabled() || !PythonFilterActive)
+        return PYmidfilter(mid, idlen);
+    hash = HashMessageID(mid);
+    if (VERDICTfind(VERDICT_PYTHONMID, &hash, &filterrc))
+        return filterrc;
+    filterrc = PYmidfilter(mid, idlen);
+    if (PythonFilterActive)
+        VERDICTadd(VERDICT_PYTHONMID, &hash, filterrc);
+    return filterrc;
+}
+#endif /* defined(DO_PYTHON) */
+
+
 /*
 **  The IHAVE command.  Check the message-ID, and see if we want the
 **  article or not.  Set the state appropriately.
@@ -664,7 +800,7 @@ NCihave(CHANNEL *cp)
 
 #if defined(DO_PERL)
     /* Invoke a Perl message filter on the message-ID. */
-    filterrc = PLmidfilter(cp->av[1]);
+    filterrc = NCperlmid(cp->av[1]);
     if (filterrc) {
         cp->Refused++;
         msglen = strlen(cp->av[1]) + 5; /* 3 digits + space + id + null. */
@@ -690,7 +826,7 @@ NCihave(CHANNEL *cp)
     /* Invoke a Python message filter on the message-ID. */
     msglen = strlen(cp->av[1]);
     TMRstart(TMR_PYTHON);
-    filterrc = PYmidfilter(cp->av[1], msglen);
+    filterrc = NCpythonmid(cp->av[1], msglen);
     TMRstop(TMR_PYTHON);
     if (filterrc) {
         cp->Refused++;
@@ -713,7 +849,7 @@ NCihave(CHANNEL *cp)
     }
 #endif
 
-    if (HIScheck(History, cp->av[1]) || cp->Ignore) {
+    if (InndHisHave(cp->av[1]) || cp->Ignore) {
         cp->Refused++;
         cp->Ihave_Duplicate++;
         xasprintf(&buff, "%d Duplicate", NNTP_FAIL_IHAVE_REFUSE);
@@ -1023,6 +1159,12 @@ NCmode(CHANNEL *cp)
         return;
     }
 
+    /* Send the replies gathered so far before handing off. */
+    if (cp == NCgather.cp && NCgather.own && NCgather.replies > 0) {
+        NCgather.replies = 0;
+        NCflush(cp);
+    }
+
     /* Hand off if reached. */
     RChandoff(cp->fd, h);
     if (NCcount > 0)
@@ -1090,7 +1232,7 @@ NC_unimp(CHANNEL *cp)
 **  full amount (i.e., the command or the whole article) process it.
 */
 static void
-NCproc(CHANNEL *cp)
+NCprocess(CHANNEL *cp)
 {
     char *p, *q;
     NCDISPATCH *dp;
@@ -1136,6 +1278,11 @@ NCproc(CHANNEL *cp)
             readmore = true;
             break;
 
+        case CSstoring:
+            movedata = false;
+            readmore = false;
+            break;
+
         case CSgetcmd:
         case CScancel:
             /* Did we get the whole command, terminated with "\r\n"? */
@@ -1440,7 +1587,7 @@ NCproc(CHANNEL *cp)
                     HDR_PARSE_START(HDR__MESSAGE_ID);
                     /* The article posting time has not been parsed.  We cannot
                      * give it to InndHisRemember. */
-                    if (!HIScheck(History, HDR(HDR__MESSAGE_ID))
+                    if (!InndHisHave(HDR(HDR__MESSAGE_ID))
                         && !InndHisRemember(HDR(HDR__MESSAGE_ID), 0))
                         syslog(L_ERROR, "%s cant write history %s %m", LogName,
                                HDR(HDR__MESSAGE_ID));
@@ -1496,6 +1643,9 @@ NCproc(CHANNEL *cp)
                 cp->Argument = NULL;
             }
             NCpostit(cp);
+            /* The storage thread has the article; NCstored takes over. */
+            if (cp->State == CSstoring)
+                break;
             /* Clear the work-in-progress entry. */
             NCclearwip(cp);
             if (cp->State == CSwritegoodbye)
@@ -1647,7 +1797,8 @@ NCproc(CHANNEL *cp)
             break;
         }
 
-        if (cp->State == CSwritegoodbye || cp->Type == CTfree)
+        if (cp->State == CSwritegoodbye || cp->State == CSstoring
+            || cp->Type == CTfree)
             break;
         if (Tracing || cp->Tracing)
             syslog(L_TRACE, "%s NCproc state=%u Start=%lu Next=%lu Used=%lu",
@@ -1685,6 +1836,81 @@ NCproc(CHANNEL *cp)
 }
 
 
+/*
+**  Process the data available on the channel, gathering the replies to the
+**  pipelined commands in it so that they are written with a single system
+**  call.
+*/
+static void
+NCproc(CHANNEL *cp)
+{
+    if (NCgather.cp != NULL) {
+        NCprocess(cp);
+        return;
+    }
+    NCgather.cp = cp;
+    NCgather.own = (cp->Out.left == 0);
+    NCgather.replies = 0;
+    NCprocess(cp);
+    NCgather.cp = NULL;
+    if (NCgather.own && NCgather.replies > 0 && cp->Type != CTfree)
+        NCflush(cp);
+}
+
+
+/*
+**  Resume processing the commands that may already be waiting in the input
+**  buffer once the reply for an article has been sent.
+*/
+static void
+NCresume(CHANNEL *cp)
+{
+    NCclearwip(cp);
+    if (cp->State == CSwritegoodbye)
+        return;
+    cp->State = CSgetcmd;
+    cp->Start = cp->Next;
+    RCHANadd(cp);
+    if (cp->Next < cp->In.used)
+        SCHANadd(cp, Now.tv_sec, NULL, NCproc, NULL);
+}
+
+
+/*
+**  Called once ARTpost has finished with an article it handed to the storage
+**  thread or to the filter workers.  Send the reply and resume processing the
+**  commands that may already be waiting in the input buffer.
+*/
+void
+NCstored(CHANNEL *cp, bool accepted)
+{
+    NCposted(cp, accepted);
+    NCresume(cp);
+}
+
+
+/*
+**  Called once the filter workers are done with the article on this channel.
+**  The server may have been paused or throttled meanwhile, in which case the
+**  article is deferred as if it had just come in.
+*/
+void
+NCfiltered(CHANNEL *cp, FILTERJOB *job)
+{
+    bool accepted;
+
+    cp->State = CSgotarticle;
+    if (NCdefer(cp)) {
+        NCresume(cp);
+        return;
+    }
+    accepted = ARTfiltered(cp, job);
+    if (cp->State == CSstoring)
+        return;
+    NCstored(cp, accepted);
+}
+
+
 /*
 **  Read whatever data is available on the channel.  If we got the
 **  full amount (i.e., the command or the whole article) process it.
@@ -1698,6 +1924,12 @@ NCreader(CHANNEL *cp)
         syslog(L_TRACE, "%s NCreader Used=%lu", CHANname(cp),
                (unsigned long) cp->In.used);
 
+    /* The input buffer holds an article being stored; leave it alone. */
+    if (cp->State == CSstoring) {
+        RCHANremove(cp);
+        return;
+    }
+
     /* Read any data that's there; ignore errors (retry next time it's our
      * turn) and if we got nothing, then it's EOF so mark it closed. */
     if ((i = CHANreadtext(cp)) <= 0) {
@@ -1831,6 +2063,49 @@ NCcreate(int fd, bool MustAuthorize, bool IsLocal)
 **  faster.
 */
 
+/*
+**  Look up in history together the message-ID of the current CHECK command
+**  and those of the CHECK commands right after it in the input buffer, so
+**  that InndHisHaveFor answers each of them in turn without a lookup of its
+**  own.
+*/
+static void
+NCprefetch(CHANNEL *cp)
+{
+    char ids[NC_PREFETCH_CHECKS][NNTP_MAXLEN_MSGID + 1];
+    const char *keys[NC_PREFETCH_CHECKS];
+    struct buffer *bp = &cp->In;
+    const char *p, *end;
+    size_t i, n, len;
+
+    keys[0] = cp->av[1];
+    n = 1;
+    for (i = cp->Next; n < NC_PREFETCH_CHECKS && i < bp->used;
+         i = end - bp->data + 1) {
+        end = memchr(bp->data + i, '\n', bp->used - i);
+        if (end == NULL || end - (bp->data + i) < 6
+            || strncasecmp(bp->data + i, "CHECK", 5) != 0
+            || !ISWHITE(bp->data[i + 5]))
+            break;
+        for (p = bp->data + i + 5; p < end && ISWHITE(*p); p++)
+            ;
+        for (len = 0; p + len < end && !ISWHITE(p[len]) && p[len] != '\r';
+             len++)
+            ;
+        if (len == 0 || len > NNTP_MAXLEN_MSGID)
+            break;
+        memcpy(ids[n], p, len);
+        ids[n][len] = '\0';
+        if (!IsValidMessageID(ids[n], false, laxmid))
+            break;
+        keys[n] = ids[n];
+        n++;
+    }
+    if (n > 1)
+        InndHisPrefetch(cp, keys, n);
+}
+
+
 /*
 **  The CHECK command.  Check the message-ID, and see if we want the
 **  article or not.  Stay in command state.
@@ -1882,7 +2157,7 @@ NCcheck(CHANNEL *cp)
 
 #if defined(DO_PERL)
     /* Invoke a Perl message filter on the message-ID. */
-    filterrc = PLmidfilter(cp->av[1]);
+    filterrc = NCperlmid(cp->av[1]);
     if (filterrc) {
         cp->Refused++;
         snprintf(cp->Sendid.data, cp->Sendid.size, "%d %s %.200s",
@@ -1894,7 +2169,7 @@ NCcheck(CHANNEL *cp)
 
 #if defined(DO_PYTHON)
     /* Invoke a Python message filter on the message-ID. */
-    filterrc = PYmidfilter(cp->av[1], idlen);
+    filterrc = NCpythonmid(cp->av[1], idlen);
     if (filterrc) {
         cp->Refused++;
         snprintf(cp->Sendid.data, cp->Sendid.size, "%d %s %.200s",
@@ -1904,7 +2179,9 @@ NCcheck(CHANNEL *cp)
     }
 #endif /* defined(DO_PYTHON) */
 
-    if (HIScheck(History, cp->av[1]) || cp->Ignore) {
+    if (!InndHisPrefetched(cp))
+        NCprefetch(cp);
+    if (InndHisHaveFor(cp, cp->av[1]) || cp->Ignore) {
         cp->Refused++;
         cp->Check_got++;
         snprintf(cp->Sendid.data, cp->Sendid.size, "%d %s Duplicate",
@@ -1971,7 +2248,7 @@ NCtakethis(CHANNEL *cp)
     } else {
 #if defined(DO_PERL)
         /* Invoke a Perl message filter on the message-ID. */
-        filterrc = PLmidfilter(mid);
+        filterrc = NCperlmid(mid);
         if (filterrc) {
             returncode = NNTP_FAIL_TAKETHIS_REJECT;
         }
@@ -1979,7 +2256,7 @@ NCtakethis(CHANNEL *cp)
 
 #if defined(DO_PYTHON)
         /* Invoke a Python message filter on the message-ID. */
-        filterrc = PYmidfilter(mid, idlen);
+        filterrc = NCpythonmid(mid, idlen);
         if (filterrc) {
             returncode = NNTP_FAIL_TAKETHIS_REJECT;
         }
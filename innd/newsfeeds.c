@@ -4,6 +4,7 @@
 
 #include "portable/system.h"
 
+#include "inn/hashtab.h"
 #include "inn/innconf.h"
 #include "innd.h"
 
@@ -20,7 +21,23 @@ typedef struct _SITEVARIABLES {
 /* The character which introduces a variable assignment or reference. */
 #define VARIABLE_CHAR '$'
 
+/*
+**  A host name that keeps an article from some sites when it is in the Path
+**  header field: the site of that name, unless it ignores the Path, and the
+**  sites that exclude it.
+*/
+typedef struct _SITEPATHHOST {
+    char *Name;
+    SITEBITS *Sites;
+} SITEPATHHOST;
+
 static SITE SITEnull;
+static SITEMASKS SITEmasks;
+static struct hash *SITEpathhosts = NULL;
+static bool SITEmasksvalid = false;
+/* The only W flags innfeed understands, and so the only ones with R. */
+static const char RINGflags[] = {FEED_NAME, FEED_MESSAGEID, FEED_FNLNAMES,
+                                 '\0'};
 static char *SITEfeedspath = NULL;
 static SITEVARIABLES *SITEvariables = NULL;
 
@@ -357,48 +374,22 @@ SITEreadfile(const bool ReadOnly)
 
 
 /*
-**  Modify "subbed" according to the patterns in "patlist."
+**  Compile the patterns of a site, after those of ME, into sp->Wildmat, and
+**  note whether any of them is a poison pattern.
 */
 static void
-SITEsetlist(char **patlist, char *subbed, char *poison, bool *poisonEntry)
+SITEcompile(SITE *sp)
 {
-    char *pat;
-    char *p;
-    char *u;
-    char subvalue;
-    char poisonvalue;
-    NEWSGROUP *ngp;
-    int i;
-
-    while ((pat = *patlist++) != NULL) {
-        subvalue = *pat != SUB_NEGATE && *pat != SUB_POISON;
-        poisonvalue = *pat == SUB_POISON;
-        if (!subvalue)
-            pat++;
-        if (!*pat)
-            continue;
-        if (!*poisonEntry && poisonvalue)
-            *poisonEntry = true;
-
-        /* See if pattern is a simple newsgroup name.  If so, set the
-         * right subbed element for that one group (if found); if not,
-         * pattern-match against all the groups. */
-        for (p = pat; *p; p++)
-            if (*p == '?' || *p == '*' || *p == '[')
-                break;
-        if (*p == '\0') {
-            /* Simple string; look it up, set it. */
-            if ((ngp = NGfind(pat)) != NULL) {
-                subbed[ngp - Groups] = subvalue;
-                poison[ngp - Groups] = poisonvalue;
-            }
-        } else
-            for (p = subbed, u = poison, ngp = Groups, i = nGroups; --i >= 0;
-                 ngp++, p++, u++)
-                if (uwildmat(ngp->Name, pat)) {
-                    *p = subvalue;
-                    *u = poisonvalue;
-                }
+    char **pat;
+
+    sp->Wildmat = uwildmat_list_new();
+    if (sp != &ME && ME.Patterns != NULL)
+        for (pat = ME.Patterns; *pat != NULL; pat++)
+            uwildmat_list_add(sp->Wildmat, *pat);
+    for (pat = sp->Patterns; *pat != NULL; pat++) {
+        if ((*pat)[0] == SUB_POISON && (*pat)[1] != '\0')
+            sp->PoisonEntry = true;
+        uwildmat_list_add(sp->Wildmat, *pat);
     }
 }
 
@@ -453,11 +444,13 @@ SITEparseone(char *Entry, SITE *sp, char *subbed, char *poison)
     char **argv;
     bool JustModerated;
     bool JustUnmoderated;
+    enum uwildmat match;
     int isp;
     SITE *nsp;
     struct buffer b;
     HASHFEEDLIST *hf;
 
+    SITEresetmasks();
     b = sp->Buffer;
     *sp = SITEnull;
     sp->Buffer = b;
@@ -506,12 +499,14 @@ SITEparseone(char *Entry, SITE *sp, char *subbed, char *poison)
         sp->Patterns = CommaSplit(f2);
 
     if (subbed) {
-        /* Read the subscription patterns and set the bits. */
-        memset(subbed, SUB_DEFAULT, nGroups);
-        memset(poison, SUB_DEFAULT, nGroups);
-        if (ME.Patterns)
-            SITEsetlist(ME.Patterns, subbed, poison, &ME.PoisonEntry);
-        SITEsetlist(sp->Patterns, subbed, poison, &sp->PoisonEntry);
+        /* Compile the subscription patterns and set the bits. */
+        SITEcompile(sp);
+        for (p = subbed, u = poison, ngp = Groups, i = nGroups; --i >= 0;
+             ngp++, p++, u++) {
+            match = uwildmat_list_match(sp->Wildmat, ngp->Name);
+            *p = (match == UWILDMAT_MATCH);
+            *u = (match == UWILDMAT_POISON);
+        }
     }
 
     /* Get the third field, the flags. */
@@ -663,6 +658,12 @@ SITEparseone(char *Entry, SITE *sp, char *subbed, char *poison)
             hf->next = sp->HashFeedList;
             sp->HashFeedList = hf;
             break;
+        case 'R':
+            if (*++p && isdigit((unsigned char) *p))
+                sp->RingSize = strtoul(p, NULL, 10) * 1024;
+            else
+                sp->RingSize = SITE_RING_SIZE;
+            break;
         case 'S':
             if (*++p && isdigit((unsigned char) *p))
                 sp->StartSpooling = atol(p);
@@ -746,6 +747,13 @@ SITEparseone(char *Entry, SITE *sp, char *subbed, char *poison)
         return "I param with non-file feed";
     if (sp->Flushpoint == 0 && sp->Type == FTfile)
         sp->Flushpoint = SITE_BUFFER_SIZE;
+    if (sp->RingSize
+        && (sp->Type != FTchannel || strcmp(sp->FileFlags, RINGflags) != 0))
+        return "R param without Tc and Wnm*";
+
+    /* Remember these for groups created later; see SITEsubscribe. */
+    sp->JustModerated = JustModerated;
+    sp->JustUnmoderated = JustUnmoderated;
 
     if (subbed) {
         /* Modify the subscription list based on the flags. */
@@ -840,6 +848,181 @@ SITEparseone(char *Entry, SITE *sp, char *subbed, char *poison)
 }
 
 
+/*
+**  Fill in the lists of sites that get and are poisoned by a single group,
+**  from the patterns and flags each site was parsed with.  Used for groups
+**  added or changed after newsfeeds was read, so that the sites do not have
+**  to be parsed (and their feeds flushed) again.  The lists must have room
+**  for nSites entries.
+*/
+void
+SITEsubscribe(NEWSGROUP *ngp)
+{
+    SITE *sp;
+    int i;
+
+    ngp->nSites = 0;
+    ngp->nPoison = 0;
+    for (sp = Sites, i = 0; i < nSites; sp++, i++) {
+        /* Dropped sites have no name. */
+        if (sp->Name == NULL)
+            continue;
+        if (SITEwantsgroup(sp, ngp->Name)
+            && !(sp->JustModerated && ngp->Rest[0] != NF_FLAG_MODERATED)
+            && !(sp->JustUnmoderated && ngp->Rest[0] == NF_FLAG_MODERATED))
+            ngp->Sites[ngp->nSites++] = i;
+        if (SITEpoisongroup(sp, ngp->Name))
+            ngp->Poison[ngp->nPoison++] = i;
+    }
+}
+
+
+/*
+**  Hash functions for SITEpathhosts.  Host names in the Path header field
+**  are compared without regard to case.
+*/
+static unsigned long
+SITEhosthash(const void *key)
+{
+    const unsigned char *p;
+    unsigned long h = 2166136261UL;
+
+    for (p = key; *p != '\0'; p++) {
+        h ^= (unsigned long) tolower(*p);
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static const void *
+SITEhostkey(const void *entry)
+{
+    return ((const SITEPATHHOST *) entry)->Name;
+}
+
+static bool
+SITEhostequal(const void *key, const void *entry)
+{
+    return strcasecmp(key, ((const SITEPATHHOST *) entry)->Name) == 0;
+}
+
+static void
+SITEhostfree(void *entry)
+{
+    SITEPATHHOST *hp = entry;
+
+    free(hp->Name);
+    free(hp->Sites);
+    free(hp);
+}
+
+
+/*
+**  Note that the site at index i must not get articles with name in their
+**  Path header field.
+*/
+static void
+SITEaddpathhost(const char *name, int i)
+{
+    SITEPATHHOST *hp;
+
+    hp = hash_lookup(SITEpathhosts, name);
+    if (hp == NULL) {
+        hp = xmalloc(sizeof(SITEPATHHOST));
+        hp->Name = xstrdup(name);
+        hp->Sites = xcalloc(SITEmasks.Words, sizeof(SITEBITS));
+        hash_insert(SITEpathhosts, hp->Name, hp);
+    }
+    SITEBITS_SET(hp->Sites, i);
+}
+
+
+/*
+**  Forget the site masks; called whenever a site is parsed or freed.
+*/
+void
+SITEresetmasks(void)
+{
+    SITEmasksvalid = false;
+}
+
+
+/*
+**  Return the site masks, compiling them first if a site has changed.
+*/
+const SITEMASKS *
+SITEgetmasks(void)
+{
+    SITE *sp;
+    char **pp;
+    size_t words;
+    int i;
+
+    if (SITEmasksvalid)
+        return &SITEmasks;
+
+    free(SITEmasks.IgnoreControl);
+    if (SITEpathhosts != NULL)
+        hash_free(SITEpathhosts);
+    words = SITEBITS_WORDS(nSites > 0 ? nSites : 1);
+    SITEmasks.Words = words;
+    SITEmasks.IgnoreControl = xcalloc(5 * words, sizeof(SITEBITS));
+    SITEmasks.NeedOverview = SITEmasks.IgnoreControl + words;
+    SITEmasks.DropFiltered = SITEmasks.NeedOverview + words;
+    SITEmasks.DistRequired = SITEmasks.DropFiltered + words;
+    SITEmasks.Checked = SITEmasks.DistRequired + words;
+    SITEpathhosts = hash_create(nSites * 2 + 16, SITEhosthash, SITEhostkey,
+                                SITEhostequal, SITEhostfree);
+
+    for (i = 0, sp = Sites; i < nSites; i++, sp++) {
+        if (sp->Name == NULL)
+            continue;
+        if (sp->IgnoreControl)
+            SITEBITS_SET(SITEmasks.IgnoreControl, i);
+        if (sp->NeedOverviewCreation)
+            SITEBITS_SET(SITEmasks.NeedOverview, i);
+        if (sp->DropFiltered)
+            SITEBITS_SET(SITEmasks.DropFiltered, i);
+        if (sp->DistRequired)
+            SITEBITS_SET(SITEmasks.DistRequired, i);
+        if (sp->Originator != NULL || sp->Master != NOSITE || sp->MaxSize
+            || sp->MinSize || sp->Hops || sp->Groupcount || sp->Followcount
+            || sp->Crosscount || sp->HashFeedList != NULL
+            || sp->Distributions != NULL)
+            SITEBITS_SET(SITEmasks.Checked, i);
+        if (!sp->IgnorePath)
+            SITEaddpathhost(sp->Name, i);
+        if (sp->Exclusions != NULL)
+            for (pp = sp->Exclusions; *pp != NULL; pp++)
+                SITEaddpathhost(*pp, i);
+    }
+    SITEmasksvalid = true;
+    return &SITEmasks;
+}
+
+
+/*
+**  Set skip to the sites that must not get an article with the given hosts
+**  in its Path header field.
+*/
+void
+SITEpathmask(const char **hops, SITEBITS *skip)
+{
+    const SITEMASKS *masks;
+    SITEPATHHOST *hp;
+    size_t w;
+
+    masks = SITEgetmasks();
+    memset(skip, 0, masks->Words * sizeof(SITEBITS));
+    for (; *hops != NULL; hops++) {
+        hp = hash_lookup(SITEpathhosts, *hops);
+        if (hp != NULL)
+            for (w = 0; w < masks->Words; w++)
+                skip[w] |= hp->Sites[w];
+    }
+}
+
+
 /*
 **  Patch up the funnel references.
 */
@@ -22,41 +22,44 @@
 
 
 /*
-**  Size of hash table.   Change NGH_BUCKET if not a power of two.
+**  The groups are found through an open-addressing table with linear
+**  probing, kept at most half full.  The hash and length of the name in
+**  each slot are stored apart from the group pointers, so that a probe
+**  reads a single small array and only looks at a group whose name has the
+**  right hash and length.
 */
-#define NGH_SIZE      2048
-#define NGH_BUCKET(j) &NGHtable[j & (NGH_SIZE - 1)]
+typedef struct _NGHKEY {
+    unsigned int Hash;
+    unsigned int Length;
+} NGHKEY;
 
-
-/*
-**  Newsgroup hash entry, which is really a hash bucket -- pointers
-**  to all the groups with this hash code.
-*/
-typedef struct _NGHASH {
-    int Size;
-    int Used;
-    NEWSGROUP **Groups;
-} NGHASH;
+/* Number of names NGfindlist hashes before probing the table for them. */
+#define NGH_BATCH 32
 
 
 static struct buffer NGnames;
-static NGHASH NGHtable[NGH_SIZE];
-static int NGHbuckets;
+static NGHKEY *NGHkeys;
+static NEWSGROUP **NGHgroups; /* NULL for an empty slot. */
+static unsigned int NGHmask;
 static int NGHcount;
 
 
 /*
-**  Sorting predicate for qsort call in NGparsefile.  Put newsgroups in
-**  rough order of their activity.  Will be better if we write a "counts"
-**  file sometime.
+**  Find a group in the table, given the hash and length of its name.
 */
-static int
-NGcompare(const void *p1, const void *p2)
+static NEWSGROUP *
+NGHprobe(const char *Name, unsigned int hash, unsigned int length)
 {
-    const NEWSGROUP *const *n1 = p1;
-    const NEWSGROUP *const *n2 = p2;
-
-    return n1[0]->Last - n2[0]->Last;
+    unsigned int slot;
+
+    if (NGHgroups == NULL)
+        return NULL;
+    for (slot = hash & NGHmask; NGHgroups[slot] != NULL;
+         slot = (slot + 1) & NGHmask)
+        if (NGHkeys[slot].Hash == hash && NGHkeys[slot].Length == length
+            && memcmp(Name, NGHgroups[slot]->Name, length) == 0)
+            return NGHgroups[slot];
+    return NULL;
 }
 
 
@@ -69,9 +72,7 @@ static bool
 NGparseentry(NEWSGROUP *ngp, const char *p, char *end)
 {
     char *q;
-    unsigned int j;
-    NGHASH *htp;
-    NEWSGROUP **ngpp;
+    unsigned int j, slot;
     int i;
     ARTNUM lo;
 
@@ -103,19 +104,18 @@ NGparseentry(NEWSGROUP *ngp, const char *p, char *end)
     ngp->Poison = xmalloc(NGHcount * sizeof(int));
     ngp->Alias = NULL;
 
-    /* Find the right bucket for the group, make sure there is room. */
+    /* Find the slot for the group. */
     NGH_HASH(ngp->Name, p, j);
-    htp = NGH_BUCKET(j);
-    for (p = ngp->Name, ngpp = htp->Groups, i = htp->Used; --i >= 0; ngpp++)
-        if (*p == ngpp[0]->Name[0] && strcmp(p, ngpp[0]->Name) == 0) {
-            syslog(L_ERROR, "%s duplicate_group %s", LogName, p);
-            return false;
-        }
-    if (htp->Used >= htp->Size) {
-        htp->Size += NGHbuckets;
-        htp->Groups = xrealloc(htp->Groups, htp->Size * sizeof(NEWSGROUP *));
+    if (NGHprobe(ngp->Name, j, ngp->NameLength) != NULL) {
+        syslog(L_ERROR, "%s duplicate_group %s", LogName, ngp->Name);
+        return false;
     }
-    htp->Groups[htp->Used++] = ngp;
+    for (slot = j & NGHmask; NGHgroups[slot] != NULL;
+         slot = (slot + 1) & NGHmask)
+        ;
+    NGHkeys[slot].Hash = j;
+    NGHkeys[slot].Length = ngp->NameLength;
+    NGHgroups[slot] = ngp;
 
     if (innconf->enableoverview
         && !OVgroupadd(ngp->Name, lo, ngp->Last, ngp->Rest))
@@ -136,7 +136,7 @@ NGparsefile(void)
     int i;
     bool SawMe;
     NEWSGROUP *ngp;
-    NGHASH *htp;
+    unsigned int size;
     char **strings;
     char *active;
     char *end;
@@ -164,19 +164,12 @@ NGparsefile(void)
     NGnames.data = xmalloc(NGnames.size + 1);
     NGnames.used = 0;
 
-    /* Set up the default hash buckets. */
-    NGHbuckets = nGroups / NGH_SIZE;
-    if (NGHbuckets == 0)
-        NGHbuckets = 1;
-    if (NGHtable[0].Groups)
-        for (i = NGH_SIZE, htp = NGHtable; --i >= 0; htp++)
-            htp->Used = 0;
-    else
-        for (i = NGH_SIZE, htp = NGHtable; --i >= 0; htp++) {
-            htp->Size = NGHbuckets;
-            htp->Groups = xmalloc(htp->Size * sizeof(NEWSGROUP *));
-            htp->Used = 0;
-        }
+    /* Set up an empty table with at least twice as many slots as groups. */
+    for (size = 16; size < (unsigned int) nGroups * 2; size <<= 1)
+        ;
+    NGHmask = size - 1;
+    NGHkeys = xmalloc(size * sizeof(NGHKEY));
+    NGHgroups = xcalloc(size, sizeof(NEWSGROUP *));
 
     /* Count the number of sites. */
     SawMe = false;
@@ -199,11 +192,6 @@ NGparsefile(void)
         }
     }
 
-    /* Sort each bucket. */
-    for (i = NGH_SIZE, htp = NGHtable; --i >= 0; htp++)
-        if (htp->Used > 1)
-            qsort(htp->Groups, htp->Used, sizeof htp->Groups[0], NGcompare);
-
     /* Chase down any alias flags. */
     for (ngp = Groups, i = nGroups; --i >= 0; ngp++)
         if (ngp->Rest[0] == NF_FLAG_ALIAS) {
@@ -219,6 +207,75 @@ NGparsefile(void)
         }
 }
 
+/*
+**  Re-read the active file after a group has been added, removed or changed
+**  by one of the ICD routines.  Groups that were already there with the same
+**  flags keep their lists of sites; only the others are matched against the
+**  patterns of each site, with SITEsubscribe.
+*/
+void
+NGreparsefile(void)
+{
+    NEWSGROUP *old;
+    NEWSGROUP **oldpointers;
+    NEWSGROUP *ngp;
+    struct buffer oldnames;
+    char *flags;
+    bool *kept;
+    int nold;
+    int i;
+
+    /* Hide the old groups from NGclose, noting their flags while the old
+     * active file is still there. */
+    old = Groups;
+    nold = nGroups;
+    oldpointers = GroupPointers;
+    oldnames = NGnames;
+    flags = xmalloc(nold);
+    for (i = 0; i < nold; i++)
+        flags[i] = old[i].Rest[0];
+    Groups = NULL;
+    GroupPointers = NULL;
+
+    ICDcloseactive();
+    NGparsefile();
+
+    kept = xcalloc(nGroups, sizeof(bool));
+    for (i = 0; i < nold; i++) {
+        ngp = NGfind(old[i].Name);
+        if (ngp == NULL || ngp->Rest[0] != flags[i])
+            continue;
+        free(ngp->Sites);
+        free(ngp->Poison);
+        ngp->nSites = old[i].nSites;
+        ngp->Sites = old[i].Sites;
+        ngp->nPoison = old[i].nPoison;
+        ngp->Poison = old[i].Poison;
+        old[i].Sites = old[i].Poison = NULL;
+        kept[ngp - Groups] = true;
+    }
+    for (ngp = Groups, i = 0; i < nGroups; ngp++, i++) {
+        if (kept[i])
+            continue;
+        /* newsfeeds may have been edited since it was last read. */
+        if (NGHcount < nSites) {
+            ngp->Sites = xrealloc(ngp->Sites, nSites * sizeof(int));
+            ngp->Poison = xrealloc(ngp->Poison, nSites * sizeof(int));
+        }
+        SITEsubscribe(ngp);
+    }
+
+    for (i = 0; i < nold; i++) {
+        free(old[i].Sites);
+        free(old[i].Poison);
+    }
+    free(old);
+    free(oldpointers);
+    free(oldnames.data);
+    free(flags);
+    free(kept);
+}
+
 /*
 ** Free allocated memory
 */
@@ -227,7 +284,6 @@ NGclose(void)
 {
     int i;
     NEWSGROUP *ngp;
-    NGHASH *htp;
 
     if (Groups) {
         for (i = nGroups, ngp = Groups; --i >= 0; ngp++) {
@@ -240,14 +296,10 @@ NGclose(void)
         free(NGnames.data);
     }
 
-    for (i = NGH_SIZE, htp = NGHtable; --i >= 0; htp++) {
-        htp->Size = NGHbuckets;
-        if (htp->Groups) {
-            free(htp->Groups);
-            htp->Used = 0;
-            htp->Groups = NULL;
-        }
-    }
+    free(NGHkeys);
+    NGHkeys = NULL;
+    free(NGHgroups);
+    NGHgroups = NULL;
 }
 
 /*
@@ -257,18 +309,48 @@ NEWSGROUP *
 NGfind(const char *Name)
 {
     const char *p;
-    int i;
     unsigned int j;
-    NEWSGROUP **ngp;
-    char c;
-    NGHASH *htp;
 
     NGH_HASH(Name, p, j);
-    htp = NGH_BUCKET(j);
-    for (c = *Name, ngp = htp->Groups, i = htp->Used; --i >= 0; ngp++)
-        if (c == ngp[0]->Name[0] && strcmp(Name, ngp[0]->Name) == 0)
-            return ngp[0];
-    return NULL;
+    return NGHprobe(Name, j, p - Name);
+}
+
+
+/*
+**  Look up a NULL-terminated list of newsgroups, as for the Newsgroups
+**  header field of an article.  Returns an array parallel to names, with
+**  NULL for the groups we do not get; it is overwritten by the next call.
+**  The names are hashed a batch at a time before the table is probed, so
+**  that the probes for a long crosspost do not wait on each other.
+*/
+NEWSGROUP **
+NGfindlist(char **names)
+{
+    static NEWSGROUP **found;
+    static int size;
+    unsigned int hash[NGH_BATCH], length[NGH_BATCH];
+    const char *p;
+    unsigned int j;
+    int count, i, k, n;
+
+    for (count = 0; names[count] != NULL; count++)
+        ;
+    if (count >= size) {
+        size = count + 1;
+        found = xrealloc(found, size * sizeof(NEWSGROUP *));
+    }
+    for (i = 0; i < count; i += n) {
+        n = count - i < NGH_BATCH ? count - i : NGH_BATCH;
+        for (k = 0; k < n; k++) {
+            NGH_HASH(names[i + k], p, j);
+            hash[k] = j;
+            length[k] = p - names[i + k];
+        }
+        for (k = 0; k < n; k++)
+            found[i + k] = NGHprobe(names[i + k], hash[k], length[k]);
+    }
+    found[count] = NULL;
+    return found;
 }
 
 
@@ -344,10 +426,6 @@ NGrenumber(NEWSGROUP *ngp)
         return true; /* can't do anything w/o overview */
 
     /* Get a valid offset into the active file. */
-    if (ICDneedsetup) {
-        syslog(L_ERROR, "%s unsynched must reload before renumber", LogName);
-        return false;
-    }
     start = ICDreadactive(&dummy) + ngp->Start;
 
     /* Check the file format. */
@@ -383,6 +461,7 @@ NGrenumber(NEWSGROUP *ngp)
             return false;
         }
         ngp->Last = himark;
+        ICDmarkdirty(f2, f3 - f2 - 1);
         ICDactivedirty++;
     } else if (himark < l && count > 0) {
         /* Do not decrease the high water mark as innd uses it to assign
@@ -403,6 +482,7 @@ NGrenumber(NEWSGROUP *ngp)
             syslog(L_ERROR, NORENUMBER, LogName, ngp->Name, "lo");
             return false;
         }
+        ICDmarkdirty(f3, f4 - f3);
         ICDactivedirty++;
     }
     return true;
@@ -438,6 +518,7 @@ NGlowmark(NEWSGROUP *ngp, long lomark)
             return false;
         }
         ngp->Last = lomark - 1;
+        ICDmarkdirty(f2, f3 - f2 - 1);
         ICDactivedirty++;
     }
     /* Update the low water mark. */
@@ -449,6 +530,7 @@ NGlowmark(NEWSGROUP *ngp, long lomark)
             syslog(L_ERROR, NORENUMBER, LogName, ngp->Name, "lo");
             return false;
         }
+        ICDmarkdirty(f3, f4 - f3);
         ICDactivedirty++;
     }
     return true;
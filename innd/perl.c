@@ -386,11 +386,15 @@ XS(XS_INN_article)
         XSRETURN_UNDEF;
 
     /* Retrieve the article and convert it from wire format. */
+    STORElock();
     art = SMretrieve(token, RETR_ALL);
-    if (art == NULL)
+    if (art == NULL) {
+        STOREunlock();
         XSRETURN_UNDEF;
+    }
     p = wire_to_native(art->data, art->len, &len);
     SMfreearticle(art);
+    STOREunlock();
 
     /* Push a copy of the article onto the Perl stack, free our temporary
        memory allocation, and return the article to Perl. */
@@ -460,7 +464,7 @@ XS(XS_INN_havehist)
         croak("Usage: INN::havehist(msgid)");
 
     msgid = (char *) SvPV_nolen(ST(0));
-    if (HIScheck(History, msgid))
+    if (InndHisHave(msgid))
         XSRETURN_YES;
     else
         XSRETURN_NO;
@@ -490,11 +494,15 @@ XS(XS_INN_head)
         XSRETURN_UNDEF;
 
     /* Retrieve the article headers and convert them from wire format. */
+    STORElock();
     art = SMretrieve(token, RETR_HEAD);
-    if (art == NULL)
+    if (art == NULL) {
+        STOREunlock();
         XSRETURN_UNDEF;
+    }
     p = wire_to_native(art->data, art->len, &len);
     SMfreearticle(art);
+    STOREunlock();
 
     /* Push a copy of the article headers onto the Perl stack, free our
        temporary memory allocation, and return the headers to Perl. */
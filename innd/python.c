@@ -283,7 +283,7 @@ PY_havehist(PyObject *self UNUSED, PyObject *args)
     if (!PyArg_ParseTuple(args, (char *) "s#", &msgid, &msgidlen))
         return NULL;
 
-    if (HIScheck(History, msgid))
+    if (InndHisHave(msgid))
         return PyInt_FromLong(1);
     return PyInt_FromLong(0);
 }
@@ -396,10 +396,14 @@ PY_head(PyObject *self UNUSED, PyObject *args)
 
     if (!HISlookup(History, msgid, NULL, NULL, NULL, &token))
         return Py_BuildValue((char *) "s", "");
-    if ((art = SMretrieve(token, RETR_HEAD)) == NULL)
+    STORElock();
+    if ((art = SMretrieve(token, RETR_HEAD)) == NULL) {
+        STOREunlock();
         return Py_BuildValue((char *) "s", "");
+    }
     p = wire_to_native(art->data, art->len, &headerlen);
     SMfreearticle(art);
+    STOREunlock();
     header = PyString_FromStringAndSize(p, headerlen);
     free(p);
 
@@ -426,10 +430,14 @@ PY_article(PyObject *self UNUSED, PyObject *args)
 
     if (!HISlookup(History, msgid, NULL, NULL, NULL, &token))
         return Py_BuildValue((char *) "s", "");
-    if ((arth = SMretrieve(token, RETR_ALL)) == NULL)
+    STORElock();
+    if ((arth = SMretrieve(token, RETR_ALL)) == NULL) {
+        STOREunlock();
         return Py_BuildValue((char *) "s", "");
+    }
     p = wire_to_native(arth->data, arth->len, &artlen);
     SMfreearticle(arth);
+    STOREunlock();
     art = PyString_FromStringAndSize(p, artlen);
     free(p);
 
@@ -628,6 +636,22 @@ PYclose(void)
 }
 
 
+/*
+**  This runs in a filter worker right after it has been forked.
+*/
+void
+PYforked(void)
+{
+    if (!Py_IsInitialized())
+        return;
+#    if PY_VERSION_HEX >= 0x03070000
+    PyOS_AfterFork_Child();
+#    else
+    PyOS_AfterFork();
+#    endif
+}
+
+
 /*
 **  Check that a method exists and is callable.  Set a pointer to
 **  the corresponding PyObject, or NULL if not found.
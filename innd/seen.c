@@ -0,0 +1,132 @@
+/*
+**  Routines for remembering recently seen Message-IDs.
+**
+**  On a transit server most offers are for articles another peer sent a few
+**  seconds earlier.  InndHisHave looks for the hash of the Message-ID here
+**  before asking the history method, and every Message-ID found in or added
+**  to history is put here, so most of those duplicates are refused without
+**  going to the history database.  Only Message-IDs known to be in history
+**  are kept, so a hit is always right; a miss just means asking history.
+**
+**  The table is a fixed array of buckets, each the size of a cache line and
+**  holding SEEN_WAYS hashes, so a lookup touches a single line.  A new hash
+**  goes in front of its bucket and the oldest one falls off the end.  Unlike
+**  the WIP table, which tracks articles still being received, this only
+**  holds articles already in history.
+*/
+
+#include "portable/system.h"
+
+#include "inn/innconf.h"
+#include "innd.h"
+
+#define SEEN_LINE 64
+#define SEEN_WAYS (SEEN_LINE / sizeof(HASH))
+
+struct seenbucket {
+    HASH hash[SEEN_WAYS];
+};
+
+static struct {
+    struct seenbucket *buckets; /* Aligned on SEEN_LINE. */
+    void *memory;               /* What to free. */
+    unsigned long mask;         /* Number of buckets minus one. */
+} seen;
+
+static const HASH SEENempty;
+
+
+/*
+**  Return the bucket for a hash.  Any bytes of the MD5 will do; his.c uses
+**  the last ones for its own cache, so use the first ones here.
+*/
+static struct seenbucket *
+SEENbucket(const HASH *hash)
+{
+    unsigned long i;
+
+    memcpy(&i, hash, sizeof(i) < sizeof(HASH) ? sizeof(i) : sizeof(HASH));
+    return &seen.buckets[i & seen.mask];
+}
+
+
+/*
+**  Size the table from inn.conf, emptying it.  Called whenever history is
+**  opened, since entries may not be in a history that was replaced.
+*/
+void
+SEENsetup(void)
+{
+    unsigned long count;
+    uintptr_t p;
+
+    free(seen.memory);
+    seen.memory = NULL;
+    seen.buckets = NULL;
+    count = innconf->hisoverlaysize * 1024 / sizeof(struct seenbucket);
+    if (count == 0)
+        return;
+
+    /* Round down to a power of two so that the bucket is a mask away. */
+    while ((count & (count - 1)) != 0)
+        count &= count - 1;
+    seen.mask = count - 1;
+    seen.memory = xcalloc(count + 1, sizeof(struct seenbucket));
+    p = (uintptr_t) seen.memory;
+    p = (p + SEEN_LINE - 1) & ~((uintptr_t) SEEN_LINE - 1);
+    seen.buckets = (struct seenbucket *) p;
+}
+
+
+/*
+**  Whether the table is in use.
+*/
+bool
+SEENenabled(void)
+{
+    return seen.buckets != NULL;
+}
+
+
+/*
+**  Whether a hash is in the table.
+*/
+bool
+SEENcheck(const HASH *hash)
+{
+    struct seenbucket *b;
+    size_t i;
+
+    if (seen.buckets == NULL)
+        return false;
+    b = SEENbucket(hash);
+    for (i = 0; i < SEEN_WAYS; i++)
+        if (memcmp(&b->hash[i], hash, sizeof(HASH)) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+**  Add a hash known to be in history.
+*/
+void
+SEENadd(const HASH *hash)
+{
+    struct seenbucket *b;
+    size_t i;
+
+    if (seen.buckets == NULL)
+        return;
+    b = SEENbucket(hash);
+    for (i = 0; i < SEEN_WAYS; i++) {
+        if (memcmp(&b->hash[i], hash, sizeof(HASH)) == 0)
+            return;
+        if (memcmp(&b->hash[i], &SEENempty, sizeof(HASH)) == 0)
+            break;
+    }
+    if (i == SEEN_WAYS)
+        i--;
+    memmove(&b->hash[1], &b->hash[0], i * sizeof(HASH));
+    b->hash[0] = *hash;
+}
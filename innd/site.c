@@ -7,6 +7,7 @@
 
 #include "inn/fdflag.h"
 #include "inn/innconf.h"
+#include "inn/ring.h"
 #include "innd.h"
 
 
@@ -63,7 +64,7 @@ SITEspool(SITE *sp, CHANNEL *cp)
     }
     if (togo != NULL)
         free(togo);
-    if (!isvalidfd(i)) {
+    if (!CHANvalidfd(i)) {
         syslog(L_ERROR,
                "%s cant SITEspool: file descriptor %d too high (see "
                "rlimitnofile in inn.conf)",
@@ -328,6 +329,87 @@ SITEwrite(SITE *sp, const char *text)
 }
 
 
+/*
+**  Put an article in a channel process's ring instead of writing a line down
+**  the pipe.  The record holds the token, the Message-ID and the names of the
+**  sites that got the article, each nul-terminated, so that the reader can
+**  use them in place.  Returns false if the ring is full.
+*/
+static bool
+SITEringput(SITE *sp, ARTDATA *Data)
+{
+    static struct buffer *record = NULL;
+    HDRCONTENT *hc = Data->HdrContent;
+    SITE *spx;
+    char *p, *end;
+    size_t start;
+    int i;
+
+    if (record == NULL)
+        record = buffer_new();
+    buffer_set(record, Data->TokenText, sizeof(TOKEN) * 2 + 2);
+    buffer_append(record, "", 1);
+    buffer_append(record, HDR(HDR__MESSAGE_ID), HDR_LEN(HDR__MESSAGE_ID));
+    buffer_append(record, "", 1);
+    if (sp->FNLnames.left != 0) {
+        start = record->left;
+        buffer_append(record, sp->FNLnames.data, sp->FNLnames.left);
+        buffer_append(record, "", 1);
+        for (p = record->data + start, end = p + sp->FNLnames.left; p < end;
+             p++)
+            if (*p == ' ')
+                *p = '\0';
+    } else {
+        for (spx = Sites, i = nSites; --i >= 0; spx++)
+            if (spx->Sendit) {
+                buffer_append(record, spx->Name, spx->NameLength);
+                buffer_append(record, "", 1);
+            }
+    }
+    if (!ring_put(sp->Ring, record->data, record->left))
+        return false;
+
+    /* A blank line wakes the process up if it has emptied the ring. */
+    if (ring_wakeup(sp->Ring)) {
+        buffer_append(&sp->Channel->Out, "\n", 1);
+        SITEflushcheck(sp, &sp->Channel->Out);
+    } else
+        sp->Channel->LastActive = Now.tv_sec;
+    return true;
+}
+
+
+/*
+**  Turn the records left in a site's ring back into lines, appended to bp,
+**  and drop the ring.  Used when its reader is gone.
+*/
+static void
+SITEringdrain(SITE *sp, struct buffer *bp)
+{
+    const char *record;
+    char *p, *end;
+    size_t length;
+    unsigned long count = 0;
+
+    if (sp->Ring == NULL)
+        return;
+    while ((record = ring_peek(sp->Ring, &length)) != NULL) {
+        buffer_append(bp, record, length);
+        end = bp->data + bp->used + bp->left;
+        for (p = end - length; p < end; p++)
+            if (*p == '\0')
+                *p = ' ';
+        end[-1] = '\n';
+        ring_advance(sp->Ring);
+        count++;
+    }
+    ring_free(sp->Ring);
+    sp->Ring = NULL;
+    if (count > 0)
+        syslog(L_NOTICE, "%s ring had %lu articles left", sp->Name, count);
+}
+
+
 /*
 **  Send the desired data about an article down a channel.
 */
@@ -353,6 +435,8 @@ SITEwritefromflags(SITE *sp, ARTDATA *Data)
         if (sp->Channel == NULL)
             return;
         bp = &sp->Channel->Out;
+        if (sp->Ring != NULL && !sp->Spooling && SITEringput(sp, Data))
+            return;
     }
     for (Dirty = false, p = sp->FileFlags; *p; p++) {
         switch (*p) {
@@ -592,6 +676,42 @@ SITEspoolwake(CHANNEL *cp)
 }
 
 
+/*
+**  Give a new channel process a new ring.  Its path goes down the pipe as a
+**  control line before anything else so that the process knows to read it.
+**  On failure, the site just keeps using the pipe.
+*/
+static void
+SITEringstart(SITE *sp)
+{
+    char *name, *path, *line;
+    ssize_t length;
+
+    ring_free(sp->Ring);
+    xasprintf(&name, "%s.ring", sp->Name);
+    path = concatpath(innconf->pathrun, name);
+    free(name);
+    sp->Ring = ring_create(path, sp->RingSize);
+    if (sp->Ring == NULL) {
+        syslog(L_ERROR, "%s cant create ring %s %m", sp->Name, path);
+        free(path);
+        return;
+    }
+
+    /* The pipe is new and empty, so this can neither block nor be split. */
+    xasprintf(&line, "%cring %s\n", EXP_CONTROL, path);
+    length = strlen(line);
+    if (write(sp->Channel->fd, line, length) != length) {
+        syslog(L_ERROR, "%s cant send ring %s %m", sp->Name, path);
+        ring_free(sp->Ring);
+        sp->Ring = NULL;
+        unlink(path);
+    }
+    free(line);
+    free(path);
+}
+
+
 /*
 **  Start up a process for a channel, or a spool to a file if we can't.
 **  Create a channel for the site to talk to.
@@ -619,7 +739,7 @@ SITEstartprocess(SITE *sp)
     }
 #endif
 
-    if (!isvalidfd(pan[PIPE_WRITE])) {
+    if (!CHANvalidfd(pan[PIPE_WRITE])) {
         syslog(L_ERROR,
                "%s cant pipe: file descriptor %d too high (see rlimitnofile "
                "in inn.conf)",
@@ -652,6 +772,8 @@ SITEstartprocess(SITE *sp)
         sp->Channel = CHANcreate(
             pan[PIPE_WRITE], sp->Type == FTchannel ? CTprocess : CTexploder,
             CSwriting, SITEreader, SITEwritedone);
+        if (sp->RingSize != 0)
+            SITEringstart(sp);
         free(process);
         return true;
     }
@@ -749,7 +871,7 @@ SITEsetup(SITE *sp)
                 IOError("site file", oerrno);
                 return false;
             }
-            if (!isvalidfd(fd)) {
+            if (!CHANvalidfd(fd)) {
                 syslog(L_ERROR,
                        "%s cant open %s: file descriptor %d too high (see "
                        "rlimitnofile in inn.conf)",
@@ -784,6 +906,7 @@ void
 SITEprocdied(SITE *sp, int process, PROCESS *pp)
 {
     CHANNEL *cp;
+    struct buffer *left = NULL;
 
     syslog(pp->Status ? L_ERROR : L_NOTICE, "%s exit %d elapsed %lu pid %ld",
            sp->Name ? sp->Name : "?", pp->Status,
@@ -792,9 +915,23 @@ SITEprocdied(SITE *sp, int process, PROCESS *pp)
         /* We already started a new process for this channel
          * or this site has been dropped. */
         return;
+    if (sp->Ring != NULL) {
+        /* Hand what the process did not read to the next one. */
+        left = buffer_new();
+        SITEringdrain(sp, left);
+    }
     if ((cp = sp->Channel) != NULL && cp->Type != CTfree)
         CHANclose(cp, CHANname(cp));
     sp->Working = SITEsetup(sp);
+    if (left != NULL) {
+        if (sp->Working && sp->Channel != NULL) {
+            buffer_append(&sp->Channel->Out, left->data, left->left);
+            WCHANadd(sp->Channel);
+        } else if (left->left != 0)
+            syslog(L_ERROR, "%s loss %lu bytes", sp->Name,
+                   (unsigned long) left->left);
+        buffer_free(left);
+    }
     if (!sp->Working) {
         syslog(L_ERROR, "%s cant restart %m", sp->Name);
         return;
@@ -817,6 +954,7 @@ SITEchanclose(CHANNEL *cp)
             /* Found the site that has this channel.  Start that
              * site spooling, copy any data that might be pending,
              * and arrange to retry later. */
+            SITEringdrain(sp, &cp->Out);
             if (!SITEspool(sp, (CHANNEL *) NULL)) {
                 syslog(L_ERROR, "%s loss %lu bytes", sp->Name,
                        (unsigned long) cp->Out.left);
@@ -952,29 +1090,9 @@ SITEflushall(const bool Restart)
 bool
 SITEwantsgroup(SITE *sp, char *name)
 {
-    bool match;
-    bool subvalue;
-    char *pat;
-    char **argv;
-
-    match = SUB_DEFAULT;
-    if (ME.Patterns) {
-        for (argv = ME.Patterns; (pat = *argv++) != NULL;) {
-            subvalue = *pat != SUB_NEGATE && *pat != SUB_POISON;
-            if (!subvalue)
-                pat++;
-            if ((match != subvalue) && uwildmat(name, pat))
-                match = subvalue;
-        }
-    }
-    for (argv = sp->Patterns; (pat = *argv++) != NULL;) {
-        subvalue = *pat != SUB_NEGATE && *pat != SUB_POISON;
-        if (!subvalue)
-            pat++;
-        if ((match != subvalue) && uwildmat(name, pat))
-            match = subvalue;
-    }
-    return match;
+    if (sp->Wildmat == NULL)
+        return false;
+    return uwildmat_list_match(sp->Wildmat, name) == UWILDMAT_MATCH;
 }
 
 
@@ -985,29 +1103,9 @@ SITEwantsgroup(SITE *sp, char *name)
 bool
 SITEpoisongroup(SITE *sp, char *name)
 {
-    bool match;
-    bool poisonvalue;
-    char *pat;
-    char **argv;
-
-    match = SUB_DEFAULT;
-    if (ME.Patterns) {
-        for (argv = ME.Patterns; (pat = *argv++) != NULL;) {
-            poisonvalue = *pat == SUB_POISON;
-            if (*pat == SUB_NEGATE || *pat == SUB_POISON)
-                pat++;
-            if (uwildmat(name, pat))
-                match = poisonvalue;
-        }
-    }
-    for (argv = sp->Patterns; (pat = *argv++) != NULL;) {
-        poisonvalue = *pat == SUB_POISON;
-        if (*pat == SUB_NEGATE || *pat == SUB_POISON)
-            pat++;
-        if (uwildmat(name, pat))
-            match = poisonvalue;
-    }
-    return match;
+    if (sp->Wildmat == NULL)
+        return false;
+    return uwildmat_list_match(sp->Wildmat, name) == UWILDMAT_POISON;
 }
 
 
@@ -1059,6 +1157,7 @@ SITEfree(SITE *sp)
     }
 
     SITEunlink(sp);
+    SITEresetmasks();
 
     sp->Name = NULL;
     if (sp->Process > 0) {
@@ -1086,6 +1185,14 @@ SITEfree(SITE *sp)
         free(sp->Patterns);
         sp->Patterns = NULL;
     }
+    if (sp->Wildmat) {
+        uwildmat_list_free(sp->Wildmat);
+        sp->Wildmat = NULL;
+    }
+    if (sp->Ring) {
+        ring_free(sp->Ring);
+        sp->Ring = NULL;
+    }
     if (sp->Exclusions) {
         free(sp->Exclusions);
         sp->Exclusions = NULL;
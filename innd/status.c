@@ -47,12 +47,18 @@ typedef struct _STATUS {
     unsigned long Ihave_Duplicate;
     unsigned long Ihave_Deferred;
     unsigned long Ihave_SendIt;
+    unsigned long Replies;
+    unsigned long Writes;
     struct _STATUS *next;
 } STATUS;
 
 static unsigned long STATUSlast_time;
 static char start_time[50];
 
+/* What the connections already closed did, by peer, for the counters of the
+   metrics endpoint. */
+static STATUS *STATUSclosedpeers;
+
 static unsigned long
 STATUSgettime(void)
 {
@@ -79,6 +85,80 @@ STATUSinit(void)
     strlcpy(start_time, ctime(&now), sizeof(start_time));
 }
 
+/*
+**  The name a channel is reported under.
+*/
+static const char *
+STATUSname(CHANNEL *cp)
+{
+    return cp->Address.ss_family == 0 ? "localhost" : RChostname(cp);
+}
+
+/*
+**  Allocate a new entry for a peer, with all counters at zero, and append it
+**  to the list starting at head.
+*/
+static STATUS *
+STATUSnew(STATUS **head, const char *name)
+{
+    STATUS *status, **sp;
+
+    status = xcalloc(1, sizeof(STATUS));
+    strlcpy(status->name, name, sizeof(status->name));
+    for (sp = head; *sp != NULL; sp = &(*sp)->next)
+        ;
+    *sp = status;
+    return status;
+}
+
+/*
+**  Find the entry for a peer in the list starting at head.
+*/
+static STATUS *
+STATUSfind(STATUS *head, const char *name)
+{
+    STATUS *status;
+
+    for (status = head; status != NULL; status = status->next)
+        if (strcmp(name, status->name) == 0)
+            break;
+    return status;
+}
+
+/*
+**  Add the article and command counters of a connection to those of its
+**  peer.
+*/
+static void
+STATUSadd(STATUS *status, const CHANNEL *cp)
+{
+    status->accepted += cp->Received;
+    status->refused += cp->Refused;
+    status->rejected += cp->Rejected;
+    status->Duplicate += cp->Duplicate;
+    status->Unwanted_u += cp->Unwanted_u;
+    status->Unwanted_d += cp->Unwanted_d;
+    status->Unwanted_g += cp->Unwanted_g;
+    status->Unwanted_s += cp->Unwanted_s;
+    status->Unwanted_f += cp->Unwanted_f;
+    status->Ihave += cp->Ihave;
+    status->Ihave_Duplicate += cp->Ihave_Duplicate;
+    status->Ihave_Deferred += cp->Ihave_Deferred;
+    status->Ihave_SendIt += cp->Ihave_SendIt;
+    status->Check += cp->Check;
+    status->Check_send += cp->Check_send;
+    status->Check_deferred += cp->Check_deferred;
+    status->Check_got += cp->Check_got;
+    status->Takethis += cp->Takethis;
+    status->Takethis_Ok += cp->Takethis_Ok;
+    status->Takethis_Err += cp->Takethis_Err;
+    status->Replies += cp->Replies;
+    status->Writes += cp->Writes;
+    status->Size += cp->Size;
+    status->DuplicateSize += cp->DuplicateSize;
+    status->RejectSize += cp->RejectSize;
+}
+
 static char *
 PrettySize(float size, char *str)
 {
@@ -139,49 +219,21 @@ STATUSsummary(void)
     fprintf(F, "%s\n", INN_VERSION_STRING);
     fprintf(F, "pid %d started %s\n", (int) getpid(), start_time);
 
-    tmp = head = NULL;
+    head = NULL;
     for (i = 0; (cp = CHANiter(&i, CTnntp)) != NULL;) {
-        strlcpy(TempString,
-                cp->Address.ss_family == 0 ? "localhost" : RChostname(cp),
-                sizeof(TempString));
-        for (status = head; status != NULL; status = status->next) {
-            if (strcmp(TempString, status->name) == 0)
-                break;
-        }
+        strlcpy(TempString, STATUSname(cp), sizeof(TempString));
+        status = STATUSfind(head, TempString);
         if (status == NULL) {
-            status = xmalloc(sizeof(STATUS));
+            status = STATUSnew(&head, TempString);
             peers++; /* A new peer. */
-            strlcpy(status->name, TempString, sizeof(status->name));
-            if (cp->Address.ss_family == 0) {
+            if (cp->Address.ss_family != 0) {
                 /* Connections from lc.c do not have an IP address. */
-                memset(&status->ip_addr, 0, sizeof(status->ip_addr));
-            } else {
                 network_sockaddr_sprint(status->ip_addr,
                                         sizeof(status->ip_addr),
                                         (struct sockaddr *) &cp->Address);
             }
             status->can_stream = cp->Streaming;
             status->maxCxn = cp->MaxCnx;
-            status->seconds = 0;
-            status->Size = status->DuplicateSize = 0;
-            status->RejectSize = 0;
-            status->Ihave = status->Ihave_Duplicate = status->Ihave_Deferred =
-                status->Ihave_SendIt = 0;
-            status->Check = status->Check_send = status->Check_deferred =
-                status->Check_got = 0;
-            status->Takethis = status->Takethis_Ok = status->Takethis_Err = 0;
-            status->activeCxn = status->sleepingCxns = 0;
-            status->accepted = 0;
-            status->refused = status->rejected = 0;
-            status->Duplicate = status->Unwanted_u = 0;
-            status->Unwanted_d = status->Unwanted_g = 0;
-            status->Unwanted_s = status->Unwanted_f = 0;
-            status->next = NULL;
-            if (head == NULL)
-                head = status;
-            else
-                tmp->next = status;
-            tmp = status;
         } else if (cp->Address.ss_family != 0) {
             network_sockaddr_sprint(other_ip_addr, sizeof(other_ip_addr),
                                     (struct sockaddr *) &cp->Address);
@@ -203,33 +255,11 @@ STATUSsummary(void)
             status->seconds = Now.tv_sec - cp->Started;
         if (Now.tv_sec - cp->Started > seconds)
             seconds = Now.tv_sec - cp->Started;
-        status->accepted += cp->Received;
+        STATUSadd(status, cp);
         accepted += cp->Received;
-        status->refused += cp->Refused;
         refused += cp->Refused;
-        status->rejected += cp->Rejected;
         rejected += cp->Rejected;
-        status->Duplicate += cp->Duplicate;
         duplicate += cp->Duplicate;
-        status->Unwanted_u += cp->Unwanted_u;
-        status->Unwanted_d += cp->Unwanted_d;
-        status->Unwanted_g += cp->Unwanted_g;
-        status->Unwanted_s += cp->Unwanted_s;
-        status->Unwanted_f += cp->Unwanted_f;
-        status->Ihave += cp->Ihave;
-        status->Ihave_Duplicate += cp->Ihave_Duplicate;
-        status->Ihave_Deferred += cp->Ihave_Deferred;
-        status->Ihave_SendIt += cp->Ihave_SendIt;
-        status->Check += cp->Check;
-        status->Check_send += cp->Check_send;
-        status->Check_deferred += cp->Check_deferred;
-        status->Check_got += cp->Check_got;
-        status->Takethis += cp->Takethis;
-        status->Takethis_Ok += cp->Takethis_Ok;
-        status->Takethis_Err += cp->Takethis_Err;
-        status->Size += cp->Size;
-        status->DuplicateSize += cp->DuplicateSize;
-        status->RejectSize += cp->RejectSize;
         size += cp->Size;
         DuplicateSize += cp->DuplicateSize;
         RejectSize += cp->RejectSize;
@@ -369,6 +399,11 @@ STATUSsummary(void)
         fprintf(F, "   Takethis: %-6lu     Ok[%d]: %-6lu  Error[%d]: %-6lu\n",
                 status->Takethis, NNTP_OK_TAKETHIS, status->Takethis_Ok,
                 NNTP_FAIL_TAKETHIS_REJECT, status->Takethis_Err);
+        fprintf(F, "    Replies: %-6lu     Writes: %-6lu    Ratio: %.2f\n",
+                status->Replies, status->Writes,
+                status->Writes == 0
+                    ? 0.0
+                    : (double) status->Replies / status->Writes);
         fputc('\n', F);
 
         if (innconf->logstatus) {
@@ -396,6 +431,198 @@ STATUSsummary(void)
     free(path);
 }
 
+/*
+**  Remember what a connection that is being closed did, so that the
+**  counters of its peer in the metrics keep going up.
+*/
+void
+STATUSclosed(CHANNEL *cp)
+{
+    STATUS *status;
+    const char *name;
+
+    if (!innconf->metrics)
+        return;
+    name = STATUSname(cp);
+    status = STATUSfind(STATUSclosedpeers, name);
+    if (status == NULL)
+        status = STATUSnew(&STATUSclosedpeers, name);
+    STATUSadd(status, cp);
+}
+
+/*
+**  Append the metrics for each peer to out: what its open connections did
+**  plus what its closed connections did.
+*/
+void
+STATUSmetrics(struct buffer *out)
+{
+    STATUS *head, *status, *closed;
+    CHANNEL *cp;
+    const char *peer;
+    int i;
+
+    head = NULL;
+    for (closed = STATUSclosedpeers; closed != NULL; closed = closed->next) {
+        status = STATUSnew(&head, closed->name);
+        memcpy(status, closed, sizeof(STATUS));
+        status->next = NULL;
+    }
+    for (i = 0; (cp = CHANiter(&i, CTnntp)) != NULL;) {
+        status = STATUSfind(head, STATUSname(cp));
+        if (status == NULL)
+            status = STATUSnew(&head, STATUSname(cp));
+        STATUSadd(status, cp);
+        if (CHANsleeping(cp))
+            status->sleepingCxns++;
+        else
+            status->activeCxn++;
+    }
+
+    METRICSfamily(out, "innd_peer_connections", "gauge",
+                  "Open incoming connections");
+    for (status = head; status != NULL; status = status->next) {
+        peer = METRICSquote(status->name);
+        buffer_append_sprintf(out,
+                              "innd_peer_connections{peer=\"%s\","
+                              "state=\"active\"} %u\n",
+                              peer, status->activeCxn);
+        buffer_append_sprintf(out,
+                              "innd_peer_connections{peer=\"%s\","
+                              "state=\"sleeping\"} %u\n",
+                              peer, status->sleepingCxns);
+    }
+
+    METRICSfamily(out, "innd_peer_articles_total", "counter",
+                  "Articles offered, by outcome");
+    for (status = head; status != NULL; status = status->next) {
+        peer = METRICSquote(status->name);
+        buffer_append_sprintf(out,
+                              "innd_peer_articles_total{peer=\"%s\","
+                              "result=\"accepted\"} %lu\n",
+                              peer, status->accepted);
+        buffer_append_sprintf(out,
+                              "innd_peer_articles_total{peer=\"%s\","
+                              "result=\"refused\"} %lu\n",
+                              peer, status->refused);
+        buffer_append_sprintf(out,
+                              "innd_peer_articles_total{peer=\"%s\","
+                              "result=\"rejected\"} %lu\n",
+                              peer, status->rejected);
+        buffer_append_sprintf(out,
+                              "innd_peer_articles_total{peer=\"%s\","
+                              "result=\"duplicate\"} %lu\n",
+                              peer, status->Duplicate);
+    }
+
+    METRICSfamily(out, "innd_peer_unwanted_total", "counter",
+                  "Articles rejected because they were unwanted, by reason");
+    for (status = head; status != NULL; status = status->next) {
+        peer = METRICSquote(status->name);
+        buffer_append_sprintf(out,
+                              "innd_peer_unwanted_total{peer=\"%s\","
+                              "reason=\"unapproved\"} %lu\n",
+                              peer, status->Unwanted_u);
+        buffer_append_sprintf(out,
+                              "innd_peer_unwanted_total{peer=\"%s\","
+                              "reason=\"distribution\"} %lu\n",
+                              peer, status->Unwanted_d);
+        buffer_append_sprintf(out,
+                              "innd_peer_unwanted_total{peer=\"%s\","
+                              "reason=\"newsgroup\"} %lu\n",
+                              peer, status->Unwanted_g);
+        buffer_append_sprintf(out,
+                              "innd_peer_unwanted_total{peer=\"%s\","
+                              "reason=\"site\"} %lu\n",
+                              peer, status->Unwanted_s);
+        buffer_append_sprintf(out,
+                              "innd_peer_unwanted_total{peer=\"%s\","
+                              "reason=\"filter\"} %lu\n",
+                              peer, status->Unwanted_f);
+    }
+
+    METRICSfamily(out, "innd_peer_bytes_total", "counter",
+                  "Size of the articles received, by outcome");
+    for (status = head; status != NULL; status = status->next) {
+        peer = METRICSquote(status->name);
+        buffer_append_sprintf(out,
+                              "innd_peer_bytes_total{peer=\"%s\","
+                              "result=\"accepted\"} %.0f\n",
+                              peer, (double) status->Size);
+        buffer_append_sprintf(out,
+                              "innd_peer_bytes_total{peer=\"%s\","
+                              "result=\"duplicate\"} %.0f\n",
+                              peer, (double) status->DuplicateSize);
+        buffer_append_sprintf(out,
+                              "innd_peer_bytes_total{peer=\"%s\","
+                              "result=\"rejected\"} %.0f\n",
+                              peer, (double) status->RejectSize);
+    }
+
+    METRICSfamily(out, "innd_peer_replies_total", "counter",
+                  "Replies to IHAVE, CHECK and TAKETHIS, by code");
+    for (status = head; status != NULL; status = status->next) {
+        peer = METRICSquote(status->name);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"ihave\",code=\"%d\"} %lu\n",
+                              peer, NNTP_CONT_IHAVE, status->Ihave_SendIt);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"ihave\",code=\"%d\"} %lu\n",
+                              peer, NNTP_FAIL_IHAVE_REFUSE,
+                              status->Ihave_Duplicate);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"ihave\",code=\"%d\"} %lu\n",
+                              peer, NNTP_FAIL_IHAVE_DEFER,
+                              status->Ihave_Deferred);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"check\",code=\"%d\"} %lu\n",
+                              peer, NNTP_OK_CHECK, status->Check_send);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"check\",code=\"%d\"} %lu\n",
+                              peer, NNTP_FAIL_CHECK_REFUSE, status->Check_got);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"check\",code=\"%d\"} %lu\n",
+                              peer, NNTP_FAIL_CHECK_DEFER,
+                              status->Check_deferred);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"takethis\",code=\"%d\"} %lu\n",
+                              peer, NNTP_OK_TAKETHIS, status->Takethis_Ok);
+        buffer_append_sprintf(out,
+                              "innd_peer_replies_total{peer=\"%s\","
+                              "command=\"takethis\",code=\"%d\"} %lu\n",
+                              peer, NNTP_FAIL_TAKETHIS_REJECT,
+                              status->Takethis_Err);
+    }
+
+    METRICSfamily(out, "innd_peer_reply_lines_total", "counter",
+                  "Reply lines sent to the peer");
+    for (status = head; status != NULL; status = status->next)
+        buffer_append_sprintf(out,
+                              "innd_peer_reply_lines_total{peer=\"%s\"} "
+                              "%lu\n",
+                              METRICSquote(status->name), status->Replies);
+    METRICSfamily(out, "innd_peer_reply_writes_total", "counter",
+                  "Writes the reply lines to the peer took");
+    for (status = head; status != NULL; status = status->next)
+        buffer_append_sprintf(out,
+                              "innd_peer_reply_writes_total{peer=\"%s\"} "
+                              "%lu\n",
+                              METRICSquote(status->name), status->Writes);
+
+    while (head != NULL) {
+        status = head->next;
+        free(head);
+        head = status;
+    }
+}
+
 void
 STATUSmainloophook(void)
 {
@@ -0,0 +1,324 @@
+/*
+**  Routines for writing articles to the storage subsystem from a separate
+**  thread.
+**
+**  When storethread is set in inn.conf, ARTpost hands each accepted article
+**  to a single storage thread instead of calling SMstore itself, so that the
+**  main loop can keep reading from other channels while the article is being
+**  written.  When SMstore returns, the thread puts the job on a list of
+**  completed jobs and writes a byte to a pipe; the read end of that pipe is
+**  a channel in the main loop whose reader calls the Done function of each
+**  completed job.  History, overview, logging and propagation thus all stay
+**  in the main thread.
+**
+**  The storage methods are not thread-safe, so the main thread must wrap
+**  every other call to the storage API in STORElock and STOREunlock.  Only
+**  one thread is used for the same reason.
+*/
+
+#include "portable/system.h"
+
+#include <errno.h>
+#include <signal.h>
+#ifdef HAVE_PTHREAD
+#    include <pthread.h>
+#endif
+
+#include "inn/fdflag.h"
+#include "inn/innconf.h"
+#include "innd.h"
+
+#ifdef HAVE_PTHREAD
+
+static struct {
+    bool running;
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;    /* Protects everything below. */
+    pthread_cond_t work;     /* Signalled when a job is queued. */
+    pthread_cond_t idle;     /* Signalled when the queue is drained. */
+    pthread_mutex_t storage; /* Held around any storage API call. */
+    STOREJOB *queue;         /* Jobs waiting for the thread. */
+    STOREJOB **queue_tail;
+    STOREJOB *done;          /* Jobs waiting for their Done function. */
+    STOREJOB **done_tail;
+    unsigned long pending;   /* Jobs queued or being stored. */
+    int pipe[2];
+    CHANNEL *channel;
+} store;
+
+
+/*
+**  The storage thread.  Store queued articles until told to stop.
+*/
+static void *
+STOREthread(void *arg UNUSED)
+{
+    STOREJOB *job;
+    char c = 0;
+
+    pthread_mutex_lock(&store.lock);
+    while (true) {
+        while (store.queue == NULL && !store.stopping)
+            pthread_cond_wait(&store.work, &store.lock);
+        if (store.queue == NULL)
+            break;
+        job = store.queue;
+        store.queue = job->Next;
+        if (store.queue == NULL)
+            store.queue_tail = &store.queue;
+        pthread_mutex_unlock(&store.lock);
+
+        pthread_mutex_lock(&store.storage);
+        job->Token = SMstore(job->Article);
+        job->Errno = SMerrno;
+        if (job->Token.type == TOKEN_EMPTY)
+            job->Error = xstrdup(SMerrorstr != NULL ? SMerrorstr : "unknown");
+        pthread_mutex_unlock(&store.storage);
+
+        pthread_mutex_lock(&store.lock);
+        job->Next = NULL;
+        *store.done_tail = job;
+        store.done_tail = &job->Next;
+        if (--store.pending == 0)
+            pthread_cond_broadcast(&store.idle);
+        /* A full pipe already has a wakeup pending. */
+        if (write(store.pipe[PIPE_WRITE], &c, 1) < 0 && errno != EAGAIN)
+            syswarn("SERVER cant write to storage thread pipe");
+    }
+    pthread_mutex_unlock(&store.lock);
+    return NULL;
+}
+
+
+/*
+**  Run the Done function of each completed job.  Jobs are taken off the list
+**  one at a time since a Done function may end up calling STOREsync.
+*/
+static void
+STOREfinish(void)
+{
+    STOREJOB *job;
+
+    while (true) {
+        pthread_mutex_lock(&store.lock);
+        job = store.done;
+        if (job != NULL) {
+            store.done = job->Next;
+            if (store.done == NULL)
+                store.done_tail = &store.done;
+        }
+        pthread_mutex_unlock(&store.lock);
+        if (job == NULL)
+            break;
+        job->Next = NULL;
+        (*job->Done)(job);
+    }
+}
+
+
+/*
+**  Read function for the pipe channel.  Drain the pipe, then finish the
+**  completed jobs.
+*/
+static void
+STOREreader(CHANNEL *cp)
+{
+    char buff[64];
+
+    while (read(cp->fd, buff, sizeof(buff)) > 0)
+        ;
+    STOREfinish();
+}
+
+
+/*
+**  Start the storage thread if inn.conf asks for it.  Must be called after
+**  the storage subsystem has been initialized.
+*/
+void
+STOREsetup(void)
+{
+    sigset_t all, old;
+    int status;
+
+    if (!innconf->storethread || store.running)
+        return;
+    if (pipe(store.pipe) < 0) {
+        syswarn("SERVER cant pipe for storage thread");
+        return;
+    }
+    if (!CHANvalidfd(store.pipe[PIPE_READ])) {
+        warn("SERVER cant start storage thread: file descriptor %d too high",
+             store.pipe[PIPE_READ]);
+        close(store.pipe[PIPE_READ]);
+        close(store.pipe[PIPE_WRITE]);
+        return;
+    }
+    fdflag_nonblocking(store.pipe[PIPE_WRITE], true);
+    fdflag_close_exec(store.pipe[PIPE_WRITE], true);
+
+    pthread_mutex_init(&store.lock, NULL);
+    pthread_mutex_init(&store.storage, NULL);
+    pthread_cond_init(&store.work, NULL);
+    pthread_cond_init(&store.idle, NULL);
+    store.queue = NULL;
+    store.queue_tail = &store.queue;
+    store.done = NULL;
+    store.done_tail = &store.done;
+    store.pending = 0;
+    store.stopping = false;
+
+    /* Signals are handled by the main thread only. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(&store.thread, NULL, STOREthread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        errno = status;
+        syswarn("SERVER cant create storage thread");
+        close(store.pipe[PIPE_READ]);
+        close(store.pipe[PIPE_WRITE]);
+        return;
+    }
+
+    store.channel = CHANcreate(store.pipe[PIPE_READ], CTstore, CSwaiting,
+                               STOREreader, NULL);
+    RCHANadd(store.channel);
+    store.running = true;
+    notice("SERVER storing articles in a separate thread");
+}
+
+
+/*
+**  Whether ARTpost should hand articles to the storage thread.
+*/
+bool
+STOREenabled(void)
+{
+    return store.running;
+}
+
+
+/*
+**  Hand an article to the storage thread.  Its Done function will be called
+**  from the main loop once it has been stored.
+*/
+void
+STOREqueue(STOREJOB *job)
+{
+    job->Next = NULL;
+    job->Error = NULL;
+    pthread_mutex_lock(&store.lock);
+    *store.queue_tail = job;
+    store.queue_tail = &job->Next;
+    store.pending++;
+    pthread_cond_signal(&store.work);
+    pthread_mutex_unlock(&store.lock);
+}
+
+
+/*
+**  Wait for the storage thread to store every queued article, and finish
+**  them.  Used before anything that could invalidate the state kept for
+**  pending articles.
+*/
+void
+STOREsync(void)
+{
+    if (!store.running)
+        return;
+    pthread_mutex_lock(&store.lock);
+    while (store.pending > 0)
+        pthread_cond_wait(&store.idle, &store.lock);
+    pthread_mutex_unlock(&store.lock);
+    STOREfinish();
+}
+
+
+/*
+**  Serialize the main thread's own calls to the storage API with the
+**  storage thread.
+*/
+void
+STORElock(void)
+{
+    if (store.running)
+        pthread_mutex_lock(&store.storage);
+}
+
+void
+STOREunlock(void)
+{
+    if (store.running)
+        pthread_mutex_unlock(&store.storage);
+}
+
+
+/*
+**  Finish pending articles and stop the storage thread.
+*/
+void
+STOREclose(void)
+{
+    if (!store.running)
+        return;
+    STOREsync();
+    pthread_mutex_lock(&store.lock);
+    store.stopping = true;
+    pthread_cond_signal(&store.work);
+    pthread_mutex_unlock(&store.lock);
+    pthread_join(store.thread, NULL);
+    store.running = false;
+
+    CHANclose(store.channel, CHANname(store.channel));
+    store.channel = NULL;
+    close(store.pipe[PIPE_WRITE]);
+    pthread_mutex_destroy(&store.lock);
+    pthread_mutex_destroy(&store.storage);
+    pthread_cond_destroy(&store.work);
+    pthread_cond_destroy(&store.idle);
+}
+
+#else /* !HAVE_PTHREAD */
+
+void
+STOREsetup(void)
+{
+    if (innconf->storethread)
+        warn("SERVER storethread set but threads are not supported");
+}
+
+bool
+STOREenabled(void)
+{
+    return false;
+}
+
+void
+STOREqueue(STOREJOB *job UNUSED)
+{
+    die("SERVER internal STOREqueue called without threads");
+}
+
+void
+STOREsync(void)
+{
+}
+
+void
+STORElock(void)
+{
+}
+
+void
+STOREunlock(void)
+{
+}
+
+void
+STOREclose(void)
+{
+}
+
+#endif /* !HAVE_PTHREAD */
@@ -309,12 +309,56 @@ ThrottleNoMatchError(void)
     }
 }
 
+/* History cache counters, for the next ME HISstats line and since start. */
+static struct inndhisstats HisInterval;
+static struct inndhisstats HisTotals;
+
+/*
+**  Answers of InndHisPrefetch, in the order of its keys, for the channel
+**  that asked for them.  InndHisHaveFor uses them for that channel as long
+**  as it is asked about the same keys in the same order, and they are
+**  dropped as soon as it is asked about another one or something is written
+**  to history.  Other channels never see them.
+*/
+#define HISAHEAD_MAX 64
+
+static struct {
+    const CHANNEL *owner;
+    HASH hash[HISAHEAD_MAX];
+    bool found[HISAHEAD_MAX];
+    size_t count; /* Answers held. */
+    size_t next;  /* The one for the next call to InndHisHaveFor. */
+} HisAhead;
+
+/*
+**  HISstats resets the counters of the history method each time it is
+**  called, so collect them here both for the next ME HISstats line and for
+**  the running totals reported by the metrics socket.
+*/
+static void
+InndHisDrain(void)
+{
+    struct histstats stats = HISstats(History);
+
+    HisInterval.hitpos += stats.hitpos;
+    HisInterval.hitneg += stats.hitneg;
+    HisInterval.misses += stats.misses;
+    HisInterval.dne += stats.dne;
+    HisInterval.evictions += stats.evictions;
+    HisTotals.hitpos += stats.hitpos;
+    HisTotals.hitneg += stats.hitneg;
+    HisTotals.misses += stats.misses;
+    HisTotals.dne += stats.dne;
+    HisTotals.evictions += stats.evictions;
+}
+
 void
 InndHisOpen(void)
 {
     char *histpath;
     int flags;
-    size_t synccount;
+    size_t synccount, batchsize;
+    unsigned long batchdelay, resizefill;
 
     histpath = concatpath(innconf->pathhistory, INN_PATH_HISTORY);
     if (innconf->hismethod == NULL) {
@@ -332,6 +376,13 @@ InndHisOpen(void)
     HISsetcache(History, 1024 * innconf->hiscachesize);
     synccount = innconf->icdsynccount;
     HISctl(History, HISCTLS_SYNCCOUNT, &synccount);
+    batchdelay = innconf->hisbatchdelay;
+    HISctl(History, HISCTLS_BATCHDELAY, &batchdelay);
+    batchsize = innconf->hisbatchsize;
+    HISctl(History, HISCTLS_BATCHSIZE, &batchsize);
+    resizefill = innconf->hisv6resizefill;
+    HISctl(History, HISCTLS_RESIZEFILL, &resizefill);
+    SEENsetup();
 }
 
 void
@@ -339,6 +390,7 @@ InndHisClose(void)
 {
     if (History == NULL)
         return;
+    InndHisDrain();
     if (!HISclose(History)) {
         char *histpath;
 
@@ -348,6 +400,98 @@ InndHisClose(void)
         free(histpath);
     }
     History = NULL;
+    HisAhead.count = 0;
+}
+
+/*
+**  Look up several Message-IDs in history at once, ahead of the calls to
+**  InndHisHaveFor for them by the same channel, so that the history method
+**  can overlap their lookups.
+*/
+void
+InndHisPrefetch(const CHANNEL *cp, const char *const *keys, size_t n)
+{
+    const char *todo[HISAHEAD_MAX];
+    size_t where[HISAHEAD_MAX];
+    bool found[HISAHEAD_MAX];
+    size_t i, count;
+
+    if (n > HISAHEAD_MAX)
+        n = HISAHEAD_MAX;
+    if (SEENenabled())
+        TMRstart(TMR_HISSEEN);
+    for (i = 0, count = 0; i < n; i++) {
+        HisAhead.hash[i] = HashMessageID(keys[i]);
+        HisAhead.found[i] = SEENenabled() && SEENcheck(&HisAhead.hash[i]);
+        if (!HisAhead.found[i]) {
+            where[count] = i;
+            todo[count++] = keys[i];
+        }
+    }
+    if (count > 0) {
+        HIScheck_batch(History, todo, count, found);
+        for (i = 0; i < count; i++) {
+            HisAhead.found[where[i]] = found[i];
+            if (found[i] && SEENenabled())
+                SEENadd(&HisAhead.hash[where[i]]);
+        }
+    }
+    if (SEENenabled())
+        TMRstop(TMR_HISSEEN);
+    HisAhead.owner = cp;
+    HisAhead.count = n;
+    HisAhead.next = 0;
+}
+
+/*
+**  Whether answers of InndHisPrefetch are waiting to be used by a channel.
+*/
+bool
+InndHisPrefetched(const CHANNEL *cp)
+{
+    return HisAhead.owner == cp && HisAhead.next < HisAhead.count;
+}
+
+/*
+**  Whether a Message-ID is in history, using the answers prefetched for the
+**  channel asking if they are about it.
+*/
+bool
+InndHisHaveFor(const CHANNEL *cp, const char *key)
+{
+    HASH hash;
+
+    if (InndHisPrefetched(cp)) {
+        hash = HashMessageID(key);
+        if (memcmp(&hash, &HisAhead.hash[HisAhead.next], sizeof(HASH)) == 0)
+            return HisAhead.found[HisAhead.next++];
+        HisAhead.count = 0;
+    }
+    return InndHisHave(key);
+}
+
+/*
+**  Whether a Message-ID is in history.  Recently seen ones are found without
+**  asking the history method; the nested hishave timer counts the misses.
+*/
+bool
+InndHisHave(const char *key)
+{
+    HASH hash;
+    bool r;
+
+    if (!SEENenabled())
+        return HIScheck(History, key);
+    TMRstart(TMR_HISSEEN);
+    hash = HashMessageID(key);
+    r = SEENcheck(&hash);
+    if (!r) {
+        r = HIScheck(History, key);
+        if (r)
+            SEENadd(&hash);
+    }
+    TMRstop(TMR_HISSEEN);
+    return r;
 }
 
 bool
@@ -356,8 +500,15 @@ InndHisWrite(const char *key, time_t arrived, time_t posted, time_t expires,
 {
     bool r = HISwrite(History, key, arrived, posted, expires, token);
 
+    HisAhead.count = 0;
+
     if (r != true)
         IOError("history write", errno);
+    else if (SEENenabled()) {
+        HASH hash = HashMessageID(key);
+
+        SEENadd(&hash);
+    }
     return r;
 }
 
@@ -370,16 +521,34 @@ InndHisRemember(const char *key, time_t posted)
 {
     bool r = HISremember(History, key, Now.tv_sec, posted);
 
+    HisAhead.count = 0;
+
     if (r != true)
         IOError("history remember", errno);
+    else if (SEENenabled()) {
+        HASH hash = HashMessageID(key);
+
+        SEENadd(&hash);
+    }
     return r;
 }
 
 void
 InndHisLogStats(void)
 {
-    struct histstats stats = HISstats(History);
+    InndHisDrain();
+    notice("ME HISstats %lu hitpos %lu hitneg %lu missed %lu dne %lu evicted",
+           HisInterval.hitpos, HisInterval.hitneg, HisInterval.misses,
+           HisInterval.dne, HisInterval.evictions);
+    memset(&HisInterval, 0, sizeof(HisInterval));
+}
 
-    notice("ME HISstats %d hitpos %d hitneg %d missed %d dne", stats.hitpos,
-           stats.hitneg, stats.misses, stats.dne);
+/*
+**  Return the history cache counters since innd started.
+*/
+void
+InndHisTotals(struct inndhisstats *stats)
+{
+    InndHisDrain();
+    *stats = HisTotals;
 }
@@ -0,0 +1,199 @@
+/*
+**  Routines for remembering what the filters said about an article.
+**
+**  Spam runs are offered by every peer within a few minutes, and the Perl
+**  and Python hooks reach the same verdict each time; CHECK followed by
+**  TAKETHIS even calls the Message-ID filter twice for a single article.
+**  The callers look here first and add whatever the filter said, accepting
+**  or rejecting, once it has run.  Message-ID verdicts are keyed by the hash
+**  of the Message-ID, article verdicts by that hash mixed with a hash of the
+**  body, so that a reused Message-ID does not get the verdict of another
+**  article.  Entries expire after innconf->filtercachetime seconds, and the
+**  whole table is emptied whenever a filter is reloaded or turned on or off.
+**
+**  As in seen.c, the table is a fixed array of buckets of VERDICT_WAYS
+**  entries; a new verdict goes in front of its bucket and the oldest one
+**  falls off the end.
+*/
+
+#include "portable/system.h"
+
+#include "inn/innconf.h"
+#include "innd.h"
+
+#define VERDICT_WAYS 4
+
+struct verdict {
+    HASH key;
+    time_t expires;
+    enum verdict_kind kind;
+    char *text; /* NULL if the filter accepted the article. */
+};
+
+struct verdictbucket {
+    struct verdict entry[VERDICT_WAYS];
+};
+
+static struct {
+    struct verdictbucket *buckets;
+    unsigned long mask; /* Number of buckets minus one. */
+    unsigned long hits[VERDICT_MAX];
+    unsigned long misses[VERDICT_MAX];
+    unsigned long generation; /* Bumped each time the table is emptied. */
+} verdicts;
+
+
+/*
+**  Return the bucket for a key.
+*/
+static struct verdictbucket *
+VERDICTbucket(const HASH *key)
+{
+    unsigned long i;
+
+    memcpy(&i, key, sizeof(i) < sizeof(HASH) ? sizeof(i) : sizeof(HASH));
+    return &verdicts.buckets[i & verdicts.mask];
+}
+
+
+/*
+**  Size the table from inn.conf.
+*/
+void
+VERDICTsetup(void)
+{
+    unsigned long count;
+
+    count = innconf->filtercachesize * 1024 / sizeof(struct verdictbucket);
+    if (count == 0 || innconf->filtercachetime == 0)
+        return;
+
+    /* Round down to a power of two so that the bucket is a mask away. */
+    while ((count & (count - 1)) != 0)
+        count &= count - 1;
+    verdicts.mask = count - 1;
+    verdicts.buckets = xcalloc(count, sizeof(struct verdictbucket));
+}
+
+
+/*
+**  Whether the table is in use.
+*/
+bool
+VERDICTenabled(void)
+{
+    return verdicts.buckets != NULL;
+}
+
+
+/*
+**  Which emptying of the table the verdicts added now belong to.  A verdict
+**  worked out before the last VERDICTclear, by a filter worker still running
+**  the old filters, must not be added.
+*/
+unsigned long
+VERDICTgeneration(void)
+{
+    return verdicts.generation;
+}
+
+
+/*
+**  Forget every verdict, after the filters changed.
+*/
+void
+VERDICTclear(void)
+{
+    struct verdict *v;
+    unsigned long i;
+    size_t j;
+
+    verdicts.generation++;
+    if (verdicts.buckets == NULL)
+        return;
+    for (i = 0; i <= verdicts.mask; i++)
+        for (j = 0; j < VERDICT_WAYS; j++) {
+            v = &verdicts.buckets[i].entry[j];
+            free(v->text);
+            v->text = NULL;
+            v->expires = 0;
+        }
+}
+
+
+/*
+**  Look for the verdict of a filter.  Returns true if it is known, in which
+**  case text is set to it; it stays valid until the next VERDICTadd.
+*/
+bool
+VERDICTfind(enum verdict_kind kind, const HASH *key, char **text)
+{
+    struct verdictbucket *b;
+    struct verdict *v;
+    size_t i;
+
+    if (verdicts.buckets == NULL)
+        return false;
+    b = VERDICTbucket(key);
+    for (i = 0; i < VERDICT_WAYS; i++) {
+        v = &b->entry[i];
+        if (v->expires > Now.tv_sec && v->kind == kind
+            && memcmp(&v->key, key, sizeof(HASH)) == 0) {
+            verdicts.hits[kind]++;
+            *text = v->text;
+            return true;
+        }
+    }
+    verdicts.misses[kind]++;
+    return false;
+}
+
+
+/*
+**  Remember the verdict of a filter, NULL or empty if it accepted.
+*/
+void
+VERDICTadd(enum verdict_kind kind, const HASH *key, const char *text)
+{
+    struct verdictbucket *b;
+    struct verdict *v;
+    size_t i;
+
+    if (verdicts.buckets == NULL)
+        return;
+    b = VERDICTbucket(key);
+    for (i = 0; i < VERDICT_WAYS - 1; i++) {
+        v = &b->entry[i];
+        if (v->expires <= Now.tv_sec
+            || (v->kind == kind && memcmp(&v->key, key, sizeof(HASH)) == 0))
+            break;
+    }
+    v = &b->entry[i];
+    free(v->text);
+    memmove(&b->entry[1], &b->entry[0], i * sizeof(struct verdict));
+    v = &b->entry[0];
+    v->key = *key;
+    v->expires = Now.tv_sec + innconf->filtercachetime;
+    v->kind = kind;
+    v->text = (text == NULL || *text == '\0') ? NULL : xstrdup(text);
+}
+
+
+/*
+**  Log how well the table did since the last call, along with the timers.
+*/
+void
+VERDICTlogstats(void)
+{
+    if (verdicts.buckets == NULL)
+        return;
+    notice("ME VERDICTstats %lu midhit %lu midmissed %lu arthit %lu artmissed",
+           verdicts.hits[VERDICT_PERLMID] + verdicts.hits[VERDICT_PYTHONMID],
+           verdicts.misses[VERDICT_PERLMID]
+               + verdicts.misses[VERDICT_PYTHONMID],
+           verdicts.hits[VERDICT_PERLART] + verdicts.hits[VERDICT_PYTHONART],
+           verdicts.misses[VERDICT_PERLART]
+               + verdicts.misses[VERDICT_PYTHONART]);
+    memset(verdicts.hits, 0, sizeof(verdicts.hits));
+    memset(verdicts.misses, 0, sizeof(verdicts.misses));
+}
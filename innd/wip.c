@@ -10,15 +10,77 @@
 #include "inn/innconf.h"
 #include "innd.h"
 
-#define WIPTABLESIZE 1024
-#define WIP_ARTMAX   300 /* innfeed default max send time. */
+#define WIPTABLESIZE 4096 /* Initial number of slots, a power of two. */
+#define WIPSLABSIZE  1024 /* Entries allocated at a time. */
+#define WIP_ARTMAX   300  /* innfeed default max send time. */
 
-static WIP *WIPtable[WIPTABLESIZE]; /* Top level of the WIP hash table. */
+/* The table is open-addressed with linear probing and holds pointers to the
+   entries, which are carved out of slabs that are never freed; unused
+   entries are chained through their Next field.  Pointers to an entry thus
+   stay valid for as long as it is in the table, which PrecommitWIP relies
+   on, and offers do not cost a malloc and a free each.  The table is kept
+   at most half full so that probe sequences stay short. */
+static struct {
+    WIP **slots;
+    unsigned long mask;  /* Number of slots minus one. */
+    unsigned long count; /* Entries in the table. */
+    WIP *free;           /* Unused entries. */
+} WIPtable;
+
+/*
+**  The slot where the probe for a hash starts.
+*/
+static unsigned long
+WIPhome(const HASH *hash)
+{
+    unsigned long bucket;
+
+    memcpy(&bucket, hash,
+           sizeof(bucket) < sizeof(HASH) ? sizeof(bucket) : sizeof(HASH));
+    return bucket & WIPtable.mask;
+}
+
+/*
+**  Whether an entry is older than any channel could still be waiting for
+**  it; see WIPinprogress.  Such entries are dropped when met while probing
+**  for a new one, rather than kept until their channel closes.
+*/
+static bool
+WIPstale(const WIP *wp)
+{
+    return (Now.tv_sec - wp->Timestamp)
+           > (time_t) (WIP_ARTMAX + innconf->wipexpire);
+}
+
+/*
+**  Double the number of slots.
+*/
+static void
+WIPgrow(void)
+{
+    WIP **old = WIPtable.slots;
+    unsigned long i, j, size = WIPtable.mask + 1;
+
+    WIPtable.slots = xcalloc(size * 2, sizeof(WIP *));
+    WIPtable.mask = size * 2 - 1;
+    for (i = 0; i < size; i++) {
+        if (old[i] == NULL)
+            continue;
+        for (j = WIPhome(&old[i]->MessageID); WIPtable.slots[j] != NULL;
+             j = (j + 1) & WIPtable.mask)
+            ;
+        WIPtable.slots[j] = old[i];
+    }
+    free(old);
+}
 
 void
 WIPsetup(void)
 {
-    memset(WIPtable, '\0', sizeof(WIPtable));
+    free(WIPtable.slots);
+    WIPtable.slots = xcalloc(WIPTABLESIZE, sizeof(WIP *));
+    WIPtable.mask = WIPTABLESIZE - 1;
+    WIPtable.count = 0;
 }
 
 /*
@@ -29,21 +91,38 @@ WIP *
 WIPnew(const char *messageid, CHANNEL *cp)
 {
     HASH hash;
-    unsigned long bucket;
+    unsigned long i;
     WIP *new;
 
-    hash = Hash(messageid, strlen(messageid));
-    memcpy(&bucket, &hash,
-           sizeof(bucket) < sizeof(hash) ? sizeof(bucket) : sizeof(hash));
-    bucket = bucket % WIPTABLESIZE;
+    if ((WIPtable.count + 1) * 2 > WIPtable.mask + 1)
+        WIPgrow();
+    if (WIPtable.free == NULL) {
+        new = xmalloc(WIPSLABSIZE * sizeof(WIP));
+        for (i = 0; i < WIPSLABSIZE; i++) {
+            new[i].Next = WIPtable.free;
+            WIPtable.free = &new[i];
+        }
+    }
+    new = WIPtable.free;
+    WIPtable.free = new->Next;
 
-    new = xmalloc(sizeof(WIP));
+    hash = Hash(messageid, strlen(messageid));
     new->MessageID = hash;
     new->Timestamp = Now.tv_sec;
     new->Chan = cp;
-    /* Link the new entry into the list. */
-    new->Next = WIPtable[bucket];
-    WIPtable[bucket] = new;
+    new->Next = NULL;
+
+    /* WIPfree moves the following entries back, so look at the same slot
+       again after dropping a stale one. */
+    i = WIPhome(&hash);
+    while (WIPtable.slots[i] != NULL) {
+        if (WIPstale(WIPtable.slots[i]))
+            WIPfree(WIPtable.slots[i]);
+        else
+            i = (i + 1) & WIPtable.mask;
+    }
+    WIPtable.slots[i] = new;
+    WIPtable.count++;
     return new;
 }
 
@@ -66,40 +145,44 @@ WIPprecomfree(CHANNEL *cp)
 void
 WIPfree(WIP *wp)
 {
-    unsigned long bucket;
-    WIP *cur;
-    WIP *prev = NULL;
-    int i;
+    unsigned long i, j, k;
     /* This is good error checking, but also allows us to
      *     WIPfree(WIPbymessageid(id))
      * without having to check if id exists first. */
     if (wp == NULL)
         return;
 
-    memcpy(&bucket, &wp->MessageID,
-           sizeof(bucket) < sizeof(HASH) ? sizeof(bucket) : sizeof(HASH));
-    bucket = bucket % WIPTABLESIZE;
-
     for (i = 0; i < PRECOMMITCACHESIZE; i++) {
         if (wp->Chan->PrecommitWIP[i] == wp) {
             wp->Chan->PrecommitWIP[i] = (WIP *) NULL;
             break;
         }
     }
-    for (cur = WIPtable[bucket]; (cur != NULL) && (cur != wp);
-         prev = cur, cur = cur->Next)
+    for (i = WIPhome(&wp->MessageID);
+         WIPtable.slots[i] != NULL && WIPtable.slots[i] != wp;
+         i = (i + 1) & WIPtable.mask)
         ;
 
-    if (cur == NULL)
+    if (WIPtable.slots[i] == NULL)
         return;
 
-    if (prev == NULL)
-        WIPtable[bucket] = cur->Next;
-    else
-        prev->Next = cur->Next;
+    /* Empty the slot, moving back any later entry of the same probe run
+       whose home slot is not between the hole and its current slot, so
+       that no probe finds an empty slot before its entry. */
+    for (j = (i + 1) & WIPtable.mask; WIPtable.slots[j] != NULL;
+         j = (j + 1) & WIPtable.mask) {
+        k = WIPhome(&WIPtable.slots[j]->MessageID);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        WIPtable.slots[i] = WIPtable.slots[j];
+        i = j;
+    }
+    WIPtable.slots[i] = NULL;
+    WIPtable.count--;
 
-    /* Unlink the entry and free the memory. */
-    free(wp);
+    /* Put the entry back on the free list. */
+    wp->Next = WIPtable.free;
+    WIPtable.free = wp;
 }
 
 /*
@@ -156,36 +239,31 @@ WIP *
 WIPbyid(const char *messageid)
 {
     HASH hash;
-    unsigned long bucket;
-    WIP *wp;
 
     hash = Hash(messageid, strlen(messageid));
-    memcpy(&bucket, &hash,
-           sizeof(bucket) < sizeof(hash) ? sizeof(bucket) : sizeof(hash));
-    bucket = bucket % WIPTABLESIZE;
-
-    /* Traverse the list until we find a match or find the head again. */
-    for (wp = WIPtable[bucket]; wp != NULL; wp = wp->Next)
-        if (!memcmp(&hash, &wp->MessageID, sizeof(HASH)))
-            return wp;
-
-    return NULL;
+    return WIPbyhash(hash);
 }
 
 WIP *
 WIPbyhash(const HASH hash)
 {
-    unsigned long bucket;
-    WIP *wp;
-
-    memcpy(&bucket, &hash,
-           sizeof(bucket) < sizeof(hash) ? sizeof(bucket) : sizeof(hash));
-    bucket = bucket % WIPTABLESIZE;
+    unsigned long i;
 
-    /* Traverse the list until we find a match or find the head again. */
-    for (wp = WIPtable[bucket]; wp != NULL; wp = wp->Next)
-        if (!memcmp(&hash, &wp->MessageID, sizeof(HASH)))
-            return wp;
+    /* Probe until we find a match or an empty slot. */
+    for (i = WIPhome(&hash); WIPtable.slots[i] != NULL;
+         i = (i + 1) & WIPtable.mask)
+        if (!memcmp(&hash, &WIPtable.slots[i]->MessageID, sizeof(HASH)))
+            return WIPtable.slots[i];
 
     return NULL;
 }
+
+/*
+**  Report how many entries are in the table and how many slots it has.
+*/
+void
+WIPusage(unsigned long *count, unsigned long *slots)
+{
+    *count = WIPtable.count;
+    *slots = WIPtable.mask + 1;
+}
@@ -18,6 +18,7 @@
 #include "inn/libinn.h"
 #include "inn/messages.h"
 #include "inn/nntp.h"
+#include "inn/ring.h"
 
 #include "article.h"
 #include "buffer.h"
@@ -39,6 +40,7 @@ struct innlistener_s {
     bool dummyListener;
     bool dynamicPeers;
     TimeoutId inputEOFSleepId;
+    struct ring *ring; /* where innd puts articles, if it does */
 
     InnListener next;
 };
@@ -59,6 +61,9 @@ static void giveArticleToPeer(InnListener lis, Article article,
                               const char *peerName);
 static void newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs,
                               void *data);
+static bool controlCommand(InnListener lis, const char *cmd);
+static void readRing(InnListener lis);
+static bool validPeerName(const char *peer);
 static void wakeUp(TimeoutId id, void *data);
 static void writeCheckPoint(int offsetAdjust);
 static void dropArticle(const char *peer, Article article);
@@ -366,7 +371,6 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
     size_t blen = bufferDataSize(buffs[0]);
     Buffer *readArray;
     static int checkPointCounter;
-    char *s;
 
     ASSERT(ep == lis->myep);
 
@@ -386,6 +390,8 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
             }
         } else {
             d_printf(1, "Got EOF on listener\n");
+            if (lis->ring != NULL)
+                readRing(lis);
             notice("ME source lost . Exiting");
             shutDown(lis);
         }
@@ -448,6 +454,20 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
 
             d_printf(2, "INN Command: %s\n", cmd);
 
+            /* A blank line only means there is something in the ring.  It
+               may also come from a batch file innd spooled the pipe to, in
+               which case there is no ring to look at. */
+            if (*cmd == '\0') {
+                cmd = next;
+                continue;
+            }
+            if (*cmd == EXP_CONTROL) {
+                if (!controlCommand(lis, cmd + 1))
+                    return;
+                cmd = next;
+                continue;
+            }
+
             /* pick out the leading string (the filename) */
             if ((fileName = findNonBlankString(cmd, &fileNameEnd)) == NULL) {
                 warn("ME source format bad, exiting: %s", cmd);
@@ -502,14 +522,8 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
                 *peerEnd = '\0';
 
                 /* See if this is a valid peername */
-                for (s = peer; *s; s++)
-                    if (!isalnum((unsigned char) *s) && *s != '.' && *s != '-'
-                        && *s != '_')
-                        break;
-                if (*s != 0) {
-                    warn("ME invalid peername %s", peer);
+                if (!validPeerName(peer))
                     continue;
-                }
                 if (article != NULL)
                     giveArticleToPeer(lis, article, peer);
             } while (peerEnd < endc);
@@ -527,6 +541,9 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
             }
         }
 
+        if (lis->ring != NULL)
+            readRing(lis);
+
         if (*cmd != '\0') /* partial command left in buffer */
         {
             Buffer *bArr;
@@ -567,6 +584,104 @@ newArticleCommand(EndPoint ep, IoStatus i, Buffer *buffs, void *data)
     freeBufferArray(buffs);
 }
 
+/* Handle a control line from innd.  The only one is "ring <path>", sent
+   first thing when the R flag is set in newsfeeds, after which innd puts
+   most articles in that ring and only wakes us up through the pipe.
+   Returns false if we are shutting down. */
+static bool
+controlCommand(InnListener lis, const char *cmd)
+{
+    const char *path;
+
+    if (strncmp(cmd, "ring ", 5) != 0) {
+        warn("ME unknown control command: %s", cmd);
+        return true;
+    }
+    path = cmd + 5;
+    if (lis->ring != NULL) {
+        readRing(lis);
+        ring_free(lis->ring);
+    }
+    lis->ring = ring_open(path);
+    if (lis->ring == NULL) {
+        /* innd will hand the articles in the ring to the next innfeed. */
+        syswarn("ME cannot open ring %s, exiting", path);
+        shutDown(lis);
+        return false;
+    }
+    unlink(path);
+    notice("ME reading articles from ring %s", path);
+    return true;
+}
+
+
+/* Take every article out of the ring.  Each record is the token, the
+   message id and the peer names, each followed by a nul.  Stop once innd
+   has been asked to wake us up when there is more. */
+static void
+readRing(InnListener lis)
+{
+    const char *record, *end, *msgid, *peer;
+    size_t length;
+    Article article;
+
+    do {
+        while ((record = ring_peek(lis->ring, &length)) != NULL) {
+            end = record + length;
+            msgid = NULL;
+            if (length > 0 && end[-1] == '\0')
+                msgid = record + strlen(record) + 1;
+            if (msgid == NULL || msgid >= end) {
+                warn("ME bad record in ring, skipping");
+                ring_advance(lis->ring);
+                continue;
+            }
+            d_printf(2, "INN ring record: %s %s\n", record, msgid);
+
+            /* The same checks as for a line from the pipe. */
+            if (strlen(msgid) > NNTP_MAXLEN_MSGID) {
+                warn("ME message id exceeds limit of %d octets: %s",
+                     NNTP_MAXLEN_MSGID, msgid);
+                ring_advance(lis->ring);
+                continue;
+            }
+            if (*msgid != '<' || msgid[strlen(msgid) - 1] != '>') {
+                warn("ME bad message id in ring: %s", msgid);
+                ring_advance(lis->ring);
+                continue;
+            }
+
+            article = newArticle(record, msgid);
+            if (article != NULL)
+                for (peer = msgid + strlen(msgid) + 1; peer < end;
+                     peer += strlen(peer) + 1)
+                    if (validPeerName(peer))
+                        giveArticleToPeer(lis, article, peer);
+            delArticle(article);
+            ring_advance(lis->ring);
+        }
+    } while (!ring_sleep(lis->ring));
+}
+
+
+/* Whether a peer name given by innd is one we can use, warning if not. */
+static bool
+validPeerName(const char *peer)
+{
+    const char *s;
+
+    for (s = peer; *s; s++)
+        if (!isalnum((unsigned char) *s) && *s != '.' && *s != '-'
+            && *s != '_')
+            break;
+    if (*s != 0 || s == peer) {
+        warn("ME invalid peername %s", peer);
+        return false;
+    }
+    return true;
+}
+
+
 /* EndPoint callback function for when the sleep due to
    having reached EOF on InputFile is done. */
 static void
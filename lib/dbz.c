@@ -57,6 +57,20 @@
 **  desirable to be a bit conservative because the overflow strategy tends to
 **  produce files with holes in them, which is a nuisance.)
 **
+**  Version 7 of the format replaces linear probing with bucketized cuckoo
+**  hashing, in the same files.  The .hash file is an array of buckets of
+**  CUCKOO_SLOTS fingerprints of CUCKOO_FPSIZE bytes, one cache line each, and
+**  the .index file holds the offsets at the same positions.  The fingerprint
+**  of a key is the start of its hash; its first and second four bytes each
+**  pick a bucket, and the key is in one of those two buckets or nowhere.
+**  When both are full, an entry of one of them is moved to its other bucket,
+**  and so on up to CUCKOO_MAXKICKS times.  The number of buckets is a power
+**  of two and, when the table gets full enough or an entry cannot be placed,
+**  the table doubles: the files grow and the buckets are split one at a
+**  time, moving to bucket b + n the entries of bucket b whose hash has the
+**  bit n set, while stores go on.  Until the last bucket is split, the split
+**  point is kept in the .dir file and lookups read both halves.
+**
 **  Tagged hash + offset fuzzy technique merged by Sang-yong Suh (Nov, 1997)
 **
 **  Fixed a bug handling larger than 1Gb history offset by Sang-yong Suh
@@ -105,6 +119,23 @@
 
 static int dbzversion = 6; /* for validating .dir file format */
 
+#ifndef DO_TAGGED_HASH
+/*
+ * CUCKOO           Version of the cuckoo format
+ * CUCKOO_SLOTS     Entries per bucket (LIA)
+ * CUCKOO_FPSIZE    Bytes of the hash kept per entry (LIA)
+ * CUCKOO_MAXKICKS  Entries moved to place one before the table must grow
+ * CUCKOO_SPLITSTEP Buckets split by each store while the table doubles
+ * CUCKOO_TRIES     Lookups of a key whose entry keeps moving (LIA)
+ */
+#    define CUCKOO           7
+#    define CUCKOO_SLOTS     8
+#    define CUCKOO_FPSIZE    8
+#    define CUCKOO_MAXKICKS  500
+#    define CUCKOO_SPLITSTEP 16
+#    define CUCKOO_TRIES     4
+#endif
+
 #ifdef DO_TAGGED_HASH
 /* assume that for tagged hash, we don't want more than 4byte of_t even if
  * off_t is 8 bytes -- people who use tagged-hash are usually short on
@@ -205,6 +236,7 @@ static int canttag_warned; /* flag to control can't tag warning */
 #define NUSEDS (1 + NMEMORY)
 
 typedef struct {
+    int version;        /* dbzversion, or CUCKOO */
     long tsize;         /* table size */
     long used[NUSEDS];  /* entries used today, yesterday, ... */
     long vused[NUSEDS]; /* ditto for text size */
@@ -216,6 +248,7 @@ typedef struct {
     int tagshift;       /* shift count for tagmask and tagenb */
     int dropbits;       /* number of bits to discard from offset */
     int lenfuzzy;       /* num of fuzzy characters in offset */
+    long split;         /* buckets split while the table doubles, or -1 */
 } dbzconfig;
 static dbzconfig conf;
 
@@ -282,6 +315,7 @@ static hash_table pagtab; /* pag hash table, stores hash + offset */
 #else
 static hash_table idxtab; /* index hash table, used for data retrieval */
 static hash_table etab;   /* existence hash table, used for existence checks */
+static bool stored;       /* stored since opened, so not just a reader? */
 #endif
 static bool dirty;     /* has a store() been done? */
 static erec empty_rec; /* empty rec to compare against
@@ -300,6 +334,16 @@ static bool set_pag(searcher *sp, of_t value);
 static bool search(searcher *sp);
 #endif
 static bool set(searcher *sp, hash_table *tab, void *value);
+static bool putrec(hash_table *tab, const void *value, size_t length,
+                   off_t offset);
+#ifndef DO_TAGGED_HASH
+static void cuckoo_key(const HASH *hash, unsigned char *fp);
+static unsigned long cuckoo_hash(const unsigned char *fp, int which);
+static unsigned long cuckoo_bucket(unsigned long h);
+static bool cuckoo_fetch(const HASH key, off_t *value);
+static int cuckoo_insert(const unsigned char *fp, of_t value);
+static DBZSTORE_RESULT cuckoo_store(const HASH key, off_t data);
+#endif
 
 /* file-naming stuff */
 static char dir[] = ".dir";
@@ -368,6 +412,62 @@ config_by_text_size(dbzconfig *c, of_t basesize)
 }
 #endif /* DO_TAGGED_HASH */
 
+/*
+ - tabslots - number of entries in the tables, counting the second half
+ - of a cuckoo table being doubled
+ */
+static long
+tabslots(void)
+{
+    if (conf.split >= 0)
+        return conf.tsize * 2;
+    return conf.tsize;
+}
+
+/*
+ - setversion - set the format of a new database from inn.conf
+ */
+static void
+setversion(dbzconfig *c)
+{
+    int version = dbzversion;
+#ifndef DO_TAGGED_HASH
+    long n;
+#endif
+
+    if (innconf != NULL && innconf->hisv6dbzversion != 0)
+        version = (int) innconf->hisv6dbzversion;
+#ifdef DO_TAGGED_HASH
+    if (version != dbzversion)
+        warn("dbz: version %d needs untagged hashes, using %d", version,
+             dbzversion);
+    c->version = dbzversion;
+#else
+    if (version != dbzversion && version != CUCKOO) {
+        warn("dbz: unknown version %d, using %d", version, dbzversion);
+        version = dbzversion;
+    }
+    if (version != c->version) {
+        c->version = version;
+        if (version == CUCKOO) {
+            c->valuesize = CUCKOO_FPSIZE + sizeof(of_t);
+            c->fillpercent = 90;
+        } else {
+            c->valuesize = sizeof(of_t) + sizeof(erec);
+            c->fillpercent = 66;
+        }
+    }
+    c->split = -1;
+
+    /* A power of two buckets, so that doubling splits each one in two. */
+    if (version == CUCKOO) {
+        for (n = 1; n * CUCKOO_SLOTS < c->tsize; n <<= 1)
+            continue;
+        c->tsize = n * CUCKOO_SLOTS;
+    }
+#endif
+}
+
 /*
  - create and truncate .pag, .idx, or .hash files
  - return false on error
@@ -442,6 +542,7 @@ dbzfresh(const char *name, off_t size)
     if (size != 0)
         c.tsize = size > (64 * 1024) ? size : 64 * 1024;
 #endif
+    setversion(&c);
 
     /* write it out */
     fn = concat(name, dir, (char *) 0);
@@ -543,6 +644,27 @@ dbzsize(off_t contents)
     return n;
 }
 
+/*
+ * dbzusage - how full is the open database?
+ * used     - set to the number of entries stored
+ * size     - set to the size of the table, or 0 if it grows by itself
+ */
+bool
+dbzusage(long *used, long *size)
+{
+    if (!opendb) {
+        warn("dbzusage: database not open!");
+        return false;
+    }
+    *used = conf.used[0];
+    *size = conf.tsize;
+#ifndef DO_TAGGED_HASH
+    if (conf.version == CUCKOO)
+        *size = 0;
+#endif
+    return true;
+}
+
 /* dbzagain - set up a new database to be a rebuild of an old one
  * Returns true on success, false on failure
  * name - base name; .dir and .pag must exist
@@ -626,6 +748,7 @@ dbzagain(const char *name, const char *oldname)
     newsize = dbzsize(top);
     if (!newtable || newsize > c.tsize) /* don't shrink new table */
         c.tsize = newsize;
+    setversion(&c);
 
     /* write it out */
     fn = concat(name, dir, (char *) 0);
@@ -700,15 +823,17 @@ openhashtable(const char *base, const char *ext, hash_table *tab,
     return true;
 }
 
+/*
+ - dropcore - release the in-core copy of a table
+ */
 static void
-closehashtable(hash_table *tab)
+dropcore(hash_table *tab)
 {
-    close(tab->fd);
     if (tab->incore == INCORE_MEM)
         free(tab->core);
     if (tab->incore == INCORE_MMAP) {
 #if defined(HAVE_MMAP)
-        if (munmap(tab->core, conf.tsize * tab->reclen) == -1) {
+        if (munmap(tab->core, tabslots() * tab->reclen) == -1) {
             syswarn("closehashtable: munmap failed");
         }
 #else
@@ -717,6 +842,13 @@ closehashtable(hash_table *tab)
     }
 }
 
+static void
+closehashtable(hash_table *tab)
+{
+    close(tab->fd);
+    dropcore(tab);
+}
+
 #ifdef DO_TAGGED_HASH
 static bool
 openbasefile(const char *name)
@@ -795,7 +927,8 @@ dbzinit(const char *name)
         Fclose(dirf);
         return false;
     }
-    if (!openhashtable(name, exists, &etab, sizeof(erec),
+    if (!openhashtable(name, exists, &etab,
+                       conf.version == CUCKOO ? CUCKOO_FPSIZE : sizeof(erec),
                        options.exists_incore)) {
         Fclose(dirf);
         return false;
@@ -804,6 +937,9 @@ dbzinit(const char *name)
 
     /* misc. setup */
     dirty = false;
+#ifndef DO_TAGGED_HASH
+    stored = false;
+#endif
     opendb = true;
     prevp = FRESH;
     memset(&empty_rec, '\0', sizeof(empty_rec));
@@ -913,6 +1049,8 @@ dbzexists(const HASH key)
     }
 
     prevp = FRESH;
+    if (conf.version == CUCKOO)
+        return cuckoo_fetch(key, NULL);
     start(&srch, key, FRESH);
     return search(&srch);
 #endif
@@ -945,6 +1083,10 @@ dbzfetch(const HASH key, off_t *value)
         return false;
     }
 
+#ifndef DO_TAGGED_HASH
+    if (conf.version == CUCKOO)
+        return cuckoo_fetch(key, value);
+#endif
     start(&srch, key, FRESH);
 #ifdef DO_TAGGED_HASH
     /*
@@ -1043,6 +1185,82 @@ dbzfetch(const HASH key, off_t *value)
 #endif
 }
 
+/* Ask the processor to start loading an address into its cache. */
+#if defined(__GNUC__) || defined(__clang__)
+#    define PREFETCH(p) __builtin_prefetch(p)
+#else
+#    define PREFETCH(p) /* nothing */
+#endif
+
+/*
+ - prefetchrange - prefetch a range of a table kept in core
+ */
+static void
+prefetchrange(const hash_table *tab, off_t offset, size_t length)
+{
+    const char *p;
+
+    if (tab->incore == INCORE_NO || tab->core == NULL)
+        return;
+    p = (const char *) tab->core + offset;
+    PREFETCH(p);
+    PREFETCH(p + length - 1);
+}
+
+/*
+ * dbzprefetch - start loading what a lookup of the given key will read
+ *
+ * Only tables kept in core are concerned.  Calling this for several keys
+ * before looking them up lets the memory accesses of the lookups overlap
+ * instead of waiting for each other.  value tells whether the offset will
+ * be fetched too, and not just checked for.
+ */
+void
+dbzprefetch(const HASH key, bool value)
+{
+    searcher sp;
+#ifndef DO_TAGGED_HASH
+    unsigned char fp[CUCKOO_FPSIZE];
+    unsigned long h, n;
+    size_t length;
+    int i;
+#endif
+
+    if (!opendb)
+        return;
+#ifdef DO_TAGGED_HASH
+    start(&sp, key, FRESH);
+    prefetchrange(&pagtab, (sp.shorthash % conf.tsize) * pagtab.reclen,
+                  pagtab.reclen);
+    (void) value;
+#else
+    if (conf.version == CUCKOO) {
+        cuckoo_key(&key, fp);
+        n = conf.tsize / CUCKOO_SLOTS;
+        for (i = 0; i < 2; i++) {
+            h = cuckoo_hash(fp, i);
+            length = CUCKOO_SLOTS * etab.reclen;
+            prefetchrange(&etab, (off_t) (h & (n - 1)) * length, length);
+            if (conf.split >= 0)
+                prefetchrange(&etab, (off_t) (h & (2 * n - 1)) * length,
+                              length);
+            if (value) {
+                length = CUCKOO_SLOTS * idxtab.reclen;
+                prefetchrange(&idxtab, (off_t) cuckoo_bucket(h) * length,
+                              length);
+            }
+        }
+        return;
+    }
+    start(&sp, key, FRESH);
+    prefetchrange(&etab, (sp.shorthash % conf.tsize) * etab.reclen,
+                  etab.reclen);
+    if (value)
+        prefetchrange(&idxtab, (sp.shorthash % conf.tsize) * idxtab.reclen,
+                      idxtab.reclen);
+#endif
+}
+
 /*
  * dbzstore - add an entry to the database
  *
@@ -1099,6 +1317,8 @@ dbzstore(const HASH key, off_t data)
         return DBZSTORE_ERROR;
     return DBZSTORE_OK;
 #else  /* DO_TAGGED_HASH */
+    if (conf.version == CUCKOO)
+        return cuckoo_store(key, data);
 
     /* find the place, exploiting previous search if possible */
     start(&srch, key, prevp);
@@ -1137,6 +1357,8 @@ getconf(FILE *df, dbzconfig *cp)
 
     /* empty file, no configuration known */
 #ifdef DO_TAGGED_HASH
+    cp->version = dbzversion;
+    cp->split = -1;
     if (df == NULL) {
         cp->tsize = DEFSIZE;
         for (i = 0; i < NUSEDS; i++)
@@ -1170,7 +1392,9 @@ getconf(FILE *df, dbzconfig *cp)
     }
     cp->lenfuzzy = (int) (1 << cp->dropbits) - 1;
 #else  /* DO_TAGGED_HASH */
+    cp->split = -1;
     if (df == NULL) {
+        cp->version = dbzversion;
         cp->tsize = DEFSIZE;
         for (i = 0; i < NUSEDS; i++)
             cp->used[i] = 0;
@@ -1180,13 +1404,25 @@ getconf(FILE *df, dbzconfig *cp)
         return true;
     }
 
-    i = fscanf(df, "dbz 6 %ld %d %d\n", &cp->tsize, &cp->valuesize,
-               &cp->fillpercent);
-    if (i != 3) {
+    i = fscanf(df, "dbz %d %ld %d %d", &cp->version, &cp->tsize,
+               &cp->valuesize, &cp->fillpercent);
+    if (i != 4 || (cp->version != dbzversion && cp->version != CUCKOO)) {
         warn("dbz: bad first line in .dir history file");
         return false;
     }
-    if (cp->valuesize != (sizeof(of_t) + sizeof(erec))) {
+    if (cp->version == CUCKOO) {
+        if (fscanf(df, "%ld", &cp->split) != 1 || cp->tsize < CUCKOO_SLOTS
+            || cp->split >= cp->tsize / CUCKOO_SLOTS
+            || ((cp->tsize / CUCKOO_SLOTS) & (cp->tsize / CUCKOO_SLOTS - 1))
+                   != 0) {
+            warn("dbz: bad first line in .dir history file");
+            return false;
+        }
+        if (cp->valuesize != CUCKOO_FPSIZE + sizeof(of_t)) {
+            warn("dbz: wrong of_t size (%d)", cp->valuesize);
+            return false;
+        }
+    } else if (cp->valuesize != (sizeof(of_t) + sizeof(erec))) {
         warn("dbz: wrong of_t size (%d)", cp->valuesize);
         return false;
     }
@@ -1233,8 +1469,12 @@ putconf(FILE *f, dbzconfig *cp)
             cp->valuesize, cp->fillpercent, cp->tagenb, cp->tagmask,
             cp->tagshift, cp->dropbits);
 #else  /* DO_TAGGED_HASH */
-    fprintf(f, "dbz %d %ld %d %d\n", dbzversion, cp->tsize, cp->valuesize,
-            cp->fillpercent);
+    if (cp->version == CUCKOO)
+        fprintf(f, "dbz %d %ld %d %d %ld\n", cp->version, cp->tsize,
+                cp->valuesize, cp->fillpercent, cp->split);
+    else
+        fprintf(f, "dbz %d %ld %d %d\n", cp->version, cp->tsize,
+                cp->valuesize, cp->fillpercent);
 #endif /* DO_TAGGED_HASH */
 
     for (i = 0; i < NUSEDS; i++)
@@ -1249,6 +1489,12 @@ putconf(FILE *f, dbzconfig *cp)
     if (ferror(f))
         ret = -1;
 
+    /* Lines may have become shorter; drop what is left of the old ones. */
+    if (ftruncate(fileno(f), ftello(f)) < 0) {
+        syswarn("dbz: ftruncate failure in putconf");
+        ret = -1;
+    }
+
     debug("putconf status %d", ret);
     return ret;
 }
@@ -1263,7 +1509,7 @@ getcore(hash_table *tab)
     char *it;
     ssize_t nread;
     size_t i;
-    size_t length = conf.tsize * tab->reclen;
+    size_t length = tabslots() * tab->reclen;
 #ifdef HAVE_MMAP
     struct stat st;
 #endif
@@ -1298,7 +1544,7 @@ getcore(hash_table *tab)
     } else {
         it = xmalloc(length);
 
-        nread = read(tab->fd, it, length);
+        nread = pread(tab->fd, it, length, 0);
         if (nread < 0) {
             syswarn("dbz: getcore: read failed");
             free(it);
@@ -1327,7 +1573,7 @@ putcore(hash_table *tab)
         if (options.writethrough)
             return true;
         fdflag_nonblocking(tab->fd, false);
-        size = tab->reclen * conf.tsize;
+        size = tab->reclen * tabslots();
         result = xpwrite(tab->fd, tab->core, size, 0);
         if (result < 0 || (size_t) result != size) {
             fdflag_nonblocking(tab->fd, options.nonblock);
@@ -1337,7 +1583,7 @@ putcore(hash_table *tab)
     }
 #ifdef HAVE_MMAP
     if (tab->incore == INCORE_MMAP) {
-        msync(tab->core, conf.tsize * tab->reclen, MS_ASYNC);
+        msync(tab->core, tabslots() * tab->reclen, MS_ASYNC);
     }
 #endif
     return true;
@@ -1570,11 +1816,27 @@ set(searcher *sp, hash_table *tab, void *value)
     }
 
     /* seek to spot */
-    tab->pos = -1; /* invalidate position memory */
     offset = sp->place * tab->reclen;
 
     /* write in data */
-    while (pwrite(tab->fd, value, tab->reclen, offset) != tab->reclen) {
+    if (!putrec(tab, value, tab->reclen, offset)) {
+        sp->aborted = 1;
+        return false;
+    }
+
+    debug("set: succeeded");
+    return true;
+}
+
+/* putrec - write to a table file, waiting for it if it would block
+ *
+ * Returns: true success, false failure
+ */
+static bool
+putrec(hash_table *tab, const void *value, size_t length, off_t offset)
+{
+    tab->pos = -1; /* invalidate position memory */
+    while (pwrite(tab->fd, value, length, offset) != (ssize_t) length) {
         if (errno == EAGAIN) {
             fd_set writeset;
 
@@ -1582,17 +1844,13 @@ set(searcher *sp, hash_table *tab, void *value)
             FD_SET(tab->fd, &writeset);
             if (select(tab->fd + 1, NULL, &writeset, NULL, NULL) < 1) {
                 syswarn("dbz: set: select failed");
-                sp->aborted = 1;
                 return false;
             }
             continue;
         }
         syswarn("dbz: set: write failed");
-        sp->aborted = 1;
         return false;
     }
-
-    debug("set: succeeded");
     return true;
 }
 
@@ -1627,6 +1885,516 @@ set_pag(searcher *sp, of_t value)
 }
 #endif /* DO_TAGGED_HASH */
 
+#ifndef DO_TAGGED_HASH
+/* A bucket of the cuckoo format, gathered from the .hash and .index files. */
+typedef struct {
+    unsigned char fp[CUCKOO_SLOTS][CUCKOO_FPSIZE];
+    of_t value[CUCKOO_SLOTS];
+} bucket;
+
+static const unsigned char empty_fp[CUCKOO_FPSIZE];
+static unsigned int victim; /* rotates the entry moved out of full buckets */
+
+/*
+ - cuckoo_key - get the fingerprint of a key, never all zeros
+ */
+static void
+cuckoo_key(const HASH *hash, unsigned char *fp)
+{
+    memcpy(fp, hash, CUCKOO_FPSIZE);
+    if (memcmp(fp, empty_fp, CUCKOO_FPSIZE) == 0)
+        fp[CUCKOO_FPSIZE - 1] = 1;
+}
+
+/*
+ - cuckoo_hash - one of the two hash values of a fingerprint
+ */
+static unsigned long
+cuckoo_hash(const unsigned char *fp, int which)
+{
+    const unsigned char *p = fp + (which == 0 ? 0 : 4);
+
+    return (unsigned long) p[0] | (unsigned long) p[1] << 8
+           | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/*
+ - cuckoo_bucket - the bucket a store uses for a hash value; those below the
+ - split point have already been split in two
+ */
+static unsigned long
+cuckoo_bucket(unsigned long h)
+{
+    unsigned long n = conf.tsize / CUCKOO_SLOTS;
+
+    if (conf.split >= 0 && (h & (n - 1)) < (unsigned long) conf.split)
+        return h & (2 * n - 1);
+    return h & (n - 1);
+}
+
+/*
+ - getbucket - read a bucket of a table
+ */
+static bool
+getbucket(hash_table *tab, unsigned long b, void *buf)
+{
+    size_t length = CUCKOO_SLOTS * tab->reclen;
+    off_t offset = (off_t) b * length;
+    ssize_t nread;
+
+    if (tab->incore != INCORE_NO) {
+        memcpy(buf, (char *) tab->core + offset, length);
+        return true;
+    }
+    nread = pread(tab->fd, buf, length, offset);
+    if (nread < 0) {
+        syswarn("dbz: getbucket: read failed");
+        return false;
+    }
+    memset((char *) buf + nread, '\0', length - nread);
+    return true;
+}
+
+/*
+ - putbucket - write a bucket of a table
+ */
+static bool
+putbucket(hash_table *tab, unsigned long b, const void *buf)
+{
+    size_t length = CUCKOO_SLOTS * tab->reclen;
+    off_t offset = (off_t) b * length;
+    char *where;
+
+    if (tab->incore != INCORE_NO) {
+        where = (char *) tab->core + offset;
+        memcpy(where, buf, length);
+        if (tab->incore == INCORE_MMAP) {
+            if (innconf != NULL && innconf->nfswriter)
+                inn_msync_page(where, length, MS_ASYNC);
+            return true;
+        }
+        if (!options.writethrough)
+            return true;
+    }
+    return putrec(tab, buf, length, offset);
+}
+
+/*
+ - readbucket - read the fingerprints of a bucket, and its values if asked
+ */
+static bool
+readbucket(unsigned long b, bucket *bp, bool values)
+{
+    if (!getbucket(&etab, b, bp->fp))
+        return false;
+    return !values || getbucket(&idxtab, b, bp->value);
+}
+
+/*
+ - writebucket - write a bucket, the values first as in dbzstore
+ */
+static bool
+writebucket(unsigned long b, const bucket *bp)
+{
+    return putbucket(&idxtab, b, bp->value) && putbucket(&etab, b, bp->fp);
+}
+
+/*
+ - findslot - the slot of a bucket holding a fingerprint, or -1
+ */
+static int
+findslot(const bucket *bp, const unsigned char *fp)
+{
+    int i;
+
+    for (i = 0; i < CUCKOO_SLOTS; i++)
+        if (memcmp(bp->fp[i], fp, CUCKOO_FPSIZE) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ - cuckoo_search - look for a fingerprint in the buckets it may be in,
+ - both halves of a table being doubled included
+ */
+static bool
+cuckoo_search(const unsigned char *fp, unsigned long *where, int *slot)
+{
+    unsigned long candidates[4], h, n;
+    int count, i, j;
+    bucket b;
+
+    n = conf.tsize / CUCKOO_SLOTS;
+    count = 0;
+    for (i = 0; i < 2; i++) {
+        h = cuckoo_hash(fp, i);
+        candidates[count++] = h & (n - 1);
+        if (conf.split >= 0)
+            candidates[count++] = h & (2 * n - 1);
+    }
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++)
+            if (candidates[j] == candidates[i])
+                break;
+        if (j < i)
+            continue;
+        if (!readbucket(candidates[i], &b, false))
+            return false;
+        if ((*slot = findslot(&b, fp)) >= 0) {
+            *where = candidates[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ - cuckoo_reload - pick up the new size of a table another process grew
+ - Returns true if it changed.
+ */
+static bool
+cuckoo_reload(void)
+{
+    dbzconfig c;
+    long slots;
+
+    if (fseeko(dirf, 0, SEEK_SET) != 0 || !getconf(dirf, &c))
+        return false;
+    if (c.version != CUCKOO)
+        return false;
+    slots = c.split >= 0 ? c.tsize * 2 : c.tsize;
+    if (slots == tabslots()) {
+        /* The split may have ended, leaving the same files twice as many
+           buckets in the .dir file. */
+        conf.tsize = c.tsize;
+        conf.split = c.split;
+        return false;
+    }
+
+    /* Map the tables again, or read them from disk if that fails. */
+    dropcore(&idxtab);
+    dropcore(&etab);
+    conf.tsize = c.tsize;
+    conf.split = c.split;
+    if (idxtab.incore != INCORE_NO && !getcore(&idxtab))
+        idxtab.incore = INCORE_NO;
+    if (etab.incore != INCORE_NO && !getcore(&etab))
+        etab.incore = INCORE_NO;
+    return true;
+}
+
+/*
+ - cuckoo_fetch - look for a key, getting its offset if value is not NULL
+ */
+static bool
+cuckoo_fetch(const HASH key, off_t *value)
+{
+    unsigned char fp[CUCKOO_FPSIZE];
+    unsigned long where;
+    int slot, tries;
+    bucket b;
+
+    cuckoo_key(&key, fp);
+    for (tries = 0;; tries++) {
+        if (!cuckoo_search(fp, &where, &slot)) {
+            /* A reader may not know yet that the table has grown. */
+            if (stored || !cuckoo_reload()
+                || !cuckoo_search(fp, &where, &slot))
+                return false;
+        }
+        if (value == NULL)
+            return true;
+
+        /* The writer may have moved the entry since it was found, in which
+           case the value is that of whatever took its slot; the
+           fingerprints are read again after the value to see that. */
+        if (!getbucket(&idxtab, where, b.value)
+            || !getbucket(&etab, where, b.fp))
+            return false;
+        if (memcmp(b.fp[slot], fp, CUCKOO_FPSIZE) == 0) {
+            *value = b.value[slot];
+            return true;
+        }
+        if (tries == CUCKOO_TRIES)
+            return false;
+    }
+}
+
+/*
+ - growtable - make room in a table for the slots of the current size
+ - oldslots - what it had room for
+ */
+static bool
+growtable(hash_table *tab, long oldslots)
+{
+    size_t length = tabslots() * tab->reclen;
+    void *old;
+
+    switch (tab->incore) {
+    case INCORE_MEM:
+        tab->core = xrealloc(tab->core, length);
+        memset((char *) tab->core + oldslots * tab->reclen, '\0',
+               length - oldslots * tab->reclen);
+        return true;
+    case INCORE_MMAP:
+        /* getcore extends the file. */
+        old = tab->core;
+        if (!getcore(tab))
+            return false;
+#ifdef HAVE_MMAP
+        if (munmap(old, oldslots * tab->reclen) == -1)
+            syswarn("dbz: growtable: munmap failed");
+#endif
+        return true;
+    case INCORE_NO:
+    default:
+        /* Extend the file now so that readers can map all of it. */
+        if (ftruncate(tab->fd, length) == -1) {
+            syswarn("dbz: growtable: ftruncate failed");
+            return false;
+        }
+        return true;
+    }
+}
+
+/*
+ - ondisk - whether the files of both tables are kept up to date, so that
+ - readers may be told about a new size before dbzsync
+ */
+static bool
+ondisk(void)
+{
+    return options.writethrough
+           || (idxtab.incore != INCORE_MEM && etab.incore != INCORE_MEM);
+}
+
+/*
+ - cuckoo_split - split up to count buckets of a table being doubled
+ */
+static bool
+cuckoo_split(unsigned long count)
+{
+    unsigned long b, h, n, other;
+    bucket low, high, now;
+    bool moved, stuck[CUCKOO_SLOTS];
+    int i, r, slot;
+
+    n = conf.tsize / CUCKOO_SLOTS;
+    while (count-- > 0 && conf.split >= 0) {
+        b = conf.split;
+        if (!readbucket(b, &low, true) || !readbucket(b + n, &high, true))
+            return false;
+        moved = false;
+        for (i = 0; i < CUCKOO_SLOTS; i++) {
+            stuck[i] = false;
+            if (memcmp(low.fp[i], empty_fp, CUCKOO_FPSIZE) == 0)
+                continue;
+            h = cuckoo_hash(low.fp[i], 0);
+            if ((h & (n - 1)) != b)
+                h = cuckoo_hash(low.fp[i], 1);
+            if ((h & n) == 0)
+                continue;
+
+            /* It may be there already if a split was interrupted. */
+            if (findslot(&high, low.fp[i]) < 0) {
+                if ((slot = findslot(&high, empty_fp)) < 0) {
+                    /* Left where it is, which will do if its other hash
+                       also picks this bucket of the doubled table. */
+                    other = cuckoo_hash(low.fp[i], 0);
+                    if (other == h)
+                        other = cuckoo_hash(low.fp[i], 1);
+                    stuck[i] = ((other & (2 * n - 1)) != b);
+                    continue;
+                }
+                memcpy(high.fp[slot], low.fp[i], CUCKOO_FPSIZE);
+                high.value[slot] = low.value[i];
+            }
+            memset(low.fp[i], '\0', CUCKOO_FPSIZE);
+            low.value[i] = 0;
+            moved = true;
+        }
+
+        /* Write the new copies first, so that nothing is lost meanwhile. */
+        if (moved && (!writebucket(b + n, &high) || !writebucket(b, &low)))
+            return false;
+        conf.split++;
+
+        /* Entries that found no room in the new half are no longer in one
+           of their buckets once the split point is past theirs, and would
+           be lost when the table has doubled.  Put them elsewhere, and only
+           then drop the old copy, unless it was moved meanwhile. */
+        for (i = 0; i < CUCKOO_SLOTS; i++) {
+            if (!stuck[i])
+                continue;
+            r = cuckoo_insert(low.fp[i], low.value[i]);
+            if (r == 0)
+                warn("dbz: no room to split bucket %lu", b);
+            if (r <= 0)
+                return false;
+            if (!readbucket(b, &now, true))
+                return false;
+            if (memcmp(now.fp[i], low.fp[i], CUCKOO_FPSIZE) == 0) {
+                memset(now.fp[i], '\0', CUCKOO_FPSIZE);
+                now.value[i] = 0;
+                if (!writebucket(b, &now))
+                    return false;
+            }
+        }
+        if (conf.split == (long) n) {
+            conf.tsize *= 2;
+            conf.split = -1;
+            n *= 2;
+            debug("cuckoo_split: table doubled to %ld", conf.tsize);
+            if (ondisk() && putconf(dirf, &conf) < 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ - cuckoo_grow - start doubling the table
+ */
+static bool
+cuckoo_grow(void)
+{
+    long oldslots = tabslots();
+
+    conf.split = 0;
+    if (!growtable(&idxtab, oldslots) || !growtable(&etab, oldslots)) {
+        conf.split = -1;
+        return false;
+    }
+
+    /* Tell the readers at once that entries may be in the new half.  Tables
+       kept in memory reach their files with the size at the next dbzsync;
+       until then, the .dir file must go on describing what is on disk. */
+    return !ondisk() || putconf(dirf, &conf) == 0;
+}
+
+/*
+ - cuckoo_insert - put an entry in one of its buckets, moving others
+ - The moves are found before any is made, and then made from the free slot
+ - back, so that every entry is in one of its buckets at all times.  Returns
+ - 1 on success, -1 on error and 0 if CUCKOO_MAXKICKS moves would not make
+ - room, in which case nothing was moved.
+ */
+static int
+cuckoo_insert(const unsigned char *fp, of_t value)
+{
+    struct {
+        unsigned long where;
+        int slot;
+    } path[CUCKOO_MAXKICKS];
+    unsigned char moving[CUCKOO_FPSIZE];
+    unsigned long b1, b2, where, from;
+    bucket b, to;
+    int i, j, n, slot;
+
+    /* Follow the entries that would be moved until one has a free slot in
+       its other bucket, never taking the same slot twice. */
+    memcpy(moving, fp, CUCKOO_FPSIZE);
+    from = ULONG_MAX;
+    for (n = 0;; n++) {
+        b1 = cuckoo_bucket(cuckoo_hash(moving, 0));
+        b2 = cuckoo_bucket(cuckoo_hash(moving, 1));
+        slot = -1;
+        for (i = 0; i < 2 && slot < 0; i++) {
+            where = (i == 0) ? b1 : b2;
+            if (where == from)
+                continue;
+            if (!readbucket(where, &b, false))
+                return -1;
+            slot = findslot(&b, empty_fp);
+        }
+        if (slot >= 0)
+            break;
+        if (n == CUCKOO_MAXKICKS)
+            return 0;
+
+        /* Both are full; go on with an entry of the one it did not come
+           from. */
+        where = (b1 != from) ? b1 : b2;
+        if (!readbucket(where, &b, false))
+            return -1;
+        for (i = 0; i < CUCKOO_SLOTS; i++) {
+            slot = (victim + i) % CUCKOO_SLOTS;
+            for (j = 0; j < n; j++)
+                if (path[j].where == where && path[j].slot == slot)
+                    break;
+            if (j == n)
+                break;
+        }
+        if (i == CUCKOO_SLOTS)
+            return 0;
+        victim++;
+        path[n].where = where;
+        path[n].slot = slot;
+        memcpy(moving, b.fp[slot], CUCKOO_FPSIZE);
+        from = where;
+    }
+
+    /* Copy the last entry of the path to the free slot, which frees its old
+       one for the entry before it, and so on. */
+    while (n-- > 0) {
+        if (!readbucket(path[n].where, &b, true)
+            || !readbucket(where, &to, true))
+            return -1;
+        memcpy(to.fp[slot], b.fp[path[n].slot], CUCKOO_FPSIZE);
+        to.value[slot] = b.value[path[n].slot];
+        if (!writebucket(where, &to))
+            return -1;
+        where = path[n].where;
+        slot = path[n].slot;
+    }
+    if (!readbucket(where, &b, true))
+        return -1;
+    memcpy(b.fp[slot], fp, CUCKOO_FPSIZE);
+    b.value[slot] = value;
+    return writebucket(where, &b) ? 1 : -1;
+}
+
+/*
+ - cuckoo_store - add an entry, growing the table as needed
+ */
+static DBZSTORE_RESULT
+cuckoo_store(const HASH key, off_t data)
+{
+    unsigned char fp[CUCKOO_FPSIZE];
+    unsigned long where;
+    of_t value = data;
+    int r, slot;
+
+    stored = true;
+    cuckoo_key(&key, fp);
+    if (cuckoo_search(fp, &where, &slot))
+        return DBZSTORE_EXISTS;
+
+    prevp = FRESH;
+    conf.used[0]++;
+    debug("store: used count %ld", conf.used[0]);
+    dirty = true;
+
+    /* Go on doubling the table, or start if it is full enough. */
+    if (conf.split >= 0) {
+        if (!cuckoo_split(CUCKOO_SPLITSTEP))
+            return DBZSTORE_ERROR;
+    } else if (conf.used[0] > conf.tsize / 100 * conf.fillpercent) {
+        if (!cuckoo_grow())
+            return DBZSTORE_ERROR;
+    }
+
+    /* If there is no room, finish doubling the table and try again. */
+    while ((r = cuckoo_insert(fp, value)) == 0) {
+        if (conf.split < 0 && !cuckoo_grow())
+            return DBZSTORE_ERROR;
+        if (!cuckoo_split(conf.tsize / CUCKOO_SLOTS))
+            return DBZSTORE_ERROR;
+    }
+    return r > 0 ? DBZSTORE_OK : DBZSTORE_ERROR;
+}
+#endif /* !DO_TAGGED_HASH */
+
 /* dbzsetoptions - set runtime options for the database.
  */
 void
@@ -1685,7 +2453,11 @@ RemoveDBZ(char *filename)
 static void
 usage(void)
 {
-    fprintf(stderr, "usage: dbztest [-i] [-n|m] [-N] [-s size] <history>\n");
+    fprintf(stderr,
+            "usage: dbztest [-ci] [-n|m] [-N] [-s size] <history>\n");
+#    ifndef DO_TAGGED_HASH
+    fprintf(stderr, "  -c       with -i, use the cuckoo format (version 7)\n");
+#    endif
 #    ifdef DO_TAGGED_HASH
     fprintf(stderr, "  -i       initialize history. deletes .pag files\n");
 #    else
@@ -1720,6 +2492,8 @@ main(int argc, char *argv[])
     for (i = 1; i < argc; i++)
         if (strcmp(argv[i], "-i") == 0)
             initialize = 1;
+        else if (strcmp(argv[i], "-c") == 0)
+            innconf->hisv6dbzversion = 7;
         else if (strcmp(argv[i], "-n") == 0)
             incore = INCORE_NO;
         else if (strcmp(argv[i], "-N") == 0)
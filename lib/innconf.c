@@ -119,12 +119,17 @@ static const struct config config_table[] = {
     {K(bindaddress),                STRING(NULL)      },
     {K(bindaddress6),               STRING(NULL)      },
     {K(blockbackoff),               UNUMBER(120)      },
+    {K(cancelrate),                 UNUMBER(0)        },
     {K(chaninacttime),              UNUMBER(600)      },
     {K(chanretrytime),              UNUMBER(300)      },
     {K(datamovethreshold),          UNUMBER(16384)    },
     {K(docancels),                  STRING(NULL)      },
     {K(dontrejectfiltered),         BOOL(false)       },
+    {K(filtercachesize),            UNUMBER(0)        },
+    {K(filtercachetime),            UNUMBER(600)      },
+    {K(filterworkers),              UNUMBER(0)        },
     {K(hiscachesize),               UNUMBER(256)      },
+    {K(hisoverlaysize),             UNUMBER(0)        },
     {K(htmlstatus),                 BOOL(true)        },
     {K(icdsynccount),               UNUMBER(10)       },
     {K(ignorenewsgroups),           BOOL(false)       },
@@ -139,6 +144,7 @@ static const struct config config_table[] = {
     {K(maxartsize),                 UNUMBER(1000000)  },
     {K(maxconnections),             UNUMBER(50)       },
     {K(mergetogroups),              BOOL(false)       },
+    {K(metrics),                    BOOL(false)       },
     {K(nntplinklog),                BOOL(false)       },
     {K(noreader),                   BOOL(false)       },
     {K(pathalias),                  STRING(NULL)      },
@@ -150,6 +156,7 @@ static const struct config config_table[] = {
     {K(remembertrash),              BOOL(true)        },
     {K(stathist),                   STRING(NULL)      },
     {K(status),                     UNUMBER(600)      },
+    {K(storethread),                BOOL(false)       },
     {K(verifygroups),               BOOL(false)       },
     {K(wanttrash),                  BOOL(false)       },
     {K(wipcheck),                   UNUMBER(5)        },
@@ -226,11 +233,15 @@ static const struct config config_table[] = {
     {K(wireformat),                 BOOL(true)        },
 
     /* The following settings are specific to the history subsystem. */
+    {K(hisbatchdelay),              UNUMBER(100)      },
+    {K(hisbatchsize),               UNUMBER(0)        },
     {K(hismethod),                  STRING(NULL)      },
     {K(hissqlitecachesize),         UNUMBER(65536)    },
     {K(hissqlitemmapsize),          UNUMBER(0)        },
     {K(hissqlitepagesize),          UNUMBER(4096)     },
     {K(hissqlitereadercachesize),   UNUMBER(2000)     },
+    {K(hisv6dbzversion),            UNUMBER(6)        },
+    {K(hisv6resizefill),            UNUMBER(0)        },
 
     /* The following settings are specific to rc.news. */
     {K(docnfsstat),                 BOOL(false)       },
@@ -0,0 +1,314 @@
+/*
+**  Single-producer, single-consumer ring buffer in a shared file.
+**
+**  The file starts with a header holding the size of the data area and the
+**  two positions: head, written only by the consumer, and tail, written only
+**  by the producer, each on its own cache line.  Positions count bytes from
+**  the creation of the ring and wrap around naturally; since the data area is
+**  a power of two in size, the offset of a position is a mask away and tail
+**  minus head is always the number of bytes in use.
+**
+**  Each record is a 32-bit length followed by the data, padded to eight
+**  bytes.  A record never wraps: if it does not fit before the end of the
+**  data area, a RING_SKIP length is written instead and the record starts
+**  again at the beginning.
+**
+**  The wakeup protocol is the usual one: the consumer sets the waiting flag
+**  and then looks at tail once more, while the producer moves tail and then
+**  looks at the flag.  Both use sequentially consistent operations so that at
+**  least one of them sees what the other did.
+*/
+
+#include "portable/system.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "inn/ring.h"
+#include "inn/xmalloc.h"
+#include "portable/mmap.h"
+
+#define RING_MAGIC 0x52494e47 /* "RING" */
+#define RING_LINE  64
+#define RING_MIN   4096
+#define RING_MAX   (1UL << 30)
+#define RING_SKIP  0xffffffffU
+#define RING_ALIGN 8
+
+/* Size taken in the data area by a record of the given length. */
+#define RING_RECORD(n) \
+    (((n) + sizeof(uint32_t) + RING_ALIGN - 1) & ~((size_t) RING_ALIGN - 1))
+
+struct ring_header {
+    uint32_t magic;
+    uint32_t size; /* Of the data area, a power of two. */
+    char pad1[RING_LINE - 2 * sizeof(uint32_t)];
+    unsigned long head;
+    char pad2[RING_LINE - sizeof(unsigned long)];
+    unsigned long tail;
+    char pad3[RING_LINE - sizeof(unsigned long)];
+    int waiting;
+    char pad4[RING_LINE - sizeof(int)];
+};
+
+struct ring {
+    struct ring_header *header;
+    char *data;
+    size_t size;
+    size_t mapped;
+    unsigned long head; /* Next record to read. */
+    unsigned long tail; /* Where the next record goes, for the producer. */
+    size_t last;        /* Length of the record returned by ring_peek. */
+};
+
+#ifdef __ATOMIC_SEQ_CST
+
+/*
+**  Map the file open on fd, which is mapped bytes long.
+*/
+static struct ring *
+ring_map(int fd, size_t mapped)
+{
+    struct ring *ring;
+    void *p;
+
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    ring = xcalloc(1, sizeof(struct ring));
+    ring->header = p;
+    ring->data = (char *) p + sizeof(struct ring_header);
+    ring->mapped = mapped;
+    return ring;
+}
+
+
+struct ring *
+ring_create(const char *path, size_t size)
+{
+    struct ring *ring;
+    size_t mapped;
+    int fd, oerrno;
+
+    if (size > RING_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    mapped = RING_MIN;
+    while (mapped < size)
+        mapped <<= 1;
+    size = mapped;
+    mapped += sizeof(struct ring_header);
+
+    /* A consumer may still be reading an old ring at path, so never write to
+       the existing file. */
+    if (unlink(path) < 0 && errno != ENOENT)
+        return NULL;
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t) mapped) < 0
+        || (ring = ring_map(fd, mapped)) == NULL) {
+        oerrno = errno;
+        close(fd);
+        unlink(path);
+        errno = oerrno;
+        return NULL;
+    }
+    close(fd);
+    ring->size = size;
+    ring->header->size = (uint32_t) size;
+    ring->header->magic = RING_MAGIC;
+    return ring;
+}
+
+
+struct ring *
+ring_open(const char *path)
+{
+    struct ring *ring;
+    struct ring_header header;
+    size_t mapped;
+    int fd, oerrno;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return NULL;
+    if (read(fd, &header, sizeof(header)) != sizeof(header)
+        || header.magic != RING_MAGIC || header.size < RING_MIN
+        || header.size > RING_MAX || (header.size & (header.size - 1)) != 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    mapped = header.size + sizeof(struct ring_header);
+    ring = ring_map(fd, mapped);
+    oerrno = errno;
+    close(fd);
+    if (ring == NULL) {
+        errno = oerrno;
+        return NULL;
+    }
+    ring->size = header.size;
+    ring->head = __atomic_load_n(&ring->header->head, __ATOMIC_RELAXED);
+    return ring;
+}
+
+
+bool
+ring_put(struct ring *ring, const void *data, size_t length)
+{
+    struct ring_header *h = ring->header;
+    size_t need, offset, room;
+    unsigned long head;
+    uint32_t n;
+
+    need = RING_RECORD(length);
+    if (length >= RING_SKIP || need > ring->size / 2)
+        return false;
+    head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    offset = ring->tail & (ring->size - 1);
+    room = ring->size - (ring->tail - head);
+    if (need > ring->size - offset) {
+        /* Skip the end of the data area and start over at the beginning. */
+        if (need + ring->size - offset > room)
+            return false;
+        n = RING_SKIP;
+        memcpy(ring->data + offset, &n, sizeof(n));
+        ring->tail += ring->size - offset;
+        offset = 0;
+    } else if (need > room)
+        return false;
+    n = (uint32_t) length;
+    memcpy(ring->data + offset, &n, sizeof(n));
+    memcpy(ring->data + offset + sizeof(n), data, length);
+    ring->tail += need;
+    __atomic_store_n(&h->tail, ring->tail, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+
+bool
+ring_wakeup(struct ring *ring)
+{
+    int *waiting = &ring->header->waiting;
+
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) == 0)
+        return false;
+    return __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+
+const void *
+ring_peek(struct ring *ring, size_t *length)
+{
+    struct ring_header *h = ring->header;
+    unsigned long tail;
+    size_t offset;
+    uint32_t n;
+
+    /* Reloading head lets the producer read back what is left. */
+    ring->head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    while (ring->head != tail) {
+        offset = ring->head & (ring->size - 1);
+        memcpy(&n, ring->data + offset, sizeof(n));
+        if (n == RING_SKIP) {
+            ring->head += ring->size - offset;
+            __atomic_store_n(&h->head, ring->head, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (RING_RECORD(n) > ring->size - offset)
+            break;
+        ring->last = n;
+        *length = n;
+        return ring->data + offset + sizeof(n);
+    }
+    return NULL;
+}
+
+
+void
+ring_advance(struct ring *ring)
+{
+    ring->head += RING_RECORD(ring->last);
+    ring->last = 0;
+    __atomic_store_n(&ring->header->head, ring->head, __ATOMIC_RELEASE);
+}
+
+
+bool
+ring_sleep(struct ring *ring)
+{
+    struct ring_header *h = ring->header;
+
+    __atomic_store_n(&h->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->tail, __ATOMIC_SEQ_CST) == ring->head)
+        return true;
+    __atomic_store_n(&h->waiting, 0, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+
+void
+ring_free(struct ring *ring)
+{
+    if (ring == NULL)
+        return;
+    munmap((void *) ring->header, ring->mapped);
+    free(ring);
+}
+
+#else /* !__ATOMIC_SEQ_CST */
+
+struct ring *
+ring_create(const char *path UNUSED, size_t size UNUSED)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+struct ring *
+ring_open(const char *path UNUSED)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+bool
+ring_put(struct ring *ring UNUSED, const void *data UNUSED,
+         size_t length UNUSED)
+{
+    return false;
+}
+
+bool
+ring_wakeup(struct ring *ring UNUSED)
+{
+    return false;
+}
+
+const void *
+ring_peek(struct ring *ring UNUSED, size_t *length UNUSED)
+{
+    return NULL;
+}
+
+void
+ring_advance(struct ring *ring UNUSED)
+{
+}
+
+bool
+ring_sleep(struct ring *ring UNUSED)
+{
+    return true;
+}
+
+void
+ring_free(struct ring *ring UNUSED)
+{
+}
+
+#endif /* !__ATOMIC_SEQ_CST */
@@ -30,6 +30,15 @@
 **  be a sub-timer of more than one timer or a timer without a parent, and
 **  each of those counts will be reported separately.
 **
+**  Each timer also keeps the distribution of its times, with a resolution of
+**  a microsecond, in a log-linear histogram in the style of HdrHistogram:
+**  the times are grouped by power of two and each group is split into
+**  2^TMR_HIST_BITS equal buckets, so that a bucket is never wider than
+**  1/2^TMR_HIST_BITS of the times it holds.  Adding a time is a bit count
+**  and an increment, and TMRsummary derives percentiles from the buckets.
+**  The histogram functions are also available on their own, for times the
+**  caller measures itself.
+**
 **  Note that this code is not thread-safe and in fact would need to be
 **  completely overhauled for a threaded server (since the idea of global
 **  timing statistics doesn't make as much sense when different tasks are
@@ -66,12 +75,16 @@
    identifier of the timer.  start stores the time (relative to the last
    summary) at which TMRstart was last called for each timer.  total is
    the total time accrued by that timer since the last summary.  count is
-   the number of times the timer has been stopped since the last summary. */
+   the number of times the timer has been stopped since the last summary.
+   start_usec is the same as start in microseconds, and hist holds the
+   distribution of the times since the last summary. */
 struct timer {
     unsigned int id;
     unsigned long start;
+    unsigned long start_usec;
     unsigned long total;
     unsigned long count;
+    struct timer_hist hist;
 
     struct timer *parent;
     struct timer *brother;
@@ -81,6 +94,11 @@ static struct timer **timers = NULL;
 static struct timer *timer_current = NULL;
 static unsigned int timer_count = 0;
 
+/* Running totals for each timer id, wherever it is in the trees, kept from
+   TMRinit on rather than reset by TMRsummary so that they can be exported
+   as counters.  See TMRstats. */
+static struct timer_stats *timer_stats = NULL;
+
 /* Names for all of the timers.  These must be given in the same order
    as the definition of the enum in timer.h. */
 static const char *const timer_name[TMR_APPLICATION] = {
@@ -106,6 +124,38 @@ TMRnow_double(void)
 }
 
 
+/* The time of the last summary, used as a base for times returned by
+   TMRnow.  Formerly, times were relative to the last call to TMRinit, which
+   was only called once when innd was starting up; with that approach, times
+   may overflow a 32-bit unsigned long about 50 days after the server starts
+   up.  While this may still work due to unsigned arithmetic, this approach
+   is less confusing to follow. */
+static struct timeval timer_base;
+
+
+/*
+**  Returns the number of milliseconds between the base time and tv, and
+**  stores the number of microseconds in usec if it is not NULL.  The latter
+**  wraps around after a bit more than an hour on platforms with a 32-bit
+**  unsigned long, which is harmless since only differences between two of
+**  them are used.
+*/
+static unsigned long
+TMRelapsed(const struct timeval *tv, unsigned long *usec)
+{
+    unsigned long now;
+    long diff, msec;
+
+    now = (unsigned long) (tv->tv_sec - timer_base.tv_sec) * 1000u;
+    diff = tv->tv_usec - timer_base.tv_usec; /* maybe negative */
+    msec = diff / 1000;                      /* still maybe negative */
+    if (usec != NULL)
+        *usec = now * 1000u + (unsigned long) diff;
+    now += (unsigned long) msec;
+    return now;
+}
+
+
 /*
 **  Returns the number of milliseconds since the base time.  This gives
 **  better resolution than time, but the return value is a lot easier to
@@ -116,28 +166,137 @@ static unsigned long
 TMRgettime(bool reset)
 {
     unsigned long now;
-    long usec, msec;
     struct timeval tv;
 
-    /* The time of the last summary, used as a base for times returned by
-       TMRnow.  Formerly, times were relative to the last call to TMRinit,
-       which was only called once when innd was starting up; with that
-       approach, times may overflow a 32-bit unsigned long about 50 days
-       after the server starts up.  While this may still work due to unsigned
-       arithmetic, this approach is less confusing to follow. */
-    static struct timeval base;
-
     gettimeofday(&tv, NULL);
-    now = (unsigned long) (tv.tv_sec - base.tv_sec) * 1000u;
-    usec = tv.tv_usec - base.tv_usec; /* maybe negative */
-    msec = usec / 1000;               /* still maybe negative */
-    now += (unsigned long) msec;
+    now = TMRelapsed(&tv, NULL);
     if (reset)
-        base = tv;
+        timer_base = tv;
     return now;
 }
 
 
+/*
+**  Returns the number of significant bits of value.
+*/
+static unsigned int
+TMRhistbits(unsigned long value)
+{
+    unsigned int bits = 0;
+
+    while (value >= 256) {
+        value >>= 8;
+        bits += 8;
+    }
+    while (value != 0) {
+        value >>= 1;
+        bits++;
+    }
+    return bits;
+}
+
+
+/*
+**  Returns the bucket of a histogram a time in microseconds goes in.  Times
+**  under 2^TMR_HIST_BITS each have their own bucket; above, the bucket is
+**  given by the position of the highest bit and the TMR_HIST_BITS bits
+**  after it.  Times too long for the histogram go in the last bucket.
+*/
+static unsigned int
+TMRhistindex(unsigned long usec)
+{
+    unsigned int bits, shift;
+
+    if (usec < (1UL << TMR_HIST_BITS))
+        return (unsigned int) usec;
+    bits = TMRhistbits(usec);
+    if (bits > TMR_HIST_RANGE)
+        return TMR_HIST_BUCKETS - 1;
+    shift = bits - 1 - TMR_HIST_BITS;
+    return ((shift + 1) << TMR_HIST_BITS)
+           + (unsigned int) ((usec >> shift) - (1UL << TMR_HIST_BITS));
+}
+
+
+/*
+**  Returns the largest time in microseconds that goes in a bucket.
+*/
+static unsigned long
+TMRhisthighest(unsigned int index)
+{
+    unsigned int shift;
+    unsigned long low;
+
+    if (index < (1U << TMR_HIST_BITS))
+        return index;
+    shift = (index >> TMR_HIST_BITS) - 1;
+    low = ((unsigned long) (index & ((1U << TMR_HIST_BITS) - 1))
+           + (1UL << TMR_HIST_BITS))
+          << shift;
+    return low + ((1UL << shift) - 1);
+}
+
+
+/*
+**  Add a time in microseconds to a histogram.
+*/
+void
+TMRhistadd(struct timer_hist *hist, unsigned long usec)
+{
+    hist->bucket[TMRhistindex(usec)]++;
+    hist->count++;
+    if (usec > hist->max)
+        hist->max = usec;
+}
+
+
+/*
+**  Returns the time in microseconds under which the given fraction of the
+**  times in a histogram fall (0.5 for the median), or 0 if it is empty.  As
+**  for HdrHistogram, this is the largest time of the bucket the percentile
+**  falls in, which overestimates it by less than one bucket.
+*/
+unsigned long
+TMRhistpercentile(const struct timer_hist *hist, double fraction)
+{
+    unsigned long rank, seen, value;
+    unsigned int i;
+
+    if (hist->count == 0)
+        return 0;
+    rank = (unsigned long) (fraction * (double) hist->count);
+    if ((double) rank < fraction * (double) hist->count || rank == 0)
+        rank++;
+    for (seen = 0, i = 0; i < TMR_HIST_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i == TMR_HIST_BUCKETS)
+        return hist->max;
+    value = TMRhisthighest(i);
+    return value < hist->max ? value : hist->max;
+}
+
+
+/*
+**  Returns how many times in a histogram are shorter than usec.  This is
+**  exact if usec is a power of two or less than 2^TMR_HIST_BITS, since
+**  these are bucket boundaries, and an approximation otherwise.
+*/
+unsigned long
+TMRhistcount(const struct timer_hist *hist, unsigned long usec)
+{
+    unsigned long count;
+    unsigned int i, last;
+
+    last = TMRhistindex(usec);
+    for (count = 0, i = 0; i < last; i++)
+        count += hist->bucket[i];
+    return count;
+}
+
+
 /*
 **  Initialize the timer.  Zero out even variables that would initially be
 **  zero so that this function can be called multiple times if wanted.
@@ -153,6 +312,7 @@ TMRinit(unsigned int count)
         timers = xmalloc(count * sizeof(struct timer *));
         for (i = 0; i < count; i++)
             timers[i] = NULL;
+        timer_stats = xcalloc(count, sizeof(struct timer_stats));
         TMRgettime(true);
     }
     timer_count = count;
@@ -188,6 +348,8 @@ TMRfree(void)
             TMRfreeone(timers[i]);
     free(timers);
     timers = NULL;
+    free(timer_stats);
+    timer_stats = NULL;
     timer_count = 0;
 }
 
@@ -206,8 +368,10 @@ TMRnew(unsigned int id, struct timer *parent)
     timer->child = NULL;
     timer->id = id;
     timer->start = 0;
+    timer->start_usec = 0;
     timer->total = 0;
     timer->count = 0;
+    memset(&timer->hist, 0, sizeof(timer->hist));
     return timer;
 }
 
@@ -222,6 +386,7 @@ void
 TMRstart(unsigned int timer)
 {
     struct timer *search;
+    struct timeval tv;
 
     if (timer_count == 0) {
         /* this should happen if innconf->timer == 0 */
@@ -258,17 +423,23 @@ TMRstart(unsigned int timer)
             }
         }
     }
-    timer_current->start = TMRgettime(false);
+    gettimeofday(&tv, NULL);
+    timer_current->start = TMRelapsed(&tv, &timer_current->start_usec);
 }
 
 
 /*
-**  Stop a particular timer, adding the total time to total and incrementing
-**  the count of times that timer has been invoked.
+**  Stop a particular timer, adding the total time to total, incrementing
+**  the count of times that timer has been invoked and recording the time in
+**  its histogram.
 */
 void
 TMRstop(unsigned int timer)
 {
+    struct timer_stats *stats;
+    struct timeval tv;
+    unsigned long elapsed, usec;
+
     if (timer_count == 0) {
         /* this should happen if innconf->timer == 0 */
         return;
@@ -279,13 +450,35 @@ TMRstop(unsigned int timer)
         warn("timer %u stopped doesn't match running timer %u", timer,
              timer_current->id);
     else {
-        timer_current->total += TMRgettime(false) - timer_current->start;
+        gettimeofday(&tv, NULL);
+        elapsed = TMRelapsed(&tv, &usec) - timer_current->start;
+        usec -= timer_current->start_usec;
+        timer_current->total += elapsed;
         timer_current->count++;
+        TMRhistadd(&timer_current->hist, usec);
         timer_current = timer_current->parent;
+
+        stats = &timer_stats[timer];
+        stats->total += elapsed;
+        TMRhistadd(&stats->hist, usec);
     }
 }
 
 
+/*
+**  Copy the running totals of a timer since TMRinit into stats.  Returns
+**  false if there is no such timer or timers are disabled.
+*/
+bool
+TMRstats(unsigned int timer, struct timer_stats *stats)
+{
+    if (timer >= timer_count)
+        return false;
+    *stats = timer_stats[timer];
+    return true;
+}
+
+
 /*
 **  Return the current time in milliseconds since the last summary or the
 **  initialization of the timer.  This is intended for use by the caller to
@@ -301,9 +494,9 @@ TMRnow(void)
 /*
 **  Return the label associated with timer number id.  Used internally
 **  to do the right thing when fetching from the timer_name or labels
-**  arrays
+**  arrays.  Also used by applications exporting TMRstats.
 */
-static const char *
+const char *
 TMRlabel(const char *const *labels, unsigned int id)
 {
     if (id >= TMR_APPLICATION)
@@ -314,14 +507,14 @@ TMRlabel(const char *const *labels, unsigned int id)
 
 
 /*
-**  Recursively summarize a single timer tree into the supplied buffer,
-**  returning the number of characters added to the buffer.
+**  Write the name of a timer node into the supplied buffer, returning the
+**  number of characters added to the buffer.
 */
 static size_t
-TMRsumone(const char *const *labels, struct timer *timer, char *buf,
-          size_t len)
+TMRsumname(const char *const *labels, const struct timer *timer, char *buf,
+           size_t len)
 {
-    struct timer *node;
+    const struct timer *node;
     size_t off = 0;
     int rc;
 
@@ -341,7 +534,22 @@ TMRsumone(const char *const *labels, struct timer *timer, char *buf,
     }
     if (off > 0)
         off--;
+    return off;
+}
+
+
+/*
+**  Recursively summarize a single timer tree into the supplied buffer,
+**  returning the number of characters added to the buffer.
+*/
+static size_t
+TMRsumone(const char *const *labels, struct timer *timer, char *buf,
+          size_t len)
+{
+    size_t off;
+    int rc;
 
+    off = TMRsumname(labels, timer, buf, len);
     rc = snprintf(buf + off, len - off, " %lu(%lu) ", timer->total,
                   timer->count);
     if (rc < 0) {
@@ -359,6 +567,7 @@ TMRsumone(const char *const *labels, struct timer *timer, char *buf,
 
     timer->total = 0;
     timer->count = 0;
+    memset(&timer->hist, 0, sizeof(timer->hist));
     if (timer->child != NULL)
         off += TMRsumone(labels, timer->child, buf + off, len - off);
     if (timer->brother != NULL)
@@ -367,16 +576,61 @@ TMRsumone(const char *const *labels, struct timer *timer, char *buf,
 }
 
 
+/*
+**  Recursively write the percentiles of the timers of a tree that ran since
+**  the last summary into the supplied buffer, returning the number of
+**  characters added to the buffer.  This must be done before TMRsumone
+**  resets the histograms.
+*/
+static size_t
+TMRsumlatency(const char *const *labels, const struct timer *timer,
+              char *buf, size_t len)
+{
+    size_t off = 0;
+    int rc;
+
+    if (timer->hist.count > 0) {
+        off = TMRsumname(labels, timer, buf, len);
+        rc = snprintf(buf + off, len - off, " %lu/%lu/%lu/%lu ",
+                      TMRhistpercentile(&timer->hist, 0.5),
+                      TMRhistpercentile(&timer->hist, 0.9),
+                      TMRhistpercentile(&timer->hist, 0.99),
+                      timer->hist.max);
+        if (rc < 0) {
+            /* Do nothing. */
+        } else if ((size_t) rc >= len - off) {
+            off = len;
+        } else {
+            off += rc;
+        }
+        if (off == len) {
+            warn("timer log too long while processing %s",
+                 TMRlabel(labels, timer->id));
+            return off;
+        }
+    }
+    if (timer->child != NULL)
+        off += TMRsumlatency(labels, timer->child, buf + off, len - off);
+    if (timer->brother != NULL)
+        off += TMRsumlatency(labels, timer->brother, buf + off, len - off);
+    return off;
+}
+
+
 /*
 **  Summarize the current timer statistics, report them to syslog, and then
-**  reset them for the next polling interval.
+**  reset them for the next polling interval.  Two lines are logged: the
+**  total time and count of each timer, as "<prefix> time <elapsed>
+**  <timer> <total>(<count>) ...", and then the 50th, 90th and 99th
+**  percentiles and the maximum of the times of each timer that ran, in
+**  microseconds, as "<prefix> latency <timer> <p50>/<p90>/<p99>/<max> ...".
 */
 void
 TMRsummary(const char *prefix, const char *const *labels)
 {
-    char *buf;
+    char *buf, *latency;
     unsigned int i;
-    size_t len, off;
+    size_t len, off, latlen, latoff, start;
     int rc;
 
     /* To find the needed buffer size, note that a 64-bit unsigned number can
@@ -385,9 +639,13 @@ TMRsummary(const char *prefix, const char *const *labels)
        for the prefix.  We may have timers recurring at multiple points in
        the structure, so this may not be long enough, but this is over-sized
        enough that it shouldn't be a problem.  We use snprintf, so if the
-       buffer isn't large enough it will just result in logged errors. */
+       buffer isn't large enough it will just result in logged errors.  Each
+       timer takes at most 52 more characters in the latency line, which
+       has four numbers instead of two. */
     len = 52 * timer_count + 27 + (prefix == NULL ? 0 : strlen(prefix)) + 1;
     buf = xmalloc(len);
+    latlen = len + 52 * timer_count;
+    latency = xmalloc(latlen);
     off = 0;
     if (prefix == NULL)
         rc = 0;
@@ -401,6 +659,28 @@ TMRsummary(const char *prefix, const char *const *labels)
         off += rc;
     }
 
+    /* The latency line starts with the same prefix. */
+    latoff = 0;
+    if (off < len) {
+        memcpy(latency, buf, off);
+        latoff = off;
+    }
+    rc = snprintf(latency + latoff, latlen - latoff, "latency ");
+    if (rc < 0) {
+        /* Do nothing. */
+    } else if ((size_t) rc >= latlen - latoff) {
+        latoff = latlen;
+    } else {
+        latoff += rc;
+    }
+    start = latoff;
+    for (i = 0; i < timer_count && latoff < latlen; i++) {
+        if (timers[i] != NULL) {
+            latoff += TMRsumlatency(labels, timers[i], latency + latoff,
+                                    latlen - latoff);
+        }
+    }
+
     rc = snprintf(buf + off, len - off, "time %lu ", TMRgettime(true));
     if (rc < 0) {
         /* Do nothing. */
@@ -416,5 +696,8 @@ TMRsummary(const char *prefix, const char *const *labels)
         }
     }
     notice("%s", buf);
+    if (latoff > start && latoff < latlen)
+        notice("%s", latency);
     free(buf);
+    free(latency);
 }
@@ -60,7 +60,7 @@
 **  accompanying test suite achieves 100% coverage of this file.
 **
 **  Various bug fixes, code and documentation improvements since then
-**  in 2002-2004, 2006, 2009, 2010, 2014, 2019, 2021, 2022, 2024.
+**  in 2002-2004, 2006, 2009, 2010, 2014, 2019, 2021, 2022, 2024, 2026.
 */
 
 #include "portable/system.h"
@@ -453,3 +453,231 @@ uwildmat_simple(const char *text, const char *pat)
         return (match_pattern(utext, upat, upat + length - 1) == true);
     }
 }
+
+
+/*
+**  Compiled lists of wildmat patterns.
+**
+**  innd matches every newsgroup against the list of patterns of each site,
+**  where the last pattern matching decides.  Matching each pattern in turn
+**  with uwildmat does not scale to many groups and many sites, so a list is
+**  compiled once into a trie of the literal prefixes of its patterns (the
+**  part before the first metacharacter).  Matching walks the trie along the
+**  text, and only the patterns whose prefix was found are looked at further:
+**  a pattern that was only a literal matches if the text ends there, one
+**  whose prefix is followed by nothing but stars always matches, and the
+**  others match the rest of the pattern with match_pattern.  Patterns that
+**  are themselves expressions (with a comma or a leading !) are left to
+**  match_expression.
+*/
+enum uwildmat_kind {
+    UWILDMAT_EXACT,
+    UWILDMAT_PREFIX,
+    UWILDMAT_GLOB,
+    UWILDMAT_EXPRESSION
+};
+
+struct uwildmat_pattern {
+    enum uwildmat_kind kind;
+    bool reverse;        /* Starts with ! or @. */
+    bool poison;         /* Starts with @. */
+    unsigned char *rest; /* What to match after the prefix. */
+    size_t length;       /* Length of rest. */
+    size_t next;         /* Next pattern ending at the same node, plus one. */
+};
+
+struct uwildmat_node {
+    unsigned char c; /* Octet leading to this node. */
+    size_t child;    /* First child, or zero (the root is never a child). */
+    size_t sibling;  /* Next child of the same parent, or zero. */
+    size_t patterns; /* Last pattern added ending here, plus one, or zero. */
+};
+
+struct uwildmat_list {
+    struct uwildmat_node *nodes;
+    size_t nnodes;
+    size_t nodesize;
+    struct uwildmat_pattern *patterns;
+    size_t npatterns;
+    size_t patternsize;
+};
+
+
+/*
+**  Create a new, empty list.
+*/
+struct uwildmat_list *
+uwildmat_list_new(void)
+{
+    struct uwildmat_list *list;
+
+    list = xcalloc(1, sizeof(struct uwildmat_list));
+    list->nodesize = 16;
+    list->nodes = xcalloc(list->nodesize, sizeof(struct uwildmat_node));
+    list->nnodes = 1;
+    return list;
+}
+
+
+/*
+**  Return the child of a node for an octet, or 0 if there is none.
+*/
+static size_t
+list_child(const struct uwildmat_list *list, size_t node, unsigned char c)
+{
+    size_t child;
+
+    for (child = list->nodes[node].child; child != 0;
+         child = list->nodes[child].sibling)
+        if (list->nodes[child].c == c)
+            return child;
+    return 0;
+}
+
+
+/*
+**  Return the child of a node for an octet, adding it if needed.
+*/
+static size_t
+list_addchild(struct uwildmat_list *list, size_t node, unsigned char c)
+{
+    size_t child;
+
+    child = list_child(list, node, c);
+    if (child != 0)
+        return child;
+    if (list->nnodes == list->nodesize) {
+        list->nodesize *= 2;
+        list->nodes = xreallocarray(list->nodes, list->nodesize,
+                                    sizeof(struct uwildmat_node));
+    }
+    child = list->nnodes++;
+    list->nodes[child].c = c;
+    list->nodes[child].child = 0;
+    list->nodes[child].patterns = 0;
+    list->nodes[child].sibling = list->nodes[node].child;
+    list->nodes[node].child = child;
+    return child;
+}
+
+
+/*
+**  Add a pattern to the end of a list.  It may start with ! to negate it or
+**  with @ to make it a poison pattern, as in uwildmat_poison; the rest is
+**  matched as by uwildmat.
+*/
+void
+uwildmat_list_add(struct uwildmat_list *list, const char *pattern)
+{
+    const unsigned char *p = (const unsigned char *) pattern;
+    struct uwildmat_pattern *pp;
+    size_t node;
+
+    if (list->npatterns == list->patternsize) {
+        list->patternsize = (list->patternsize == 0) ? 8
+                                                     : list->patternsize * 2;
+        list->patterns = xreallocarray(list->patterns, list->patternsize,
+                                       sizeof(struct uwildmat_pattern));
+    }
+    pp = &list->patterns[list->npatterns];
+    pp->poison = (*p == '@');
+    pp->reverse = (*p == '!') || pp->poison;
+    if (pp->reverse)
+        p++;
+
+    /* Walk down the trie along the literal prefix. */
+    node = 0;
+    if (*p == '!' || strchr((const char *) p, ',') != NULL)
+        pp->kind = UWILDMAT_EXPRESSION;
+    else {
+        for (; *p != '\0'; p++) {
+            if (*p == '*' || *p == '?' || *p == '[' || *p == '\\')
+                break;
+            node = list_addchild(list, node, *p);
+        }
+        if (*p == '\0')
+            pp->kind = UWILDMAT_EXACT;
+        else if (p[strspn((const char *) p, "*")] == '\0')
+            pp->kind = UWILDMAT_PREFIX;
+        else
+            pp->kind = UWILDMAT_GLOB;
+    }
+    pp->rest = (unsigned char *) xstrdup((const char *) p);
+    pp->length = strlen((const char *) p);
+    pp->next = list->nodes[node].patterns;
+    list->nodes[node].patterns = ++list->npatterns;
+}
+
+
+/*
+**  Match text against a list, with the same result as uwildmat_poison on the
+**  patterns joined with commas: the last pattern that matches decides.
+*/
+enum uwildmat
+uwildmat_list_match(const struct uwildmat_list *list, const char *text)
+{
+    const unsigned char *t = (const unsigned char *) text;
+    const struct uwildmat_pattern *pp;
+    size_t node, i, best;
+    bool matched;
+
+    /* best is the last pattern found to match, plus one. */
+    for (best = 0, node = 0;;) {
+        for (i = list->nodes[node].patterns; i > best; i = pp->next) {
+            pp = &list->patterns[i - 1];
+            switch (pp->kind) {
+            case UWILDMAT_EXACT:
+                matched = (*t == '\0');
+                break;
+            case UWILDMAT_PREFIX:
+                matched = true;
+                break;
+            case UWILDMAT_GLOB:
+                matched = (match_pattern(t, pp->rest, pp->rest + pp->length - 1)
+                           == true);
+                break;
+            case UWILDMAT_EXPRESSION:
+            default:
+                matched = (match_expression(t, pp->rest, false)
+                           == UWILDMAT_MATCH);
+                break;
+            }
+            /* Patterns at a node are kept latest first. */
+            if (matched) {
+                best = i;
+                break;
+            }
+        }
+        if (*t == '\0')
+            break;
+        node = list_child(list, node, *t);
+        if (node == 0)
+            break;
+        t++;
+    }
+
+    if (best == 0)
+        return UWILDMAT_FAIL;
+    pp = &list->patterns[best - 1];
+    if (pp->poison)
+        return UWILDMAT_POISON;
+    return pp->reverse ? UWILDMAT_FAIL : UWILDMAT_MATCH;
+}
+
+
+/*
+**  Free a list.
+*/
+void
+uwildmat_list_free(struct uwildmat_list *list)
+{
+    size_t i;
+
+    if (list == NULL)
+        return;
+    for (i = 0; i < list->npatterns; i++)
+        free(list->patterns[i].rest);
+    free(list->patterns);
+    free(list->nodes);
+    free(list);
+}
@@ -6,6 +6,7 @@
 
 #include "inn/innconf.h"
 #include "inn/ov.h"
+#include "inn/wire.h"
 #include "nnrpd.h"
 #include "post.h"
 
@@ -90,11 +91,11 @@ HEADER *EndOfTable = ARRAY_END(Table);
 static char *
 Join(char *text)
 {
-    char *p;
+    char *p, *end;
 
-    for (p = text; *p; p++)
-        if (*p == '\n' || *p == '\r')
-            *p = ' ';
+    end = text + strlen(text);
+    for (p = wire_findctl(text, end); p < end; p = wire_findctl(p + 1, end))
+        *p = ' ';
     return text;
 }
 
@@ -45,6 +45,7 @@ my %ctlinnd = (
     'o' => 'reload',
     'n' => 'renumber',
     'z' => 'reserve',
+    'G' => 'resizehist',
     'p' => 'rmgroup',
     'A' => 'send',
     'q' => 'shutdown',
@@ -75,6 +76,7 @@ my %timer_names = (
     perl     => 'perl filter',
     python   => 'python filter',
     datamove => 'data move',
+    hisseen  => 'history overlay',
 );
 
 my %innfeed_timer_names = (
@@ -750,6 +752,9 @@ sub collect($$$$$$) {
             $innd_control{"throttle"}++;
             return 1;
         }
+        # timer percentiles, not summarized
+        # ME latency X nnnn/nnnn/nnnn/nnnn [...]
+        return 1 if $left =~ m/^\S+\s+latency\s/o;
         # profile timer
         # ME time X nnnn X(X) [...]
         # The exact timers change from various versions of INN, so try to deal
@@ -781,7 +786,7 @@ sub collect($$$$$$) {
         }
         # ME time xx idle xx(xx)     [ bug ? a part of timer ?]
         return 1 if $left =~ m/^ME time \d+ idle \d+\(\d+\)\s*$/o;
-        # ME HISstats x hitpos x hitneg x missed x dne
+        # ME HISstats x hitpos x hitneg x missed x dne [x evicted]
         #
         # from innd/his.c:
         # HIShitpos: the entry existed in the cache and in history.
@@ -795,6 +800,7 @@ sub collect($$$$$$) {
                        \ (\d+)\s+hitneg           # hitneg
                        \ (\d+)\s+missed           # missed
                        \ (\d+)\s+dne              # dne
+                       (?:\ \d+\s+evicted)?     # evicted
                        $/ox
         ) {
             $innd_his{'Positive hits'} += $1;
@@ -1089,6 +1095,9 @@ sub collect($$$$$$) {
             $innfeed_shrunk{$file} += $s1 - $s2;
             return 1;
         }
+        # timer percentiles, not summarized
+        # ME latency X nnnn/nnnn/nnnn/nnnn [...]
+        return 1 if $left =~ m/^\S+\s+latency\s/o;
         # profile timer
         # ME time X nnnn X(X) [...]
         return 1 if $left =~ m/backlogstats/;
@@ -2062,6 +2071,9 @@ sub collect($$$$$$) {
           if $left =~ /^\?\ reverse\ lookup\ for\ \S+\ failed:
                        \ .*\ --\ using\ IP\ address\ for\ access
                        $/ox;
+        # timer percentiles, not summarized
+        # ME latency X nnnn/nnnn/nnnn/nnnn [...]
+        return 1 if $left =~ m/^\S+\s+latency\s/o;
         # profile timer
         # ME time X nnnn X(X) [...]
         # The exact timers change from various versions of INN, so try to deal
@@ -105,8 +105,9 @@ build_header(const char *article, size_t length, const char *header,
              struct buffer *overview)
 {
     ptrdiff_t size;
-    size_t offset;
-    const char *data, *end, *p;
+    size_t offset, run;
+    const char *data, *end, *p, *q;
+    char *tab;
 
     data = wire_findheader(article, length, header, false);
     if (data == NULL)
@@ -138,16 +139,28 @@ build_header(const char *article, size_t length, const char *header,
     offset = overview->used + overview->left;
     buffer_resize(overview, offset + size);
 
-    for (p = data; p <= end; p++) {
-        if (*p == '\r' && p[1] == '\n') {
-            p++;
+    /* Copy runs of ordinary octets at once, then deal with the \r, \n or nul
+       that ended the run.  Tabs separate overview fields, so turn those in
+       the run into spaces as well. */
+    for (p = data; p <= end;) {
+        q = wire_findctl(p, end + 1);
+        run = q - p;
+        memcpy(overview->data + offset, p, run);
+        tab = overview->data + offset;
+        offset += run;
+        overview->left += run;
+        while ((tab = memchr(tab, '\t', overview->data + offset - tab))
+               != NULL)
+            *tab++ = ' ';
+        if (q > end)
+            break;
+        if (*q == '\r' && q[1] == '\n') {
+            p = q + 2;
             continue;
         }
-        if (*p == '\0' || *p == '\t' || *p == '\n' || *p == '\r')
-            overview->data[offset++] = ' ';
-        else
-            overview->data[offset++] = *p;
+        overview->data[offset++] = ' ';
         overview->left++;
+        p = q + 1;
     }
 }
 
@@ -0,0 +1,163 @@
+/* Test suite for the queue of cancels in innd. */
+
+#include "portable/system.h"
+
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "inn/innconf.h"
+#include "inn/libinn.h"
+#include "inn/messages.h"
+#include "tap/basic.h"
+
+#include "../../innd/innd.h"
+
+/* A queue left by a previous innd, with lines that must be dropped. */
+static const char saved[] = "\
+<one@example.com> peer <c1@example.com> key\n\
+<two@example.com> - -\n\
+\n\
+not-a-message-id peer <c3@example.com>\n\
+<three@example.com>\n\
+<four@example.com> peer -\n";
+
+/* What is left of it once read. */
+static const char kept[] = "\
+<one@example.com> peer <c1@example.com> key\n\
+<two@example.com> - -\n\
+<four@example.com> peer -\n";
+
+static char *path;
+
+/* Initialize things enough to be able to call the CANCEL functions, with
+   the queue in tmpdir. */
+static void
+initialize(char *tmpdir)
+{
+    if (access("../data/etc/inn.conf", F_OK) < 0)
+        if (access("data/etc/inn.conf", F_OK) == 0)
+            if (chdir("innd") != 0)
+                sysdie("cannot cd to innd");
+    if (!innconf_read("../data/etc/inn.conf"))
+        exit(1);
+    Log = fopen("/dev/null", "w");
+    if (Log == NULL)
+        sysdie("cannot open /dev/null");
+    gettimeofday(&Now, NULL);
+
+    if (mkdtemp(tmpdir) == NULL)
+        sysbail("cannot create temporary directory");
+    innconf->pathdb = xstrdup(tmpdir);
+    innconf->docancels = xstrdup("all");
+    path = concatpath(tmpdir, INN_PATH_CANCELQUEUE);
+}
+
+/* Whether the queue file holds exactly the given text. */
+static bool
+holds(const char *text)
+{
+    char *data;
+    bool same;
+
+    data = ReadInFile(path, NULL);
+    if (data == NULL)
+        return false;
+    same = strcmp(data, text) == 0;
+    free(data);
+    return same;
+}
+
+/* Whether the queue file holds the cancels numbered from first to last, in
+   that order, as queued by main. */
+static bool
+holds_range(int first, int last)
+{
+    struct buffer *b;
+    bool same;
+    int i;
+
+    b = buffer_new();
+    for (i = first; i <= last; i++)
+        buffer_append_sprintf(b, "<%d@example.com> peer <c%d@example.com>\n",
+                              i, i);
+    buffer_append(b, "", 1);
+    same = holds(b->data);
+    buffer_free(b);
+    return same;
+}
+
+int
+main(void)
+{
+    char tmpdir[] = "cancel-XXXXXX";
+    char id[64], cid[64];
+    FILE *f;
+    int i;
+
+    test_init(15);
+    initialize(tmpdir);
+    message_handlers_warn(0);
+
+    /* Nothing is queued unless cancelrate is set. */
+    innconf->cancelrate = 0;
+    ok(1, !CANCELadd("peer", NULL, "<zero@example.com>", NULL));
+
+    /* A saved queue is read back, dropping what cannot be parsed. */
+    f = fopen(path, "w");
+    if (f == NULL || fputs(saved, f) == EOF || fclose(f) == EOF)
+        sysbail("cannot write %s", path);
+    CANCELsetup();
+    ok(2, CANCELpending() == 3);
+    ok(3, holds(kept));
+
+    /* Accepted cancels are appended at once, with a one-line key. */
+    innconf->cancelrate = 2;
+    ok(4, CANCELadd(NULL, NULL, "<five@example.com>", "a\r\n\tb"));
+    ok(5, CANCELpending() == 4);
+    ok(6, holds("<one@example.com> peer <c1@example.com> key\n"
+                "<two@example.com> - -\n"
+                "<four@example.com> peer -\n"
+                "<five@example.com> - - a   b\n"));
+
+    /* Without history, running the queue only takes the cancels off. */
+    CANCELrun();
+    ok(7, CANCELpending() == 2);
+    CANCELrun();
+    ok(8, CANCELpending() == 2);
+    innconf->cancelrate = 0;
+    CANCELrun();
+    ok(9, CANCELpending() == 0);
+    ok(10, holds(""));
+
+    /* Fill a ring that does not start at its first entry, so that growing
+       it has to unwrap it, and check the order survives. */
+    innconf->cancelrate = 2;
+    for (i = 1; i <= 4; i++) {
+        snprintf(id, sizeof(id), "<%d@example.com>", i);
+        snprintf(cid, sizeof(cid), "<c%d@example.com>", i);
+        CANCELadd("peer", cid, id, NULL);
+    }
+    Now.tv_sec++;
+    CANCELrun();
+    ok(11, CANCELpending() == 2);
+    for (i = 5; i <= 200; i++) {
+        snprintf(id, sizeof(id), "<%d@example.com>", i);
+        snprintf(cid, sizeof(cid), "<c%d@example.com>", i);
+        CANCELadd("peer", cid, id, NULL);
+    }
+    ok(12, CANCELpending() == 198);
+
+    /* Until it is compacted, the file keeps the cancels already run. */
+    ok(13, holds_range(1, 200));
+    CANCELclose();
+    ok(14, holds_range(3, 200));
+    CANCELsetup();
+    ok(15, CANCELpending() == 198);
+
+    CANCELclose();
+    unlink(path);
+    rmdir(tmpdir);
+    return 0;
+}
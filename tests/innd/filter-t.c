@@ -0,0 +1,256 @@
+/* Test suite for running the article filters in worker processes. */
+
+#include "portable/system.h"
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "inn/innconf.h"
+#include "inn/libinn.h"
+#include "inn/messages.h"
+#include "tap/basic.h"
+
+#include "../../innd/innd.h"
+
+#ifdef DO_PERL
+
+#    include "innperl.h"
+
+/* A filter that rejects some articles and kills the worker on others. */
+static const char filter[] = "\
+sub filter_art {\n\
+    kill 'KILL', $$ if $hdr{'Subject'} eq 'die';\n\
+    return $hdr{'Subject'} eq 'reject' ? 'rejected' : '';\n\
+}\n\
+1;\n";
+
+/* Initialize things enough to start filter workers, with their ring in
+   tmpdir, and to answer the articles they filtered. */
+static void
+initialize(char *tmpdir)
+{
+    char *cwd, *path;
+    FILE *f;
+
+    if (access("../data/etc/inn.conf", F_OK) < 0)
+        if (access("data/etc/inn.conf", F_OK) == 0)
+            if (chdir("innd") != 0)
+                sysdie("cannot cd to innd");
+    if (!innconf_read("../data/etc/inn.conf"))
+        exit(1);
+    Log = fopen("/dev/null", "w");
+    if (Log == NULL)
+        sysdie("cannot open /dev/null");
+    CHANsetup(32);
+    WIPsetup();
+    gettimeofday(&Now, NULL);
+
+    if (mkdtemp(tmpdir) == NULL)
+        sysbail("cannot create temporary directory");
+    innconf->pathrun = xstrdup(tmpdir);
+    innconf->filterworkers = 1;
+    cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+        sysbail("cannot get current directory");
+    xasprintf(&path, "%s/%s/filter_innd.pl", cwd, tmpdir);
+    free(cwd);
+    f = fopen(path, "w");
+    if (f == NULL || fputs(filter, f) == EOF || fclose(f) == EOF)
+        sysbail("cannot write %s", path);
+    PERLsetup(NULL, path, "filter_art");
+    if (!PERLreadfilter(path, "filter_art") || !PerlFilter(true))
+        bail("cannot load the Perl filter");
+    free(path);
+}
+
+/* The number of channels reading replies from workers, and the last one. */
+static int
+workers(CHANNEL **last)
+{
+    CHANNEL *cp;
+    int i, count = 0;
+
+    for (i = 0; (cp = CHANiter(&i, CTfilter)) != NULL;) {
+        if (last != NULL)
+            *last = cp;
+        count++;
+    }
+    return count;
+}
+
+/* Channels are never read from, but need a reader. */
+static void
+reader(CHANNEL *cp UNUSED)
+{
+}
+
+/* Make a channel on fd holding an article with the given subject, as
+   ARTpost would have parsed it. */
+static CHANNEL *
+article(int fd, const char *subject)
+{
+    static const char body[] = "A body.\r\n";
+    size_t length = strlen(subject);
+    HDRCONTENT *hc;
+    CHANNEL *cp;
+
+    cp = CHANcreate(fd, CTany, CSgotarticle, reader, NULL);
+    hc = cp->Data.HdrContent;
+    buffer_sprintf(&cp->In, "Subject: %s\r\nMessage-ID: <%s@test>\r\n\r\n",
+                   subject, subject);
+    hc[HDR__SUBJECT].Value = cp->In.data + strlen("Subject: ");
+    hc[HDR__SUBJECT].Length = (int) length;
+    hc[HDR__MESSAGE_ID].Value =
+        HDR(HDR__SUBJECT) + length + strlen("\r\nMessage-ID: ");
+    hc[HDR__MESSAGE_ID].Length = (int) (length + strlen("<@test>"));
+
+    /* The Message-ID is logged, and ARTpost leaves it nul-terminated. */
+    HDR_LASTCHAR_SAVE(HDR__MESSAGE_ID);
+    HDR_PARSE_START(HDR__MESSAGE_ID);
+    cp->Data.Body = cp->In.left;
+    buffer_append(&cp->In, body, strlen(body));
+    cp->Next = cp->In.left;
+    cp->Data.Lines = 1;
+    return cp;
+}
+
+/* Queue an article with the given subject for the workers, and forget about
+   it so that its verdict is dropped instead of going on with the article. */
+static bool
+queue(const char *subject)
+{
+    CHANNEL *cp;
+    HASH hash;
+    int fd[2];
+    bool queued;
+
+    if (pipe(fd) < 0)
+        sysbail("cannot create pipe");
+    close(fd[1]);
+    cp = article(fd[0], subject);
+    memset(&hash, 0, sizeof(hash));
+    queued = FILTERqueue(cp, hash, 0) && cp->State == CSstoring;
+    FILTERforget(cp);
+    CHANclose(cp, CHANname(cp));
+    return queued;
+}
+
+/* Read what the workers send back until nothing is pending, giving up after
+   a few seconds. */
+static void
+replies(void)
+{
+    CHANNEL *cp;
+    fd_set fds;
+    struct timeval tv;
+    time_t end;
+
+    end = time(NULL) + 10;
+    while (FILTERpending() > 0 && time(NULL) < end) {
+        if (workers(&cp) == 0)
+            return;
+        FD_ZERO(&fds);
+        FD_SET(cp->fd, &fds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(cp->fd + 1, &fds, NULL, NULL, &tv) > 0)
+            (*cp->Reader)(cp);
+    }
+}
+
+/* Have the workers filter an article with the given subject, and put what
+   is sent back to the peer in reply, with at most size bytes. */
+static CHANNEL *
+filter_article(const char *subject, char *reply, size_t size)
+{
+    CHANNEL *cp;
+    HASH hash;
+    int fd[2];
+    ssize_t n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+        sysbail("cannot create socket pair");
+    cp = article(fd[0], subject);
+    memset(&hash, 0, sizeof(hash));
+    *reply = '\0';
+    if (!FILTERqueue(cp, hash, 0))
+        return cp;
+    replies();
+    n = recv(fd[1], reply, size - 1, MSG_DONTWAIT);
+    reply[n > 0 ? n : 0] = '\0';
+    close(fd[1]);
+    return cp;
+}
+
+int
+main(void)
+{
+    char tmpdir[] = "filter-XXXXXX";
+    char reply[BUFSIZ];
+    char *cmd;
+    CHANNEL *cp;
+
+    test_init(13);
+    initialize(tmpdir);
+    message_handlers_warn(0);
+    message_handlers_notice(0);
+    innconf->remembertrash = false;
+
+    fflush(stdout);
+    FILTERsetup();
+    ok(1, workers(NULL) == 1);
+
+    /* An article goes to the worker, which answers it. */
+    ok(2, queue("accept"));
+    ok(3, FILTERpending() == 1);
+    ok(4, queue("reject"));
+    replies();
+    ok(5, FILTERpending() == 0 && workers(NULL) == 1);
+
+    /* The verdict of the worker is acted on once it comes back. */
+    cp = filter_article("reject", reply, sizeof(reply));
+    ok(6, strcmp(reply, "437 rejected\r\n") == 0);
+    ok(7, cp->Unwanted_f == 1 && cp->State == CSgetcmd);
+    CHANclose(cp, CHANname(cp));
+
+    /* A worker that dies after long enough is replaced. */
+    Now.tv_sec += 120;
+    fflush(stdout);
+    ok(8, queue("die"));
+    replies();
+    ok(9, FILTERpending() == 0);
+    ok(10, workers(NULL) == 1);
+    ok(11, queue("accept"));
+    replies();
+    ok(12, FILTERpending() == 0);
+
+    /* One that dies right after it was started is not. */
+    queue("die");
+    replies();
+    ok(13, workers(NULL) == 0 && !queue("accept"));
+
+    FILTERclose();
+    while (wait(NULL) > 0)
+        ;
+    xasprintf(&cmd, "/bin/rm -rf %s", tmpdir);
+    if (system(cmd) < 0)
+        sysdiag("cannot clean up %s", tmpdir);
+    free(cmd);
+    return 0;
+}
+
+#else /* !DO_PERL */
+
+int
+main(void)
+{
+    skip_all("Perl filter support not built");
+    return 0;
+}
+
+#endif /* !DO_PERL */
@@ -0,0 +1,123 @@
+/* Test suite for the table of filter verdicts. */
+
+#include "portable/system.h"
+
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "inn/innconf.h"
+#include "inn/libinn.h"
+#include "tap/basic.h"
+
+#include "../../innd/innd.h"
+
+/* Initialize things enough to be able to call the VERDICT functions. */
+static void
+initialize(void)
+{
+    if (access("../data/etc/inn.conf", F_OK) < 0)
+        if (access("data/etc/inn.conf", F_OK) == 0)
+            if (chdir("innd") != 0)
+                sysdie("cannot cd to innd");
+    if (!innconf_read("../data/etc/inn.conf"))
+        exit(1);
+    gettimeofday(&Now, NULL);
+}
+
+/* A key that falls in the same bucket for every n, differing in its last
+   byte. */
+static HASH
+key(int n)
+{
+    HASH hash;
+
+    memset(&hash, 0, sizeof(hash));
+    hash.hash[sizeof(hash.hash) - 1] = (char) n;
+    return hash;
+}
+
+/* Whether the verdict of a filter is known and is the given text, with NULL
+   for an accepted article. */
+static bool
+known(enum verdict_kind kind, HASH hash, const char *expected)
+{
+    char *text = NULL;
+
+    if (!VERDICTfind(kind, &hash, &text))
+        return false;
+    if (expected == NULL)
+        return text == NULL;
+    return text != NULL && strcmp(text, expected) == 0;
+}
+
+int
+main(void)
+{
+    HASH hash;
+    char *text;
+    unsigned long generation;
+    int i;
+
+    test_init(17);
+    initialize();
+
+    /* Nothing is cached until the table is set up. */
+    hash = HashMessageID("<spam@example.com>");
+    ok(1, !VERDICTenabled());
+    VERDICTadd(VERDICT_PERLMID, &hash, "rejected");
+    ok(2, !VERDICTfind(VERDICT_PERLMID, &hash, &text));
+
+    innconf->filtercachesize = 64;
+    innconf->filtercachetime = 60;
+    VERDICTsetup();
+    ok(3, VERDICTenabled());
+
+    /* Rejections keep their text, acceptances are NULL. */
+    ok(4, !VERDICTfind(VERDICT_PERLMID, &hash, &text));
+    VERDICTadd(VERDICT_PERLMID, &hash, "rejected");
+    ok(5, known(VERDICT_PERLMID, hash, "rejected"));
+    hash = HashMessageID("<ham@example.com>");
+    VERDICTadd(VERDICT_PERLMID, &hash, "");
+    ok(6, known(VERDICT_PERLMID, hash, NULL));
+    VERDICTadd(VERDICT_PYTHONMID, &hash, NULL);
+    ok(7, known(VERDICT_PYTHONMID, hash, NULL));
+
+    /* Each filter has its own verdicts. */
+    ok(8, !VERDICTfind(VERDICT_PERLART, &hash, &text));
+
+    /* A new verdict for a key replaces the old one. */
+    VERDICTadd(VERDICT_PERLMID, &hash, "changed its mind");
+    ok(9, known(VERDICT_PERLMID, hash, "changed its mind"));
+
+    /* Verdicts expire. */
+    Now.tv_sec += 61;
+    ok(10, !VERDICTfind(VERDICT_PERLMID, &hash, &text));
+    ok(11, !VERDICTfind(VERDICT_PYTHONMID, &hash, &text));
+
+    /* A full bucket drops its oldest verdict. */
+    for (i = 1; i <= 5; i++) {
+        hash = key(i);
+        VERDICTadd(VERDICT_PERLART, &hash, "rejected");
+    }
+    ok(12, !known(VERDICT_PERLART, key(1), "rejected"));
+    ok(13, known(VERDICT_PERLART, key(2), "rejected")
+               && known(VERDICT_PERLART, key(5), "rejected"));
+
+    /* Finding a verdict does not keep it from being the next to go. */
+    hash = key(6);
+    VERDICTadd(VERDICT_PERLART, &hash, NULL);
+    ok(14, !known(VERDICT_PERLART, key(2), "rejected")
+               && known(VERDICT_PERLART, key(6), NULL));
+
+    /* Clearing forgets everything, and starts a new generation. */
+    generation = VERDICTgeneration();
+    VERDICTclear();
+    ok(15, !VERDICTfind(VERDICT_PERLART, &hash, &text));
+    hash = key(5);
+    ok(16, !VERDICTfind(VERDICT_PERLART, &hash, &text));
+    ok(17, VERDICTgeneration() != generation);
+
+    return 0;
+}
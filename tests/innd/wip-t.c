@@ -0,0 +1,109 @@
+/* Test suite and benchmark for the work-in-progress table. */
+
+#include "portable/system.h"
+
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "inn/innconf.h"
+#include "inn/libinn.h"
+#include "tap/basic.h"
+
+#include "../../innd/innd.h"
+
+#define CHANNELS 16
+#define OFFERS   1000000
+
+/* Initialize things enough to be able to call the WIP functions. */
+static void
+initialize(void)
+{
+    if (access("../data/etc/inn.conf", F_OK) < 0)
+        if (access("data/etc/inn.conf", F_OK) == 0)
+            if (chdir("innd") != 0)
+                sysdie("cannot cd to innd");
+    if (!innconf_read("../data/etc/inn.conf"))
+        exit(1);
+    gettimeofday(&Now, NULL);
+    WIPsetup();
+}
+
+/* Whether every Message-ID in the list is, or is not, in the table. */
+static bool
+all_present(char **ids, size_t n, bool present)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if ((WIPbyid(ids[i]) != NULL) != present)
+            return false;
+    return true;
+}
+
+int
+main(void)
+{
+    CHANNEL *cp;
+    char **ids;
+    size_t i;
+    struct timeval start, end;
+    double elapsed;
+    bool ok_offers;
+
+    test_init(8);
+    initialize();
+
+    cp = xcalloc(CHANNELS, sizeof(CHANNEL));
+    ids = xmalloc(OFFERS * sizeof(char *));
+    for (i = 0; i < OFFERS; i++)
+        xasprintf(&ids[i], "<%lu.wip@test.invalid>", (unsigned long) i);
+
+    /* An offer is in progress on the channel that made it, and for another
+       channel until wipcheck has passed. */
+    ok(1, !WIPinprogress(ids[0], &cp[0], true));
+    ok(2, WIPinprogress(ids[0], &cp[1], true));
+    ok(3, WIPbyid(ids[0]) != NULL && WIPbyid(ids[0])->Chan == &cp[0]);
+
+    /* Once wipexpire has passed, the next channel to offer it takes it. */
+    Now.tv_sec += innconf->wipexpire + 1;
+    ok(4, !WIPinprogress(ids[0], &cp[1], true)
+              && WIPbyid(ids[0])->Chan == &cp[1]);
+    Now.tv_sec -= innconf->wipexpire + 1;
+    WIPprecomfree(&cp[1]);
+    ok(5, WIPbyid(ids[0]) == NULL);
+
+    /* Each channel keeps its last PRECOMMITCACHESIZE offers. */
+    ok_offers = true;
+    for (i = 0; i < CHANNELS * PRECOMMITCACHESIZE * 4; i++)
+        if (WIPinprogress(ids[i], &cp[i % CHANNELS], true))
+            ok_offers = false;
+    ok(6, ok_offers
+              && all_present(ids + CHANNELS * PRECOMMITCACHESIZE * 3,
+                             CHANNELS * PRECOMMITCACHESIZE, true)
+              && all_present(ids, CHANNELS * PRECOMMITCACHESIZE * 3, false));
+    for (i = 0; i < CHANNELS; i++)
+        WIPprecomfree(&cp[i]);
+    ok(7, all_present(ids, CHANNELS * PRECOMMITCACHESIZE * 4, false));
+
+    /* Time a stream of CHECK offers spread over the channels. */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < OFFERS; i++)
+        WIPinprogress(ids[i], &cp[i % CHANNELS], true);
+    gettimeofday(&end, NULL);
+    elapsed = (double) (end.tv_sec - start.tv_sec)
+              + (double) (end.tv_usec - start.tv_usec) / 1e6;
+    if (elapsed > 0)
+        diag("%d offers on %d channels: %.0f offers per second", OFFERS,
+             CHANNELS, OFFERS / elapsed);
+    for (i = 0; i < CHANNELS; i++)
+        WIPprecomfree(&cp[i]);
+    ok(8, all_present(ids, OFFERS, false));
+
+    for (i = 0; i < OFFERS; i++)
+        free(ids[i]);
+    free(ids);
+    free(cp);
+    return 0;
+}
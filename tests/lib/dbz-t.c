@@ -0,0 +1,343 @@
+/* Test suite for the cuckoo format (version 7) of lib/dbz.c.
+ *
+ * Starts from the smallest table, so that the stores double it several
+ * times, and checks that a reader which opened it before it grew, or while
+ * it was being split, still finds what was stored afterwards.
+ */
+
+#include "portable/system.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "inn/dbz.h"
+#include "inn/innconf.h"
+#include "inn/libinn.h"
+#include "inn/messages.h"
+#include "tap/basic.h"
+
+#define FIRST  20000  /* entries stored before the reader opens the table */
+#define SECOND 150000 /* entries stored while it is open */
+
+
+/*
+**  Hash of a deterministic message-ID for an integer.
+*/
+static HASH
+make_key(unsigned long n)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "<art-%lu@dbz.test>", n);
+    return HashMessageID(buf);
+}
+
+
+/*
+**  Check that the entries from start to end - 1 are there with the values
+**  they were stored with.
+*/
+static bool
+check_range(unsigned long start, unsigned long end)
+{
+    unsigned long i;
+    off_t value;
+
+    for (i = start; i < end; i++)
+        if (!dbzfetch(make_key(i), &value) || value != (off_t) i * 100)
+            return false;
+    return true;
+}
+
+
+/*
+**  Store the entries from start to end - 1.
+*/
+static bool
+store_range(unsigned long start, unsigned long end)
+{
+    unsigned long i;
+
+    for (i = start; i < end; i++)
+        if (dbzstore(make_key(i), (off_t) i * 100) != DBZSTORE_OK)
+            return false;
+    return true;
+}
+
+
+/*
+**  Return the version, size and split point from the first line of a .dir
+**  file; the split point is -1 when there is none.
+*/
+static void
+read_dir(const char *path, int *version, long *size, long *split)
+{
+    char *fn;
+    FILE *f;
+    int valuesize, fillpercent;
+
+    *version = 0;
+    *size = 0;
+    *split = -1;
+    fn = concat(path, ".dir", (char *) 0);
+    f = fopen(fn, "r");
+    if (f == NULL)
+        sysbail("can't open %s", fn);
+    if (fscanf(f, "dbz %d %ld %d %d %ld", version, size, &valuesize,
+               &fillpercent, split)
+        < 2)
+        *version = 0;
+    fclose(f);
+    free(fn);
+}
+
+
+/*
+**  Use mmap for both tables, as readers do.
+*/
+static void
+use_mmap(void)
+{
+    dbzoptions opt;
+
+    dbzgetoptions(&opt);
+    opt.pag_incore = INCORE_MMAP;
+    opt.exists_incore = INCORE_MMAP;
+    dbzsetoptions(opt);
+}
+
+
+/*
+**  The reader run by the child: check the first entries, let the parent
+**  store the others, and then check those.
+*/
+static int
+reader(const char *path, int ready, int go)
+{
+    char c = 0;
+    bool okay;
+
+    use_mmap();
+    if (!dbzinit(path))
+        return 1;
+    okay = check_range(0, FIRST);
+    if (write(ready, &c, 1) != 1 || read(go, &c, 1) != 1)
+        return 1;
+    okay = okay && check_range(FIRST, FIRST + SECOND);
+    dbzclose();
+    return okay ? 0 : 1;
+}
+
+
+/*
+**  Whether the process still maps a file whose name contains name, as far as
+**  /proc tells.
+*/
+static bool
+mapped(const char *name)
+{
+    char line[BUFSIZ];
+    FILE *f;
+    bool found = false;
+
+    f = fopen("/proc/self/maps", "r");
+    if (f == NULL)
+        return false;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (strstr(line, name) != NULL)
+            found = true;
+    fclose(f);
+    return found;
+}
+
+
+/*
+**  The reader run by the child for a table being split.  It opens the table
+**  when the parent sends the number of entries stored so far, and checks
+**  them.  Once the parent has finished the split and sent the new number,
+**  it looks for a key that is not there, so that it learns the new size,
+**  and checks all the entries.  Closing the table unmaps all of it.
+*/
+static int
+split_reader(const char *path, int ready, int go)
+{
+    unsigned long count;
+    char c = 0;
+    bool okay;
+
+    if (read(go, &count, sizeof(count)) != sizeof(count))
+        return 1;
+    use_mmap();
+    if (!dbzinit(path))
+        return 1;
+    okay = check_range(0, count);
+    if (write(ready, &c, 1) != 1)
+        return 1;
+    if (read(go, &count, sizeof(count)) != sizeof(count))
+        return 1;
+    okay = okay && !dbzexists(make_key(count)) && check_range(0, count);
+    dbzclose();
+    return okay && !mapped(path) ? 0 : 1;
+}
+
+
+int
+main(void)
+{
+    char tmpdir[64], path[128], again[128], split[128], mem[128], full[128];
+    char cmd[128], junk[64], *fn;
+    int ready[2], go[2], status, version, fd;
+    long size, first, at;
+    unsigned long n;
+    dbzoptions opt;
+    pid_t child;
+    char c = 0;
+    bool okay;
+
+    test_init(15);
+
+    strlcpy(tmpdir, "dbz-XXXXXX", sizeof(tmpdir));
+    if (mkdtemp(tmpdir) == NULL)
+        sysbail("can't create temp directory");
+    snprintf(path, sizeof(path), "%s/history", tmpdir);
+    snprintf(again, sizeof(again), "%s/history.n", tmpdir);
+    snprintf(split, sizeof(split), "%s/split", tmpdir);
+    snprintf(mem, sizeof(mem), "%s/mem", tmpdir);
+    snprintf(full, sizeof(full), "%s/full", tmpdir);
+    innconf = xcalloc(1, sizeof(struct innconf));
+    innconf->hisv6dbzversion = 7;
+
+    if (!dbzfresh(path, dbzsize(1000)))
+        bail("can't create %s", path);
+    okay = store_range(0, FIRST);
+    ok(1, dbzclose() && okay);
+
+    /* The reader opens the table before it grows. */
+    if (pipe(ready) < 0 || pipe(go) < 0)
+        sysbail("can't create pipes");
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("can't fork");
+    if (child == 0)
+        _exit(reader(path, ready[1], go[0]));
+    if (read(ready[0], &c, 1) != 1)
+        bail("reader failed to start");
+    if (!dbzinit(path))
+        bail("can't open %s", path);
+    okay = store_range(FIRST, FIRST + SECOND);
+    ok(2, dbzsync() && okay);
+    if (write(go[1], &c, 1) != 1)
+        sysbail("can't start the reader");
+    if (waitpid(child, &status, 0) != child)
+        sysbail("can't wait for the reader");
+    ok(3, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    /* It doubled at least twice and ends up a power of two of buckets. */
+    read_dir(path, &version, &size, &at);
+    ok(4, version == 7 && size >= 4 * 65536 && (size & (size - 1)) == 0);
+    ok(5, dbzstore(make_key(1), 100) == DBZSTORE_EXISTS
+              && !dbzexists(make_key(FIRST + SECOND)));
+    ok(6, dbzclose());
+
+    /* Everything is still there after the table was written out. */
+    if (!dbzinit(path))
+        bail("can't open %s", path);
+    ok(7, check_range(0, FIRST + SECOND));
+    dbzclose();
+
+    /* The next rebuild uses the version set in inn.conf. */
+    innconf->hisv6dbzversion = 6;
+    okay = dbzagain(again, path) && dbzclose();
+    read_dir(again, &version, &size, &at);
+    ok(8, okay && version == 6);
+    innconf->hisv6dbzversion = 7;
+
+    /* A reader that opens the table in the middle of a split still finds
+       everything once the split is over, which leaves the files the same
+       size as during the split. */
+    if (pipe(ready) < 0 || pipe(go) < 0)
+        sysbail("can't create pipes");
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("can't fork");
+    if (child == 0)
+        _exit(split_reader(split, ready[1], go[0]));
+    close(ready[1]);
+    if (!dbzfresh(split, dbzsize(1000)))
+        bail("can't create %s", split);
+    for (n = 0, at = -1; at < 0; n++) {
+        if (!store_range(n, n + 1))
+            bail("can't store in %s", split);
+        read_dir(split, &version, &size, &at);
+    }
+    if (write(go[1], &n, sizeof(n)) != sizeof(n))
+        sysbail("can't start the reader");
+    if (read(ready[0], &c, 1) != 1)
+        bail("reader failed to start");
+    first = size;
+    for (okay = true; okay && at >= 0; n++) {
+        okay = store_range(n, n + 1);
+        read_dir(split, &version, &size, &at);
+    }
+    ok(9, okay && size == 2 * first);
+    if (write(go[1], &n, sizeof(n)) != sizeof(n))
+        sysbail("can't restart the reader");
+    if (waitpid(child, &status, 0) != child)
+        sysbail("can't wait for the reader");
+    ok(10, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ok(11, dbzclose());
+
+    /* A table kept in memory tells about its new size only when it is
+       written out, so that the .dir file always describes the files. */
+    dbzgetoptions(&opt);
+    opt.pag_incore = INCORE_MEM;
+    opt.exists_incore = INCORE_MEM;
+    dbzsetoptions(opt);
+    if (!dbzfresh(mem, dbzsize(1000)))
+        bail("can't create %s", mem);
+    read_dir(mem, &version, &first, &at);
+    okay = store_range(0, FIRST + SECOND);
+    read_dir(mem, &version, &size, &at);
+    ok(12, okay && size == first && at < 0);
+    okay = dbzsync();
+    read_dir(mem, &version, &size, &at);
+    ok(13, okay && size > first);
+    dbzclose();
+    if (!dbzinit(mem))
+        bail("can't open %s", mem);
+    ok(14, check_range(0, FIRST + SECOND));
+    dbzclose();
+
+    /* A bucket of the new half may already be full, from a doubling that
+       was interrupted before it could be recorded.  The entries of the old
+       bucket that cannot go there are put elsewhere rather than lost.  Fill
+       the first bucket of the new half, eight fingerprints of eight bytes,
+       with something that is not empty. */
+    opt.pag_incore = INCORE_NO;
+    opt.exists_incore = INCORE_NO;
+    dbzsetoptions(opt);
+    if (!dbzfresh(full, dbzsize(1000)))
+        bail("can't create %s", full);
+    read_dir(full, &version, &first, &at);
+    fn = concat(full, ".hash", (char *) 0);
+    fd = open(fn, O_WRONLY);
+    memset(junk, 0xff, sizeof(junk));
+    if (fd < 0 || pwrite(fd, junk, sizeof(junk), first * 8) != sizeof(junk)
+        || ftruncate(fd, 2 * first * 8) < 0 || close(fd) < 0)
+        sysbail("can't fill %s", fn);
+    free(fn);
+    size = first;
+    for (n = 0, okay = true; okay && (at >= 0 || size == first); n++) {
+        okay = store_range(n, n + 1);
+        read_dir(full, &version, &size, &at);
+    }
+    ok(15, okay && size > first && check_range(0, n));
+    dbzclose();
+
+    snprintf(cmd, sizeof(cmd), "/bin/rm -rf %s", tmpdir);
+    if (system(cmd) < 0)
+        sysdiag("can't clean up %s", tmpdir);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/* Test suite for the history cache of history/his.c.
+ *
+ * Uses a cache of a single set, so that every Message-ID competes for the
+ * same entries, and checks which ones the CLOCK hand pushes out, and how the
+ * batched check uses it.
+ */
+
+#include "portable/system.h"
+
+#include "inn/history.h"
+#include "inn/libinn.h"
+#include "inn/messages.h"
+#include "inn/storage.h"
+#include "tap/basic.h"
+
+
+/*
+**  Generate a deterministic message-ID from an integer.
+*/
+static const char *
+make_msgid(unsigned long n)
+{
+    static char buf[64];
+
+    snprintf(buf, sizeof(buf), "<art-%lu@hiscache.test>", n);
+    return buf;
+}
+
+
+int
+main(void)
+{
+    struct history *h;
+    struct histstats stats;
+    char tmpdir[64];
+    char histpath[128];
+    char cmd[128];
+    TOKEN token, tokens[8];
+    const char *keys[8];
+    bool found[8];
+    unsigned long i;
+    bool okay;
+
+    test_init(11);
+
+    strlcpy(tmpdir, "hiscache-XXXXXX", sizeof(tmpdir));
+    if (mkdtemp(tmpdir) == NULL)
+        sysbail("can't create temp directory");
+    snprintf(histpath, sizeof(histpath), "%s/history", tmpdir);
+    h = HISopen(histpath, "hisv6", HIS_CREAT | HIS_RDWR);
+    if (h == NULL)
+        bail("can't create history at %s", histpath);
+    memset(&token, 0, sizeof(token));
+    token.type = 1;
+
+    /* One set of four entries. */
+    HISsetcache(h, 64);
+    for (i = 1; i <= 4; i++)
+        if (!HISwrite(h, make_msgid(i), 1000000, 1000000, 0, &token))
+            bail("can't write history entry %lu: %s", i, HISerror(h));
+    okay = true;
+    for (i = 1; i <= 4; i++)
+        if (!HIScheck(h, make_msgid(i)))
+            okay = false;
+    ok(1, okay);
+    stats = HISstats(h);
+    ok(2, stats.hitpos == 4 && stats.evictions == 0);
+
+    /* All four were looked up; the hand spares each once and then pushes out
+       the first. */
+    if (!HISwrite(h, make_msgid(5), 1000000, 1000000, 0, &token))
+        bail("can't write history entry 5: %s", HISerror(h));
+    ok(3, HISstats(h).evictions == 1);
+
+    /* Look up the second again; the next one in line goes instead. */
+    ok(4, HIScheck(h, make_msgid(2)));
+    if (!HISwrite(h, make_msgid(6), 1000000, 1000000, 0, &token))
+        bail("can't write history entry 6: %s", HISerror(h));
+    stats = HISstats(h);
+    ok(5, stats.hitpos == 1 && stats.evictions == 1);
+    ok(6, HIScheck(h, make_msgid(2)) && HISstats(h).hitpos == 1);
+    ok(7, HIScheck(h, make_msgid(3)) && HISstats(h).misses == 1);
+
+    /* Articles not in history are cached as such. */
+    ok(8, !HIScheck(h, make_msgid(7)) && HISstats(h).dne == 1);
+    ok(9, !HIScheck(h, make_msgid(7)) && HISstats(h).hitneg == 1);
+
+    /* The batched check answers from the cache where it can and asks the
+       method for the others, counting each key once; the batched lookup
+       finds the same ones. */
+    for (i = 0; i < 8; i++)
+        keys[i] = xstrdup(make_msgid(i + 1));
+    okay = HIScheck_batch(h, keys, 8, found);
+    for (i = 0; i < 8; i++)
+        if (found[i] != (i < 6))
+            okay = false;
+    stats = HISstats(h);
+    ok(10, okay
+               && stats.hitpos + stats.hitneg + stats.misses + stats.dne
+                      == 8);
+    okay = HISlookup_batch(h, keys, 8, found, NULL, NULL, NULL, tokens);
+    for (i = 0; i < 8; i++)
+        if (found[i] != (i < 6) || (found[i] && tokens[i].type != 1))
+            okay = false;
+    ok(11, okay);
+    for (i = 0; i < 8; i++)
+        free((char *) keys[i]);
+
+    HISclose(h);
+    snprintf(cmd, sizeof(cmd), "/bin/rm -rf %s", tmpdir);
+    if (system(cmd) < 0)
+        sysdiag("can't clean up %s", tmpdir);
+    return 0;
+}
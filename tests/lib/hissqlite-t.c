@@ -3,8 +3,8 @@
 **
 **  Exercises the full HIS_METHOD vtable through the public HIS API against a
 **  real SQLite database: open/create, write, remember, check, lookup, replace,
-**  walk, the two-horizon expire (real->remembered transition +
-**  remember-delete), sync, close, and persistence across reopen.
+**  batched check and lookup, walk, the two-horizon expire (real->remembered
+**  transition + remember-delete), sync, close, and persistence across reopen.
 **
 **  Written by Kevin Bowling in 2026.
 */
@@ -124,7 +124,7 @@ main(void)
     struct walkcount wc;
     bool has_token;
 
-    test_init(34);
+    test_init(40);
 
     strlcpy(tmpdir, "hissqlite-XXXXXX", sizeof(tmpdir));
     if (mkdtemp(tmpdir) == NULL)
@@ -262,6 +262,50 @@ main(void)
             HISclose(hv);
     }
 
+    /* HISCTLS_BATCHSIZE: the history API holds writes in core, where the
+       writing handle sees them but a direct reader does not, and passes them
+       on in one transaction when the batch fills or on HISsync. */
+    {
+        char gpath[160];
+        struct history *gw, *gr;
+        TOKEN gt, got;
+        size_t size = 4;
+        unsigned long delay = 3600 * 1000;
+        bool seen;
+
+        snprintf(gpath, sizeof(gpath), "%s/grouped", tmpdir);
+        gw = HISopen(gpath, "hissqlite", HIS_CREAT | HIS_RDWR);
+        if (gw == NULL)
+            bail("can't create grouped hissqlite history");
+        HISctl(gw, HISCTLS_BATCHDELAY, &delay);
+        HISctl(gw, HISCTLS_BATCHSIZE, &size);
+        memset(&gt, 0, sizeof(gt));
+        gt.type = 1;
+        gt.class = 7;
+        HISwrite(gw, "<group-0@test>", BASE, BASE, 0, &gt);
+        HISwrite(gw, "<group-1@test>", BASE, BASE, 0, &gt);
+        HISremember(gw, "<group-2@test>", BASE, BASE);
+        gr = HISopen(gpath, "hissqlite", HIS_RDONLY);
+        memset(&got, 0, sizeof(got));
+        seen = HIScheck(gw, "<group-0@test>") && HIScheck(gw, "<group-2@test>")
+               && HISlookup(gw, "<group-1@test>", NULL, NULL, NULL, &got)
+               && got.class == 7
+               && !HISlookup(gw, "<group-2@test>", NULL, NULL, NULL, NULL);
+        ok(35, seen && gr != NULL && !HIScheck(gr, "<group-0@test>"));
+
+        /* The fourth write fills the batch. */
+        HISwrite(gw, "<group-3@test>", BASE, BASE, 0, &gt);
+        ok(36, gr != NULL && HIScheck(gr, "<group-0@test>")
+                   && HIScheck(gr, "<group-2@test>")
+                   && HIScheck(gr, "<group-3@test>"));
+
+        HISwrite(gw, "<group-4@test>", BASE, BASE, 0, &gt);
+        ok(37, HISsync(gw) && gr != NULL && HIScheck(gr, "<group-4@test>"));
+        if (gr != NULL)
+            HISclose(gr);
+        HISclose(gw);
+    }
+
     /* corrupt token -> reported, and schema-version mismatch -> refused.
        Both need DB-level tampering there is no HIS API for, so reach in with
        SQLite directly (this whole test is already HAVE_SQLITE3-only). */
@@ -512,6 +556,72 @@ main(void)
             HISclose(hv);
     }
 
+    /* HIScheck_batch and HISlookup_batch: more keys than one execution of
+       the batched statements takes, real, remembered and absent ones mixed,
+       through the writer and through a direct reader. */
+    {
+        char bpath[160];
+        struct history *bw, *br;
+        const char *keys[40];
+        char *ids[40];
+        bool found[40], checked, looked;
+        time_t arrived[40];
+        TOKEN tokens[40], tk;
+
+        snprintf(bpath, sizeof(bpath), "%s/lookup-batch", tmpdir);
+        bw = HISopen(bpath, "hissqlite", HIS_CREAT | HIS_RDWR);
+        if (bw == NULL)
+            bail("can't create lookup-batch hissqlite history");
+        memset(&tk, 0, sizeof(tk));
+        tk.type = 1;
+        for (i = 0; i < 40; i++) {
+            ids[i] = make_msgid(i);
+            keys[i] = ids[i];
+            tk.class = (unsigned char) i;
+            if (i % 3 == 0)
+                HISwrite(bw, ids[i], BASE + i, BASE + i, 0, &tk);
+            else if (i % 3 == 1)
+                HISremember(bw, ids[i], BASE + i, BASE + i);
+        }
+        HISsync(bw);
+        br = HISopen(bpath, "hissqlite", HIS_RDONLY);
+
+        checked = HIScheck_batch(bw, keys, 40, found);
+        for (i = 0; i < 40; i++)
+            if (found[i] != (i % 3 != 2))
+                checked = false;
+        ok(38, checked);
+
+        memset(tokens, 0, sizeof(tokens));
+        looked = HISlookup_batch(bw, keys, 40, found, arrived, NULL, NULL,
+                                 tokens);
+        for (i = 0; i < 40; i++)
+            if (found[i] != (i % 3 == 0)
+                || (found[i]
+                    && (arrived[i] != BASE + (time_t) i
+                        || tokens[i].class != (unsigned char) i)))
+                looked = false;
+        ok(39, looked);
+
+        checked = br != NULL && HIScheck_batch(br, keys, 40, found);
+        for (i = 0; checked && i < 40; i++)
+            if (found[i] != (i % 3 != 2))
+                checked = false;
+        looked = br != NULL
+                 && HISlookup_batch(br, keys, 40, found, NULL, NULL, NULL,
+                                    NULL);
+        for (i = 0; looked && i < 40; i++)
+            if (found[i] != (i % 3 == 0))
+                looked = false;
+        ok(40, checked && looked);
+
+        for (i = 0; i < 40; i++)
+            free(ids[i]);
+        if (br != NULL)
+            HISclose(br);
+        HISclose(bw);
+    }
+
     {
         char cmd[160];
         snprintf(cmd, sizeof(cmd), "/bin/rm -rf %s", tmpdir);
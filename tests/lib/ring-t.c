@@ -0,0 +1,133 @@
+/* Test suite for lib/ring.c. */
+
+#include "portable/system.h"
+
+#include <errno.h>
+
+#include "inn/ring.h"
+#include "tap/basic.h"
+
+#define RING_FILE "ring.test"
+
+
+/*
+**  Fill a record with a pattern depending on its sequence number.
+*/
+static size_t
+make_record(char *buf, unsigned long n)
+{
+    size_t length, i;
+
+    length = 1 + (n * 37) % 300;
+    for (i = 0; i < length; i++)
+        buf[i] = (char) (n + i);
+    return length;
+}
+
+
+/*
+**  Read the next record and check that it is record n.
+*/
+static bool
+check_record(struct ring *ring, unsigned long n)
+{
+    char buf[512];
+    const char *p;
+    size_t length, wanted;
+
+    wanted = make_record(buf, n);
+    p = ring_peek(ring, &length);
+    if (p == NULL || length != wanted || memcmp(p, buf, length) != 0)
+        return false;
+    ring_advance(ring);
+    return true;
+}
+
+
+int
+main(void)
+{
+    struct ring *producer, *consumer;
+    char buf[512];
+    const char *p;
+    size_t length;
+    unsigned long i, written, read;
+    bool okay;
+    FILE *f;
+
+    producer = ring_create(RING_FILE, 8192);
+    if (producer == NULL && errno == ENOSYS)
+        skip_all("rings are not supported");
+
+    test_init(15);
+
+    ok(1, producer != NULL);
+    consumer = ring_open(RING_FILE);
+    ok(2, consumer != NULL);
+    if (producer == NULL || consumer == NULL)
+        bail("cannot create ring");
+    ok(3, ring_peek(consumer, &length) == NULL);
+
+    /* A single record goes through unchanged. */
+    ok(4, ring_put(producer, "hello", 5));
+    p = ring_peek(consumer, &length);
+    ok(5, p != NULL && length == 5 && memcmp(p, "hello", 5) == 0);
+    ring_advance(consumer);
+    ok(6, ring_peek(consumer, &length) == NULL);
+
+    /* Records larger than half the ring are refused outright. */
+    ok(7, !ring_put(producer, buf, 8192 / 2));
+
+    /* Fill the ring, then read everything back in order. */
+    for (written = 0; ring_put(producer, buf, make_record(buf, written));)
+        written++;
+    okay = written > 0;
+    for (i = 0; i < written; i++)
+        if (!check_record(consumer, i))
+            okay = false;
+    ok(8, okay && ring_peek(consumer, &length) == NULL);
+
+    /* Keep it half full for a while so that records wrap around. */
+    okay = true;
+    for (written = 0, read = 0; written < 20000; written++) {
+        if (!ring_put(producer, buf, make_record(buf, written)))
+            okay = false;
+        if (written % 2 == 1 || written - read > 10)
+            while (read < written && okay)
+                if (!check_record(consumer, read++))
+                    okay = false;
+    }
+    while (read < written && okay)
+        if (!check_record(consumer, read++))
+            okay = false;
+    ok(9, okay && ring_peek(consumer, &length) == NULL);
+
+    /* A sleeping consumer is woken up once. */
+    ok(10, !ring_wakeup(producer));
+    ok(11, ring_sleep(consumer));
+    ring_put(producer, "x", 1);
+    ok(12, ring_wakeup(producer) && !ring_wakeup(producer));
+    ok(13, !ring_sleep(consumer));
+
+    /* The producer can read back what the consumer left. */
+    ring_free(consumer);
+    ring_put(producer, "y", 1);
+    p = ring_peek(producer, &length);
+    okay = p != NULL && length == 1 && *p == 'x';
+    ring_advance(producer);
+    p = ring_peek(producer, &length);
+    okay = okay && p != NULL && length == 1 && *p == 'y';
+    ring_advance(producer);
+    ok(14, okay && ring_peek(producer, &length) == NULL);
+    ring_free(producer);
+
+    /* Anything else is not a ring. */
+    f = fopen(RING_FILE, "w");
+    if (f != NULL) {
+        fputs("not a ring\n", f);
+        fclose(f);
+    }
+    ok(15, ring_open(RING_FILE) == NULL);
+    unlink(RING_FILE);
+    return 0;
+}
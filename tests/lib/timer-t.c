@@ -0,0 +1,100 @@
+/* Test suite for the histograms of lib/timer.c. */
+
+#include "portable/system.h"
+
+#include "inn/timer.h"
+#include "tap/basic.h"
+
+
+/*
+**  Whether a single time is reported as its own median, rounded up by less
+**  than a bucket.
+*/
+static bool
+check_single(unsigned long usec)
+{
+    struct timer_hist hist;
+    unsigned long p;
+
+    memset(&hist, 0, sizeof(hist));
+    TMRhistadd(&hist, usec);
+    p = TMRhistpercentile(&hist, 0.5);
+    return p == usec && hist.max == usec && hist.count == 1;
+}
+
+
+/*
+**  Whether the median of two times, the smaller first, stays within the
+**  precision of the histogram.
+*/
+static bool
+check_pair(unsigned long usec)
+{
+    struct timer_hist hist;
+    unsigned long p;
+
+    memset(&hist, 0, sizeof(hist));
+    TMRhistadd(&hist, usec);
+    TMRhistadd(&hist, usec * 4);
+    p = TMRhistpercentile(&hist, 0.5);
+    return p >= usec && p - usec <= usec >> TMR_HIST_BITS;
+}
+
+
+int
+main(void)
+{
+    struct timer_hist hist;
+    struct timer_stats stats;
+    unsigned long i;
+    bool okay;
+
+    test_init(14);
+
+    memset(&hist, 0, sizeof(hist));
+    ok(1, TMRhistpercentile(&hist, 0.5) == 0);
+
+    /* Short times have their own buckets. */
+    okay = true;
+    for (i = 0; i < (1UL << TMR_HIST_BITS); i++)
+        if (!check_single(i))
+            okay = false;
+    ok(2, okay);
+
+    /* Longer ones are within a bucket, whatever their magnitude. */
+    okay = true;
+    for (i = 1UL << TMR_HIST_BITS; i < (1UL << 29); i = i * 3 + 1)
+        if (!check_pair(i))
+            okay = false;
+    ok(3, okay);
+
+    /* One to a thousand microseconds. */
+    for (i = 1; i <= 1000; i++)
+        TMRhistadd(&hist, i);
+    ok(4, hist.count == 1000 && hist.max == 1000);
+    i = TMRhistpercentile(&hist, 0.5);
+    ok(5, i >= 500 && i - 500 <= 500 >> TMR_HIST_BITS);
+    i = TMRhistpercentile(&hist, 0.9);
+    ok(6, i >= 900 && i - 900 <= 900 >> TMR_HIST_BITS);
+    ok(7, TMRhistpercentile(&hist, 0.99) >= 990);
+    ok(8, TMRhistpercentile(&hist, 1.0) == 1000);
+    ok(9, TMRhistcount(&hist, 256) == 255);
+    ok(10, TMRhistcount(&hist, 1UL << 20) == 1000);
+
+    /* Times too long for the histogram go in the last bucket. */
+    memset(&hist, 0, sizeof(hist));
+    TMRhistadd(&hist, ULONG_MAX);
+    ok(11, hist.bucket[TMR_HIST_BUCKETS - 1] == 1);
+
+    /* The timers keep histograms of their own. */
+    ok(12, !TMRstats(0, &stats));
+    TMRinit(2);
+    for (i = 0; i < 3; i++) {
+        TMRstart(1);
+        TMRstop(1);
+    }
+    ok(13, TMRstats(1, &stats) && stats.hist.count == 3);
+    ok(14, !TMRstats(2, &stats));
+    TMRfree();
+    return 0;
+}
@@ -44,6 +44,31 @@ test_s(int n, const char *text, const char *pattern, bool matches)
         diag("  %s\n  %s\n  expected %d\n", text, pattern, matches);
 }
 
+static void
+test_l(int n, const char *text, const char *patterns, enum uwildmat matches)
+{
+    struct uwildmat_list *list;
+    char *copy, *pattern, *next;
+    enum uwildmat matched;
+
+    /* Split on every comma; none of the patterns used contain one. */
+    list = uwildmat_list_new();
+    copy = xstrdup(patterns);
+    for (pattern = copy; pattern != NULL; pattern = next) {
+        next = strchr(pattern, ',');
+        if (next != NULL)
+            *next++ = '\0';
+        uwildmat_list_add(list, pattern);
+    }
+    matched = uwildmat_list_match(list, text);
+    ok(n, matched == matches && matched == uwildmat_poison(text, patterns));
+    if (matched != matches)
+        diag("  %s\n  %s\n  expected %d got %d\n", text, patterns,
+             (int) matches, (int) matched);
+    uwildmat_list_free(list);
+    free(copy);
+}
+
 static void
 test_v(int n, const char *text, bool matches)
 {
@@ -58,7 +83,7 @@ test_v(int n, const char *text, bool matches)
 int
 main(void)
 {
-    test_init(188);
+    test_init(202);
 
     /* Basic wildmat features. */
     /* clang-format off */
@@ -279,6 +304,26 @@ main(void)
     test_v(186, "",                                    true);
     test_v(187, "a\303\251b\303\0c",                   false);
     test_v(188, "two words",                           true);
+
+    /* Tests for compiled lists of patterns. */
+    test_l(189, "comp.lang.c",    "*",                 UWILDMAT_MATCH);
+    test_l(190, "comp.lang.c",    "comp.*,!comp.lang.*",
+                                                       UWILDMAT_FAIL);
+    test_l(191, "comp.lang.c",    "!comp.lang.*,comp.*",
+                                                       UWILDMAT_MATCH);
+    test_l(192, "comp.lang.c",    "*,@comp.*,comp.lang.c",
+                                                       UWILDMAT_MATCH);
+    test_l(193, "comp.lang.c",    "*,comp.lang.c,@comp.*",
+                                                       UWILDMAT_POISON);
+    test_l(194, "comp",           "comp.*",            UWILDMAT_FAIL);
+    test_l(195, "comp",           "comp*",             UWILDMAT_MATCH);
+    test_l(196, "comp.lang",      "comp.lang.c",       UWILDMAT_FAIL);
+    test_l(197, "alt.binaries.x", "*,!*.binaries.*",   UWILDMAT_FAIL);
+    test_l(198, "alt.bin.x",      "alt.b?n.*,!alt.bin", UWILDMAT_MATCH);
+    test_l(199, "alt.b\\n",       "alt.b\\\\n",        UWILDMAT_MATCH);
+    test_l(200, "alt.x",          "!*,alt.[xy]",       UWILDMAT_MATCH);
+    test_l(201, "",               "",                  UWILDMAT_MATCH);
+    test_l(202, "alt.x",          "",                  UWILDMAT_FAIL);
     /* clang-format on */
 
     return 0;
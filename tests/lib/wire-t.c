@@ -48,11 +48,12 @@ main(void)
 {
     const char *p, *end;
     char *article, *wire, *native;
+    char line[100];
     int oerrno;
     struct stat st;
     size_t wire_size, native_size, size;
 
-    test_init(67);
+    test_init(72);
 
     end = ta + sizeof(ta) - 1;
     p = end - 4;
@@ -231,5 +232,16 @@ main(void)
     ok_int(66, EOVERFLOW, oerrno);
     ok_int(67, 0, size);
 
+    /* wire_findctl stops at the first \r, \n or nul, wherever it is. */
+    p = "Subject: x\r\n";
+    ok(68, wire_findctl(p, p + 12) == p + 10);
+    ok(69, wire_findctl(p, p + 10) == p + 10);
+    memset(line, 'x', sizeof(line));
+    ok(70, wire_findctl(line, line + sizeof(line)) == line + sizeof(line));
+    line[37] = '\n';
+    ok(71, wire_findctl(line, line + sizeof(line)) == line + 37);
+    line[21] = '\0';
+    ok(72, wire_findctl(line + 1, line + sizeof(line)) == line + 21);
+
     return 0;
 }